@@ -0,0 +1,208 @@
+// Benchmarks of the serial bus library against x16target, the stand-in for
+// the loader on a pseudo terminal:
+//
+//   ../x16load/x16target -l 1000 &     prints the terminal to use, e.g. /dev/pts/3
+//   ./bench -p /dev/pts/3
+//
+// Each compares an access at a time, the way the tools did before, with the
+// library's queue, pipelined replies or shadow copy. It also checks the
+// results in the target's memory, so a faster version that loses data
+// doesn't go unnoticed.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "serialbus.h"
+
+// x16load's loader commands
+enum {
+    CMD_WRITE       = 1, // <addr:u16> <data>
+    CMD_READ        = 2, // <addr:u16>, replies <data>
+    CMD_BLOCK_WRITE = 7, // <addr:u16> <length:u8> <data...>
+    CMD_BLOCK_READ  = 8, // <addr:u16> <length:u8>, replies <data...>
+};
+
+static unsigned failures;
+
+static double time_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, unsigned ops, double seconds) {
+    printf("%-28s %8u ops  %8.1f us/op\n", name, ops, seconds * 1e6 / ops);
+}
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("%s: FAILED\n", what);
+        failures++;
+    }
+}
+
+static void write_byte(uint16_t addr, uint8_t data) {
+    uint8_t cmd[4] = {CMD_WRITE, addr & 0xff, addr >> 8, data};
+    serialbus_queue(cmd, sizeof(cmd));
+}
+
+static void read_byte_start(uint16_t addr, uint8_t *data, struct serialbus_reply *reply) {
+    uint8_t cmd[3] = {CMD_READ, addr & 0xff, addr >> 8};
+    *reply         = (struct serialbus_reply){.buf = data, .length = 1};
+    serialbus_queue_read(cmd, sizeof(cmd), reply);
+}
+
+static uint8_t read_byte(uint16_t addr) {
+    uint8_t                data;
+    struct serialbus_reply reply;
+    read_byte_start(addr, &data, &reply);
+    serialbus_wait(&reply);
+    return data;
+}
+
+static void read_block(uint16_t addr, uint8_t *data) {
+    uint8_t                cmd[4] = {CMD_BLOCK_READ, addr & 0xff, addr >> 8, 0};
+    struct serialbus_reply reply  = {.buf = data, .length = 256};
+    serialbus_queue_read(cmd, sizeof(cmd), &reply);
+    serialbus_wait(&reply);
+}
+
+// Register writes: 256 addresses written over and over, done when a read
+// after them comes back
+
+static uint8_t write_value(unsigned i, unsigned seed) {
+    return (uint8_t)(i * 7 + (i >> 8) + seed);
+}
+
+static void check_writes(unsigned count, unsigned seed, const char *what) {
+    uint8_t data[256];
+    read_block(0x0400, data);
+
+    bool ok = true;
+    for (unsigned i = count > 256 ? count - 256 : 0; i < count; i++) {
+        ok = ok && data[i & 0xFF] == write_value(i, seed);
+    }
+    check(ok, what);
+}
+
+static void bench_writes(unsigned count) {
+    double t0 = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        write_byte(0x0400 + (i & 0xFF), write_value(i, 1));
+        serialbus_flush();
+    }
+    read_byte(0);
+    report("write, a syscall each", count, time_now() - t0);
+    check_writes(count, 1, "write, a syscall each: data");
+
+    t0 = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        write_byte(0x0400 + (i & 0xFF), write_value(i, 2));
+    }
+    read_byte(0);
+    report("write, queued", count, time_now() - t0);
+    check_writes(count, 2, "write, queued: data");
+}
+
+// Reads of memory set up with a block write
+
+static void bench_reads(unsigned count) {
+    uint8_t cmd[4 + 256] = {CMD_BLOCK_WRITE, 0x00, 0x05, 0};
+    for (unsigned i = 0; i < 256; i++) {
+        cmd[4 + i] = (uint8_t)(i * 13 + 5);
+    }
+    serialbus_queue(cmd, sizeof(cmd));
+
+    uint8_t *data = malloc(count);
+    bool     ok   = true;
+    double   t0   = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        data[i] = read_byte(0x0500 + (i & 0xFF));
+    }
+    report("read, waiting for each", count, time_now() - t0);
+    for (unsigned i = 0; i < count; i++) {
+        ok = ok && data[i] == cmd[4 + (i & 0xFF)];
+    }
+    check(ok, "read, waiting for each: data");
+
+    struct serialbus_reply *replies = malloc(count * sizeof(*replies));
+    memset(data, 0, count);
+    t0 = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        read_byte_start(0x0500 + (i & 0xFF), &data[i], &replies[i]);
+    }
+    serialbus_sync();
+    report("read, pipelined", count, time_now() - t0);
+    ok = true;
+    for (unsigned i = 0; i < count; i++) {
+        ok = ok && replies[i].completed && data[i] == cmd[4 + (i & 0xFF)];
+    }
+    check(ok, "read, pipelined: data");
+
+    free(replies);
+    free(data);
+}
+
+// Read-modify-write of a register, memory standing in for it
+
+static void bench_read_modify_write(unsigned count) {
+    const uint16_t addr = 0x0300;
+    write_byte(addr, 0);
+
+    double t0 = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        write_byte(addr, read_byte(addr) + 1);
+    }
+    report("read-modify-write", count, time_now() - t0);
+    check(read_byte(addr) == (uint8_t)count, "read-modify-write: value");
+
+    struct serialbus_shadow shadow = {.base = addr, .size = 1};
+    t0                             = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        uint8_t value;
+        if (!serialbus_shadow_get(&shadow, addr, &value)) {
+            value = read_byte(addr);
+        }
+        value++;
+        write_byte(addr, value);
+        serialbus_shadow_set(&shadow, addr, value);
+    }
+    read_byte(0);
+    report("read-modify-write, shadow", count, time_now() - t0);
+    check(read_byte(addr) == (uint8_t)(2 * count), "read-modify-write, shadow: value");
+}
+
+int main(int argc, char *const argv[]) {
+    int         opt;
+    bool        params_ok   = true;
+    const char *serial_port = NULL;
+    unsigned    count       = 1000;
+
+    while ((opt = getopt(argc, argv, "p:n:")) != -1) {
+        switch (opt) {
+            case 'p': serial_port = optarg; break;
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            default: params_ok = false; break;
+        }
+    }
+    if (!params_ok || serial_port == NULL || count == 0) {
+        fprintf(stderr, "usage: %s -p <x16target's terminal> [-n <iterations>]\n", argv[0]);
+        exit(1);
+    }
+
+    serialbus_open(serial_port, 1000000);
+
+    bench_writes(count);
+    bench_reads(count);
+    bench_read_modify_write(count);
+
+    if (failures > 0) {
+        printf("%u checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,195 @@
+#include "serialbus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define QUEUE_SIZE  (4096)
+#define MAX_REPLIES (1024)
+
+// Replies outstanding, they must fit the receive buffer of the serial port
+#define MAX_REPLY_BYTES (4096)
+
+static int            serial_fd = -1;
+static struct termios old_serial_tio;
+
+static uint8_t  queue[QUEUE_SIZE];
+static unsigned queue_length;
+
+// Replies not completed yet, oldest first
+static struct serialbus_reply *replies[MAX_REPLIES];
+static unsigned                reply_head, reply_count;
+static unsigned                reply_received; // bytes of the oldest one
+static size_t                  reply_bytes;    // still to come for all of them
+
+static void restore_settings(void) {
+    if (serial_fd < 0) {
+        return;
+    }
+
+    // Send what's still queued, without exiting on errors from here
+    const uint8_t *p = queue;
+    while (queue_length > 0) {
+        int result = write(serial_fd, p, queue_length);
+        if (result <= 0) {
+            break;
+        }
+        p += result;
+        queue_length -= result;
+    }
+    tcdrain(serial_fd);
+    tcsetattr(serial_fd, TCSANOW, &old_serial_tio);
+    printf("Serial settings restored\n");
+}
+
+void serialbus_open(const char *serial_port, unsigned baudrate) {
+    printf("Opening %s @ %u bps\n", serial_port, baudrate);
+
+    // Open serial port
+    serial_fd = open(serial_port, O_RDWR | O_NOCTTY | O_NONBLOCK); //O_EXLOCK
+    if (serial_fd < 0) {
+        perror(serial_port);
+        exit(1);
+    }
+
+    // Get old terminal io settings
+    memset(&old_serial_tio, 0, sizeof(old_serial_tio));
+    tcgetattr(serial_fd, &old_serial_tio);
+    atexit(restore_settings);
+
+    // Set new serial io settings, reads block until there is at least a byte
+    struct termios new_serial_tio;
+    memcpy(&new_serial_tio, &old_serial_tio, sizeof(new_serial_tio));
+
+    if (cfsetspeed(&new_serial_tio, baudrate) < 0) {
+        perror("cfsetspeed");
+        exit(1);
+    }
+    new_serial_tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+    new_serial_tio.c_cflag |= CS8 | CLOCAL | CREAD;
+    new_serial_tio.c_iflag &= ~(IGNBRK | IXON | IXOFF | IXANY);
+    new_serial_tio.c_lflag     = 0;
+    new_serial_tio.c_oflag     = 0;
+    new_serial_tio.c_cc[VMIN]  = 1;
+    new_serial_tio.c_cc[VTIME] = 0;
+    if (tcsetattr(serial_fd, TCSANOW, &new_serial_tio)) {
+        perror("tcsetattr");
+        exit(1);
+    }
+
+    // Make serial port blocking
+    if (fcntl(serial_fd, F_SETFL, fcntl(serial_fd, F_GETFL) & ~O_NONBLOCK) < 0) {
+        perror("fcntl");
+        exit(1);
+    }
+}
+
+void serialbus_flush(void) {
+    const uint8_t *p = queue;
+    while (queue_length > 0) {
+        int result = write(serial_fd, p, queue_length);
+        if (result < 0) {
+            perror("write");
+            exit(1);
+        }
+        p += result;
+        queue_length -= result;
+    }
+}
+
+void serialbus_queue(const void *cmd, size_t length) {
+    const uint8_t *p = cmd;
+    while (length > 0) {
+        if (queue_length == QUEUE_SIZE) {
+            serialbus_flush();
+        }
+        size_t n = QUEUE_SIZE - queue_length;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(queue + queue_length, p, n);
+        queue_length += n;
+        p += n;
+        length -= n;
+    }
+}
+
+// Receives what has come in, at least a byte, and hands it out to the
+// replies in order
+static void receive(void) {
+    uint8_t buf[4096];
+    int     result = read(serial_fd, buf, reply_bytes < sizeof(buf) ? reply_bytes : sizeof(buf));
+    if (result <= 0) {
+        perror("read");
+        exit(1);
+    }
+    reply_bytes -= result;
+
+    const uint8_t *p = buf;
+    while (result > 0) {
+        struct serialbus_reply *reply = replies[reply_head];
+        unsigned                n     = reply->length - reply_received;
+        if (n > (unsigned)result) {
+            n = result;
+        }
+        memcpy(reply->buf + reply_received, p, n);
+        reply_received += n;
+        p += n;
+        result -= n;
+
+        if (reply_received == reply->length) {
+            reply->completed = true;
+            reply_head       = (reply_head + 1) % MAX_REPLIES;
+            reply_count--;
+            reply_received = 0;
+        }
+    }
+}
+
+void serialbus_queue_read(const void *cmd, size_t length, struct serialbus_reply *reply) {
+    while (reply_count == MAX_REPLIES || (reply_count > 0 && reply_bytes + reply->length > MAX_REPLY_BYTES)) {
+        serialbus_wait(replies[reply_head]);
+    }
+    serialbus_queue(cmd, length);
+
+    reply->completed = reply->length == 0;
+    if (!reply->completed) {
+        replies[(reply_head + reply_count) % MAX_REPLIES] = reply;
+        reply_count++;
+        reply_bytes += reply->length;
+    }
+}
+
+void serialbus_wait(struct serialbus_reply *reply) {
+    serialbus_flush();
+    while (!reply->completed) {
+        receive();
+    }
+}
+
+void serialbus_sync(void) {
+    serialbus_flush();
+    while (reply_count > 0) {
+        receive();
+    }
+}
+
+bool serialbus_shadow_get(const struct serialbus_shadow *shadow, uint32_t addr, uint8_t *value) {
+    uint32_t idx = addr - shadow->base;
+    if (addr < shadow->base || idx >= shadow->size || idx >= SERIALBUS_SHADOW_MAX || !shadow->known[idx]) {
+        return false;
+    }
+    *value = shadow->value[idx];
+    return true;
+}
+
+void serialbus_shadow_set(struct serialbus_shadow *shadow, uint32_t addr, uint8_t value) {
+    uint32_t idx = addr - shadow->base;
+    if (addr < shadow->base || idx >= shadow->size || idx >= SERIALBUS_SHADOW_MAX) {
+        return;
+    }
+    shadow->value[idx] = value;
+    shadow->known[idx] = true;
+}
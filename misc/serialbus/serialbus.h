@@ -0,0 +1,60 @@
+#pragma once
+
+// Access to a target's bus through a loader on a serial port, shared by
+// testvera and x16load. The loaders' command sets differ, the tools encode
+// their commands themselves and pass them here.
+//
+// Commands are queued and go out together in a single write when the queue
+// fills up, when it is flushed or when a reply is waited for. Commands with a
+// reply can be queued without waiting for it, the reply comes in later while
+// more commands are sent.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Reply to a command, filled in as it comes in. The loaders reply in the
+// order of the commands. Owned by the caller until it's completed.
+struct serialbus_reply {
+    uint8_t *buf;
+    unsigned length;
+    bool     completed;
+};
+
+// Copy of registers that read back what was written, and that only the host
+// changes, so read-modify-write needs no round trip
+#define SERIALBUS_SHADOW_MAX (256)
+
+struct serialbus_shadow {
+    uint32_t base;
+    unsigned size; // up to SERIALBUS_SHADOW_MAX registers from base
+    uint8_t  value[SERIALBUS_SHADOW_MAX];
+    bool     known[SERIALBUS_SHADOW_MAX];
+};
+
+// Opens the serial port at the given rate, its settings are restored when the
+// program exits, after the queued commands have gone out
+void serialbus_open(const char *serial_port, unsigned baudrate);
+
+// Queues a command without a reply
+void serialbus_queue(const void *cmd, size_t length);
+
+// Queues a command with a reply of reply->length bytes into reply->buf. With
+// 4 KB of replies outstanding, it first waits for older ones, so they fit
+// into the serial port's receive buffer.
+void serialbus_queue_read(const void *cmd, size_t length, struct serialbus_reply *reply);
+
+// Sends the queued commands
+void serialbus_flush(void);
+
+// Sends the queued commands and receives replies until this one is completed
+void serialbus_wait(struct serialbus_reply *reply);
+
+// Sends the queued commands and receives all replies
+void serialbus_sync(void);
+
+// Register value, false when it isn't in the shadow copy or not known yet
+bool serialbus_shadow_get(const struct serialbus_shadow *shadow, uint32_t addr, uint8_t *value);
+
+// Records a value written to a register, ignored outside the shadow copy
+void serialbus_shadow_set(struct serialbus_shadow *shadow, uint32_t addr, uint8_t value);
@@ -1,111 +1,42 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <fcntl.h>
-#include <termios.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <errno.h>
 #include <signal.h>
+#include "serialbus.h"
 
 #define SERIAL_PORT "/dev/ttyS4"
 #define BAUDRATE 19200
 
-static int     serial_fd = -1;
-struct termios old_serial_tio;
-
-uint8_t bus_read(uint16_t addr);
-
-void restore_settings(void) {
-    bus_read(0x8000);
-
-    if (serial_fd >= 0) {
-        tcsetattr(serial_fd, TCSANOW, &old_serial_tio);
-    }
-    printf("Settings restored\n");
-}
-
-void init_serial(void) {
-    atexit(restore_settings);
-
-    printf("Opening %s @ %u bps\n", SERIAL_PORT, BAUDRATE);
-
-    // Open serial port
-    serial_fd = open(SERIAL_PORT, O_RDWR | O_NOCTTY | O_NONBLOCK); //O_EXLOCK
-    if (serial_fd < 0) {
-        perror(SERIAL_PORT);
-        exit(1);
-    }
-
-    // Get old terminal io settings
-    memset(&old_serial_tio, 0, sizeof(old_serial_tio));
-    tcgetattr(serial_fd, &old_serial_tio);
-
-    // Set new serial io settings
-    struct termios new_serial_tio;
-    memcpy(&new_serial_tio, &old_serial_tio, sizeof(new_serial_tio));
-
-    if (cfsetspeed(&new_serial_tio, BAUDRATE) < 0) {
-        perror("cfsetspeed");
-        exit(1);
-    }
-    new_serial_tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
-    new_serial_tio.c_cflag |= CS8 | CLOCAL | CREAD;
-    new_serial_tio.c_iflag &= ~(IGNBRK | IXON | IXOFF | IXANY);
-    new_serial_tio.c_lflag     = 0;
-    new_serial_tio.c_oflag     = 0;
-    new_serial_tio.c_cc[VMIN]  = 0;
-    new_serial_tio.c_cc[VTIME] = 0;
-    if (tcsetattr(serial_fd, TCSANOW, &new_serial_tio)) {
-        perror("tcsetattr");
-        exit(1);
-    }
-
-    // Make serial port blocking
-    if (fcntl(serial_fd, F_SETFL, fcntl(serial_fd, F_GETFL) & ~O_NONBLOCK) < 0) {
-        perror("fcntl");
-        exit(1);
-    }
-}
+// Layer and display composer registers, which read back what was written
+static struct serialbus_shadow vera_regs = {.base = 0x40000, .size = 0x50};
 
 void bus_write(uint16_t addr, uint8_t data) {
-    uint8_t buf[4];
-    buf[0] = 2;
-    buf[1] = addr & 0xff;
-    buf[2] = addr >> 8;
-    buf[3] = data;
-    write(serial_fd, buf, 4);
+    uint8_t cmd[4] = {2, addr & 0xff, addr >> 8, data};
+    serialbus_queue(cmd, sizeof(cmd));
 }
 
 void bus_vwrite(uint32_t addr, uint8_t data) {
-    uint8_t buf[5];
-    buf[0] = 4;
-    buf[1] = (addr >> 16) & 0xff;
-    buf[2] = (addr >> 8) & 0xff;
-    buf[3] = (addr >> 0) & 0xff;
-    buf[4] = data;
-    write(serial_fd, buf, 5);
+    uint8_t cmd[5] = {4, (addr >> 16) & 0xff, (addr >> 8) & 0xff, (addr >> 0) & 0xff, data};
+    serialbus_queue(cmd, sizeof(cmd));
+    serialbus_shadow_set(&vera_regs, addr, data);
 }
 
+// Registers in the shadow copy take no round trip
 uint8_t bus_vread(uint32_t addr) {
-    uint8_t buf[4];
-    buf[0] = 3;
-    buf[1] = (addr >> 16) & 0xff;
-    buf[2] = (addr >> 8) & 0xff;
-    buf[3] = (addr >> 0) & 0xff;
-    write(serial_fd, buf, 4);
-
-    int result;
-    do {
-        result = read(serial_fd, buf, 1);
-        if (result < 0) {
-            perror("read");
-            exit(1);
-        }
-    } while (result == 0);
+    uint8_t data;
+    if (serialbus_shadow_get(&vera_regs, addr, &data)) {
+        return data;
+    }
 
-    return buf[0];
+    uint8_t                cmd[4] = {3, (addr >> 16) & 0xff, (addr >> 8) & 0xff, (addr >> 0) & 0xff};
+    struct serialbus_reply reply  = {.buf = &data, .length = 1};
+    serialbus_queue_read(cmd, sizeof(cmd), &reply);
+    serialbus_wait(&reply);
+    serialbus_shadow_set(&vera_regs, addr, data);
+    return data;
 }
 
 void bus_vwrite2(uint32_t addr, const uint8_t *data, size_t length) {
@@ -117,39 +48,43 @@ void bus_vwrite2(uint32_t addr, const uint8_t *data, size_t length) {
 
         printf("Writing to 0x%x, length: %lu\n", addr, len);
 
-        uint8_t buf[512];
-        buf[0] = 5;
-        buf[1] = 0x10 | ((addr >> 16) & 0x0f);
-        buf[2] = (addr >> 8) & 0xff;
-        buf[3] = (addr >> 0) & 0xff;
-        buf[4] = len & 0xFF;
-        for (int i = 0; i < (int)len; i++) {
-            buf[5 + i] = *(data++);
+        uint8_t cmd[5];
+        cmd[0] = 5;
+        cmd[1] = 0x10 | ((addr >> 16) & 0x0f);
+        cmd[2] = (addr >> 8) & 0xff;
+        cmd[3] = (addr >> 0) & 0xff;
+        cmd[4] = len & 0xFF;
+        serialbus_queue(cmd, sizeof(cmd));
+        serialbus_queue(data, len);
+        for (size_t i = 0; i < len; i++) {
+            serialbus_shadow_set(&vera_regs, addr + i, data[i]);
         }
-        write(serial_fd, buf, 5 + len);
 
+        data += len;
         addr += len;
         length -= len;
     }
 }
 
 uint8_t bus_read(uint16_t addr) {
-    uint8_t buf[3];
-    buf[0] = 1;
-    buf[1] = addr & 0xff;
-    buf[2] = addr >> 8;
-    write(serial_fd, buf, 3);
+    uint8_t                cmd[3] = {1, addr & 0xff, addr >> 8};
+    uint8_t                data;
+    struct serialbus_reply reply = {.buf = &data, .length = 1};
+    serialbus_queue_read(cmd, sizeof(cmd), &reply);
+    serialbus_wait(&reply);
+    return data;
+}
 
-    int result;
-    do {
-        result = read(serial_fd, buf, 1);
-        if (result < 0) {
-            perror("read");
-            exit(1);
-        }
-    } while (result == 0);
+// Sends what's queued, then waits, e.g. for the next frame
+void bus_delay(unsigned us) {
+    serialbus_flush();
+    usleep(us);
+}
 
-    return buf[0];
+// Dummy read, so everything queued has been done before the settings are
+// restored
+void wait_completion(void) {
+    bus_read(0x8000);
 }
 
 void sigint_handler(int s) {
@@ -284,13 +219,13 @@ void test_8bpp_tile_mode(void) {
     for (int i = 0; i <= 512; i++) {
         bus_vwrite(0x040006, i & 0xff);
         bus_vwrite(0x040007, i >> 8);
-        usleep(16400);
+        bus_delay(16400);
     }
 
     for (int i = 0; i <= 512; i++) {
         bus_vwrite(0x040008, i & 0xff);
         bus_vwrite(0x040009, i >> 8);
-        usleep(16400);
+        bus_delay(16400);
     }
 #endif
 }
@@ -369,14 +304,14 @@ void test_stuff(void) {
         // while ((bus_read(0x8007) & 1) == 0) {
         // }
         // bus_write(0x8007, 1);
-        usleep(16400);
+        bus_delay(16400);
     }
 
     for (int i = 0; i <= 512; i++) {
         bus_vwrite(0x040008, i & 0xff);
         bus_vwrite(0x040009, i >> 8);
 
-        usleep(16400);
+        bus_delay(16400);
     }
 
     exit(0);
@@ -433,13 +368,13 @@ void test_stuff(void) {
     for (int i = 0; i <= 256; i++) {
         bus_vwrite(0x040006, i & 0xff);
         bus_vwrite(0x040007, i >> 8);
-        usleep(16400);
+        bus_delay(16400);
     }
 
     for (int i = 0; i <= 256; i++) {
         bus_vwrite(0x040008, i & 0xff);
         bus_vwrite(0x040009, i >> 8);
-        usleep(16400);
+        bus_delay(16400);
     }
 #endif
 }
@@ -522,7 +457,8 @@ int main(int argc, const char **argv) {
     (void)argv;
 
     signal(SIGINT, sigint_handler);
-    init_serial();
+    serialbus_open(SERIAL_PORT, BAUDRATE);
+    atexit(wait_completion);
 
     bool vga = true;
 
@@ -0,0 +1,165 @@
+#include <stdbool.h>
+#include <string.h>
+#include "lz.h"
+
+#define HASH_BITS (15)
+#define MAX_CHAIN (256) // candidates tried for each match
+
+static int32_t head[1 << HASH_BITS];  // last position with the hash
+static int32_t chain[LZ_MAX_OFFSET]; // previous position with the same hash
+
+static unsigned hash(const uint8_t *p) {
+    return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void insert(const uint8_t *data, size_t pos) {
+    unsigned h                         = hash(data + pos);
+    chain[pos & (LZ_MAX_OFFSET - 1)] = head[h];
+    head[h]                          = pos;
+}
+
+// Longest match worth encoding at pos, 0 if none
+static unsigned find_match(const uint8_t *data, size_t pos, size_t end, unsigned max_offset, unsigned *offset) {
+    if (end - pos < 3) {
+        return 0;
+    }
+    unsigned max_length = end - pos < LZ_MAX_LENGTH ? end - pos : LZ_MAX_LENGTH;
+    unsigned best       = 0;
+    int32_t  candidate  = head[hash(data + pos)];
+    for (unsigned tries = 0; candidate >= 0 && pos - candidate <= max_offset && tries < MAX_CHAIN; tries++) {
+        unsigned length = 0;
+        while (length < max_length && data[candidate + length] == data[pos + length]) {
+            length++;
+        }
+        // Copies from further than 256 bytes back take one more byte
+        unsigned min_length = pos - candidate <= 256 ? 3 : 4;
+        if (length >= min_length && length > best) {
+            best    = length;
+            *offset = pos - candidate;
+            if (length == max_length) {
+                break;
+            }
+        }
+        candidate = chain[candidate & (LZ_MAX_OFFSET - 1)];
+    }
+    return best;
+}
+
+static uint8_t *emit_literals(uint8_t *out, const uint8_t *p, size_t count) {
+    while (count > 0) {
+        unsigned n = count > 0x7F ? 0x7F : count;
+        *out++     = n;
+        memcpy(out, p, n);
+        out += n;
+        p += n;
+        count -= n;
+    }
+    return out;
+}
+
+// Size of a run of literals
+static size_t literal_size(size_t count) {
+    return count + (count + 0x7E) / 0x7F;
+}
+
+size_t lz_compress(const uint8_t *data, size_t start, size_t *end, unsigned max_offset, uint8_t *out, size_t max_size) {
+    uint8_t *out_start = out;
+
+    memset(head, 0xFF, sizeof(head));
+    for (size_t pos = start > max_offset ? start - max_offset : 0; pos + 3 <= *end && pos < start; pos++) {
+        insert(data, pos);
+    }
+
+    size_t literals = start;
+    size_t pos      = start;
+    while (pos < *end) {
+        unsigned offset = 0;
+        unsigned length = find_match(data, pos, *end, max_offset, &offset);
+
+        // Lazy matching: a literal first may allow a longer match
+        if (length > 0 && length < LZ_MAX_LENGTH && pos + 1 < *end) {
+            unsigned next_offset;
+            insert(data, pos);
+            if (find_match(data, pos + 1, *end, max_offset, &next_offset) > length) {
+                length = 0;
+            }
+        } else if (pos + 3 <= *end) {
+            insert(data, pos);
+        }
+
+        // Stop where the stream and its end token no longer fit, a literal
+        // may still fit where a copy doesn't
+        size_t size = out - out_start + literal_size(pos - literals) + 1;
+        if (length > 0 && size + (offset <= 256 ? 2 : 3) > max_size) {
+            length = 0;
+        }
+        if (length == 0 && out - out_start + literal_size(pos + 1 - literals) + 1 > max_size) {
+            *end = pos;
+            break;
+        }
+
+        if (length == 0) {
+            pos++;
+            continue;
+        }
+
+        out          = emit_literals(out, data + literals, pos - literals);
+        unsigned o   = offset - 1;
+        unsigned tok = length - 3;
+        if (offset <= 256) {
+            *out++ = 0x80 | tok;
+            *out++ = o;
+        } else {
+            *out++ = 0xC0 | tok;
+            *out++ = o & 0xFF;
+            *out++ = o >> 8;
+        }
+        for (size_t i = pos + 1; i < pos + length && i + 3 <= *end; i++) {
+            insert(data, i);
+        }
+        pos += length;
+        literals = pos;
+    }
+    out    = emit_literals(out, data + literals, pos - literals);
+    *out++ = 0;
+    return out - out_start;
+}
+
+static void output(struct lz_history *history, void (*put)(void *arg, uint8_t data), void *arg, uint8_t data) {
+    put(arg, data);
+    history->data[history->pos++] = data;
+    if (history->filled < LZ_MAX_OFFSET) {
+        history->filled++;
+    }
+}
+
+long lz_decode(struct lz_history *history, uint8_t (*get)(void *arg), void (*put)(void *arg, uint8_t data), void *arg) {
+    long size = 0;
+    while (true) {
+        uint8_t token = get(arg);
+        if (token == 0) {
+            return size;
+        }
+
+        if (token < 0x80) {
+            for (unsigned i = 0; i < token; i++) {
+                output(history, put, arg, get(arg));
+            }
+            size += token;
+            continue;
+        }
+
+        unsigned length = (token & 0x3F) + 3;
+        unsigned offset = get(arg) + 1;
+        if (token >= 0xC0) {
+            offset += get(arg) << 8;
+        }
+        if (offset > history->filled) {
+            return -1;
+        }
+        for (unsigned i = 0; i < length; i++) {
+            output(history, put, arg, history->data[(uint16_t)(history->pos - offset)]);
+        }
+        size += length;
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+// Byte aligned LZ compression, simple enough to decompress on the fly on a
+// 65C02 as the data comes in over the serial link. A stream is a sequence of
+// tokens:
+//
+//   00                  end of the stream
+//   01..7F              that many literal bytes follow
+//   80..BF <o>          copy (token & 3F) + 3 bytes from o + 1 bytes back (1..256)
+//   C0..FF <o:u16>      copy (token & 3F) + 3 bytes from o + 1 bytes back (1..65536)
+//
+// Copies may overlap the bytes they produce, they go byte by byte from the
+// front. A stream can continue an earlier one, copying from its output.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_MAX_OFFSET (65536)
+#define LZ_MAX_LENGTH (0x3F + 3)
+
+// Worst case size of the stream for size bytes of data
+#define LZ_MAX_COMPRESSED_SIZE(size) ((size) + ((size) + 0x7E) / 0x7F + 1)
+
+// Compress data from start on into out, terminated by an end token. It
+// stops at *end, or earlier where the stream would exceed max_size bytes
+// (at least 3), and sets *end to where it stopped. Copies may reach back to
+// data[0] but no further than max_offset bytes. Returns the size of the
+// stream.
+size_t lz_compress(const uint8_t *data, size_t start, size_t *end, unsigned max_offset, uint8_t *out, size_t max_size);
+
+// Output of earlier streams, for copies
+struct lz_history {
+    uint8_t  data[LZ_MAX_OFFSET];
+    uint16_t pos;
+    size_t   filled; // zero to clear
+};
+
+// Reference decoder: decompress one stream, reading it with get() and
+// passing the output to put(). Returns the size of the output, or -1 when a
+// copy reaches back further than what has been output since history was
+// cleared.
+long lz_decode(struct lz_history *history, uint8_t (*get)(void *arg), void (*put)(void *arg, uint8_t data), void *arg);
@@ -1,183 +1,338 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <fcntl.h>
-#include <termios.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <errno.h>
 #include <signal.h>
 #include <libgen.h>
+#include <time.h>
+#include "lz.h"
+#include "serialbus.h"
 
 // #define SERIAL_PORT "/dev/ttyS5"
 #define BAUDRATE 1000000
 
-static int     serial_fd = -1;
-struct termios old_serial_tio;
+// Commands of the loader running on the target. The block commands move up
+// to 256 bytes (length byte 0) behind one header instead of one record per
+// byte. Their numbers are unused by the per-byte commands here and those of
+// misc/bootloader, which implements them as well. The port commands access
+// a single address for all their data, like VERA's data ports.
+enum {
+    CMD_WRITE         = 1,  // <addr:u16> <data>
+    CMD_READ          = 2,  // <addr:u16>, replies <data>
+    CMD_JUMP          = 3,  // <addr:u16>
+    CMD_BLOCK_WRITE   = 7,  // <addr:u16> <length:u8> <data...>
+    CMD_BLOCK_READ    = 8,  // <addr:u16> <length:u8>, replies <data...>
+    CMD_SYNC          = 9,  // <seq:u8>, replies <seq> <sum of the data written since the last sync:u8>
+    CMD_LZ_WRITE      = 10, // <addr:u16> <compressed data, see lz.h>
+    CMD_LZ_PORT_WRITE = 11, // <addr:u16> <compressed data, copies up to 256 bytes back>
+    CMD_PORT_WRITE    = 12, // <addr:u16> <length:u8> <data...>
+    CMD_PORT_READ     = 13, // <addr:u16> <length:u8>, replies <data...>
+};
+
+// VERA registers, VRAM is accessed through data port 0 (see fpga/source/top.v)
+#define VERA_BASE (0x9F20)
+enum {
+    VERA_ADDR_L = 0,
+    VERA_ADDR_M = 1,
+    VERA_ADDR_H = 2,
+    VERA_DATA0  = 3,
+    VERA_CTRL   = 5,
+};
+
+// Address increments selected by ADDR_H bits 7:4
+static const int vera_increments[16] = {0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 40, 80, 160, 320, 640};
+
+static bool     block_commands = true;
+static bool     compress       = false;
+static unsigned window_size    = 1024; // see x16_write_blocks()
 
 void sigint_handler(int s) {
     printf("Caught signal %d\n", s);
     exit(1);
 }
 
-void restore_settings(void) {
-    tcdrain(serial_fd);
-
-    if (serial_fd >= 0) {
-        tcsetattr(serial_fd, TCSANOW, &old_serial_tio);
-    }
-    printf("Serial settings restored\n");
+void x16_write(uint16_t addr, uint8_t data) {
+    uint8_t cmd[4] = {CMD_WRITE, addr & 0xff, addr >> 8, data};
+    serialbus_queue(cmd, sizeof(cmd));
 }
 
-void init_serial(const char *serial_port) {
-    atexit(restore_settings);
+uint8_t x16_read(uint16_t addr) {
+    uint8_t                cmd[3] = {CMD_READ, addr & 0xff, addr >> 8};
+    uint8_t                data;
+    struct serialbus_reply reply = {.buf = &data, .length = 1};
+    serialbus_queue_read(cmd, sizeof(cmd), &reply);
+    serialbus_wait(&reply);
+    return data;
+}
 
-    printf("Opening %s @ %u bps\n", serial_port, BAUDRATE);
+// Uploads keep up to window_size command bytes in flight. Each batch is a
+// block write or compressed write, followed by a sync command, which the
+// target acknowledges with the batch's sequence number and the sum of the
+// data written, so lost or corrupted bytes are noticed. Should the target
+// fall behind the line rate, the window must fit its receive buffer.
+struct batch {
+    unsigned               bytes; // command bytes
+    uint8_t                sum;   // of the data
+    uint8_t                ack[2];
+    struct serialbus_reply reply; // the sync's, into ack
+};
+
+// Compressed batches take up to this many times their size in data
+#define LZ_BATCH_DATA_FACTOR (8)
+
+static uint8_t batch_command[4 + LZ_MAX_COMPRESSED_SIZE(256 * LZ_BATCH_DATA_FACTOR) + 2];
+
+static unsigned block_batch(uint16_t addr, bool port, const uint8_t *data, size_t size, unsigned batch_size, size_t *len) {
+    *len             = size > batch_size ? batch_size : size;
+    batch_command[0] = port ? CMD_PORT_WRITE : CMD_BLOCK_WRITE;
+    batch_command[1] = addr & 0xff;
+    batch_command[2] = addr >> 8;
+    batch_command[3] = *len & 0xff;
+    memcpy(batch_command + 4, data, *len);
+    return 4 + *len;
+}
 
-    // Open serial port
-    serial_fd = open(serial_port, O_RDWR | O_NOCTTY | O_NONBLOCK); //O_EXLOCK
-    if (serial_fd < 0) {
-        perror(serial_port);
-        exit(1);
-    }
+// Reference decoding of a compressed batch, compared with the data
+struct lz_check {
+    const uint8_t *in;
+    const uint8_t *expected;
+    bool           ok;
+};
 
-    // Get old terminal io settings
-    memset(&old_serial_tio, 0, sizeof(old_serial_tio));
-    tcgetattr(serial_fd, &old_serial_tio);
+static uint8_t lz_check_get(void *arg) {
+    struct lz_check *check = arg;
+    return *check->in++;
+}
 
-    // Set new serial io settings
-    struct termios new_serial_tio;
-    memcpy(&new_serial_tio, &old_serial_tio, sizeof(new_serial_tio));
+static void lz_check_put(void *arg, uint8_t data) {
+    struct lz_check *check = arg;
+    check->ok              = check->ok && data == *check->expected++;
+}
 
-    if (cfsetspeed(&new_serial_tio, BAUDRATE) < 0) {
-        perror("cfsetspeed");
-        exit(1);
+// As much data as compresses into batch_size bytes. Copies may reach back
+// to the start of the upload, that data is in the target's memory. A port
+// can't be read back, the target keeps the last 256 bytes written to it.
+static unsigned lz_batch(uint16_t addr, bool port, const uint8_t *base, size_t offset, size_t size, unsigned batch_size, size_t *len) {
+    static struct lz_history histories[2]; // of what the target decodes, to memory and ports
+    struct lz_history       *history = &histories[port];
+
+    size_t   end        = offset + (size > batch_size * LZ_BATCH_DATA_FACTOR ? batch_size * LZ_BATCH_DATA_FACTOR : size);
+    unsigned compressed = lz_compress(base, offset, &end, port ? 256 : LZ_MAX_OFFSET, batch_command + 3, batch_size < 3 ? 3 : batch_size);
+    size_t   n          = end - offset;
+    *len                = n;
+
+    // Check the stream with the reference decoder before the target decodes it
+    struct lz_check check = {batch_command + 3, base + offset, true};
+    if (offset == 0) {
+        history->filled = 0;
     }
-    new_serial_tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
-    new_serial_tio.c_cflag |= CS8 | CLOCAL | CREAD;
-    new_serial_tio.c_iflag &= ~(IGNBRK | IXON | IXOFF | IXANY);
-    new_serial_tio.c_lflag     = 0;
-    new_serial_tio.c_oflag     = 0;
-    new_serial_tio.c_cc[VMIN]  = 0;
-    new_serial_tio.c_cc[VTIME] = 0;
-    if (tcsetattr(serial_fd, TCSANOW, &new_serial_tio)) {
-        perror("tcsetattr");
+    if (lz_decode(history, lz_check_get, lz_check_put, &check) != (long)n || !check.ok) {
+        fprintf(stderr, "x16_write_buf: compressed data doesn't decompress to the original\n");
         exit(1);
     }
 
-    // Make serial port blocking
-    if (fcntl(serial_fd, F_SETFL, fcntl(serial_fd, F_GETFL) & ~O_NONBLOCK) < 0) {
-        perror("fcntl");
-        exit(1);
-    }
+    batch_command[0] = port ? CMD_LZ_PORT_WRITE : CMD_LZ_WRITE;
+    batch_command[1] = addr & 0xff;
+    batch_command[2] = addr >> 8;
+    return 3 + compressed;
 }
 
-void x16_write(uint16_t addr, uint8_t data) {
-    uint8_t buf[4];
-    buf[0] = 1;
-    buf[1] = addr & 0xff;
-    buf[2] = addr >> 8;
-    buf[3] = data;
-    write(serial_fd, buf, 4);
+static void x16_write_blocks(uint16_t addr, bool port, const uint8_t *p, size_t size) {
+    struct batch batches[256]; // by sequence number
+    uint8_t      next_seq   = 0;
+    uint8_t      oldest_seq = 0;
+    unsigned     count      = 0;
+    unsigned     in_flight  = 0;
+    size_t       offset     = 0;
+    size_t       sent       = 0;
+    unsigned     batch_size = window_size / 2 - 6; // keep two batches in flight
+    if (batch_size > 256) {
+        batch_size = 256;
+    }
+
+    while (offset < size || count > 0) {
+        size_t   len   = 0;
+        unsigned bytes = 0;
+        if (offset < size) {
+            if (compress) {
+                bytes = lz_batch(addr, port, p, offset, size - offset, batch_size, &len);
+            } else {
+                bytes = block_batch(addr, port, p + offset, size - offset, batch_size, &len);
+            }
+            batch_command[bytes++] = CMD_SYNC;
+            batch_command[bytes++] = next_seq;
+        }
+
+
+        while (count > 0 && (bytes == 0 || count == 255 || in_flight + bytes > window_size)) {
+            struct batch *batch = &batches[oldest_seq];
+            serialbus_wait(&batch->reply);
+            if (batch->ack[0] != oldest_seq || batch->ack[1] != batch->sum) {
+                fprintf(stderr, "x16_write_buf: batch %u acknowledged as %u, sum 0x%02X instead of 0x%02X\n",
+                        oldest_seq, batch->ack[0], batch->ack[1], batch->sum);
+                fprintf(stderr, "data lost, a smaller window (-w) may fit the target's receive buffer\n");
+                exit(1);
+            }
+            in_flight -= batch->bytes;
+            oldest_seq++;
+            count--;
+        }
+        if (bytes == 0) {
+            break;
+        }
+
+        uint8_t sum = 0;
+        for (size_t i = 0; i < len; i++) {
+            sum += p[offset + i];
+        }
+        // The sync's reply acknowledges the batch, it goes out right away to
+        // keep the line busy
+        struct batch *batch = &batches[next_seq];
+        *batch              = (struct batch){.bytes = bytes, .sum = sum};
+        batch->reply        = (struct serialbus_reply){.buf = batch->ack, .length = sizeof(batch->ack)};
+        serialbus_queue(batch_command, bytes - 2);
+        serialbus_queue_read(batch_command + bytes - 2, 2, &batch->reply);
+        serialbus_flush();
+
+        next_seq++;
+        count++;
+        in_flight += bytes;
+        sent += bytes;
+        addr += port ? 0 : len;
+        offset += len;
+    }
+
+    if (compress) {
+        printf("Sent %zu bytes compressed (%.1f%%)\n", sent, 100.0 * sent / size);
+    }
 }
 
-uint8_t x16_read(uint16_t addr) {
-    uint8_t buf[3];
-    buf[0] = 2;
-    buf[1] = addr & 0xff;
-    buf[2] = addr >> 8;
-    write(serial_fd, buf, 3);
-
-    int result;
-    do {
-        result = read(serial_fd, buf, 1);
-        if (result < 0) {
-            perror("read");
-            exit(1);
+// Downloads keep up to window_size reply bytes requested, the replies go
+// straight into the buffer
+static void x16_read_blocks(uint16_t addr, bool port, uint8_t *p, size_t size) {
+    struct serialbus_reply replies[256]; // by block
+    unsigned               oldest    = 0;
+    unsigned               count     = 0;
+    size_t                 requested = 0;
+    size_t                 received  = 0;
+
+    while (received < size) {
+        unsigned len = size - requested > 256 ? 256 : size - requested;
+        if (requested < size && count < 256 && (requested == received || requested - received + len <= window_size)) {
+            uint16_t                a      = port ? addr : addr + requested;
+            uint8_t                 cmd[4] = {port ? CMD_PORT_READ : CMD_BLOCK_READ, a & 0xff, a >> 8, len & 0xff};
+            struct serialbus_reply *reply  = &replies[(oldest + count++) % 256];
+            *reply                         = (struct serialbus_reply){.buf = p + requested, .length = len};
+            serialbus_queue_read(cmd, sizeof(cmd), reply);
+            requested += len;
+            continue;
         }
-    } while (result == 0);
 
-    return buf[0];
+        serialbus_wait(&replies[oldest]);
+        received += replies[oldest].length;
+        oldest = (oldest + 1) % 256;
+        count--;
+    }
 }
 
-void x16_write_buf(uint16_t addr, const void *buf, size_t size) {
+// Writes to consecutive addresses, or all to the same address for a port
+static void write_buf(uint16_t addr, bool port, const void *buf, size_t size) {
     const uint8_t *p = buf;
 
     if (size == 0) {
         return;
     }
+    if (block_commands) {
+        x16_write_blocks(addr, port, p, size);
+        return;
+    }
 
+    // A dummy read after every 62 writes, which fit into 256 bytes with it,
+    // checks completion
     while (size > 0) {
-        uint8_t cmd[256];
-        int     idx = 0;
-        while (idx + 4 + 3 < 256 && size > 0) {
-            cmd[idx++] = 1;
-            cmd[idx++] = addr & 0xff;
-            cmd[idx++] = addr >> 8;
-            cmd[idx++] = *(p++);
-            addr++;
+        for (int i = 0; i < 62 && size > 0; i++) {
+            x16_write(addr, *(p++));
+            addr += port ? 0 : 1;
             size--;
         }
-
-        // Add dummy read to check completion
-        cmd[idx++] = 2;
-        cmd[idx++] = 0;
-        cmd[idx++] = 0;
-        write(serial_fd, cmd, idx);
-
-        // Wait completion
-        int result;
-        do {
-            uint8_t tmp;
-            result = read(serial_fd, &tmp, 1);
-            if (result < 0) {
-                perror("x16_write_buf");
-                exit(1);
-            }
-        } while (result == 0);
+        x16_read(0);
     }
 }
 
-void x16_read_buf(uint16_t addr, void *buf, size_t size) {
+void x16_write_buf(uint16_t addr, const void *buf, size_t size) {
+    write_buf(addr, false, buf, size);
+}
+
+void x16_write_port(uint16_t addr, const void *buf, size_t size) {
+    write_buf(addr, true, buf, size);
+}
+
+static void read_buf(uint16_t addr, bool port, void *buf, size_t size) {
     uint8_t *p = buf;
 
     if (size == 0) {
         return;
     }
+    if (block_commands) {
+        x16_read_blocks(addr, port, p, size);
+        return;
+    }
 
+    // Up to 85 reads in flight, their commands fit into 256 bytes
     while (size > 0) {
-        uint8_t cmd[256];
-        int     idx   = 0;
-        int     rdcnt = 0;
-        while (idx + 3 < 256 && size > 0) {
-            cmd[idx++] = 2;
-            cmd[idx++] = addr & 0xff;
-            cmd[idx++] = addr >> 8;
-            addr++;
-            rdcnt++;
+        struct serialbus_reply replies[85];
+        for (int i = 0; i < 85 && size > 0; i++) {
+            uint8_t cmd[3] = {CMD_READ, addr & 0xff, addr >> 8};
+            replies[i]     = (struct serialbus_reply){.buf = p++, .length = 1};
+            serialbus_queue_read(cmd, sizeof(cmd), &replies[i]);
+            addr += port ? 0 : 1;
             size--;
         }
-        write(serial_fd, cmd, idx);
+        serialbus_sync();
+    }
+}
 
-        while (rdcnt > 0) {
-            int result = read(serial_fd, p, rdcnt);
-            if (result < 0) {
-                perror("read");
-                exit(1);
-            }
-            rdcnt -= result;
-            p += result;
+void x16_read_buf(uint16_t addr, void *buf, size_t size) {
+    read_buf(addr, false, buf, size);
+}
+
+void x16_read_port(uint16_t addr, void *buf, size_t size) {
+    read_buf(addr, true, buf, size);
+}
+
+// ADDR_H increment bits for an increment, -1 when VERA has none such
+static int vera_increment_index(int increment) {
+    for (int i = 0; i < 16; i++) {
+        if (vera_increments[i] == abs(increment)) {
+            return i;
         }
     }
+    return -1;
+}
+
+// Points VERA's data port 0 at a VRAM address, after each access it moves on
+// by increment bytes, back for negative ones. Then every byte transferred is
+// a single write or read of the port.
+static void vera_set_address(uint32_t addr, int increment) {
+    // Select port 0, keeping DCSEL
+    x16_write(VERA_BASE + VERA_CTRL, x16_read(VERA_BASE + VERA_CTRL) & ~1);
+    x16_write(VERA_BASE + VERA_ADDR_L, addr & 0xff);
+    x16_write(VERA_BASE + VERA_ADDR_M, (addr >> 8) & 0xff);
+    x16_write(VERA_BASE + VERA_ADDR_H, vera_increment_index(increment) << 4 | (increment < 0 ? 0x08 : 0) | (addr >> 16 & 1));
 }
 
 void x16_jump(uint16_t addr) {
-    uint8_t buf[3];
-    buf[0] = 3;
-    buf[1] = addr & 0xff;
-    buf[2] = addr >> 8;
-    write(serial_fd, buf, 3);
+    uint8_t cmd[3] = {CMD_JUMP, addr & 0xff, addr >> 8};
+    serialbus_queue(cmd, sizeof(cmd));
+    serialbus_flush();
+}
+
+static double time_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
 int main(int argc, char *const argv[]) {
@@ -189,8 +344,10 @@ int main(int argc, char *const argv[]) {
     int         start             = -1;
     int         transfer_size     = -1;
     int         jmp_addr          = -1;
+    bool        vram              = false;
+    int         vram_increment    = 1;
 
-    while ((opt = getopt(argc, argv, "u:d:s:z:j:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:u:d:s:z:j:bw:cvi:")) != -1) {
         switch (opt) {
             case 'p': serial_port = optarg; break;
             case 'u': upload_filepath = optarg; break;
@@ -198,6 +355,11 @@ int main(int argc, char *const argv[]) {
             case 's': start = strtoul(optarg, NULL, 0); break;
             case 'z': transfer_size = strtoul(optarg, NULL, 0); break;
             case 'j': jmp_addr = strtoul(optarg, NULL, 0); break;
+            case 'b': block_commands = false; break;
+            case 'c': compress = true; break;
+            case 'w': window_size = strtoul(optarg, NULL, 0); break;
+            case 'v': vram = true; break;
+            case 'i': vram_increment = strtol(optarg, NULL, 0); break;
             default: params_ok = false; break;
         }
     }
@@ -212,6 +374,12 @@ int main(int argc, char *const argv[]) {
     if (!(do_upload || do_download || do_jmp)) {
         params_ok = false;
     }
+    if (window_size < 16 || (compress && !block_commands)) {
+        params_ok = false;
+    }
+    if (vram && (start > 0x1FFFF || vera_increment_index(vram_increment) < 0)) {
+        params_ok = false;
+    }
 
     if (!params_ok) { // || !filepath) {
         fprintf(stderr, "usage: %s [options]\n", basename(argv[0]));
@@ -222,12 +390,18 @@ int main(int argc, char *const argv[]) {
         fprintf(stderr, "  -s <start>       Memory start address\n");
         fprintf(stderr, "  -z <size>        Download size\n");
         fprintf(stderr, "  -j <addr>        Jump to address (performed as last action)\n");
+        fprintf(stderr, "  -b               Transfer byte by byte, for loaders without block commands\n");
+        fprintf(stderr, "  -c               Compress uploads, the target decompresses them\n");
+        fprintf(stderr, "  -w <bytes>       Bytes in flight with block commands, at least 16 (default: %u)\n", window_size);
+        fprintf(stderr, "  -v               Transfer to/from VRAM through VERA's data port, start is a VRAM address\n");
+        fprintf(stderr, "  -i <bytes>       VRAM address increment: 0, 1, 2, 4 ... 512, 40, 80, 160, 320 or 640,\n");
+        fprintf(stderr, "                   negative to decrement (default: 1)\n");
         fprintf(stderr, "\n");
         exit(1);
     }
 
     signal(SIGINT, sigint_handler);
-    init_serial(serial_port);
+    serialbus_open(serial_port, BAUDRATE);
 
     if (do_upload) {
         FILE *f = fopen(upload_filepath, "rb");
@@ -245,8 +419,14 @@ int main(int argc, char *const argv[]) {
         fclose(f);
 
         printf("Uploading %zu bytes from %s to 0x%X...\n", size, upload_filepath, start);
-        x16_write_buf(start, buf, size);
-        printf("Done\n");
+        double t0 = time_now();
+        if (vram) {
+            vera_set_address(start, vram_increment);
+            x16_write_port(VERA_BASE + VERA_DATA0, buf, size);
+        } else {
+            x16_write_buf(start, buf, size);
+        }
+        printf("Done (%.1f KB/s)\n", size / 1024.0 / (time_now() - t0));
 
         free(buf);
     }
@@ -260,11 +440,18 @@ int main(int argc, char *const argv[]) {
 
         uint8_t *buf = malloc(transfer_size);
         printf("Downloading %u bytes from 0x%X to %s...\n", transfer_size, start, download_filepath);
-        x16_read_buf(start, buf, transfer_size);
+        double t0 = time_now();
+        if (vram) {
+            vera_set_address(start, vram_increment);
+            x16_read_port(VERA_BASE + VERA_DATA0, buf, transfer_size);
+        } else {
+            x16_read_buf(start, buf, transfer_size);
+        }
+        double t1 = time_now();
         fwrite(buf, transfer_size, 1, f);
         free(buf);
         fclose(f);
-        printf("Done\n");
+        printf("Done (%.1f KB/s)\n", transfer_size / 1024.0 / (t1 - t0));
     }
 
     if (do_jmp) {
@@ -0,0 +1,410 @@
+// Stand-in for the loader on the target, to try x16load without hardware.
+// It runs the loader's commands against 64 KB of memory on a pseudo terminal,
+// timed like a serial link of the given rate, so transfer rates can be
+// compared:
+//
+//   ./x16target &                  prints the terminal to use, e.g. /dev/pts/3
+//   ./x16load -p /dev/pts/3 -u file.prg -s 0x801
+//
+// Optionally replies are delayed further, like by the latency timer of a USB
+// serial adapter, and the target takes time for each byte, with a receive
+// buffer of limited size. Bytes that don't fit into the buffer are lost.
+//
+// Like on the X16, VERA's registers are at 0x9F20, here a model of the ones
+// for accessing VRAM (see fpga/source/top.v), so VRAM uploads can be checked.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <libgen.h>
+#include <poll.h>
+#include "lz.h"
+
+// Same as in x16load.c
+enum {
+    CMD_WRITE         = 1,  // <addr:u16> <data>
+    CMD_READ          = 2,  // <addr:u16>, replies <data>
+    CMD_JUMP          = 3,  // <addr:u16>
+    CMD_BLOCK_WRITE   = 7,  // <addr:u16> <length:u8> <data...>
+    CMD_BLOCK_READ    = 8,  // <addr:u16> <length:u8>, replies <data...>
+    CMD_SYNC          = 9,  // <seq:u8>, replies <seq> <sum of the data written since the last sync:u8>
+    CMD_LZ_WRITE      = 10, // <addr:u16> <compressed data, see lz.h>
+    CMD_LZ_PORT_WRITE = 11, // <addr:u16> <compressed data, copies up to 256 bytes back>
+    CMD_PORT_WRITE    = 12, // <addr:u16> <length:u8> <data...>
+    CMD_PORT_READ     = 13, // <addr:u16> <length:u8>, replies <data...>
+};
+
+// VERA registers
+#define VERA_BASE (0x9F20)
+enum {
+    VERA_ADDR_L = 0,
+    VERA_ADDR_M = 1,
+    VERA_ADDR_H = 2,
+    VERA_DATA0  = 3,
+    VERA_DATA1  = 4,
+    VERA_CTRL   = 5,
+    VERA_REGS   = 32,
+};
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static uint8_t memory[65536];
+
+// ADDR_x, DATA0/1 and CTRL's ADDRSEL bit, the other registers read back what
+// was written
+static struct {
+    uint8_t  vram[0x20000];
+    uint32_t addr[2];
+    uint8_t  addr_h[2]; // increment, decrement bits
+    uint8_t  regs[VERA_REGS];
+} vera;
+
+static const uint16_t vera_increments[16] = {0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 40, 80, 160, 320, 640};
+
+static int      pty_fd = -1;
+static uint64_t byte_ns;      // one byte on the line (start, 8 data, stop bit), 0 for no limit
+static uint64_t latency_ns;   // added to replies
+static uint64_t process_ns;   // the target takes for each byte received
+static unsigned rx_fifo_size; // receive buffer, 0 for no limit
+
+static uint64_t line_time; // the last byte received has come in
+static uint64_t cpu_time;  // the target is done with the bytes received so far
+
+static uint8_t  rx_buf[4096];
+static unsigned rx_pos, rx_len;
+static uint64_t rx_count;
+static uint64_t *rx_fifo_taken; // the last rx_fifo_size bytes were taken from the receive buffer
+static uint64_t rx_overruns, rx_overruns_reported;
+
+static struct {
+    uint64_t time; // is due on the host side
+    uint8_t  data;
+} tx_queue[4096];
+static unsigned tx_head, tx_tail;
+static uint64_t tx_time; // the last byte queued has gone out
+
+static uint64_t time_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Sends the replies that are due, returns the time until the next one is, or
+// -1 when there is none
+static int64_t tx_send_due(void) {
+    uint8_t  buf[sizeof(tx_queue) / sizeof(tx_queue[0])];
+    unsigned length = 0;
+    uint64_t now    = time_now();
+    while (tx_tail != tx_head && tx_queue[tx_tail].time <= now) {
+        buf[length++] = tx_queue[tx_tail].data;
+        tx_tail       = (tx_tail + 1) % (sizeof(tx_queue) / sizeof(tx_queue[0]));
+    }
+
+    const uint8_t *p = buf;
+    while (length > 0) {
+        int result = write(pty_fd, p, length);
+        if (result < 0) {
+            perror("write");
+            exit(1);
+        }
+        p += result;
+        length -= result;
+    }
+    return tx_tail != tx_head ? (int64_t)(tx_queue[tx_tail].time - now) : -1;
+}
+
+// Waits for more bytes from the host, sending replies as they become due
+static void rx_fill(void) {
+    if (rx_overruns != rx_overruns_reported) {
+        fprintf(stderr, "receive buffer overrun, %llu byte(s) lost\n", (unsigned long long)rx_overruns);
+        rx_overruns_reported = rx_overruns;
+    }
+
+    while (true) {
+        int64_t         wait = tx_send_due();
+        struct timespec ts   = {.tv_sec = wait / 1000000000, .tv_nsec = wait % 1000000000};
+        struct pollfd   pfd  = {.fd = pty_fd, .events = POLLIN};
+        if (ppoll(&pfd, 1, wait >= 0 ? &ts : NULL, NULL) < 0 && errno != EINTR) {
+            perror("ppoll");
+            exit(1);
+        }
+        if (pfd.revents & POLLIN) {
+            break;
+        }
+    }
+
+    int result = read(pty_fd, rx_buf, sizeof(rx_buf));
+    if (result <= 0) {
+        perror("read");
+        exit(1);
+    }
+    rx_pos    = 0;
+    rx_len    = result;
+    line_time = MAX(line_time, time_now());
+}
+
+// Replies are sent once the target has processed the command
+static void tx_byte(uint8_t data) {
+    unsigned next = (tx_head + 1) % (sizeof(tx_queue) / sizeof(tx_queue[0]));
+    while (next == tx_tail) {
+        int64_t         wait = tx_send_due();
+        struct timespec ts   = {.tv_sec = wait / 1000000000, .tv_nsec = wait % 1000000000};
+        nanosleep(&ts, NULL);
+    }
+    tx_time                = MAX(tx_time, cpu_time) + byte_ns;
+    tx_queue[tx_head].time = tx_time + latency_ns;
+    tx_queue[tx_head].data = data;
+    tx_head                = next;
+}
+
+static uint8_t rx_byte(void) {
+    while (true) {
+        if (rx_pos == rx_len) {
+            rx_fill();
+        }
+        uint8_t data = rx_buf[rx_pos++];
+        line_time += byte_ns;
+
+        // The byte waits in the receive buffer until the target takes it,
+        // it's lost when the byte received rx_fifo_size bytes earlier is
+        // still there
+        if (rx_fifo_size > 0) {
+            uint64_t *taken = &rx_fifo_taken[rx_count % rx_fifo_size];
+            if (*taken > line_time) {
+                rx_overruns++;
+                continue;
+            }
+            *taken = MAX(cpu_time, line_time);
+        }
+        rx_count++;
+        cpu_time = MAX(cpu_time, line_time) + process_ns;
+        return data;
+    }
+}
+
+// Data port access, the address moves on by the port's increment
+static uint8_t *vera_data(unsigned port) {
+    uint8_t *p         = &vera.vram[vera.addr[port]];
+    unsigned increment = vera_increments[vera.addr_h[port] >> 4];
+    vera.addr[port]    = (vera.addr[port] + (vera.addr_h[port] & 0x08 ? -increment : increment)) & 0x1FFFF;
+    return p;
+}
+
+static uint8_t vera_read(unsigned reg) {
+    unsigned port = vera.regs[VERA_CTRL] & 1;
+    switch (reg) {
+        case VERA_ADDR_L: return vera.addr[port] & 0xFF;
+        case VERA_ADDR_M: return (vera.addr[port] >> 8) & 0xFF;
+        case VERA_ADDR_H: return vera.addr_h[port] | vera.addr[port] >> 16;
+        case VERA_DATA0: return *vera_data(0);
+        case VERA_DATA1: return *vera_data(1);
+        default: return vera.regs[reg];
+    }
+}
+
+static void vera_write(unsigned reg, uint8_t data) {
+    unsigned port = vera.regs[VERA_CTRL] & 1;
+    switch (reg) {
+        case VERA_ADDR_L: vera.addr[port] = (vera.addr[port] & 0x1FF00) | data; break;
+        case VERA_ADDR_M: vera.addr[port] = (vera.addr[port] & 0x100FF) | data << 8; break;
+        case VERA_ADDR_H:
+            vera.addr[port]   = (vera.addr[port] & 0x0FFFF) | (data & 1) << 16;
+            vera.addr_h[port] = data & 0xF8;
+            break;
+        case VERA_DATA0: *vera_data(0) = data; break;
+        case VERA_DATA1: *vera_data(1) = data; break;
+        case VERA_CTRL: vera.regs[reg] = data & 0x03; break;
+        default: vera.regs[reg] = data; break;
+    }
+}
+
+static uint8_t sum; // of the data written since the last sync
+
+static uint8_t bus_read(uint16_t addr) {
+    if ((unsigned)(addr - VERA_BASE) < VERA_REGS) {
+        return vera_read(addr - VERA_BASE);
+    }
+    return memory[addr];
+}
+
+static void bus_write(uint16_t addr, uint8_t data) {
+    if ((unsigned)(addr - VERA_BASE) < VERA_REGS) {
+        vera_write(addr - VERA_BASE, data);
+    } else {
+        memory[addr] = data;
+    }
+}
+
+// Compressed data is decoded with the reference decoder. Copies to a port
+// come from a separate history, like the loader's ring.
+static struct lz_history lz_history, lz_port_history;
+static uint16_t          lz_addr;
+
+static uint8_t lz_get(void *arg) {
+    (void)arg;
+    return rx_byte();
+}
+
+static void lz_put_memory(void *arg, uint8_t data) {
+    (void)arg;
+    bus_write(lz_addr++, data);
+    sum += data;
+}
+
+static void lz_put_port(void *arg, uint8_t data) {
+    (void)arg;
+    bus_write(lz_addr, data);
+    sum += data;
+}
+
+static uint16_t rx_addr(void) {
+    uint16_t addr = rx_byte();
+    return addr | rx_byte() << 8;
+}
+
+// Block length, 0 stands for 256
+static unsigned rx_length(void) {
+    uint8_t length = rx_byte();
+    return length == 0 ? 256 : length;
+}
+
+static void open_pty(void) {
+    pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pty_fd < 0 || grantpt(pty_fd) < 0 || unlockpt(pty_fd) < 0) {
+        perror("posix_openpt");
+        exit(1);
+    }
+
+    struct termios tio;
+    tcgetattr(pty_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(pty_fd, TCSANOW, &tio);
+
+    // Keep the terminal open in between x16load runs, otherwise reading the
+    // master side fails while nobody has it open
+    const char *name = ptsname(pty_fd);
+    if (open(name, O_RDWR | O_NOCTTY) < 0) {
+        perror(name);
+        exit(1);
+    }
+    printf("%s\n", name);
+    fflush(stdout);
+}
+
+int main(int argc, char *const argv[]) {
+    int      opt;
+    unsigned baudrate = 1000000;
+
+    while ((opt = getopt(argc, argv, "b:l:r:t:")) != -1) {
+        switch (opt) {
+            case 'b': baudrate = strtoul(optarg, NULL, 0); break;
+            case 'l': latency_ns = strtoull(optarg, NULL, 0) * 1000; break;
+            case 'r': rx_fifo_size = strtoul(optarg, NULL, 0); break;
+            case 't': process_ns = strtoull(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [options]\n", basename(argv[0]));
+                fprintf(stderr, "\n");
+                fprintf(stderr, "  -b <baudrate>    Serial link to simulate, 0 for none (default: 1000000)\n");
+                fprintf(stderr, "  -l <us>          Delay replies further, e.g. 16000 for a USB serial adapter's latency timer\n");
+                fprintf(stderr, "  -r <bytes>       Receive buffer of the target, 0 for no limit (default)\n");
+                fprintf(stderr, "  -t <ns>          Time the target takes for each byte received (default: 0)\n");
+                fprintf(stderr, "\n");
+                exit(1);
+        }
+    }
+    byte_ns = baudrate > 0 ? 10 * 1000000000ULL / baudrate : 0;
+    if (rx_fifo_size > 0) {
+        rx_fifo_taken = calloc(rx_fifo_size, sizeof(*rx_fifo_taken));
+    }
+
+    open_pty();
+
+    while (true) {
+        uint8_t cmd = rx_byte();
+        switch (cmd) {
+            case CMD_WRITE: {
+                uint16_t addr = rx_addr();
+                bus_write(addr, rx_byte());
+                break;
+            }
+
+            case CMD_READ: tx_byte(bus_read(rx_addr())); break;
+
+            case CMD_JUMP:
+                printf("jump to 0x%04X\n", rx_addr());
+                fflush(stdout);
+                break;
+
+            case CMD_BLOCK_WRITE: {
+                uint16_t addr   = rx_addr();
+                unsigned length = rx_length();
+                for (unsigned i = 0; i < length; i++) {
+                    uint8_t data = rx_byte();
+                    bus_write(addr + i, data);
+                    sum += data;
+                }
+                break;
+            }
+
+            case CMD_BLOCK_READ: {
+                uint16_t addr   = rx_addr();
+                unsigned length = rx_length();
+                for (unsigned i = 0; i < length; i++) {
+                    tx_byte(bus_read(addr + i));
+                }
+                break;
+            }
+
+            case CMD_PORT_WRITE: {
+                uint16_t addr   = rx_addr();
+                unsigned length = rx_length();
+                for (unsigned i = 0; i < length; i++) {
+                    uint8_t data = rx_byte();
+                    bus_write(addr, data);
+                    sum += data;
+                }
+                break;
+            }
+
+            case CMD_PORT_READ: {
+                uint16_t addr   = rx_addr();
+                unsigned length = rx_length();
+                for (unsigned i = 0; i < length; i++) {
+                    tx_byte(bus_read(addr));
+                }
+                break;
+            }
+
+            case CMD_LZ_WRITE:
+                lz_addr = rx_addr();
+                if (lz_decode(&lz_history, lz_get, lz_put_memory, NULL) < 0) {
+                    fprintf(stderr, "compressed data copies from before its start\n");
+                }
+                break;
+
+            case CMD_LZ_PORT_WRITE:
+                lz_addr = rx_addr();
+                if (lz_decode(&lz_port_history, lz_get, lz_put_port, NULL) < 0) {
+                    fprintf(stderr, "compressed data copies from before its start\n");
+                }
+                break;
+
+            case CMD_SYNC:
+                tx_byte(rx_byte());
+                tx_byte(sum);
+                sum = 0;
+                break;
+
+            // Like the loader, skip unknown command bytes
+            default: break;
+        }
+    }
+}
@@ -0,0 +1,205 @@
+#include "lib.h"
+#include "usb.h"
+#include "flash.h"
+#include "unistd.h"
+#include <time.h>
+
+// Throughput of the programmer operations, by default against the simulated
+// programmer. Reports MB/s for a volatile FPGA upload, flash write, verify
+// (CRC and readback) and dump of the same amount of data. The pipelined path
+// (CMD_SPI_STREAM, queue depth 16 by default) is shown next to a baseline of
+// the path it replaced: 62/64-byte CMD_SPI_SHIFT_* chunks with one transfer in
+// flight, so each waits for the one before and for its IN reply. Write and
+// CRC verify have no such older path, their baseline is just queue depth 1.
+// Exits nonzero when any of them goes wrong.
+
+enum bench {
+    BENCH_UPLOAD,
+    BENCH_WRITE,
+    BENCH_VERIFY_CRC,
+    BENCH_VERIFY_READBACK,
+    BENCH_DUMP,
+    BENCH_COUNT,
+};
+
+static const char *const bench_names[BENCH_COUNT] = {
+    [BENCH_UPLOAD]          = "upload (-F)",
+    [BENCH_WRITE]           = "write",
+    [BENCH_VERIFY_CRC]      = "verify (crc)",
+    [BENCH_VERIFY_READBACK] = "verify (readback)",
+    [BENCH_DUMP]            = "dump",
+};
+
+static double time_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Bitstream-like data: preamble, pseudo random payload. Each run writes
+// different data, so the flash write can't skip unchanged sectors and has to
+// erase them.
+static void fill_image(uint8_t *image, unsigned size, uint32_t seed) {
+    uint32_t x = seed;
+    for (unsigned i = 0; i < size; i++) {
+        x        = x * 1103515245 + 12345;
+        image[i] = x >> 24;
+    }
+    memcpy(image, "\x7E\xAA\x99\x7E", 4);
+}
+
+// Flash read with CMD_SPI_SHIFT_RX chunks, as flash_read() did before
+// CMD_SPI_STREAM
+static void shift_read(unsigned address, void *data, unsigned size) {
+    uint8_t buf[] = {0x0B, address >> 16, address >> 8, address >> 0, 0xFF}; // FAST_READ
+    spi_select(1);
+    spi_transfer(buf, NULL, sizeof(buf));
+    spi_transfer(NULL, data, size);
+    spi_select(0);
+}
+
+static bool bench_upload(const uint8_t *image, unsigned size, bool baseline, double *seconds) {
+    double t0 = time_now();
+    spi_set_mode(SPI_MODE_FPGA);
+    if (baseline) {
+        spi_transfer(image, NULL, size);
+    } else {
+        spi_stream(false, NULL, 0, image, NULL, size);
+    }
+
+    uint8_t dummy[100];
+    memset(dummy, 0, sizeof(dummy));
+    spi_transfer(dummy, NULL, sizeof(dummy));
+    spi_set_mode(SPI_MODE_NONE);
+    bool cdone = get_cdone();
+    *seconds   = time_now() - t0;
+
+    if (!cdone) {
+        printf("upload: CDONE low\n");
+    }
+    return cdone;
+}
+
+// All benchmarks at the current queue depth, the time of each in seconds[]
+static bool bench_run(const struct flash_info *flash_info, unsigned address, const uint8_t *image, uint8_t *check, unsigned size,
+                      bool baseline, double *seconds) {
+    bool ok = bench_upload(image, size, baseline, &seconds[BENCH_UPLOAD]);
+
+    spi_set_mode(SPI_MODE_FLASH);
+    double t0 = time_now();
+    flash_write(flash_info, address, image, size);
+    flash_flush(flash_info);
+    seconds[BENCH_WRITE] = time_now() - t0;
+
+    t0                        = time_now();
+    int result                = flash_verify_crc(address, image, size);
+    seconds[BENCH_VERIFY_CRC] = time_now() - t0;
+    if (result != 0) {
+        printf("verify (crc): mismatch\n");
+        ok = false;
+    }
+
+    t0 = time_now();
+    if (baseline) {
+        shift_read(address, check, size);
+        result = memcmp(check, image, size);
+    } else {
+        result = flash_compare(address, image, size);
+    }
+    seconds[BENCH_VERIFY_READBACK] = time_now() - t0;
+    if (result != 0) {
+        printf("verify (readback): mismatch\n");
+        ok = false;
+    }
+
+    t0 = time_now();
+    memset(check, 0, size);
+    if (baseline) {
+        shift_read(address, check, size);
+    } else {
+        flash_read(address, check, size);
+    }
+    seconds[BENCH_DUMP] = time_now() - t0;
+    if (memcmp(check, image, size) != 0) {
+        printf("dump: mismatch\n");
+        ok = false;
+    }
+
+    spi_set_mode(SPI_MODE_NONE);
+    return ok;
+}
+
+int main(int argc, char *const argv[]) {
+    int         opt;
+    const char *transport   = "sim";
+    unsigned    size        = 0x1A000; // one FPGA image slot
+    unsigned    address     = 0x1000;
+    unsigned    queue_depth = 16;
+
+    while ((opt = getopt(argc, argv, "T:z:q:")) != -1) {
+        switch (opt) {
+            case 'T': transport = optarg; break;
+            case 'z': size = strtoul(optarg, NULL, 0); break;
+            case 'q': queue_depth = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-T <transport>] [-z <size>] [-q <depth>]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    usb_init(transport);
+    struct programmer *programmer = usb_open(NULL);
+    if (programmer == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    usb_select(programmer);
+
+    uint8_t *image = malloc(size);
+    uint8_t *check = malloc(size);
+    if (image == NULL || check == NULL || size < 4) {
+        fprintf(stderr, "invalid size\n");
+        exit(EXIT_FAILURE);
+    }
+
+    spi_set_mode(SPI_MODE_FLASH);
+    const struct flash_info *flash_info = flash_detect();
+    if (flash_info == NULL) {
+        fprintf(stderr, "flash not detected\n");
+        exit(EXIT_FAILURE);
+    }
+    if (address + size > flash_info->size) {
+        fprintf(stderr, "size too large\n");
+        exit(EXIT_FAILURE);
+    }
+    fill_image(image, size, 12345);
+    flash_write(flash_info, address, image, size);
+    flash_flush(flash_info);
+    spi_set_mode(SPI_MODE_NONE);
+
+    // Baseline first, then the pipelined path
+    double seconds[2][BENCH_COUNT];
+    bool   ok = true;
+    for (unsigned run = 0; run < 2; run++) {
+        usb_set_queue_depth(run == 0 ? 1 : queue_depth);
+        fill_image(image, size, 12346 + run);
+        ok = bench_run(flash_info, address, image, check, size, run == 0, seconds[run]) && ok;
+    }
+
+    printf("transport %s, %u bytes\n", transport, size);
+    char pipelined[32];
+    snprintf(pipelined, sizeof(pipelined), "stream, depth %u", queue_depth);
+    printf("%-18s  %22s  %22s\n", "", "shift, depth 1", pipelined);
+    for (unsigned b = 0; b < BENCH_COUNT; b++) {
+        printf("%-18s", bench_names[b]);
+        for (unsigned run = 0; run < 2; run++) {
+            printf("  %7.3f s %7.3f MB/s", seconds[run][b], size / seconds[run][b] / 1e6);
+        }
+        printf("\n");
+    }
+
+    usb_close(programmer);
+    usb_deinit();
+    free(image);
+    free(check);
+    return ok ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,292 @@
+#include "file_reader.h"
+#include "lib.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct file_reader_buffer {
+    uint8_t *data;
+    size_t   length; // less than a block at the end of the file
+    int      error;  // errno of a failed read
+    bool     full;   // filled by the thread, not handed back yet
+};
+
+struct file_reader {
+    const char *path;
+    int         fd;
+    long long   size;
+    bool        error;
+    bool        end;
+
+    // Regular files
+    bool           mapped;
+    const uint8_t *map;
+    size_t         map_size;
+    size_t         offset;
+
+    // Other files
+    pthread_t                 thread;
+    pthread_mutex_t           lock;
+    pthread_cond_t            cond;
+    bool                      stop;
+    struct file_reader_buffer buffers[2];
+    unsigned                  current;  // buffer the caller reads from
+    bool                      holding;  // current buffer taken from the thread
+    size_t                    consumed; // bytes of it handed out
+    uint8_t *                 contents; // copy made by file_reader_contents()
+};
+
+static void *reader_thread(void *arg) {
+    struct file_reader *r = (struct file_reader *)arg;
+
+    // Only cancelled while blocked in read(), otherwise stopped by r->stop
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    for (unsigned i = 0;; i ^= 1) {
+        struct file_reader_buffer *b = &r->buffers[i];
+
+        pthread_mutex_lock(&r->lock);
+        while (b->full && !r->stop) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        bool stop = r->stop;
+        pthread_mutex_unlock(&r->lock);
+        if (stop) {
+            return NULL;
+        }
+
+        size_t length = 0;
+        int    error  = 0;
+        while (length < FILE_READER_BLOCK_SIZE) {
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            ssize_t n = read(r->fd, b->data + length, FILE_READER_BLOCK_SIZE - length);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                error = errno;
+                break;
+            }
+            if (n == 0) {
+                break;
+            }
+            length += n;
+        }
+
+        pthread_mutex_lock(&r->lock);
+        b->length = length;
+        b->error  = error;
+        b->full   = true;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+
+        if (length < FILE_READER_BLOCK_SIZE) {
+            return NULL;
+        }
+    }
+}
+
+struct file_reader *file_reader_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+
+    struct file_reader *r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    r->path = path;
+    r->fd   = fd;
+    r->size = -1;
+
+    if (S_ISREG(st.st_mode)) {
+        r->size     = st.st_size;
+        r->map_size = st.st_size;
+        if (r->map_size > 0) {
+            void *map = mmap(NULL, r->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, r->map_size, MADV_SEQUENTIAL);
+                r->map    = (const uint8_t *)map;
+                r->mapped = true;
+            }
+        } else {
+            r->mapped = true;
+        }
+    }
+    if (r->mapped) {
+        return r;
+    }
+
+    // Not mappable, read it in the background
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    for (unsigned i = 0; i < 2; i++) {
+        r->buffers[i].data = malloc(FILE_READER_BLOCK_SIZE);
+        if (r->buffers[i].data == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int result = pthread_create(&r->thread, NULL, reader_thread, r);
+    if (result != 0) {
+        fprintf(stderr, "%s: can't create reader thread: %s\n", path, strerror(result));
+        exit(EXIT_FAILURE);
+    }
+    return r;
+}
+
+void file_reader_close(struct file_reader *r) {
+    if (r->mapped) {
+        if (r->map != NULL) {
+            munmap((void *)r->map, r->map_size);
+        }
+    } else {
+        pthread_mutex_lock(&r->lock);
+        r->stop = true;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        pthread_cancel(r->thread);
+        pthread_join(r->thread, NULL);
+
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        free(r->buffers[0].data);
+        free(r->buffers[1].data);
+        free(r->contents);
+    }
+    close(r->fd);
+    free(r);
+}
+
+long long file_reader_size(const struct file_reader *r) {
+    return r->size;
+}
+
+bool file_reader_error(const struct file_reader *r) {
+    return r->error;
+}
+
+static size_t next_mapped(struct file_reader *r, const uint8_t **data, size_t max) {
+    size_t length = r->map_size - r->offset;
+    if (length > max) {
+        length = max;
+    }
+    if (length > FILE_READER_BLOCK_SIZE) {
+        length = FILE_READER_BLOCK_SIZE;
+    }
+    *data = r->map + r->offset;
+    r->offset += length;
+
+    // Have the kernel read the next block while this one is sent
+    size_t    page  = sysconf(_SC_PAGESIZE);
+    uintptr_t ahead = ((uintptr_t)(r->map + r->offset)) & ~(uintptr_t)(page - 1);
+    uintptr_t end   = (uintptr_t)(r->map + r->map_size);
+    if (ahead < end) {
+        size_t ahead_length = end - ahead < FILE_READER_BLOCK_SIZE ? end - ahead : FILE_READER_BLOCK_SIZE;
+        madvise((void *)ahead, ahead_length, MADV_WILLNEED);
+    }
+    return length;
+}
+
+size_t file_reader_next(struct file_reader *r, const uint8_t **data, size_t max) {
+    if (r->end || max == 0) {
+        return 0;
+    }
+    if (r->mapped) {
+        return next_mapped(r, data, max);
+    }
+
+    struct file_reader_buffer *b = &r->buffers[r->current];
+    if (r->holding && r->consumed == b->length) {
+        // Hand the used buffer back to the thread
+        bool last = b->length < FILE_READER_BLOCK_SIZE;
+        pthread_mutex_lock(&r->lock);
+        b->full = false;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+
+        r->holding = false;
+        r->current ^= 1;
+        if (last) {
+            r->end = true;
+            return 0;
+        }
+        b = &r->buffers[r->current];
+    }
+
+    if (!r->holding) {
+        pthread_mutex_lock(&r->lock);
+        while (!b->full) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        pthread_mutex_unlock(&r->lock);
+
+        r->holding  = true;
+        r->consumed = 0;
+        if (b->error != 0) {
+            fprintf(stderr, "%s: %s\n", r->path, strerror(b->error));
+            r->error = true;
+            r->end   = true;
+            return 0;
+        }
+        if (b->length == 0) {
+            r->end = true;
+            return 0;
+        }
+    }
+
+    size_t length = b->length - r->consumed;
+    if (length > max) {
+        length = max;
+    }
+    *data = b->data + r->consumed;
+    r->consumed += length;
+    return length;
+}
+
+const uint8_t *file_reader_contents(struct file_reader *r, size_t max, size_t *size) {
+    if (r->mapped) {
+        if (r->map_size - r->offset > max) {
+            fprintf(stderr, "%s: file too large (%zu bytes, at most %zu)\n", r->path, r->map_size - r->offset, max);
+            return NULL;
+        }
+        *size     = r->map_size - r->offset;
+        r->offset = r->map_size;
+        return r->map + r->map_size - *size;
+    }
+
+    // Collect the stream, one byte more than allowed tells it's too large
+    free(r->contents);
+    r->contents = malloc(max + 1);
+    if (r->contents == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t         length = 0;
+    const uint8_t *data;
+    size_t         n;
+    while ((n = file_reader_next(r, &data, max + 1 - length)) > 0) {
+        memcpy(r->contents + length, data, n);
+        length += n;
+    }
+    if (r->error) {
+        return NULL;
+    }
+    if (length > max) {
+        fprintf(stderr, "%s: file too large (at most %zu bytes)\n", r->path, max);
+        return NULL;
+    }
+    *size = length;
+    return r->contents;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sequential reader for input files, so sending can start on the first block
+// while the rest of the file is still being read. Regular files are memory
+// mapped: nothing is copied, and the kernel is asked to read ahead of the
+// block being sent. Other files (pipes, devices) are read by a thread into
+// two buffers that alternate between the thread and the caller.
+
+#define FILE_READER_BLOCK_SIZE (64 * 1024)
+
+struct file_reader;
+
+// Prints an error and returns NULL when the file can't be opened.
+struct file_reader *file_reader_open(const char *path);
+void                file_reader_close(struct file_reader *r);
+
+// File size, -1 when it isn't known in advance.
+long long file_reader_size(const struct file_reader *r);
+
+// Next block of at most max bytes. The block stays valid until the next call.
+// Returns 0 at the end of the file or after an error.
+size_t file_reader_next(struct file_reader *r, const uint8_t **data, size_t max);
+
+// Whole rest of the file, at most max bytes, stays valid until the reader is
+// closed. Returns NULL (after printing an error) when it's larger.
+const uint8_t *file_reader_contents(struct file_reader *r, size_t max, size_t *size);
+
+// True when reading failed, the error has been printed already.
+bool file_reader_error(const struct file_reader *r);
@@ -2,7 +2,7 @@
 #include <string.h>
 #include "usb.h"
 #include "flash.h"
-#include <unistd.h>
+#include "flash_cache.h"
 
 #if 0
 #    pragma GCC diagnostic ignored "-Wpedantic"
@@ -13,8 +13,6 @@
 #    define assert(...)
 #endif
 
-#define PROGRAM_BITS // experimental
-
 enum flash_commands {
     JEDEC_ID                 = 0x9F,
     VOLATILE_SR_WRITE_ENABLE = 0x50,
@@ -49,57 +47,33 @@ const struct flash_info *flash_detect() {
     spi_select(0);
     // hexdump(buf, sizeof(buf));
     if (buf[1] == 0xEF && buf[2] == 0x40 && buf[3] == 0x15) {
-        static struct flash_info i = {.name = "W25Q16JV", .size = 0x200000, .sector_size = 4096, .page_size = 256};
-        // .block_size = 32768,
+        static struct flash_info i = {.name = "W25Q16JV", .size = 0x200000, .block_size = 65536, .sector_size = 4096, .page_size = 256};
         return &i;
     }
     return NULL;
 }
 
-enum flash_status_register_1_flags flash_status_register_1() {
-    uint8_t buf[] = {READ_STATUS_REGISTER_1, 0};
-    spi_select(1);
-    spi_transfer(buf, buf, sizeof(buf));
-    spi_select(0);
-    return buf[1];
-}
-
-void flash_wait() {
-    while ((flash_status_register_1() & ERASE_WRITE_IN_PROGRESS) != 0) {
-        usleep(10000);
-    }
-}
+static const struct flash_ops usb_flash_ops = {
+    .read    = flash_read,
+    .erase   = spi_flash_erase,
+    .program = spi_flash_program,
+};
 
-#define MAX_SECTOR_SIZE 4096
-unsigned flash_cache_sector_index = (unsigned)-1;
-uint8_t  flash_cache_sector_data[MAX_SECTOR_SIZE];
-bool     flash_cache_sector_erase = false;
-#ifdef PROGRAM_BITS
-uint8_t flash_cache_sector_prog[MAX_SECTOR_SIZE];
-// bool flash_cache_page_todo[256]; // need to program? at least 4096 / 256
-#endif
-unsigned flash_cache_begin = MAX_SECTOR_SIZE;
-unsigned flash_cache_end   = 0;
+// One cache per thread, each thread drives its own programmer.
+static _Thread_local struct flash_cache cache;
 
 void flash_read(unsigned address, void *data, unsigned size) {
     dprintf("flash_read(%u, %p, %u)\n", address, data, size);
     uint8_t buf[] = {FAST_READ, address >> 16, address >> 8, address >> 0, 0xFF};
-    spi_select(1);
-    spi_transfer(buf, NULL, sizeof(buf));
-    spi_transfer(NULL, data, size);
-    spi_select(0);
+    spi_stream(true, buf, sizeof(buf), NULL, data, size);
 }
 
 int flash_compare(unsigned address, const void *data, unsigned size) {
     dprintf("flash_read(%u, %p, %u)\n", address, data, size);
     while (size > 0) {
-        uint8_t buf[] = {FAST_READ, address >> 16, address >> 8, address >> 0, 0xFF};
-        spi_select(1);
-        spi_transfer(buf, NULL, sizeof(buf));
-        uint8_t  cmpbuf[4096];
-        unsigned s = size > 4096 ? 4096 : size;
-        spi_transfer(NULL, cmpbuf, s);
-        spi_select(0);
+        static _Thread_local uint8_t cmpbuf[65536];
+        unsigned                     s = size > sizeof(cmpbuf) ? sizeof(cmpbuf) : size;
+        flash_read(address, cmpbuf, s);
         if (memcmp(cmpbuf, data, s) != 0) {
             dprintf("mismatch at offset %u\n", address);
             return -1;
@@ -111,189 +85,160 @@ int flash_compare(unsigned address, const void *data, unsigned size) {
     return 0;
 }
 
-static void flash_cache_dirty(unsigned sector_address, unsigned sector_begin, unsigned sector_end) {
-    //dprintf("[%u,%u] += [%u,%u]\n", flash_cache_begin, flash_cache_end, sector_begin, sector_end);
-
-    if (sector_begin > flash_cache_end) {
-        // read between flash_cache_end and sector_begin
-        flash_read(sector_address + flash_cache_end, flash_cache_sector_data + flash_cache_end, sector_begin - flash_cache_end);
-        flash_cache_end = sector_begin;
-#ifdef PROGRAM_BITS
-        memset(flash_cache_sector_prog + flash_cache_end, 0xFF, sector_begin - flash_cache_end);
-#endif
-    }
-    if (sector_end < flash_cache_begin) {
-        // read between sector_end and flash_cache_begin
-        flash_read(sector_address + sector_end, flash_cache_sector_data + sector_end, flash_cache_begin - sector_end);
-        flash_cache_begin = sector_end;
-#ifdef PROGRAM_BITS
-        memset(flash_cache_sector_prog + sector_end, 0xFF, flash_cache_begin - sector_end);
-#endif
+// Compare flash contents using a CRC calculated by the programmer instead of reading back all data.
+int flash_verify_crc(unsigned address, const void *data, unsigned size) {
+    dprintf("flash_verify_crc(%u, %p, %u)\n", address, data, size);
+    if (spi_flash_crc(address, size) != crc32(0, data, size)) {
+        dprintf("CRC mismatch\n");
+        return -1;
     }
+    return 0;
+}
 
-    if (sector_begin < flash_cache_begin)
-        flash_cache_begin = sector_begin;
-    if (sector_end > flash_cache_end)
-        flash_cache_end = sector_end;
-    //printf("-> [%u,%u]\n", flash_cache_begin, flash_cache_end);
+void flash_write(const struct flash_info *flash_info, unsigned address, const void *data, unsigned size) {
+    if (cache.flash_info != flash_info) {
+        if (cache.flash_info != NULL) {
+            flash_cache_flush(&cache);
+        }
+        flash_cache_init(&cache, flash_info, &usb_flash_ops);
+    }
+    flash_cache_write(&cache, address, data, size);
 }
 
-static void flash_erase_sector(const struct flash_info *flash_info, unsigned sector_address) {
-    dprintf("flash_erase_sector(%u)\n", sector_address);
+// Like flash_write(), but whole sectors that already hold the new data are
+// skipped without reading them back. The programmer calculates a CRC per
+// sector, so only the sectors that changed are transferred, erased and
+// programmed. Returns the number of skipped sectors.
+unsigned flash_write_changed(const struct flash_info *flash_info, unsigned address, const void *data, unsigned size) {
+    dprintf("flash_write_changed(%u, %p, %u)\n", address, data, size);
 
-    {
-        uint8_t buf[] = {WRITE_ENABLE};
-        spi_select(1);
-        spi_transfer(buf, NULL, sizeof(buf));
-        spi_select(0);
+    const uint8_t *pdata       = (const uint8_t *)data;
+    unsigned       sector_size = flash_info->sector_size;
+
+    // Partial sector at start
+    unsigned head = (sector_size - address % sector_size) % sector_size;
+    if (head > size) {
+        head = size;
     }
+    flash_write(flash_info, address, pdata, head);
+    pdata += head;
+    address += head;
+    size -= head;
+
+    unsigned skipped = 0;
+    while (size >= sector_size) {
+        uint32_t crcs[64];
+        unsigned count = size / sector_size;
+        if (count > 64) {
+            count = 64;
+        }
+        spi_flash_crc_blocks(address, sector_size, count, crcs);
 
-    if (flash_info->sector_size == 4096) {
-        uint8_t buf[] = {SECTOR_ERASE_4KB, sector_address >> 16, sector_address >> 8, sector_address >> 0};
-        spi_select(1);
-        spi_transfer(buf, NULL, sizeof(buf));
-        spi_select(0);
+        for (unsigned i = 0; i < count; i++) {
+            // A cached sector may differ from what is in flash
+            if (!flash_cache_contains(&cache, address) && crcs[i] == crc32(0, pdata, sector_size)) {
+                skipped++;
+            } else {
+                flash_write(flash_info, address, pdata, sector_size);
+            }
+            pdata += sector_size;
+            address += sector_size;
+            size -= sector_size;
+        }
     }
 
-    flash_wait();
+    // Partial sector at end
+    flash_write(flash_info, address, pdata, size);
+    return skipped;
 }
 
-static void flash_cache_program_pages(const struct flash_info *flash_info, unsigned sector_address) {
-    dprintf("flash_cache_program_pages(%u) offset %u to %u\n", sector_address, flash_cache_begin, flash_cache_end);
-    // hexdump(flash_cache_sector_data, MAX_SECTOR_SIZE);
-
-    assert((flash_cache_begin % flash_info->page_size) == 0);
-    assert((flash_cache_end % flash_info->page_size) == 0);
-    assert(flash_cache_end <= flash_info->sector_size);
-    assert(flash_cache_begin <= flash_cache_end);
-
-    for (unsigned offset = flash_cache_begin; offset < flash_cache_end; offset += flash_info->page_size) {
-#ifdef PROGRAM_BITS
-        bool changed = false;
-        for (unsigned i = offset; i < offset + flash_info->page_size; i += 8) {
-            if (*(uint64_t *)(&flash_cache_sector_prog[i]) != (uint64_t)-1) {
-                changed = true;
-                break;
-            }
-        }
-        //if (!flash_cache_page_todo[offset / flash_info->page_size]) {
-        if (!changed) {
-            dprintf("page offset %u not changed\n", offset);
-            continue;
-        }
-#endif
-        dprintf("page offset %u CHANGED!\n", offset);
+void flash_flush(const struct flash_info *flash_info) {
+    dprintf("flash_flush()\n");
+    if (cache.flash_info == flash_info) {
+        flash_cache_flush(&cache);
+    }
+}
 
-        {
-            uint8_t buf[] = {WRITE_ENABLE};
-            spi_select(1);
-            spi_transfer(buf, NULL, sizeof(buf));
-            spi_select(0);
-        }
+// SPI timings tried by flash_select_timing(), fastest first. The last one is
+// the firmware's default and known to work.
+static const struct spi_timing spi_timings[] = {
+    {0, 0, 0},
+    {0, 20, 20},
+    {0, 100, 100},
+    {1, 100, 100},
+    {2, 500, 500},
+    {3, 2000, 2000},
+};
 
-        {
-            unsigned address = sector_address + offset;
-            uint8_t  buf[]   = {PAGE_PROGRAM, address >> 16, address >> 8, address >> 0};
-            spi_select(1);
-            spi_transfer(buf, NULL, sizeof(buf));
-#ifdef PROGRAM_BITS
-            spi_transfer(flash_cache_sector_prog + offset, NULL, flash_info->page_size);
-#else
-            spi_transfer(flash_cache_sector_data + offset, NULL, flash_info->page_size);
-#endif
-            spi_select(0);
-        }
+#define SPI_TIMING_COUNT (sizeof(spi_timings) / sizeof(spi_timings[0]))
+#define TIMING_ID_SIZE (3 + 8)  // JEDEC ID and unique ID
+#define TIMING_DATA_SIZE (4096) // first sector, the image records
 
-        flash_wait();
-    }
+// Reads the IDs and data compared by flash_select_timing(). The IDs have
+// varied bits even when the flash is erased.
+static void read_timing_sample(uint8_t *sample) {
+    uint8_t id[] = {JEDEC_ID, 0, 0, 0};
+    spi_select(1);
+    spi_transfer(id, id, sizeof(id));
+    spi_select(0);
+
+    uint8_t unique_id[1 + 4 + 8] = {READ_UNIQUE_ID};
+    spi_select(1);
+    spi_transfer(unique_id, unique_id, sizeof(unique_id));
+    spi_select(0);
+
+    memcpy(sample, id + 1, 3);
+    memcpy(sample + 3, unique_id + 5, 8);
+    flash_read(0, sample + TIMING_ID_SIZE, TIMING_DATA_SIZE);
 }
 
-static unsigned flash_cache_set_sector(const struct flash_info *flash_info, unsigned address) {
-    unsigned new_sector_index   = address / flash_info->sector_size;
-    unsigned new_sector_address = new_sector_index * flash_info->sector_size;
-    if (new_sector_index != flash_cache_sector_index) {
-        if (flash_cache_begin < flash_cache_end) { // contain data?
-            assert(flash_cache_sector_index < flash_info->size / flash_info->sector_size);
-            unsigned flash_cache_sector_address = flash_cache_sector_index * flash_info->sector_size;
-            if (flash_cache_sector_erase) {
-                // read rest of data
-                flash_cache_dirty(flash_cache_sector_address, 0, flash_cache_begin);
-                flash_cache_dirty(flash_cache_sector_address, flash_cache_end, flash_info->sector_size);
-                // memset(flash_cache_page_todo, 0xFF, sizeof(flash_cache_page_todo)); // hmz
-                flash_erase_sector(flash_info, flash_cache_sector_address);
-#ifdef PROGRAM_BITS
-                memcpy(flash_cache_sector_prog, flash_cache_sector_data, sizeof(flash_cache_sector_prog));
-#endif
-                flash_cache_program_pages(flash_info, flash_cache_sector_address);
-            } else {
-                // only read for certain pages
-                unsigned b = flash_cache_begin - (flash_cache_begin % flash_info->page_size);
-                unsigned e = flash_cache_end + flash_info->page_size - 1;
-                e -= e % flash_info->page_size;
-                flash_cache_dirty(flash_cache_sector_address, b, flash_cache_begin);
-                flash_cache_dirty(flash_cache_sector_address, flash_cache_end, e);
-                flash_cache_program_pages(flash_info, flash_cache_sector_address);
-            }
-        }
-        flash_cache_begin        = MAX_SECTOR_SIZE;
-        flash_cache_end          = 0;
-        flash_cache_sector_index = new_sector_index;
-        flash_cache_sector_erase = false;
-        // printf("flash_cache_sector_index %u\n", flash_cache_sector_index);
-#ifdef PROGRAM_BITS
-        // memset(flash_cache_page_todo, 0, sizeof(flash_cache_page_todo));
-#endif
+// Write enable and disable, each deselected and checked in the status register.
+// The flash ignores them when chip select doesn't go high in time, which the
+// reads don't show.
+static bool write_enable_works(void) {
+    bool ok = true;
+    for (int enable = 1; enable >= 0; enable--) {
+        uint8_t cmd = enable ? WRITE_ENABLE : WRITE_DISABLE;
+        spi_select(1);
+        spi_transfer(&cmd, NULL, 1);
+        spi_select(0);
+
+        uint8_t status[] = {READ_STATUS_REGISTER_1, 0};
+        spi_select(1);
+        spi_transfer(status, status, sizeof(status));
+        spi_select(0);
+        ok = ok && ((status[1] & WRITEENABLE_LATCH) != 0) == enable;
     }
-    return new_sector_address;
+    return ok;
 }
 
-void flash_write(const struct flash_info *flash_info, unsigned address, const void *data, unsigned size) {
-    dprintf("flash_write(%u, %p, %u)\n", address, data, size);
+bool flash_select_timing(struct spi_timing *selected) {
+    static _Thread_local uint8_t reference[TIMING_ID_SIZE + TIMING_DATA_SIZE];
+    static _Thread_local uint8_t sample[TIMING_ID_SIZE + TIMING_DATA_SIZE];
 
-    const uint8_t *pdata = (const uint8_t *)data;
-    while (size > 0) {
-        unsigned sector_address = flash_cache_set_sector(flash_info, address);
-        unsigned sector_offset  = (address % flash_info->sector_size);
-        uint8_t *p              = flash_cache_sector_data + sector_offset;
-#ifdef PROGRAM_BITS
-        uint8_t *pp = flash_cache_sector_prog + sector_offset;
-#endif
-        unsigned size2 = flash_info->sector_size - sector_offset;
-        if (size < size2) {
-            size2 = size;
-        }
-        if (flash_cache_begin == MAX_SECTOR_SIZE && flash_cache_end == 0) {
-            flash_cache_begin = sector_offset;
-#ifdef PROGRAM_BITS
-            flash_cache_end = sector_offset; // zero assumption
-            flash_cache_dirty(sector_address, sector_offset, sector_offset + size2);
-#else
-            flash_cache_end = sector_offset + size2; // we'll just do memcpy anyway
-#endif
-        } else {
-            flash_cache_dirty(sector_address, sector_offset, sector_offset + size2);
-        }
+    const struct spi_timing *safe = &spi_timings[SPI_TIMING_COUNT - 1];
+    spi_set_timing(safe);
+    read_timing_sample(reference);
+    *selected = *safe;
+    if (reference[0] != 0xEF || reference[1] != 0x40 || reference[2] != 0x15) {
+        return false;
+    }
 
-#ifdef PROGRAM_BITS
-        for (unsigned i = 0; i < size2; i++) {
-            flash_cache_sector_erase |= ~p[i] & pdata[i]; // when old data is 0 and new data is 1, need to erase
-            pp[i] &= ~p[i] | pdata[i];                    // when old data is 1 and new data is 0, set program bit to 0
-            // flash_cache_page_todo[(sector_offset + i) / flash_info->page_size] |= (p[i] & ~pdata[i]); // when old data is 1 and new data is 0, need to program page
-            p[i] = pdata[i];
+    // Besides the streamed readback, the programmer reads the data again for
+    // the CRC, with its own reads and chip select timing. Erase and program
+    // need the write enable latch set as well.
+    for (unsigned i = 0; i < SPI_TIMING_COUNT - 1; i++) {
+        spi_set_timing(&spi_timings[i]);
+        read_timing_sample(sample);
+        if (memcmp(sample, reference, sizeof(sample)) == 0 && write_enable_works() &&
+            flash_verify_crc(0, reference + TIMING_ID_SIZE, TIMING_DATA_SIZE) == 0) {
+            *selected = spi_timings[i];
+            return true;
         }
-#else
-        memcpy(p, pdata, size2);
-        flash_cache_sector_erase = true;
-#endif
-        pdata += size2;
-        address += size2;
-        size -= size2;
+        dprintf("SPI timing %u failed\n", i);
     }
-}
-
-void flash_flush(const struct flash_info *flash_info) {
-    dprintf("flash_flush()\n");
-    flash_cache_set_sector(flash_info, (unsigned)-1);
+    spi_set_timing(safe);
+    return true;
 }
 
 void flash_test(const struct flash_info *flash_info) {
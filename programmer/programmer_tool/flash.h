@@ -1,18 +1,28 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
+#include "usb.h"
 
 struct flash_info {
     const char *name;
     unsigned    size;
+    unsigned    block_size;
     unsigned    sector_size;
     unsigned    page_size;
-    // unsigned    block_size;
 };
 
 const struct flash_info *flash_detect();
 void                     flash_read(unsigned address, void *data, unsigned size);
 int                      flash_compare(unsigned address, const void *data, unsigned size);
+int                      flash_verify_crc(unsigned address, const void *data, unsigned size);
 void                     flash_write(const struct flash_info *flash_info, unsigned address, const void *data, unsigned size);
+unsigned                 flash_write_changed(const struct flash_info *flash_info, unsigned address, const void *data, unsigned size);
 void                     flash_flush(const struct flash_info *flash_info);
 void                     flash_test(const struct flash_info *flash_info);
+
+// Set the fastest SPI timing of flash mode at which the flash reads back the
+// same as at the slowest one and takes write enable and disable commands, and
+// return it in *selected. Returns false, leaving the slowest timing set, when
+// no W25Q16JV is detected.
+bool flash_select_timing(struct spi_timing *selected);
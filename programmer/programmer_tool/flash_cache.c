@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <string.h>
+#include "flash_cache.h"
+
+#if 0
+#    pragma GCC diagnostic ignored "-Wpedantic"
+#    define dprintf(...) printf(__VA_ARGS__)
+#    define assert(ok) ({ bool _ok = (ok); if (!_ok) printf("Assertion failed at %s:%u (%s)\n", __FILE__, __LINE__, #ok); })
+#else
+#    define dprintf(...)
+#    define assert(...)
+#endif
+
+#define UNUSED_ADDRESS ((unsigned)-1)
+
+static void sector_clear(struct flash_cache_sector *cs) {
+    cs->address = UNUSED_ADDRESS;
+    cs->begin   = FLASH_CACHE_MAX_SECTOR_SIZE;
+    cs->end     = 0;
+    cs->erase   = false;
+}
+
+static void sector_dirty(struct flash_cache *cache, struct flash_cache_sector *cs, unsigned sector_begin, unsigned sector_end) {
+    //dprintf("[%u,%u] += [%u,%u]\n", cs->begin, cs->end, sector_begin, sector_end);
+
+    if (sector_begin > cs->end) {
+        // read between cs->end and sector_begin
+        cache->ops->read(cs->address + cs->end, cs->data + cs->end, sector_begin - cs->end);
+#ifdef PROGRAM_BITS
+        memset(cs->prog + cs->end, 0xFF, sector_begin - cs->end);
+#endif
+        cs->end = sector_begin;
+    }
+    if (sector_end < cs->begin) {
+        // read between sector_end and cs->begin
+        cache->ops->read(cs->address + sector_end, cs->data + sector_end, cs->begin - sector_end);
+#ifdef PROGRAM_BITS
+        memset(cs->prog + sector_end, 0xFF, cs->begin - sector_end);
+#endif
+        cs->begin = sector_end;
+    }
+
+    if (sector_begin < cs->begin)
+        cs->begin = sector_begin;
+    if (sector_end > cs->end)
+        cs->end = sector_end;
+    //printf("-> [%u,%u]\n", cs->begin, cs->end);
+}
+
+// Extend the cached range to [sector_begin, sector_end), reading the missing data from flash.
+static void sector_fill(struct flash_cache *cache, struct flash_cache_sector *cs, unsigned sector_begin, unsigned sector_end) {
+    if (sector_begin < cs->begin) {
+        cache->ops->read(cs->address + sector_begin, cs->data + sector_begin, cs->begin - sector_begin);
+#ifdef PROGRAM_BITS
+        memset(cs->prog + sector_begin, 0xFF, cs->begin - sector_begin);
+#endif
+        cs->begin = sector_begin;
+    }
+    if (sector_end > cs->end) {
+        cache->ops->read(cs->address + cs->end, cs->data + cs->end, sector_end - cs->end);
+#ifdef PROGRAM_BITS
+        memset(cs->prog + cs->end, 0xFF, sector_end - cs->end);
+#endif
+        cs->end = sector_end;
+    }
+}
+
+static void sector_program_pages(struct flash_cache *cache, const struct flash_cache_sector *cs) {
+    const struct flash_info *flash_info = cache->flash_info;
+    dprintf("sector_program_pages(%u) offset %u to %u\n", cs->address, cs->begin, cs->end);
+    // hexdump(cs->data, FLASH_CACHE_MAX_SECTOR_SIZE);
+
+    assert((cs->begin % flash_info->page_size) == 0);
+    assert((cs->end % flash_info->page_size) == 0);
+    assert(cs->end <= flash_info->sector_size);
+    assert(cs->begin <= cs->end);
+
+    // Consecutive changed pages are programmed with a single operation
+    unsigned run_begin = cs->begin;
+    for (unsigned offset = cs->begin; offset < cs->end; offset += flash_info->page_size) {
+#ifdef PROGRAM_BITS
+        bool changed = false;
+        for (unsigned i = offset; i < offset + flash_info->page_size; i += 8) {
+            if (*(uint64_t *)(&cs->prog[i]) != (uint64_t)-1) {
+                changed = true;
+                break;
+            }
+        }
+        if (!changed) {
+            dprintf("page offset %u not changed\n", offset);
+            if (run_begin < offset) {
+                cache->ops->program(cs->address + run_begin, cs->data + run_begin, offset - run_begin);
+            }
+            run_begin = offset + flash_info->page_size;
+            continue;
+        }
+#endif
+        dprintf("page offset %u CHANGED!\n", offset);
+    }
+    if (run_begin < cs->end) {
+        cache->ops->program(cs->address + run_begin, cs->data + run_begin, cs->end - run_begin);
+    }
+}
+
+// Plan the erases for one block. written[] tells which sectors are being
+// written, erase[] which of those need an erase. A 64 KB or 32 KB erase is
+// used when all sectors it covers are being written and at least half of
+// them need an erase; sectors that are not written are never erased. The
+// erase sizes are stored per sector in plan[] (0 for no erase, or for
+// sectors covered by an erase starting at a lower sector). Returns the number
+// of erase operations.
+static unsigned plan_erase(unsigned block_sectors, unsigned sector_size, const bool *written, const bool *erase, unsigned *plan) {
+    unsigned count = 0;
+
+    unsigned i = 0;
+    while (i < block_sectors) {
+        plan[i] = 0;
+
+        // Largest erase first: whole block, half block, sector
+        unsigned unit_sectors = block_sectors;
+        for (; unit_sectors > 1; unit_sectors /= 2) {
+            if (i % unit_sectors != 0 || unit_sectors * sector_size < 32768) {
+                continue;
+            }
+            unsigned n_written = 0, n_erase = 0;
+            for (unsigned j = i; j < i + unit_sectors; j++) {
+                n_written += written[j];
+                n_erase += erase[j];
+            }
+            if (n_written == unit_sectors && n_erase * 2 >= unit_sectors) {
+                break;
+            }
+        }
+
+        if (unit_sectors > 1 || erase[i]) {
+            plan[i] = unit_sectors * sector_size;
+            count++;
+        }
+        for (unsigned j = i + 1; j < i + unit_sectors; j++) {
+            plan[j] = 0;
+        }
+        i += unit_sectors;
+    }
+    return count;
+}
+
+// Write back all cached sectors of a block and release them.
+static void flush_block(struct flash_cache *cache, unsigned block_index) {
+    const struct flash_info *  flash_info    = cache->flash_info;
+    unsigned                   block_sectors = flash_info->block_size / flash_info->sector_size;
+    unsigned                   block_address = block_index * flash_info->block_size;
+    struct flash_cache_sector *sectors[FLASH_CACHE_MAX_BLOCK_SECTORS];
+    bool                       written[FLASH_CACHE_MAX_BLOCK_SECTORS];
+    bool                       erase[FLASH_CACHE_MAX_BLOCK_SECTORS];
+    unsigned                   plan[FLASH_CACHE_MAX_BLOCK_SECTORS];
+
+    for (unsigned i = 0; i < block_sectors; i++) {
+        sectors[i] = NULL;
+    }
+    for (unsigned i = 0; i < FLASH_CACHE_SECTORS; i++) {
+        struct flash_cache_sector *cs = &cache->sectors[i];
+        if (cs->address != UNUSED_ADDRESS && cs->address / flash_info->block_size == block_index) {
+            sectors[(cs->address - block_address) / flash_info->sector_size] = cs;
+        }
+    }
+    for (unsigned i = 0; i < block_sectors; i++) {
+        written[i] = sectors[i] != NULL && sectors[i]->begin < sectors[i]->end;
+        erase[i]   = written[i] && sectors[i]->erase;
+    }
+    plan_erase(block_sectors, flash_info->sector_size, written, erase, plan);
+
+    // Written sectors included in a larger erase get completely reprogrammed
+    for (unsigned i = 0; i < block_sectors; i++) {
+        for (unsigned j = i; j < i + plan[i] / flash_info->sector_size; j++) {
+            sectors[j]->erase = true;
+        }
+    }
+
+    // Read all data that needs to be preserved before anything is erased
+    for (unsigned i = 0; i < block_sectors; i++) {
+        struct flash_cache_sector *cs = sectors[i];
+        if (!written[i]) {
+            continue;
+        }
+        assert(cs->address < flash_info->size);
+
+        if (cs->erase) {
+            // read rest of data
+            sector_fill(cache, cs, 0, flash_info->sector_size);
+#ifdef PROGRAM_BITS
+            memcpy(cs->prog, cs->data, sizeof(cs->prog));
+#endif
+        } else {
+            // only read for certain pages
+            unsigned b = cs->begin - (cs->begin % flash_info->page_size);
+            unsigned e = cs->end + flash_info->page_size - 1;
+            e -= e % flash_info->page_size;
+            sector_fill(cache, cs, b, e);
+        }
+    }
+
+    for (unsigned i = 0; i < block_sectors; i++) {
+        if (plan[i] != 0) {
+            dprintf("flash erase %u bytes @ %u\n", plan[i], block_address + i * flash_info->sector_size);
+            cache->ops->erase(block_address + i * flash_info->sector_size, plan[i]);
+        }
+    }
+
+    for (unsigned i = 0; i < block_sectors; i++) {
+        if (written[i]) {
+            sector_program_pages(cache, sectors[i]);
+        }
+        if (sectors[i] != NULL) {
+            sector_clear(sectors[i]);
+        }
+    }
+}
+
+static struct flash_cache_sector *find_sector(struct flash_cache *cache, unsigned sector_address) {
+    for (unsigned i = 0; i < FLASH_CACHE_SECTORS; i++) {
+        if (cache->sectors[i].address == sector_address) {
+            return &cache->sectors[i];
+        }
+    }
+    return NULL;
+}
+
+// Get the cache entry for a sector, evicting the block of the least recently
+// used sector when the cache is full.
+static struct flash_cache_sector *get_sector(struct flash_cache *cache, unsigned sector_address) {
+    struct flash_cache_sector *cs = find_sector(cache, sector_address);
+    if (cs == NULL) {
+        cs = find_sector(cache, UNUSED_ADDRESS);
+    }
+    if (cs == NULL) {
+        struct flash_cache_sector *lru = &cache->sectors[0];
+        for (unsigned i = 1; i < FLASH_CACHE_SECTORS; i++) {
+            if (cache->sectors[i].last_used < lru->last_used) {
+                lru = &cache->sectors[i];
+            }
+        }
+        flush_block(cache, lru->address / cache->flash_info->block_size);
+        cs = find_sector(cache, UNUSED_ADDRESS);
+    }
+
+    if (cs->address == UNUSED_ADDRESS) {
+        sector_clear(cs);
+        cs->address = sector_address;
+    }
+    cs->last_used = ++cache->use_counter;
+    return cs;
+}
+
+void flash_cache_init(struct flash_cache *cache, const struct flash_info *flash_info, const struct flash_ops *ops) {
+    cache->flash_info  = flash_info;
+    cache->ops         = ops;
+    cache->use_counter = 0;
+    for (unsigned i = 0; i < FLASH_CACHE_SECTORS; i++) {
+        sector_clear(&cache->sectors[i]);
+    }
+}
+
+void flash_cache_write(struct flash_cache *cache, unsigned address, const void *data, unsigned size) {
+    dprintf("flash_cache_write(%u, %p, %u)\n", address, data, size);
+    const struct flash_info *flash_info = cache->flash_info;
+
+    const uint8_t *pdata = (const uint8_t *)data;
+    while (size > 0) {
+        unsigned                   sector_offset = address % flash_info->sector_size;
+        struct flash_cache_sector *cs            = get_sector(cache, address - sector_offset);
+        uint8_t *                  p             = cs->data + sector_offset;
+#ifdef PROGRAM_BITS
+        uint8_t *pp = cs->prog + sector_offset;
+#endif
+        unsigned size2 = flash_info->sector_size - sector_offset;
+        if (size < size2) {
+            size2 = size;
+        }
+        if (cs->begin >= cs->end) {
+            cs->begin = sector_offset;
+#ifdef PROGRAM_BITS
+            // Start from the current flash contents
+            cache->ops->read(address, p, size2);
+            memset(pp, 0xFF, size2);
+            cs->end = sector_offset + size2;
+#else
+            cs->end = sector_offset + size2; // we'll just do memcpy anyway
+#endif
+        } else {
+            sector_dirty(cache, cs, sector_offset, sector_offset + size2);
+        }
+
+#ifdef PROGRAM_BITS
+        for (unsigned i = 0; i < size2; i++) {
+            cs->erase |= ~p[i] & pdata[i]; // when old data is 0 and new data is 1, need to erase
+            pp[i] &= ~p[i] | pdata[i];     // when old data is 1 and new data is 0, set program bit to 0
+            p[i] = pdata[i];
+        }
+#else
+        memcpy(p, pdata, size2);
+        cs->erase = true;
+#endif
+        pdata += size2;
+        address += size2;
+        size -= size2;
+    }
+}
+
+// Write back everything, in address order.
+void flash_cache_flush(struct flash_cache *cache) {
+    dprintf("flash_cache_flush()\n");
+    while (true) {
+        struct flash_cache_sector *first = NULL;
+        for (unsigned i = 0; i < FLASH_CACHE_SECTORS; i++) {
+            struct flash_cache_sector *cs = &cache->sectors[i];
+            if (cs->address != UNUSED_ADDRESS && (first == NULL || cs->address < first->address)) {
+                first = cs;
+            }
+        }
+        if (first == NULL) {
+            break;
+        }
+        flush_block(cache, first->address / cache->flash_info->block_size);
+    }
+}
+
+bool flash_cache_contains(const struct flash_cache *cache, unsigned address) {
+    unsigned sector_address = address - address % cache->flash_info->sector_size;
+    for (unsigned i = 0; i < FLASH_CACHE_SECTORS; i++) {
+        const struct flash_cache_sector *cs = &cache->sectors[i];
+        if (cs->address == sector_address && cs->begin < cs->end) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "flash.h"
+
+#define PROGRAM_BITS // experimental
+
+#define FLASH_CACHE_SECTORS 32 // enough for an FPGA image and the image records
+#define FLASH_CACHE_MAX_SECTOR_SIZE 4096
+#define FLASH_CACHE_MAX_BLOCK_SECTORS 16
+
+// Flash access used by the cache, so it can be used with a simulated flash.
+struct flash_ops {
+    void (*read)(unsigned address, void *data, unsigned size);
+    void (*erase)(unsigned address, unsigned size);   // erases the sectors in range, size is a supported erase size
+    void (*program)(unsigned address, const void *data, unsigned size); // may span multiple pages
+};
+
+struct flash_cache_sector {
+    unsigned address;   // sector address, (unsigned)-1 when unused
+    unsigned last_used; // for LRU replacement
+    unsigned begin;     // valid data range
+    unsigned end;
+    bool     erase; // sector needs to be erased
+    uint8_t  data[FLASH_CACHE_MAX_SECTOR_SIZE];
+#ifdef PROGRAM_BITS
+    uint8_t prog[FLASH_CACHE_MAX_SECTOR_SIZE];
+#endif
+};
+
+// Write-back cache of flash sectors. Sectors are written back one block at a
+// time, so the erases of all cached sectors in a block can be combined.
+struct flash_cache {
+    const struct flash_info * flash_info;
+    const struct flash_ops *  ops;
+    unsigned                  use_counter;
+    struct flash_cache_sector sectors[FLASH_CACHE_SECTORS];
+};
+
+void flash_cache_init(struct flash_cache *cache, const struct flash_info *flash_info, const struct flash_ops *ops);
+void flash_cache_write(struct flash_cache *cache, unsigned address, const void *data, unsigned size);
+void flash_cache_flush(struct flash_cache *cache);
+bool flash_cache_contains(const struct flash_cache *cache, unsigned address);
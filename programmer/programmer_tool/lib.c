@@ -1,4 +1,5 @@
 #include "lib.h"
+#include <pthread.h>
 
 void hexdump(const void *buf, int length) {
     int            idx = 0;
@@ -34,3 +35,27 @@ void hexdump(const void *buf, int length) {
         p += len;
     }
 }
+
+static uint32_t       crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : (c >> 1);
+        }
+        crc32_table[i] = c;
+    }
+}
+
+uint32_t crc32(uint32_t crc, const void *buf, size_t length) {
+    pthread_once(&crc32_once, crc32_init);
+
+    const uint8_t *p = (const uint8_t *)buf;
+    crc              = ~crc;
+    while (length--) {
+        crc = (crc >> 8) ^ crc32_table[(crc ^ *(p++)) & 0xFF];
+    }
+    return ~crc;
+}
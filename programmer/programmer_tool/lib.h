@@ -11,3 +11,6 @@
 #include <string.h>
 
 void hexdump(const void *buf, int length);
+
+// CRC-32 as used by zlib, start with crc = 0.
+uint32_t crc32(uint32_t crc, const void *buf, size_t length);
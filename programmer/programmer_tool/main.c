@@ -1,7 +1,10 @@
 #include "lib.h"
 #include "usb.h"
 #include "flash.h"
+#include "file_reader.h"
 #include "unistd.h"
+#include <pthread.h>
+#include <time.h>
 
 #ifndef __APPLE__
 #include <libgen.h>
@@ -17,27 +20,35 @@ const char *basename(const char *argv0) {
 }
 #endif
 
-void upload_fpga(const char *filepath) {
-    FILE *f = fopen(filepath, "rb");
-    if (!f) {
-        perror(filepath);
-        exit(EXIT_FAILURE);
+// Progress output is turned off when several programmers run at once.
+static bool verbose = true;
+#define info(...)                    \
+    do {                             \
+        if (verbose) {               \
+            printf(__VA_ARGS__);     \
+        }                            \
+    } while (0)
+
+bool upload_fpga(const char *filepath) {
+    struct file_reader *reader = file_reader_open(filepath);
+    if (reader == NULL) {
+        usb_fail();
     }
 
-    fseek(f, 0, SEEK_END);
-    unsigned size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    uint8_t *image = malloc(size);
-    fread(image, size, 1, f);
-    fclose(f);
-
-    // hexdump(image, size);
-
     spi_set_mode(SPI_MODE_FPGA);
-    printf("CDONE before: %u\n", get_cdone());
+    info("CDONE before: %u\n", get_cdone());
 
-    spi_transfer(image, NULL, size);
+    // Configuration starts with the first block, the rest is read meanwhile
+    const uint8_t *data;
+    size_t         length;
+    while ((length = file_reader_next(reader, &data, SIZE_MAX)) > 0) {
+        spi_stream(false, NULL, 0, data, NULL, length);
+    }
+    if (file_reader_error(reader)) {
+        file_reader_close(reader);
+        usb_fail();
+    }
+    file_reader_close(reader);
 
     uint8_t dummy[100];
     memset(dummy, 0, sizeof(dummy));
@@ -45,9 +56,17 @@ void upload_fpga(const char *filepath) {
 
     spi_set_mode(SPI_MODE_NONE);
 
-    printf("CDONE after: %u\n", get_cdone());
-
-    free(image);
+    bool cdone = get_cdone();
+    info("CDONE after: %u\n", cdone);
+    if (!cdone) {
+        // The programmer holds the FPGA in reset when data didn't come in time
+        struct firmware_stats stats;
+        get_firmware_stats(&stats, false);
+        if (stats.fpga_underruns > 0) {
+            fprintf(stderr, "FPGA configuration data underruns: %u\n", stats.fpga_underruns);
+        }
+    }
+    return cdone;
 }
 
 #define IMAGE_RECORD_SIZE 32
@@ -93,16 +112,42 @@ enum image_record {
     IMAGE_RECORD_NUM,
 };
 
-void upload_fpga_image(int index, const char *filepath, bool power_on_reset) {
+static void write_data(const struct flash_info *flash_info, unsigned address, const void *data, unsigned size, bool incremental) {
+    if (incremental) {
+        unsigned skipped = flash_write_changed(flash_info, address, data, size);
+        if (skipped > 0) {
+            info("skipped %u unchanged sector(s)\n", skipped);
+        }
+    } else {
+        flash_write(flash_info, address, data, size);
+    }
+}
+
+// Switch to flash mode with the given SPI timing, or the fastest one that
+// works when timing is NULL, and detect the flash.
+static const struct flash_info *flash_open(const struct spi_timing *timing) {
     spi_set_mode(SPI_MODE_FLASH);
 
+    struct spi_timing selected;
+    if (timing != NULL) {
+        spi_set_timing(timing);
+        selected = *timing;
+    } else {
+        flash_select_timing(&selected);
+    }
+
     const struct flash_info *flash_info = flash_detect();
     if (flash_info == NULL) {
         fprintf(stderr, "flash not detected\n");
-        exit(EXIT_FAILURE);
+        usb_fail();
     }
 
-    printf("flash: %s\n", flash_info->name);
+    info("flash: %s, SPI prescaler %u, CS setup/hold %u/%u ns\n", flash_info->name, selected.prescaler, selected.cs_setup_ns, selected.cs_hold_ns);
+    return flash_info;
+}
+
+int upload_fpga_image(int index, const char *filepath, bool power_on_reset, bool full_verify, bool incremental, const struct spi_timing *timing) {
+    const struct flash_info *flash_info = flash_open(timing);
 
 #if 0
     flash_test(flash_info);
@@ -113,32 +158,31 @@ void upload_fpga_image(int index, const char *filepath, bool power_on_reset) {
     fpga_image_size += (flash_info->sector_size - 1);
     fpga_image_size -= (fpga_image_size % flash_info->sector_size);
 
-    FILE *f = fopen(filepath, "rb");
-    if (!f) {
-        perror(filepath);
-        exit(EXIT_FAILURE);
+    struct file_reader *reader = file_reader_open(filepath);
+    if (reader == NULL) {
+        usb_fail();
     }
 
-    fseek(f, 0, SEEK_END);
-    unsigned size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    uint8_t *image = malloc(size);
-    fread(image, size, 1, f);
-    fclose(f);
+    // Images are written and verified as a whole, mapped rather than copied
+    size_t         size;
+    const uint8_t *image = file_reader_contents(reader, index < 0 ? flash_info->size : fpga_image_size, &size);
+    if (image == NULL) {
+        file_reader_close(reader);
+        usb_fail();
+    }
 
     uint32_t boot_address = 0;
     if (index < 0) {
-        printf("flashing image data @ 0x%X\n", boot_address);
-        flash_write(flash_info, boot_address, image, size);
+        info("flashing image data @ 0x%X\n", boot_address);
+        write_data(flash_info, boot_address, image, size, incremental);
         flash_flush(flash_info);
     } else if (index < 4) {
         boot_address = flash_info->sector_size + index * fpga_image_size;
-        printf("flashing image data @ 0x%X\n", boot_address);
-        flash_write(flash_info, boot_address, image, size);
+        info("flashing image data @ 0x%X\n", boot_address);
+        write_data(flash_info, boot_address, image, size, incremental);
         flash_flush(flash_info);
 
-        printf("current image records:\n");
+        info("current image records:\n");
         uint8_t records[IMAGE_RECORD_NUM][IMAGE_RECORD_SIZE];
         flash_read(0, records, IMAGE_RECORD_SIZE * IMAGE_RECORD_NUM);
 
@@ -152,76 +196,77 @@ void upload_fpga_image(int index, const char *filepath, bool power_on_reset) {
             if (records[i][0] != 0x7E || records[i][1] != 0xAA || records[i][2] != 0x99 || records[i][3] != 0x7E) {
                 memset(records[i], 0xFF, IMAGE_RECORD_SIZE);
             }
-            printf("image #%d boot address 0x%X\n", i - 1, records[i][9] << 16 | records[i][10] << 8 | records[i][11] << 0);
+            info("image #%d boot address 0x%X\n", i - 1, records[i][9] << 16 | records[i][10] << 8 | records[i][11] << 0);
         }
 
-        printf("flashing image records\n");
+        info("flashing image records\n");
         flash_write(flash_info, 0, records, IMAGE_RECORD_SIZE * IMAGE_RECORD_NUM);
         flash_flush(flash_info);
     }
 
-    printf("verifying image data\n");
-    if (flash_compare(boot_address, image, size) != 0) {
-        printf("flash verification error!\n");
+    info("verifying image data\n");
+    int verify_result = full_verify ? flash_compare(boot_address, image, size) : flash_verify_crc(boot_address, image, size);
+    if (verify_result != 0) {
+        info("flash verification error!\n");
     }
 
-    free(image);
+    file_reader_close(reader);
+    return verify_result;
 }
 
-void flash_write_file(const char *filepath, unsigned start) {
-    spi_set_mode(SPI_MODE_FLASH);
-
-    const struct flash_info *flash_info = flash_detect();
-    if (flash_info == NULL) {
-        fprintf(stderr, "flash not detected\n");
-        exit(EXIT_FAILURE);
-    }
-
-    printf("flash: %s\n", flash_info->name);
+void flash_write_file(const char *filepath, unsigned start, bool incremental, const struct spi_timing *timing) {
+    const struct flash_info *flash_info = flash_open(timing);
 
-    FILE *f = fopen(filepath, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "File not found: '%s'\n", filepath);
-        exit(EXIT_FAILURE);
+    struct file_reader *reader = file_reader_open(filepath);
+    if (reader == NULL) {
+        usb_fail();
     }
-    fseek(f, 0, SEEK_END);
-    unsigned size = ftell(f);
-    fseek(f, 0, SEEK_SET);
 
-    unsigned end = start + size;
-    if (start >= flash_info->size || end >= flash_info->size) {
+    // The size of a pipe isn't known, it's checked while writing then
+    long long size = file_reader_size(reader);
+    if (start >= flash_info->size || (size >= 0 && start + size >= flash_info->size)) {
         fprintf(stderr, "Given memory area out of range.\n");
-        exit(EXIT_FAILURE);
+        file_reader_close(reader);
+        usb_fail();
     }
 
-    uint8_t  data[4096];
-    unsigned todo = size;
-    while (todo > 0) {
+    unsigned       written = 0;
+    const uint8_t *data;
+    size_t         t;
+    // Keep chunks sector aligned, so unchanged sectors can be skipped
+    while ((t = file_reader_next(reader, &data, 4096 - start % 4096)) > 0) {
         fflush(stdout);
-        unsigned t = todo > 4096 ? 4096 : todo;
-        fread(data, t, 1, f);
-        flash_write(flash_info, start, data, t);
+        if (start + t >= flash_info->size) {
+            fprintf(stderr, "\nGiven memory area out of range.\n");
+            file_reader_close(reader);
+            usb_fail();
+        }
+        if (incremental) {
+            flash_write_changed(flash_info, start, data, t);
+        } else {
+            flash_write(flash_info, start, data, t);
+        }
         // hexdump(data, t);
         start += t;
-        todo -= t;
-        printf("\rwriting %u%%", 100 - (todo * 100 / size));
+        written += t;
+        if (size > 0) {
+            info("\rwriting %u%%", (unsigned)(written * 100 / size));
+        } else {
+            info("\rwriting %u KB", written / 1024);
+        }
+    }
+    info("\n");
+    if (file_reader_error(reader)) {
+        file_reader_close(reader);
+        usb_fail();
     }
-    printf("\n");
     flash_flush(flash_info);
-    fclose(f);
+    file_reader_close(reader);
     return;
 }
 
-void flash_dump(const char *filepath, unsigned start, unsigned size) {
-    spi_set_mode(SPI_MODE_FLASH);
-
-    const struct flash_info *flash_info = flash_detect();
-    if (flash_info == NULL) {
-        fprintf(stderr, "flash not detected\n");
-        exit(EXIT_FAILURE);
-    }
-
-    printf("flash: %s\n", flash_info->name);
+void flash_dump(const char *filepath, unsigned start, unsigned size, const struct spi_timing *timing) {
+    const struct flash_info *flash_info = flash_open(timing);
 
     if (size == (unsigned)-1) {
         size = flash_info->size - start;
@@ -247,41 +292,235 @@ void flash_dump(const char *filepath, unsigned start, unsigned size) {
         fwrite(data, t, 1, fdump);
         start += t;
         todo -= t;
-        printf("\rdumping %u%%", 100 - (todo * 100 / size));
+        info("\rdumping %u%%", 100 - (todo * 100 / size));
     }
     printf("\n");
     fclose(fdump);
     return;
 }
 
+// Operations applied to each programmer
+struct job {
+    unsigned    queue_depth;
+    bool        mass_erase;
+    const char *filepath;
+    int         fpga_image_index;
+    const char *filepath0;
+    const char *fileflashwrite;
+    const char *fileflashdump;
+    unsigned    start;
+    unsigned    size;
+    bool        full_verify;
+    bool        incremental;
+    bool        fpga_boot_flash;
+    bool        firmware_stats;
+
+    const struct spi_timing *spi_timing; // flash mode, NULL selects it
+};
+
+// Result of running a job on one programmer
+struct job_result {
+    bool   cdone;  // FPGA configured after -F
+    int    verify; // result of the image verification after -I
+    double seconds;
+
+    struct firmware_stats firmware_stats; // after the job, with -S
+};
+
+static double time_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run_job(const struct job *job, struct job_result *result) {
+    double t0 = time_now();
+
+    usb_set_queue_depth(job->queue_depth);
+    spi_set_mode(SPI_MODE_NONE);
+
+    if (job->mass_erase) {
+        start_mass_erase();
+    }
+
+    if (job->filepath != NULL) {
+        result->cdone = upload_fpga(job->filepath);
+    }
+
+    if (job->filepath0 != NULL) {
+        result->verify = upload_fpga_image(job->fpga_image_index, job->filepath0, job->fpga_image_index == 0, job->full_verify, job->incremental, job->spi_timing);
+    }
+
+    if (job->fileflashwrite != NULL) {
+        flash_write_file(job->fileflashwrite, job->start, job->incremental, job->spi_timing);
+    }
+
+    if (job->fileflashdump != NULL) {
+        flash_dump(job->fileflashdump, job->start, job->size, job->spi_timing);
+    }
+
+    if (job->fpga_boot_flash) {
+        spi_set_mode(SPI_MODE_FPGA_BOOT);
+    }
+
+    usb_flush();
+    result->seconds = time_now() - t0;
+
+    if (job->firmware_stats) {
+        get_firmware_stats(&result->firmware_stats, false);
+    }
+}
+
+static void print_firmware_stats(const struct firmware_stats *s) {
+    printf("  uptime                %10.3f s\n", s->uptime_ms / 1000.0);
+    printf("  SPI flash             %10u bytes\n", s->spi_flash_bytes);
+    printf("  SPI FPGA              %10u bytes\n", s->spi_fpga_bytes);
+    printf("  SPI DMA busy          %10.3f s\n", s->dma_busy_us / 1e6);
+    printf("  USB packets out       %10u\n", s->usb_packets_out);
+    printf("  USB packets in        %10u\n", s->usb_packets_in);
+    printf("  UART bytes forwarded  %10u\n", s->cdc_bytes_forwarded);
+    printf("  UART bytes dropped    %10u\n", s->cdc_bytes_dropped);
+    printf("  max task latency      %10u us\n", s->task_latency_max_us);
+    printf("  max timer lateness    %10u us\n", s->timer_lateness_max_us);
+    printf("  FPGA underruns        %10u\n", s->fpga_underruns);
+}
+
+struct worker {
+    pthread_t          thread;
+    struct programmer *programmer;
+    const struct job * job;
+    struct job_result  result;
+};
+
+static void *worker_thread(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    usb_select(w->programmer);
+    run_job(w->job, &w->result);
+    return NULL;
+}
+
+// Run the job on all attached programmers at once, one thread per programmer.
+static int run_all(const struct job *job) {
+    static char serials[64][USB_SERIAL_SIZE];
+    unsigned    count = usb_list(serials, 64);
+    if (count == 0) {
+        fprintf(stderr, "no programmers found\n");
+        return EXIT_FAILURE;
+    }
+
+    struct worker *workers = calloc(count, sizeof(*workers));
+    if (workers == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("running on %u programmer(s)\n", count);
+    verbose = false;
+    for (unsigned i = 0; i < count; i++) {
+        workers[i].job        = job;
+        workers[i].programmer = usb_open(serials[i]);
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (workers[i].programmer == NULL) {
+            continue;
+        }
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+            fprintf(stderr, "%s: error creating thread\n", serials[i]);
+            usb_close(workers[i].programmer);
+            workers[i].programmer = NULL;
+        }
+    }
+
+    unsigned failed = 0;
+    for (unsigned i = 0; i < count; i++) {
+        struct worker *w = &workers[i];
+        if (w->programmer == NULL) {
+            printf("%-24s  FAILED (could not open)\n", serials[i]);
+            failed++;
+            continue;
+        }
+        pthread_join(w->thread, NULL);
+
+        struct usb_stats stats = usb_get_stats(w->programmer);
+        bool             ok    = !usb_failed(w->programmer);
+        printf("%-24s  %s", serials[i], ok ? "OK" : "FAILED");
+        if (ok && job->filepath != NULL) {
+            printf(", CDONE %s", w->result.cdone ? "high" : "low");
+            ok = w->result.cdone;
+        }
+        if (ok && job->filepath0 != NULL) {
+            printf(", verify %s", w->result.verify == 0 ? "passed" : "FAILED");
+            ok = w->result.verify == 0;
+        }
+        if (w->result.seconds > 0) {
+            printf(", %llu bytes out, %llu bytes in, %.2f s, %.1f KB/s",
+                   (unsigned long long)stats.bytes_out, (unsigned long long)stats.bytes_in, w->result.seconds,
+                   (stats.bytes_out + stats.bytes_in) / w->result.seconds / 1024.0);
+        }
+        printf("\n");
+        if (ok && job->firmware_stats) {
+            print_firmware_stats(&w->result.firmware_stats);
+        }
+        if (!ok) {
+            failed++;
+        }
+        usb_close(w->programmer);
+    }
+    free(workers);
+
+    printf("%u of %u programmer(s) succeeded\n", count - failed, count);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char *const argv[]) {
-    int         opt;
-    bool        params_ok         = true;
-    const char *filepath          = NULL;
-    int         fpga_image_index  = 0;
-    const char *filepath0         = NULL;
-    const char *fileflashwrite    = NULL;
-    const char *fileflashdump     = NULL;
-    bool        fpga_boot_flash   = false;
-    bool        mass_erase        = false;
-    unsigned    start             = 0;
-    unsigned    size              = (unsigned)-1;
-
-    while ((opt = getopt(argc, argv, "F:i:I:U:D:s:z:B!")) != -1) {
+    int               opt;
+    bool              params_ok = true;
+    const char *      serial    = NULL;
+    const char *      transport = "usb";
+    bool              all       = false;
+    bool              list      = false;
+    struct spi_timing spi_timing;
+    struct job        job = {
+        .queue_depth = 16,
+        .size        = (unsigned)-1,
+        .incremental = true,
+    };
+
+    while ((opt = getopt(argc, argv, "F:i:I:U:D:s:z:q:k:n:T:alVfBS!")) != -1) {
         switch (opt) {
-            case 'F': filepath = optarg; break;
-            case 'i': fpga_image_index = atoi(optarg); break;
-            case 'I': filepath0 = optarg; break;
-            case 'U': fileflashwrite = optarg; break;
-            case 'D': fileflashdump = optarg; break;
-            case 's': start = strtoul(optarg, NULL, 0); break;
-            case 'z': size = strtoul(optarg, NULL, 0); break;
-            case 'B': fpga_boot_flash = true; break;
-            case '!': mass_erase = true; break;
+            case 'F': job.filepath = optarg; break;
+            case 'i': job.fpga_image_index = atoi(optarg); break;
+            case 'I': job.filepath0 = optarg; break;
+            case 'U': job.fileflashwrite = optarg; break;
+            case 'D': job.fileflashdump = optarg; break;
+            case 's': job.start = strtoul(optarg, NULL, 0); break;
+            case 'z': job.size = strtoul(optarg, NULL, 0); break;
+            case 'q': job.queue_depth = strtoul(optarg, NULL, 0); break;
+            case 'k':
+                spi_timing = (struct spi_timing){.cs_setup_ns = 2000, .cs_hold_ns = 2000};
+                if (sscanf(optarg, "%u,%u,%u", &spi_timing.prescaler, &spi_timing.cs_setup_ns, &spi_timing.cs_hold_ns) < 1 ||
+                    spi_timing.prescaler > 7 || spi_timing.cs_setup_ns > 65535 || spi_timing.cs_hold_ns > 65535) {
+                    params_ok = false;
+                }
+                job.spi_timing = &spi_timing;
+                break;
+            case 'n': serial = optarg; break;
+            case 'T': transport = optarg; break;
+            case 'a': all = true; break;
+            case 'l': list = true; break;
+            case 'V': job.full_verify = true; break;
+            case 'f': job.incremental = false; break;
+            case 'B': job.fpga_boot_flash = true; break;
+            case 'S': job.firmware_stats = true; break;
+            case '!': job.mass_erase = true; break;
             default: params_ok = false; break;
         }
     }
 
+    if (all && (serial != NULL || job.fileflashdump != NULL)) {
+        params_ok = false;
+    }
+
     if (!params_ok) { // || !filepath) {
         fprintf(stderr, "usage: %s [options]\n", basename(argv[0]));
         fprintf(stderr, "\n");
@@ -292,38 +531,61 @@ int main(int argc, char *const argv[]) {
         fprintf(stderr, "  -D <filename>  Dump flash\n");
         fprintf(stderr, "  -s <start>     Write/dump start address\n");
         fprintf(stderr, "  -z <size>      Dump size\n");
+        fprintf(stderr, "  -q <depth>     USB transfers kept in flight (1..64). default=16\n");
+        fprintf(stderr, "  -k <prescaler>[,<setup ns>,<hold ns>]\n");
+        fprintf(stderr, "                 Flash SPI clock divider 2^prescaler (0..7) and chip select\n");
+        fprintf(stderr, "                 timing. default=fastest that reads back correctly and\n");
+        fprintf(stderr, "                 takes write enable\n");
+        fprintf(stderr, "  -n <serial>    Use the programmer with this serial number\n");
+        fprintf(stderr, "  -a             Run on all attached programmers at once (not with -n or -D)\n");
+        fprintf(stderr, "  -l             List attached programmers\n");
+        fprintf(stderr, "  -T <transport> usb (default) or sim[:<devices>[:<latency us>[:<bytes/s>]]]\n");
+        fprintf(stderr, "  -V             Verify image by reading it back instead of by CRC\n");
+        fprintf(stderr, "  -f             Write all sectors, don't skip sectors that are unchanged\n");
         fprintf(stderr, "  -B             Reset FPGA and boot from flash\n");
+        fprintf(stderr, "  -S             Show the programmer's statistics after the other operations\n");
         fprintf(stderr, "  -!             Erase microcontroller of programmer and return to USB DFU (CAUTION!)\n");
         fprintf(stderr, "\n");
         exit(1);
     }
 
-    usb_init();
-    spi_set_mode(SPI_MODE_NONE);
+    usb_init(transport);
 
-    if (mass_erase) {
-        start_mass_erase();
+    if (list) {
+        static char serials[64][USB_SERIAL_SIZE];
+        unsigned    count = usb_list(serials, 64);
+        for (unsigned i = 0; i < count; i++) {
+            printf("%s\n", serials[i]);
+        }
+        usb_deinit();
+        return 0;
     }
 
-    if (filepath != NULL) {
-        upload_fpga(filepath);
+    if (all) {
+        int status = run_all(&job);
+        usb_deinit();
+        return status;
     }
 
-    if (filepath0 != NULL) {
-        upload_fpga_image(fpga_image_index, filepath0, fpga_image_index == 0);
+    struct programmer *programmer = usb_open(serial);
+    if (programmer == NULL) {
+        exit(EXIT_FAILURE);
     }
+    usb_select(programmer);
 
-    if (fileflashwrite != NULL) {
-        flash_write_file(fileflashwrite, start);
+    struct job_result result = {0};
+    run_job(&job, &result);
+    if (job.firmware_stats) {
+        printf("programmer statistics:\n");
+        print_firmware_stats(&result.firmware_stats);
     }
 
-    if (fileflashdump != NULL) {
-        flash_dump(fileflashdump, start, size);
-    }
+    usb_close(programmer);
+    usb_deinit();
 
-    if (fpga_boot_flash) {
-        spi_set_mode(SPI_MODE_FPGA_BOOT);
+    // Same failures as with -a: FPGA not configured, or image verify error
+    if ((job.filepath != NULL && !result.cdone) || (job.filepath0 != NULL && result.verify != 0)) {
+        return EXIT_FAILURE;
     }
-
     return 0;
 }
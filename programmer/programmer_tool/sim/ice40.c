@@ -0,0 +1,47 @@
+#include "ice40.h"
+#include <string.h>
+
+#define PREAMBLE (0x7EAA997E)
+#define DUMMY_BYTES (7) // at least 49 clocks
+
+void ice40_reset(struct ice40 *fpga) {
+    memset(fpga, 0, sizeof(*fpga));
+}
+
+void ice40_start_config(struct ice40 *fpga) {
+    ice40_reset(fpga);
+    fpga->sck = true;
+}
+
+void ice40_config_data(struct ice40 *fpga, const uint8_t *data, unsigned length) {
+    for (unsigned i = 0; i < length; i++) {
+        if (!fpga->preamble) {
+            fpga->shift    = (fpga->shift << 8) | data[i];
+            fpga->preamble = fpga->shift == PREAMBLE;
+            continue;
+        }
+        fpga->trailing_zeros = data[i] == 0 ? fpga->trailing_zeros + 1 : 0;
+    }
+    fpga->bytes += length;
+    fpga->cdone = fpga->preamble && fpga->trailing_zeros >= DUMMY_BYTES;
+}
+
+void ice40_config_pins(struct ice40 *fpga, const uint8_t *odr, unsigned count, uint8_t sck, uint8_t data) {
+    for (unsigned i = 0; i < count; i++) {
+        bool rising = !fpga->sck && (odr[i] & sck);
+        fpga->sck   = (odr[i] & sck) != 0;
+        if (!rising) {
+            continue;
+        }
+        fpga->byte = (uint8_t)(fpga->byte << 1) | ((odr[i] & data) != 0);
+        if (++fpga->bits == 8) {
+            ice40_config_data(fpga, &fpga->byte, 1);
+            fpga->bits = 0;
+        }
+    }
+}
+
+void ice40_boot(struct ice40 *fpga, const uint8_t *flash) {
+    ice40_reset(fpga);
+    fpga->cdone = flash[0] == 0x7E && flash[1] == 0xAA && flash[2] == 0x99 && flash[3] == 0x7E;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Emulated iCE40 UltraPlus configuration. The bitstream itself isn't
+// interpreted: CDONE goes high when the preamble has been seen and the
+// stream ended with at least 49 dummy clocks, as iCE40 slave configuration
+// requires.
+
+struct ice40 {
+    bool     cdone;
+    bool     preamble;
+    uint32_t shift;
+    unsigned trailing_zeros; // consecutive zero bytes at the end of the stream
+    uint64_t bytes;
+    bool     sck;      // level of the last ice40_config_pins() sample
+    uint8_t  byte;     // bits received so far
+    unsigned bits;
+};
+
+// Reset released with SPI_SS low: wait for a bitstream.
+void ice40_start_config(struct ice40 *fpga);
+void ice40_config_data(struct ice40 *fpga, const uint8_t *data, unsigned length);
+
+// Configuration pins over time, as GPIO output data register values: a bit is
+// taken from the data pin on every rising edge of the sck pin, MSB first.
+void ice40_config_pins(struct ice40 *fpga, const uint8_t *odr, unsigned count, uint8_t sck, uint8_t data);
+
+// Reset released with SPI_SS high: boot from flash, which holds a bitstream
+// (or warm boot image records) when it starts with the preamble.
+void ice40_boot(struct ice40 *fpga, const uint8_t *flash);
+
+// Reset asserted
+void ice40_reset(struct ice40 *fpga);
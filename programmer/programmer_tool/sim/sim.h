@@ -0,0 +1,46 @@
+#pragma once
+
+// Interface between programmer_tool's simulator transport and the simulated
+// programmer. The simulated programmer runs the firmware's command decoder
+// (../stm32/cmd.c, spi_flash.c, fpga_wave.c) against an emulated W25Q16JV and
+// iCE40 configuration port. It only includes standard headers, the firmware
+// side is built with the firmware's include paths.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIM_PACKET_SIZE (64)
+
+struct sim_config {
+    unsigned latency_us; // added to every USB packet, in each direction
+    unsigned bandwidth;  // USB bytes per second, in each direction
+    unsigned spi_hz;     // SPI clock in flash mode with prescaler 0
+    unsigned fpga_hz;    // FPGA configuration clock (FPGA_CONFIG_SCK_HZ)
+    bool     flash_busy; // model erase and program times of the flash
+};
+
+#define SIM_DEFAULT_CONFIG                                                                                     \
+    {                                                                                                          \
+        .latency_us = 125, .bandwidth = 1000000, .spi_hz = 24000000, .fpga_hz = 3000000, .flash_busy = true, \
+    }
+
+// Packet on the OUT or IN socket. time is CLOCK_MONOTONIC in ns: for OUT and
+// IN packets the time the packet has crossed the simulated link, for OUT
+// acknowledgements the time the programmer accepted the packet.
+struct sim_packet {
+    uint64_t time;
+    uint16_t length;
+    uint8_t  data[SIM_PACKET_SIZE];
+};
+
+#define SIM_PACKET_HEADER_SIZE (offsetof(struct sim_packet, data))
+
+// Run the simulated programmer until out_fd is closed. Meant to run in a
+// process of its own, the firmware state is global. OUT packets and their
+// acknowledgements use out_fd, IN packets in_fd. Both are SOCK_SEQPACKET
+// sockets, so packet boundaries are kept.
+void sim_programmer_run(int out_fd, int in_fd, const struct sim_config *config);
+
+uint64_t sim_time_now(void);
+void     sim_sleep_until(uint64_t time);
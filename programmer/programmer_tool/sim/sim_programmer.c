@@ -0,0 +1,363 @@
+// Simulated programmer: the firmware's hardware interface (spi.h, usb.h,
+// lltimer, CRC unit) implemented on top of the emulated flash and FPGA.
+// Built with the firmware's include paths and linked together with
+// ../stm32/cmd.c, spi_flash.c and fpga_wave.c into a single object of which only
+// sim_programmer_run() is visible, so the firmware's spi_* functions don't
+// clash with programmer_tool's.
+
+#include "lib.h"
+#include "usb.h"
+#include "spi.h"
+#include "flash.h"
+#include "crc32.h"
+#include "fpga_config.h"
+#include "fpga_wave.h"
+#include "stats.h"
+#include "sim.h"
+#include "w25q16jv.h"
+#include "ice40.h"
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const struct sim_config *config;
+static int                      out_fd;
+static int                      in_fd;
+
+// The programmer runs in simulated time, which advances by the time the
+// hardware would take. Packets carry the time they cross the USB link; the
+// host side waits until then before completing a transfer.
+static uint64_t device_time;
+static uint64_t boot_time;
+static uint64_t in_link_time;
+static uint64_t fpga_done_time; // DMA has shifted out all queued FPGA data
+static uint64_t dma_done_time;  // end of the spi_transfer_start() transfer
+static uint64_t in_free_time;   // IN endpoint buffer free again
+
+static enum spi_mode   current_mode = SPI_MODE_NONE;
+static unsigned        spi_hz;      // flash mode SCK, set by spi_set_timing()
+static uint64_t        cs_setup_ns;
+static uint64_t        cs_hold_ns;
+static struct w25q16jv flash;
+static struct ice40    fpga;
+static uint32_t        hw_crc;
+
+static void device_delay(uint64_t ns) {
+    device_time += ns;
+}
+
+static uint64_t bits_to_ns(uint64_t bytes, unsigned hz) {
+    return bytes * 8 * 1000000000 / hz;
+}
+
+// SPI transfers use DMA in the firmware
+static void count_dma(uint64_t ns) {
+    stats.dma_busy_cycles += ns * (SYSCLK_FREQ / 1000000) / 1000;
+}
+
+static void set_cdone(bool cdone) {
+    if (cdone) {
+        GPIOA->IDR |= 1 << (IO_FPGA_CDONE & 15);
+    } else {
+        GPIOA->IDR &= ~(1 << (IO_FPGA_CDONE & 15));
+    }
+}
+
+// GPIO registers are read directly by io_in(), back them with memory.
+static bool map_gpio(void) {
+    uintptr_t base = GPIOA_BASE & ~(uintptr_t)0xFFF;
+    void *    p    = mmap((void *)base, 0x2000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != (void *)base) {
+        if (p != MAP_FAILED) {
+            munmap(p, 0x2000);
+        }
+        return false;
+    }
+    return true;
+}
+
+void spi_set_mode(enum spi_mode mode) {
+    // fpga_config_stop()
+    if (current_mode == SPI_MODE_FPGA && device_time < fpga_done_time) {
+        device_time = fpga_done_time;
+    }
+    current_mode = mode;
+    switch (mode) {
+        case SPI_MODE_NONE: break;
+        case SPI_MODE_FPGA_BOOT:
+            ice40_boot(&fpga, flash.mem);
+            device_delay(2000);
+            break;
+        case SPI_MODE_FPGA:
+            ice40_start_config(&fpga);
+            device_delay(4000);
+            break;
+        case SPI_MODE_FLASH:
+            ice40_reset(&fpga);
+            spi_select(1);
+            spi_transfer((const uint8_t[]){0xAB}, NULL, 1);
+            spi_select(0);
+            device_delay(4000);
+            break;
+    }
+    set_cdone(fpga.cdone);
+}
+
+void spi_select(bool on) {
+    if (current_mode == SPI_MODE_FLASH) {
+        device_delay(on ? 0 : cs_hold_ns);
+        w25q16jv_select(&flash, on, device_time);
+        device_delay(on ? cs_setup_ns : SPI_CS_DESELECT_NS);
+    }
+}
+
+void spi_set_timing(unsigned prescaler, unsigned setup_ns, unsigned hold_ns) {
+    spi_hz      = config->spi_hz >> (prescaler & 7);
+    cs_setup_ns = setup_ns;
+    cs_hold_ns  = hold_ns;
+}
+
+void spi_transfer(const void *tx_buf, void *rx_buf, size_t length) {
+    const uint8_t *tx_buf8 = (const uint8_t *)tx_buf;
+    uint8_t *      rx_buf8 = (uint8_t *)rx_buf;
+
+    if (current_mode == SPI_MODE_FLASH) {
+        for (size_t i = 0; i < length; i++) {
+            uint8_t data = w25q16jv_transfer(&flash, tx_buf8 ? tx_buf8[i] : 0xFF, device_time);
+            if (rx_buf8) {
+                rx_buf8[i] = data;
+            }
+        }
+        device_delay(bits_to_ns(length, spi_hz));
+        stats.spi_flash_bytes += length;
+        count_dma(bits_to_ns(length, spi_hz));
+    } else if (tx_buf8 && current_mode == SPI_MODE_FPGA) {
+        fpga_config_write(tx_buf8, length);
+        stats.spi_fpga_bytes += length;
+    }
+}
+
+// FPGA configuration by DMA: the data goes through the firmware's waveform
+// generator and the emulated FPGA samples the pins. Shifting out runs in the
+// background, writing only waits while the FIFO is full. It takes all data,
+// the wait is simulated time.
+size_t fpga_config_write(const void *data, size_t length) {
+    struct fpga_wave wave;
+    uint8_t          sck = 1 << (IO_SPI_SCK & 15);
+    uint8_t          pin = 1 << (IO_SPI_MISO & 15);
+    fpga_wave_init(&wave, 0, sck, pin);
+
+    const uint8_t *data8 = (const uint8_t *)data;
+    for (size_t offset = 0; offset < length; offset += 16) {
+        unsigned n = length - offset < 16 ? length - offset : 16;
+        uint8_t  samples[16 * FPGA_WAVE_SAMPLES_PER_BYTE];
+        fpga_wave_expand(&wave, samples, data8 + offset, n);
+        ice40_config_pins(&fpga, samples, n * FPGA_WAVE_SAMPLES_PER_BYTE, sck, pin);
+    }
+    set_cdone(fpga.cdone);
+
+    uint64_t start = fpga_done_time > device_time ? fpga_done_time : device_time;
+    fpga_done_time = start + bits_to_ns(length, config->fpga_hz);
+    uint64_t fifo  = bits_to_ns(FPGA_CONFIG_FIFO_SIZE, config->fpga_hz);
+    if (fpga_done_time > device_time + fifo) {
+        device_time = fpga_done_time - fifo;
+    }
+    return length;
+}
+
+// Completes right away, the time it takes is accounted for.
+void spi_receive_start(volatile void *rx_buf, size_t length, bool increment) {
+    if (current_mode != SPI_MODE_FLASH) {
+        return;
+    }
+    volatile uint8_t *rx_buf8 = (volatile uint8_t *)rx_buf;
+    for (size_t i = 0; i < length; i++) {
+        uint8_t data = w25q16jv_transfer(&flash, 0xFF, device_time);
+        if (rx_buf == &CRC->DR) {
+            hw_crc = ~hw_crc;
+            hw_crc ^= data;
+            for (unsigned k = 0; k < 8; k++) {
+                hw_crc = (hw_crc & 1) ? (hw_crc >> 1) ^ 0xEDB88320 : (hw_crc >> 1);
+            }
+            hw_crc = ~hw_crc;
+        } else {
+            *rx_buf8 = data;
+            if (increment) {
+                rx_buf8++;
+            }
+        }
+    }
+    device_delay(bits_to_ns(length, spi_hz));
+    stats.spi_flash_bytes += length;
+    count_dma(bits_to_ns(length, spi_hz));
+}
+
+// The data is transferred right away, the time it takes runs in the
+// background until spi_transfer_busy() returns false.
+void spi_transfer_start(const void *tx_buf, void *rx_buf, size_t length) {
+    if (current_mode != SPI_MODE_FLASH) {
+        spi_transfer(tx_buf, rx_buf, length);
+        return;
+    }
+    uint64_t start = device_time;
+    spi_transfer(tx_buf, rx_buf, length);
+    dma_done_time = device_time;
+    device_time   = start;
+}
+
+bool spi_transfer_busy(void) {
+    return device_time < dma_done_time;
+}
+
+// spi_set_mode() waits for the FPGA configuration data in simulated time
+bool spi_fpga_busy(void) {
+    return false;
+}
+
+void crc32_hw_begin(void) {
+    hw_crc = 0;
+}
+
+uint32_t crc32_hw_end(void) {
+    return hw_crc;
+}
+
+uint64_t lltimer_get_counter_value(void) {
+    return (device_time - boot_time) / (1000000000 / TICKS_PER_SECOND);
+}
+
+uint32_t task_get_latency_max(bool clear) {
+    return 0;
+}
+
+uint32_t timer_get_lateness_max(bool clear) {
+    return 0;
+}
+
+void timer_start(struct timer *timer, uint32_t delay) {
+    (void)timer;
+    (void)delay;
+}
+
+bool flash_mass_erase(void) {
+    fprintf(stderr, "sim: programmer firmware erased\n");
+    return false;
+}
+
+void usb_send_buffer(void *buf, unsigned size) {
+    struct sim_packet packet;
+
+    uint64_t start = device_time > in_link_time ? device_time : in_link_time;
+    in_link_time   = start + (uint64_t)size * 1000000000 / config->bandwidth;
+    packet.time    = in_link_time + config->latency_us * 1000ULL;
+    packet.length  = size;
+    memcpy(packet.data, buf, size);
+
+    in_free_time = in_link_time;
+    stats.usb_packets_in++;
+    if (send(in_fd, &packet, SIM_PACKET_HEADER_SIZE + size, 0) < 0) {
+        _exit(EXIT_FAILURE);
+    }
+}
+
+bool usb_send_ready(void) {
+    return device_time >= in_free_time;
+}
+
+// Advance to the next DMA or USB event, when there is one.
+static void wait_next_event(void) {
+    uint64_t next = UINT64_MAX;
+    if (dma_done_time > device_time) {
+        next = dma_done_time;
+    }
+    if (in_free_time > device_time && in_free_time < next) {
+        next = in_free_time;
+    }
+    if (next != UINT64_MAX) {
+        device_time = next;
+    }
+}
+
+// OUT packet in one of the two receive buffers
+struct rx_buffer {
+    struct sim_packet packet;
+    uint64_t          accepted; // time the packet was received into the buffer
+    uint64_t          free;     // time the decoder released the buffer
+};
+
+void sim_programmer_run(int out_fd_, int in_fd_, const struct sim_config *config_) {
+    out_fd = out_fd_;
+    in_fd  = in_fd_;
+    config = config_;
+
+    if (!map_gpio()) {
+        fprintf(stderr, "sim: can't map GPIO registers\n");
+        return;
+    }
+    device_time = sim_time_now();
+    boot_time   = device_time;
+    w25q16jv_init(&flash, config->flash_busy);
+    spi_set_timing(0, 2000, 2000);
+    spi_set_mode(SPI_MODE_FPGA_BOOT);
+
+    // The same steps as the firmware's USB command task: OUT packets go into
+    // two buffers in turn, a packet is handed to the decoder when the previous
+    // one is released and the IN endpoint is free.
+    struct rx_buffer rx_bufs[2] = {0};
+    unsigned         rx_head    = 0;
+    unsigned         rx_tail    = 0;
+    bool             holding    = false;
+
+    while (true) {
+        bool busy = usb_handle_cmd_continue();
+        if (!busy && holding) {
+            rx_bufs[rx_tail % 2].free = device_time;
+            rx_tail++;
+            holding = false;
+        }
+
+        // Receive into free buffers, wait for a packet when there's nothing else to do
+        while (rx_head - rx_tail < 2) {
+            bool              idle = !busy && rx_head == rx_tail;
+            struct sim_packet packet;
+            ssize_t           size = recv(out_fd, &packet, sizeof(packet), idle ? 0 : MSG_DONTWAIT);
+            if (size < 0 && !idle && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (size < (ssize_t)SIM_PACKET_HEADER_SIZE) {
+                return;
+            }
+
+            struct rx_buffer *b = &rx_bufs[rx_head % 2];
+            b->packet           = packet;
+            b->accepted         = packet.time > b->free ? packet.time : b->free;
+            rx_head++;
+            stats.usb_packets_out++;
+
+            struct sim_packet ack = {.time = b->accepted, .length = 0};
+            if (send(out_fd, &ack, SIM_PACKET_HEADER_SIZE, 0) < 0) {
+                return;
+            }
+        }
+
+        if (!busy && rx_head != rx_tail) {
+            if (!usb_send_ready()) {
+                device_time = in_free_time;
+                continue;
+            }
+            struct rx_buffer *b = &rx_bufs[rx_tail % 2];
+            if (device_time < b->accepted) {
+                device_time = b->accepted;
+            }
+            if (b->packet.length > 0) {
+                struct buf_reader br;
+                buf_reader_init(&br, b->packet.data, b->packet.length);
+                usb_handle_cmd_packet(&br);
+            }
+            holding = true;
+        } else if (busy) {
+            wait_next_event();
+        }
+    }
+}
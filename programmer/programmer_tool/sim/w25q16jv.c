@@ -0,0 +1,141 @@
+#include "w25q16jv.h"
+#include <string.h>
+
+enum {
+    WRITE_ENABLE           = 0x06,
+    WRITE_DISABLE          = 0x04,
+    READ_STATUS_REGISTER_1 = 0x05,
+    READ_DATA              = 0x03,
+    FAST_READ              = 0x0B,
+    PAGE_PROGRAM           = 0x02,
+    SECTOR_ERASE_4KB       = 0x20,
+    BLOCK_ERASE_32KB       = 0x52,
+    BLOCK_ERASE_64KB       = 0xD8,
+    CHIP_ERASE             = 0xC7,
+    CHIP_ERASE_ALT         = 0x60,
+    RELEASE_POWER_DOWN     = 0xAB,
+    JEDEC_ID               = 0x9F,
+    READ_UNIQUE_ID         = 0x4B,
+};
+
+#define STATUS_BUSY (0x01)
+#define STATUS_WEL (0x02)
+
+#define US(x) ((uint64_t)(x)*1000)
+#define MS(x) ((uint64_t)(x)*1000000)
+
+void w25q16jv_init(struct w25q16jv *flash, bool busy_timing) {
+    memset(flash, 0, sizeof(*flash));
+    memset(flash->mem, 0xFF, sizeof(flash->mem));
+    flash->busy_timing = busy_timing;
+}
+
+static bool is_busy(const struct w25q16jv *flash, uint64_t now) {
+    return now < flash->busy_until;
+}
+
+static void start_busy(struct w25q16jv *flash, uint64_t now, uint64_t duration) {
+    flash->busy_until   = flash->busy_timing ? now + duration : now;
+    flash->write_enable = false;
+}
+
+static void erase(struct w25q16jv *flash, uint32_t size, uint64_t now, uint64_t duration) {
+    uint32_t address = flash->address & (W25Q16JV_SIZE - 1) & ~(size - 1);
+    memset(&flash->mem[address], 0xFF, size);
+    flash->erases++;
+    start_busy(flash, now, duration);
+}
+
+// Write and erase commands take effect when chip select goes inactive.
+static void execute(struct w25q16jv *flash, uint64_t now) {
+    if (flash->count == 1) {
+        switch (flash->cmd) {
+            case WRITE_ENABLE: flash->write_enable = true; break;
+            case WRITE_DISABLE: flash->write_enable = false; break;
+            case CHIP_ERASE:
+            case CHIP_ERASE_ALT:
+                if (flash->write_enable) {
+                    flash->address = 0;
+                    erase(flash, W25Q16JV_SIZE, now, MS(5000));
+                }
+                break;
+        }
+        return;
+    }
+    if (flash->count < 4 || !flash->write_enable) {
+        return;
+    }
+
+    switch (flash->cmd) {
+        case PAGE_PROGRAM: {
+            uint32_t page = flash->address & (W25Q16JV_SIZE - 1) & ~(W25Q16JV_PAGE_SIZE - 1);
+            for (unsigned i = 0; i < W25Q16JV_PAGE_SIZE; i++) {
+                flash->mem[page + i] &= flash->page[i];
+            }
+            flash->programs++;
+            start_busy(flash, now, US(400));
+            break;
+        }
+        case SECTOR_ERASE_4KB: erase(flash, 4096, now, MS(45)); break;
+        case BLOCK_ERASE_32KB: erase(flash, 32768, now, MS(120)); break;
+        case BLOCK_ERASE_64KB: erase(flash, 65536, now, MS(150)); break;
+    }
+}
+
+void w25q16jv_select(struct w25q16jv *flash, bool on, uint64_t now) {
+    if (flash->selected && !on && flash->count > 0) {
+        execute(flash, now);
+    }
+    flash->selected = on;
+    flash->count    = 0;
+}
+
+uint8_t w25q16jv_transfer(struct w25q16jv *flash, uint8_t data, uint64_t now) {
+    if (!flash->selected) {
+        return 0xFF;
+    }
+
+    unsigned index = flash->count++;
+    if (index == 0) {
+        // Only the status register can be read while busy
+        flash->cmd = (is_busy(flash, now) && data != READ_STATUS_REGISTER_1) ? 0 : data;
+        flash->address   = 0;
+        flash->page_fill = 0;
+        memset(flash->page, 0xFF, sizeof(flash->page));
+        return 0xFF;
+    }
+
+    switch (flash->cmd) {
+        case READ_STATUS_REGISTER_1: return (is_busy(flash, now) ? STATUS_BUSY : 0) | (flash->write_enable ? STATUS_WEL : 0);
+
+        case JEDEC_ID: {
+            static const uint8_t id[] = {0xEF, 0x40, 0x15};
+            return index <= sizeof(id) ? id[index - 1] : 0xFF;
+        }
+
+        case RELEASE_POWER_DOWN: return index >= 4 ? 0x14 : 0xFF;
+
+        case READ_UNIQUE_ID: return index >= 5 ? (uint8_t)(0xA0 + index) : 0xFF;
+
+        case READ_DATA:
+        case FAST_READ:
+        case PAGE_PROGRAM:
+        case SECTOR_ERASE_4KB:
+        case BLOCK_ERASE_32KB:
+        case BLOCK_ERASE_64KB:
+            if (index <= 3) {
+                flash->address = (flash->address << 8) | data;
+                return 0xFF;
+            }
+            if (flash->cmd == READ_DATA || (flash->cmd == FAST_READ && index > 4)) {
+                return flash->mem[(flash->address++) & (W25Q16JV_SIZE - 1)];
+            }
+            if (flash->cmd == PAGE_PROGRAM) {
+                // Data wraps around within the page
+                flash->page[(flash->address + flash->page_fill++) & (W25Q16JV_PAGE_SIZE - 1)] = data;
+            }
+            return 0xFF;
+
+        default: return 0xFF;
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Emulated Winbond W25Q16JV SPI flash. Times are in ns, busy times are the
+// typical values from the datasheet.
+
+#define W25Q16JV_SIZE (0x200000)
+#define W25Q16JV_PAGE_SIZE (256)
+
+struct w25q16jv {
+    bool     busy_timing; // keep the busy flag set for the typical erase/program time
+    bool     selected;
+    unsigned count;   // bytes since chip select
+    uint8_t  cmd;
+    uint32_t address;
+    bool     write_enable;
+    uint64_t busy_until;
+    uint8_t  page[W25Q16JV_PAGE_SIZE];
+    unsigned page_fill;
+    unsigned erases;
+    unsigned programs;
+    uint8_t  mem[W25Q16JV_SIZE];
+};
+
+void    w25q16jv_init(struct w25q16jv *flash, bool busy_timing);
+void    w25q16jv_select(struct w25q16jv *flash, bool on, uint64_t now);
+uint8_t w25q16jv_transfer(struct w25q16jv *flash, uint8_t data, uint64_t now);
@@ -0,0 +1,41 @@
+#include "test.h"
+#include <stdarg.h>
+
+static unsigned failures;
+static uint32_t random_state = 2463534242;
+
+void check(bool ok, const char *what, ...) {
+    if (ok) {
+        return;
+    }
+    va_list args;
+    va_start(args, what);
+    vprintf(what, args);
+    va_end(args);
+    printf(": FAILED\n");
+    failures++;
+}
+
+uint32_t test_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static void run(const char *name, void (*test)(void)) {
+    unsigned failures_before = failures;
+    test();
+    printf("%-24s %s\n", name, failures == failures_before ? "ok" : "FAILED");
+}
+
+int main(void) {
+    run("flash cache", test_cache);
+    run("verify", test_verify);
+
+    if (failures > 0) {
+        printf("%u checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "lib.h"
+
+// Tests of programmer_tool against the simulated flash and programmer (see
+// Makefile). Each test is a function called from test.c's main(), it reports
+// what's wrong with check().
+
+// Count a failed check and print it
+void check(bool ok, const char *what, ...) __attribute__((format(printf, 2, 3)));
+
+// Pseudo random numbers, the same sequence on every run
+uint32_t test_random(void);
+
+void test_cache(void);
+void test_verify(void);
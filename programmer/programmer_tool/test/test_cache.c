@@ -0,0 +1,322 @@
+#include "test.h"
+#include "flash_cache.h"
+#include "sim/w25q16jv.h"
+
+// The write-back cache and its erase planner on the simulator's W25Q16JV,
+// driven with the flash's SPI commands. The flash counts the erases and page
+// programs it executes, each case checks them exactly, along with the erase
+// sizes chosen and the flash contents afterwards.
+
+enum {
+    WRITE_ENABLE     = 0x06,
+    READ_DATA        = 0x03,
+    PAGE_PROGRAM     = 0x02,
+    SECTOR_ERASE_4KB = 0x20,
+    BLOCK_ERASE_32KB = 0x52,
+    BLOCK_ERASE_64KB = 0xD8,
+};
+
+#define BLOCK_SIZE (65536)
+#define SECTOR_SIZE (4096)
+#define PAGE_SIZE (256)
+#define BLOCK_SECTORS (BLOCK_SIZE / SECTOR_SIZE)
+
+static const struct flash_info flash_info = {
+    .name        = "W25Q16JV",
+    .size        = W25Q16JV_SIZE,
+    .block_size  = BLOCK_SIZE,
+    .sector_size = SECTOR_SIZE,
+    .page_size   = PAGE_SIZE,
+};
+
+static struct w25q16jv    flash;
+static struct flash_cache cache;
+static uint8_t            expected[W25Q16JV_SIZE]; // flash contents after the writes
+
+// Operations in the order the flash executed them
+#define LOG_SIZE (64)
+
+struct flash_op {
+    unsigned address;
+    unsigned size; // erase size, 0 for a page program
+};
+
+static struct flash_op log_ops[LOG_SIZE];
+static unsigned        log_length;
+
+static void log_op(unsigned address, unsigned size) {
+    if (log_length < LOG_SIZE) {
+        log_ops[log_length] = (struct flash_op){address, size};
+    }
+    log_length++;
+}
+
+static void spi_command(uint8_t cmd, unsigned address, const uint8_t *tx, uint8_t *rx, unsigned length) {
+    w25q16jv_select(&flash, true, 0);
+    w25q16jv_transfer(&flash, cmd, 0);
+    w25q16jv_transfer(&flash, address >> 16, 0);
+    w25q16jv_transfer(&flash, address >> 8, 0);
+    w25q16jv_transfer(&flash, address >> 0, 0);
+    for (unsigned i = 0; i < length; i++) {
+        uint8_t data = w25q16jv_transfer(&flash, tx != NULL ? tx[i] : 0xFF, 0);
+        if (rx != NULL) {
+            rx[i] = data;
+        }
+    }
+    w25q16jv_select(&flash, false, 0);
+}
+
+static void write_enable(void) {
+    w25q16jv_select(&flash, true, 0);
+    w25q16jv_transfer(&flash, WRITE_ENABLE, 0);
+    w25q16jv_select(&flash, false, 0);
+}
+
+static void sim_read(unsigned address, void *data, unsigned size) {
+    spi_command(READ_DATA, address, NULL, data, size);
+}
+
+static void sim_erase(unsigned address, unsigned size) {
+    log_op(address, size);
+    write_enable();
+    spi_command(size == BLOCK_SIZE ? BLOCK_ERASE_64KB : size == BLOCK_SIZE / 2 ? BLOCK_ERASE_32KB : SECTOR_ERASE_4KB, address, NULL, NULL, 0);
+}
+
+static void sim_program(unsigned address, const void *data, unsigned size) {
+    const uint8_t *p = data;
+    while (size > 0) {
+        unsigned n = PAGE_SIZE - address % PAGE_SIZE;
+        if (n > size) {
+            n = size;
+        }
+        log_op(address, 0);
+        write_enable();
+        spi_command(PAGE_PROGRAM, address, p, NULL, n);
+        address += n;
+        p += n;
+        size -= n;
+    }
+}
+
+static const struct flash_ops sim_ops = {
+    .read    = sim_read,
+    .erase   = sim_erase,
+    .program = sim_program,
+};
+
+static void fill_random(uint8_t *data, unsigned size) {
+    for (unsigned i = 0; i < size; i++) {
+        data[i] = test_random();
+    }
+}
+
+// Start a case: flash contents as set up, cache empty, nothing counted
+static void start(void) {
+    memcpy(expected, flash.mem, sizeof(expected));
+    flash.erases   = 0;
+    flash.programs = 0;
+    log_length     = 0;
+    flash_cache_init(&cache, &flash_info, &sim_ops);
+}
+
+static void write(unsigned address, const uint8_t *data, unsigned size) {
+    memcpy(&expected[address], data, size);
+    flash_cache_write(&cache, address, data, size);
+}
+
+static void finish(const char *what, unsigned erases, unsigned programs) {
+    flash_cache_flush(&cache);
+    check(flash.erases == erases && flash.programs == programs, "%s: %u erases, %u page programs, expected %u, %u", what, flash.erases,
+          flash.programs, erases, programs);
+    check(memcmp(flash.mem, expected, sizeof(expected)) == 0, "%s: flash contents", what);
+}
+
+static bool erases_are(const struct flash_op *ops, unsigned count) {
+    unsigned n = 0;
+    for (unsigned i = 0; i < log_length && i < LOG_SIZE; i++) {
+        if (log_ops[i].size != 0) {
+            if (n >= count || log_ops[i].address != ops[n].address || log_ops[i].size != ops[n].size) {
+                return false;
+            }
+            n++;
+        }
+    }
+    return n == count;
+}
+
+// Writes of a sector or less
+
+static void test_unchanged(void) {
+    static uint8_t data[6000];
+    fill_random(data, sizeof(data));
+    memcpy(&flash.mem[0x50100], data, sizeof(data));
+
+    start();
+    write(0x50100, data, sizeof(data));
+    finish("unchanged rewrite", 0, 0);
+}
+
+static void test_partial_sector(void) {
+    uint8_t data[100];
+    fill_random(data, sizeof(data));
+
+    // Erased flash: just the pages written
+    start();
+    write(0x60010, data, 100);
+    finish("partial sector, one page", 0, 1);
+
+    start();
+    write(0x610F0, data, 0x20);
+    finish("partial sector, two pages", 0, 2);
+
+    // Bits cleared only: programmed over the old data
+    fill_random(&flash.mem[0x62000], SECTOR_SIZE);
+    for (unsigned i = 0; i < 10; i++) {
+        data[i] = flash.mem[0x62105 + i] & data[i];
+    }
+    start();
+    write(0x62105, data, 10);
+    finish("partial sector, program only", 0, 1);
+
+    // Bits set: the sector is erased and programmed again, except for the
+    // page that is erased anyway
+    fill_random(&flash.mem[0x70000], SECTOR_SIZE);
+    memset(&flash.mem[0x70500], 0xFF, PAGE_SIZE);
+    for (unsigned i = 0; i < 10; i++) {
+        data[i] = ~flash.mem[0x70005 + i];
+    }
+    start();
+    write(0x70005, data, 10);
+    finish("partial sector, erase", 1, BLOCK_SECTORS - 1);
+    check(erases_are(&(struct flash_op){0x70000, SECTOR_SIZE}, 1), "partial sector, erase: erase size");
+}
+
+// Whole and partial blocks: the planner's choice between 64 KB, 32 KB and
+// 4 KB erases
+
+enum sector_kind {
+    NOT_WRITTEN,  // random data, left alone
+    UNCHANGED,    // written with what the flash holds
+    PROGRAM_ONLY, // erased flash, random data written
+    NEEDS_ERASE,  // random data, different random data written
+};
+
+struct block_case {
+    const char *     name;
+    enum sector_kind kinds[BLOCK_SECTORS];
+    unsigned         programs;
+    unsigned         erase_count;
+    struct flash_op  erases[8]; // addresses relative to the block
+};
+
+#define N NOT_WRITTEN
+#define U UNCHANGED
+#define P PROGRAM_ONLY
+#define E NEEDS_ERASE
+
+static const struct block_case block_cases[] = {
+    {"block, all erased", {E, E, E, E, E, E, E, E, E, E, E, E, E, E, E, E}, 256, 1, {{0, 65536}}},
+    {"block, half erased", {E, E, E, E, E, E, E, E, U, U, U, U, U, U, U, U}, 256, 1, {{0, 65536}}},
+    {"block, 32K and programs", {E, E, E, E, E, P, P, P, P, P, P, P, P, P, P, P}, 256, 1, {{0, 32768}}},
+    {"block, 32K and 4K", {E, E, E, E, P, P, P, P, P, E, P, P, P, P, U, U}, 224, 2, {{0, 32768}, {0x9000, 4096}}},
+    {"block, 32K in second half", {P, E, U, U, U, U, U, U, E, E, E, E, P, P, P, P}, 16 + 16 + 128, 2, {{0x1000, 4096}, {0x8000, 32768}}},
+    {"partial block, 4K", {E, E, E, N, N, N, N, N, N, N, N, N, N, N, N, N}, 48, 3, {{0, 4096}, {0x1000, 4096}, {0x2000, 4096}}},
+    {"partial block, no 32K",
+     {E, E, E, E, E, E, E, N, P, P, P, P, P, P, P, P},
+     7 * 16 + 8 * 16,
+     7,
+     {{0, 4096}, {0x1000, 4096}, {0x2000, 4096}, {0x3000, 4096}, {0x4000, 4096}, {0x5000, 4096}, {0x6000, 4096}}},
+};
+
+#undef N
+#undef U
+#undef P
+#undef E
+
+static void test_blocks(void) {
+    const unsigned block = 0x100000;
+    static uint8_t data[BLOCK_SIZE];
+
+    for (unsigned c = 0; c < sizeof(block_cases) / sizeof(block_cases[0]); c++) {
+        const struct block_case *bc = &block_cases[c];
+        fill_random(data, sizeof(data));
+        for (unsigned s = 0; s < BLOCK_SECTORS; s++) {
+            uint8_t *mem = &flash.mem[block + s * SECTOR_SIZE];
+            switch (bc->kinds[s]) {
+                case NOT_WRITTEN:
+                case NEEDS_ERASE: fill_random(mem, SECTOR_SIZE); break;
+                case UNCHANGED: memcpy(mem, &data[s * SECTOR_SIZE], SECTOR_SIZE); break;
+                case PROGRAM_ONLY: memset(mem, 0xFF, SECTOR_SIZE); break;
+            }
+        }
+
+        start();
+        for (unsigned s = 0; s < BLOCK_SECTORS; s++) {
+            if (bc->kinds[s] != NOT_WRITTEN) {
+                write(block + s * SECTOR_SIZE, &data[s * SECTOR_SIZE], SECTOR_SIZE);
+            }
+        }
+        finish(bc->name, bc->erase_count, bc->programs);
+
+        struct flash_op erases[8];
+        for (unsigned i = 0; i < bc->erase_count; i++) {
+            erases[i] = (struct flash_op){block + bc->erases[i].address, bc->erases[i].size};
+        }
+        check(erases_are(erases, bc->erase_count), "%s: erase sizes", bc->name);
+    }
+}
+
+// Eviction: a new sector in a full cache writes back the block of the least
+// recently used sector, all its sectors at once
+static void test_eviction(void) {
+    memset(flash.mem, 0xFF, sizeof(flash.mem));
+    start();
+
+    // One sector in each of the 32 blocks, fills the cache
+    uint8_t value = 0;
+    for (unsigned b = 0; b < FLASH_CACHE_SECTORS; b++) {
+        write(b * BLOCK_SIZE + 0x10, &value, 1);
+    }
+    write(0x00011, &value, 1); // block 0 used last now
+    check(flash.programs == 0, "eviction: %u page programs before the cache is full", flash.programs);
+
+    static const struct {
+        unsigned address;      // new sector
+        unsigned programs;     // page programs so far
+        unsigned evicted[2];   // sectors written back
+    } steps[] = {
+        {0x01000, 1, {0x10000}},          // block 1 least recently used
+        {0x23000, 2, {0x20000}},          // then block 2
+        {0x51000, 3, {0x30000}},          // block 3, block 5 has two sectors now
+        {0xA1000, 4, {0x40000}},          // block 4
+        {0xB1000, 6, {0x50000, 0x51000}}, // block 5, both sectors
+    };
+    bool ok = true;
+    for (unsigned i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        unsigned before = log_length;
+        write(steps[i].address, &value, 1);
+        ok = ok && flash.programs == steps[i].programs && flash.erases == 0;
+        for (unsigned j = 0; ok && before + j < log_length; j++) {
+            ok = log_ops[before + j].address == steps[i].evicted[j];
+        }
+    }
+    check(ok, "eviction: order");
+
+    // The rest is written back in address order
+    unsigned before = log_length;
+    flash_cache_flush(&cache);
+    for (unsigned i = before + 1; i < log_length && i < LOG_SIZE; i++) {
+        ok = ok && log_ops[i].address > log_ops[i - 1].address;
+    }
+    check(ok && log_length - before == FLASH_CACHE_SECTORS - 5 + 4, "eviction: flush order");
+    finish("eviction", 0, FLASH_CACHE_SECTORS + 5);
+}
+
+void test_cache(void) {
+    w25q16jv_init(&flash, false);
+
+    test_unchanged();
+    test_partial_sector();
+    test_blocks();
+    test_eviction();
+}
@@ -0,0 +1,81 @@
+#include "test.h"
+#include "usb.h"
+#include "flash.h"
+
+// Image verification through the simulated programmer: an image written with
+// flash_write() verifies, and after one of its bytes is changed in the flash
+// both the CRC and the readback verification report the error.
+
+enum {
+    WRITE_ENABLE  = 0x06,
+    READ_STATUS_1 = 0x05,
+    PAGE_PROGRAM  = 0x02,
+    STATUS_1_BUSY = 0x01,
+};
+
+// Clear a bit of one byte in the flash, with SPI commands of its own
+static void corrupt(unsigned address, uint8_t value) {
+    uint8_t cmd[5] = {PAGE_PROGRAM, address >> 16, address >> 8, address, value & (value - 1)};
+
+    spi_select(1);
+    spi_transfer((uint8_t[]){WRITE_ENABLE}, NULL, 1);
+    spi_select(0);
+    spi_select(1);
+    spi_transfer(cmd, NULL, sizeof(cmd));
+    spi_select(0);
+
+    uint8_t status[2];
+    do {
+        status[0] = READ_STATUS_1;
+        spi_select(1);
+        spi_transfer(status, status, sizeof(status));
+        spi_select(0);
+    } while (status[1] & STATUS_1_BUSY);
+}
+
+void test_verify(void) {
+    const unsigned size    = 0x1A000; // one FPGA image slot
+    const unsigned address = 0x1000;
+
+    usb_init("sim");
+    struct programmer *programmer = usb_open(NULL);
+    if (programmer == NULL) {
+        check(false, "verify: sim programmer");
+        return;
+    }
+    usb_select(programmer);
+
+    spi_set_mode(SPI_MODE_FLASH);
+    const struct flash_info *flash_info = flash_detect();
+    check(flash_info != NULL, "verify: flash not detected");
+    if (flash_info == NULL) {
+        usb_close(programmer);
+        usb_deinit();
+        return;
+    }
+
+    uint8_t *image = malloc(size);
+    if (image == NULL) {
+        usb_fail();
+    }
+    for (unsigned i = 0; i < size; i++) {
+        image[i] = test_random();
+    }
+    image[0x1234] |= 0x01; // the byte corrupted below has a bit to clear
+
+    flash_write(flash_info, address, image, size);
+    flash_flush(flash_info);
+    check(flash_verify_crc(address, image, size) == 0, "verify: CRC error after writing");
+    check(flash_compare(address, image, size) == 0, "verify: readback error after writing");
+
+    corrupt(address + 0x1234, image[0x1234]);
+    check(flash_verify_crc(address, image, size) != 0, "verify: CRC of a corrupted image passes");
+    check(flash_compare(address, image, size) != 0, "verify: readback of a corrupted image passes");
+    check(flash_verify_crc(address, image, 0x1234) == 0, "verify: CRC error before the corrupted byte");
+
+    spi_set_mode(SPI_MODE_NONE);
+    check(!usb_failed(programmer), "verify: programmer failed");
+    free(image);
+    usb_close(programmer);
+    usb_deinit();
+}
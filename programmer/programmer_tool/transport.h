@@ -0,0 +1,38 @@
+#pragma once
+
+#include "lib.h"
+
+#define USB_SERIAL_SIZE (64)
+#define USB_ENDPOINT_IN (0x80)
+
+// A bulk transfer. Completion is signalled by setting completed, ok tells
+// whether all length bytes were transferred.
+struct transport_xfer {
+    uint8_t  endpoint;
+    uint8_t *buf;
+    unsigned length;
+    unsigned actual_length;
+    bool     ok;
+    int      completed;
+    void *   priv; // owned by the backend
+};
+
+struct transport;
+
+// Backend that moves the programmer's bulk transfers. Transfers are submitted
+// asynchronously and complete in order per endpoint.
+struct transport_ops {
+    const char *name;
+    bool (*init)(const char *params);
+    void (*deinit)(void);
+    unsigned (*list)(char (*serials)[USB_SERIAL_SIZE], unsigned max);
+    struct transport *(*open)(const char *serial, char *found_serial); // NULL serial opens the first device
+    void (*close)(struct transport *transport);
+    bool (*submit)(struct transport *transport, struct transport_xfer *xfer);
+    bool (*wait)(struct transport *transport, struct transport_xfer *xfer); // until xfer->completed
+    void (*cancel)(struct transport *transport, struct transport_xfer *xfer);
+    void (*xfer_free)(struct transport_xfer *xfer);
+};
+
+extern const struct transport_ops transport_usb;
+extern const struct transport_ops transport_sim;
@@ -0,0 +1,333 @@
+#include "transport.h"
+#include "sim/sim.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Simulated programmers. Every opened programmer is a child process running
+// sim_programmer_run(), the firmware keeps its state in globals. OUT packets
+// go over one socket pair, which also carries the acknowledgements that tell
+// when the programmer accepted a packet, IN packets over another. Each packet
+// carries the time it crosses the simulated link, the transfer completes when
+// that time has come.
+
+#define SIM_MAX_XFERS (64)
+
+static struct sim_config config  = SIM_DEFAULT_CONFIG;
+static unsigned          devices = 1;
+
+struct xfer_queue {
+    struct transport_xfer *xfers[SIM_MAX_XFERS];
+    unsigned               head;
+    unsigned               count;
+};
+
+struct transport {
+    pid_t             pid;
+    int               out_fd;
+    int               in_fd;
+    bool              dead;
+    uint64_t          out_link_time;
+    struct xfer_queue out;      // OUT transfers not fully acknowledged yet
+    unsigned          out_send; // index in out of the transfer being sent
+    unsigned          out_send_offset;
+    unsigned          out_ack_offset;
+    struct xfer_queue in;
+};
+
+uint64_t sim_time_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sim_sleep_until(uint64_t time) {
+    struct timespec ts = {.tv_sec = time / 1000000000, .tv_nsec = time % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static struct transport_xfer *queue_get(struct xfer_queue *q, unsigned index) {
+    return q->xfers[(q->head + index) % SIM_MAX_XFERS];
+}
+
+static void queue_pop(struct xfer_queue *q) {
+    q->head = (q->head + 1) % SIM_MAX_XFERS;
+    q->count--;
+}
+
+// sim[:<devices>[:<latency us>[:<bytes/s>]]]
+static bool sim_init(const char *params) {
+    unsigned values[] = {devices, config.latency_us, config.bandwidth};
+    for (unsigned i = 0; i < 3 && *params != '\0'; i++) {
+        char *end;
+        values[i] = strtoul(params, &end, 0);
+        if (end == params || (*end != ':' && *end != '\0')) {
+            fprintf(stderr, "invalid sim parameters '%s'\n", params);
+            return false;
+        }
+        params = *end == ':' ? end + 1 : end;
+    }
+    if (values[0] < 1 || values[2] < 1) {
+        fprintf(stderr, "invalid sim parameters\n");
+        return false;
+    }
+    devices           = values[0];
+    config.latency_us = values[1];
+    config.bandwidth  = values[2];
+    return true;
+}
+
+static void sim_deinit(void) {
+}
+
+static unsigned sim_list(char (*serials)[USB_SERIAL_SIZE], unsigned max) {
+    unsigned count = devices < max ? devices : max;
+    for (unsigned i = 0; i < count; i++) {
+        snprintf(serials[i], USB_SERIAL_SIZE, "sim%u", i);
+    }
+    return count;
+}
+
+static struct transport *sim_open(const char *serial, char *found_serial) {
+    unsigned index = 0;
+    if (serial != NULL && (sscanf(serial, "sim%u", &index) != 1 || index >= devices)) {
+        return NULL;
+    }
+    snprintf(found_serial, USB_SERIAL_SIZE, "sim%u", index);
+
+    int out_fds[2], in_fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, out_fds) != 0) {
+        perror("socketpair");
+        return NULL;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, in_fds) != 0) {
+        perror("socketpair");
+        close(out_fds[0]);
+        close(out_fds[1]);
+        return NULL;
+    }
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(out_fds[0]);
+        close(out_fds[1]);
+        close(in_fds[0]);
+        close(in_fds[1]);
+        return NULL;
+    }
+    if (pid == 0) {
+        // Drop the sockets of other simulated programmers, or they wouldn't
+        // see their sockets close
+        long max_fd = sysconf(_SC_OPEN_MAX);
+        for (int fd = 3; fd < max_fd && fd < 65536; fd++) {
+            if (fd != out_fds[1] && fd != in_fds[1]) {
+                close(fd);
+            }
+        }
+        sim_programmer_run(out_fds[1], in_fds[1], &config);
+        _exit(EXIT_SUCCESS);
+    }
+    close(out_fds[1]);
+    close(in_fds[1]);
+
+    struct transport *t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    t->pid    = pid;
+    t->out_fd = out_fds[0];
+    t->in_fd  = in_fds[0];
+    return t;
+}
+
+static void fail_all(struct transport *t) {
+    while (t->out.count > 0) {
+        queue_get(&t->out, 0)->completed = 1;
+        queue_pop(&t->out);
+    }
+    while (t->in.count > 0) {
+        queue_get(&t->in, 0)->completed = 1;
+        queue_pop(&t->in);
+    }
+    t->out_send = 0;
+}
+
+static void sim_kill(struct transport *t) {
+    if (!t->dead) {
+        kill(t->pid, SIGKILL);
+        t->dead = true;
+    }
+    fail_all(t);
+}
+
+static void sim_close(struct transport *t) {
+    close(t->out_fd);
+    close(t->in_fd);
+    waitpid(t->pid, NULL, 0);
+    free(t);
+}
+
+// Send queued OUT packets until the socket is full.
+static bool send_out(struct transport *t) {
+    while (t->out_send < t->out.count) {
+        struct transport_xfer *xfer = queue_get(&t->out, t->out_send);
+        unsigned               size = xfer->length - t->out_send_offset;
+        if (size > SIM_PACKET_SIZE) {
+            size = SIM_PACKET_SIZE;
+        }
+
+        uint64_t          now   = sim_time_now();
+        uint64_t          start = t->out_link_time > now ? t->out_link_time : now;
+        struct sim_packet packet;
+        packet.time   = start + (uint64_t)size * 1000000000 / config.bandwidth + config.latency_us * 1000ULL;
+        packet.length = size;
+        memcpy(packet.data, xfer->buf + t->out_send_offset, size);
+
+        if (send(t->out_fd, &packet, SIM_PACKET_HEADER_SIZE + size, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            perror("sim: send");
+            return false;
+        }
+        t->out_link_time = start + (uint64_t)size * 1000000000 / config.bandwidth;
+
+        t->out_send_offset += size;
+        if (t->out_send_offset >= xfer->length) {
+            t->out_send++;
+            t->out_send_offset = 0;
+        }
+    }
+    return true;
+}
+
+static bool receive_ack(struct transport *t) {
+    struct sim_packet packet;
+    if (recv(t->out_fd, &packet, sizeof(packet), MSG_DONTWAIT) < (ssize_t)SIM_PACKET_HEADER_SIZE || t->out.count == 0) {
+        return false;
+    }
+    sim_sleep_until(packet.time);
+
+    struct transport_xfer *xfer = queue_get(&t->out, 0);
+    unsigned               size = xfer->length - t->out_ack_offset;
+    if (size > SIM_PACKET_SIZE) {
+        size = SIM_PACKET_SIZE;
+    }
+    t->out_ack_offset += size;
+    if (t->out_ack_offset >= xfer->length) {
+        xfer->actual_length = xfer->length;
+        xfer->ok            = true;
+        xfer->completed     = 1;
+        queue_pop(&t->out);
+        t->out_send--;
+        t->out_ack_offset = 0;
+    }
+    return true;
+}
+
+static bool receive_in(struct transport *t) {
+    struct sim_packet packet;
+    ssize_t           size = recv(t->in_fd, &packet, sizeof(packet), MSG_DONTWAIT);
+    if (size < (ssize_t)SIM_PACKET_HEADER_SIZE || t->in.count == 0) {
+        return false;
+    }
+    sim_sleep_until(packet.time);
+
+    struct transport_xfer *xfer = queue_get(&t->in, 0);
+    if (packet.length > xfer->length - xfer->actual_length) {
+        fprintf(stderr, "sim: IN packet overflows transfer\n");
+        xfer->completed = 1;
+        queue_pop(&t->in);
+        return true;
+    }
+    memcpy(xfer->buf + xfer->actual_length, packet.data, packet.length);
+    xfer->actual_length += packet.length;
+
+    // A short packet ends the transfer
+    if (xfer->actual_length == xfer->length || packet.length < SIM_PACKET_SIZE) {
+        xfer->ok        = xfer->actual_length == xfer->length;
+        xfer->completed = 1;
+        queue_pop(&t->in);
+    }
+    return true;
+}
+
+static bool sim_submit(struct transport *t, struct transport_xfer *xfer) {
+    if (t->dead) {
+        return false;
+    }
+    struct xfer_queue *q = (xfer->endpoint & USB_ENDPOINT_IN) ? &t->in : &t->out;
+    if (q->count >= SIM_MAX_XFERS) {
+        fprintf(stderr, "sim: too many transfers\n");
+        return false;
+    }
+    q->xfers[(q->head + q->count++) % SIM_MAX_XFERS] = xfer;
+    return send_out(t);
+}
+
+static bool sim_wait(struct transport *t, struct transport_xfer *xfer) {
+    while (!xfer->completed) {
+        if (t->dead || !send_out(t)) {
+            sim_kill(t);
+            return false;
+        }
+
+        struct pollfd fds[2] = {
+            {.fd = t->out_fd, .events = POLLIN | (t->out_send < t->out.count ? POLLOUT : 0)},
+            {.fd = t->in_fd, .events = t->in.count > 0 ? POLLIN : 0},
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("sim: poll");
+            sim_kill(t);
+            return false;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            receive_ack(t);
+        }
+        if (fds[1].revents & POLLIN) {
+            receive_in(t);
+        }
+        short events = fds[0].revents | fds[1].revents;
+        if ((events & (POLLHUP | POLLERR)) && !(events & POLLIN)) {
+            fprintf(stderr, "sim: programmer process ended\n");
+            sim_kill(t);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void sim_cancel(struct transport *t, struct transport_xfer *xfer) {
+    if (!xfer->completed) {
+        sim_kill(t);
+    }
+}
+
+static void sim_xfer_free(struct transport_xfer *xfer) {
+    (void)xfer;
+}
+
+const struct transport_ops transport_sim = {
+    .name      = "sim",
+    .init      = sim_init,
+    .deinit    = sim_deinit,
+    .list      = sim_list,
+    .open      = sim_open,
+    .close     = sim_close,
+    .submit    = sim_submit,
+    .wait      = sim_wait,
+    .cancel    = sim_cancel,
+    .xfer_free = sim_xfer_free,
+};
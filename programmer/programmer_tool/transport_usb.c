@@ -0,0 +1,202 @@
+#include "transport.h"
+#include <libusb.h>
+
+#define USB_VID (0xc0de)
+#define USB_PID (0xbabe)
+#define USB_INTERFACE (2)
+
+static libusb_context *ctx = NULL;
+
+struct transport {
+    libusb_device_handle *handle;
+};
+
+static void LIBUSB_CALL usb_xfer_callback(struct libusb_transfer *transfer) {
+    struct transport_xfer *xfer = (struct transport_xfer *)transfer->user_data;
+    xfer->actual_length         = transfer->actual_length;
+    xfer->ok                    = transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length == transfer->length;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        fprintf(stderr, "usb transfer (ep 0x%02x): status %d\n", transfer->endpoint, transfer->status);
+    }
+    xfer->completed = 1;
+}
+
+static bool usb_transport_init(const char *params) {
+    (void)params;
+    int result = libusb_init(&ctx);
+    if (result != 0) {
+        fprintf(stderr, "error initializing libusb\n");
+        return false;
+    }
+    return true;
+}
+
+static void usb_transport_deinit(void) {
+    libusb_exit(ctx);
+    ctx = NULL;
+}
+
+static void get_serial(libusb_device_handle *device_handle, const struct libusb_device_descriptor *desc, char *serial) {
+    serial[0] = '\0';
+    if (desc->iSerialNumber != 0 && libusb_get_string_descriptor_ascii(device_handle, desc->iSerialNumber, (unsigned char *)serial, USB_SERIAL_SIZE) < 0) {
+        serial[0] = '\0';
+    }
+}
+
+// Walk the attached programmers. The callback gets an opened handle and
+// returns true to keep it, which ends the walk.
+static unsigned usb_enumerate(bool (*fn)(libusb_device_handle *device_handle, const char *serial, void *arg), void *arg) {
+    libusb_device **list;
+    ssize_t         count = libusb_get_device_list(ctx, &list);
+    if (count < 0) {
+        fprintf(stderr, "usb_enumerate - libusb_get_device_list: %s\n", libusb_error_name((int)count));
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned found = 0;
+    for (ssize_t i = 0; i < count; i++) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) != 0 || desc.idVendor != USB_VID || desc.idProduct != USB_PID) {
+            continue;
+        }
+
+        libusb_device_handle *device_handle;
+        if (libusb_open(list[i], &device_handle) != 0) {
+            continue;
+        }
+
+        char serial[USB_SERIAL_SIZE];
+        get_serial(device_handle, &desc, serial);
+        found++;
+        if (fn(device_handle, serial, arg)) {
+            break;
+        }
+        libusb_close(device_handle);
+    }
+    libusb_free_device_list(list, 1);
+    return found;
+}
+
+struct usb_list_arg {
+    char (*serials)[USB_SERIAL_SIZE];
+    unsigned max;
+    unsigned count;
+};
+
+static bool usb_list_fn(libusb_device_handle *device_handle, const char *serial, void *arg) {
+    (void)device_handle;
+    struct usb_list_arg *list = (struct usb_list_arg *)arg;
+    if (list->count < list->max) {
+        strcpy(list->serials[list->count++], serial);
+    }
+    return false;
+}
+
+static unsigned usb_transport_list(char (*serials)[USB_SERIAL_SIZE], unsigned max) {
+    struct usb_list_arg list = {.serials = serials, .max = max, .count = 0};
+    usb_enumerate(usb_list_fn, &list);
+    return list.count;
+}
+
+struct usb_open_arg {
+    const char *          serial;
+    libusb_device_handle *handle;
+    char *                found_serial;
+};
+
+static bool usb_open_fn(libusb_device_handle *device_handle, const char *serial, void *arg) {
+    struct usb_open_arg *open = (struct usb_open_arg *)arg;
+    if (open->serial != NULL && strcmp(open->serial, serial) != 0) {
+        return false;
+    }
+    open->handle = device_handle;
+    strcpy(open->found_serial, serial);
+    return true;
+}
+
+static struct transport *usb_transport_open(const char *serial, char *found_serial) {
+    struct usb_open_arg open = {.serial = serial, .handle = NULL, .found_serial = found_serial};
+    usb_enumerate(usb_open_fn, &open);
+    if (open.handle == NULL) {
+        return NULL;
+    }
+
+    if (libusb_claim_interface(open.handle, USB_INTERFACE) != 0) {
+        fprintf(stderr, "%s: error claiming usb interface!\n", found_serial);
+        libusb_close(open.handle);
+        return NULL;
+    }
+
+    struct transport *t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    t->handle = open.handle;
+    return t;
+}
+
+static void usb_transport_close(struct transport *t) {
+    libusb_release_interface(t->handle, USB_INTERFACE);
+    libusb_close(t->handle);
+    free(t);
+}
+
+static bool usb_transport_submit(struct transport *t, struct transport_xfer *xfer) {
+    struct libusb_transfer *transfer = (struct libusb_transfer *)xfer->priv;
+    if (transfer == NULL) {
+        transfer = libusb_alloc_transfer(0);
+        if (transfer == NULL) {
+            fprintf(stderr, "error allocating usb transfer\n");
+            return false;
+        }
+        xfer->priv = transfer;
+    }
+
+    libusb_fill_bulk_transfer(transfer, t->handle, xfer->endpoint, xfer->buf, xfer->length, usb_xfer_callback, xfer, 0);
+    int result = libusb_submit_transfer(transfer);
+    if (result != 0) {
+        fprintf(stderr, "usb_submit - libusb_submit_transfer: %s\n", libusb_error_name(result));
+        return false;
+    }
+    return true;
+}
+
+// Several threads may wait on the same context, libusb lets one of them
+// handle the events for all.
+static bool usb_transport_wait(struct transport *t, struct transport_xfer *xfer) {
+    (void)t;
+    while (!xfer->completed) {
+        int result = libusb_handle_events_completed(ctx, &xfer->completed);
+        if (result != 0) {
+            fprintf(stderr, "usb_wait - libusb_handle_events_completed: %s\n", libusb_error_name(result));
+            return false;
+        }
+    }
+    return true;
+}
+
+static void usb_transport_cancel(struct transport *t, struct transport_xfer *xfer) {
+    if (!xfer->completed) {
+        libusb_cancel_transfer((struct libusb_transfer *)xfer->priv);
+        usb_transport_wait(t, xfer);
+    }
+}
+
+static void usb_transport_xfer_free(struct transport_xfer *xfer) {
+    libusb_free_transfer((struct libusb_transfer *)xfer->priv);
+    xfer->priv = NULL;
+}
+
+const struct transport_ops transport_usb = {
+    .name      = "usb",
+    .init      = usb_transport_init,
+    .deinit    = usb_transport_deinit,
+    .list      = usb_transport_list,
+    .open      = usb_transport_open,
+    .close     = usb_transport_close,
+    .submit    = usb_transport_submit,
+    .wait      = usb_transport_wait,
+    .cancel    = usb_transport_cancel,
+    .xfer_free = usb_transport_xfer_free,
+};
@@ -1,30 +1,254 @@
 #include "usb.h"
-#include <libusb.h>
+#include "transport.h"
+#include <pthread.h>
 
 #define CMD_EPIN_ADDR (0x83)
 #define CMD_EPOUT_ADDR (0x04)
 
-static libusb_context *      ctx    = NULL;
-static libusb_device_handle *handle = NULL;
+#define USB_MAX_QUEUE_DEPTH (64)
+#define USB_PACKET_SIZE (64)
+#define USB_STREAM_CHUNK (4096) // multiple of USB_PACKET_SIZE
 
-void usb_init(void) {
-    int result;
-    result = libusb_init(&ctx);
-    if (result != 0) {
-        fprintf(stderr, "error initializing libusb\n");
-        exit(EXIT_FAILURE);
+// CMD_SPI_STREAM flags
+enum {
+    STREAM_TX     = (1 << 0),
+    STREAM_RX     = (1 << 1),
+    STREAM_SELECT = (1 << 2),
+};
+
+// CMD_FLASH_* result
+enum {
+    FLASH_OK          = 0,
+    FLASH_ERR_VERIFY  = 1,
+    FLASH_ERR_TIMEOUT = 2,
+};
+#define FLASH_RESULT_SIZE (5) // <status:u8> <value:u32>
+
+static const struct transport_ops *ops = &transport_usb;
+static pthread_t                   main_thread;
+
+// Transfers are submitted asynchronously and retired in submission order.
+// Bulk transfers on an endpoint complete in order, so retiring the oldest
+// transfer first keeps OUT/IN pairs matched up.
+struct usb_xfer {
+    struct transport_xfer xfer;
+    bool                  flash_result; // buf holds a CMD_FLASH_* result to check
+    uint8_t               buf[USB_PACKET_SIZE];
+};
+
+struct programmer {
+    struct transport *transport;
+    char              serial[USB_SERIAL_SIZE];
+    struct usb_xfer   xfers[USB_MAX_QUEUE_DEPTH];
+    unsigned          xfer_head;  // next slot to submit
+    unsigned          xfer_count; // number of transfers in flight
+    unsigned          queue_depth;
+    bool              failed;
+    struct usb_stats  stats;
+};
+
+// Programmer used by the calling thread, see usb_select().
+static _Thread_local struct programmer *dev = NULL;
+
+// Give up on the current programmer. Worker threads only end themselves, so
+// the other programmers carry on; the main thread exits the tool.
+void usb_fail(void) {
+    if (dev != NULL && !pthread_equal(pthread_self(), main_thread)) {
+        dev->failed = true;
+        pthread_exit(NULL);
+    }
+    exit(EXIT_FAILURE);
+}
+
+// Check the result of a CMD_FLASH_* command, returns its value.
+static uint32_t flash_check_result(const uint8_t *result) {
+    uint32_t value = result[1] | (result[2] << 8) | (result[3] << 16) | ((uint32_t)result[4] << 24);
+    switch (result[0]) {
+        case FLASH_OK: break;
+        case FLASH_ERR_VERIFY: fprintf(stderr, "%s: flash verify failed at address 0x%06x\n", dev->serial, value); usb_fail(); break;
+        case FLASH_ERR_TIMEOUT: fprintf(stderr, "%s: flash timeout at address 0x%06x\n", dev->serial, value); usb_fail(); break;
+        default: fprintf(stderr, "%s: flash operation failed: status %u\n", dev->serial, result[0]); usb_fail(); break;
+    }
+    return value;
+}
+
+static void usb_retire_oldest(void) {
+    struct usb_xfer *      uxfer = &dev->xfers[(dev->xfer_head + USB_MAX_QUEUE_DEPTH - dev->xfer_count) % USB_MAX_QUEUE_DEPTH];
+    struct transport_xfer *xfer  = &uxfer->xfer;
+
+    if (!ops->wait(dev->transport, xfer)) {
+        usb_fail();
+    }
+    dev->xfer_count--;
+
+    if (!xfer->ok) {
+        fprintf(stderr, "%s: usb transfer (ep 0x%02x) failed: transferred != %u (%u)\n",
+                dev->serial, xfer->endpoint, xfer->length, xfer->actual_length);
+        usb_fail();
+    }
+
+    if (xfer->endpoint & USB_ENDPOINT_IN) {
+        dev->stats.bytes_in += xfer->actual_length;
+    } else {
+        dev->stats.bytes_out += xfer->actual_length;
+    }
+
+    if (uxfer->flash_result) {
+        flash_check_result(uxfer->buf);
+    }
+}
+
+// Get a free transfer slot, retiring the oldest transfer if the queue is full.
+static struct usb_xfer *usb_get_xfer(void) {
+    while (dev->xfer_count >= dev->queue_depth) {
+        usb_retire_oldest();
+    }
+    return &dev->xfers[dev->xfer_head];
+}
+
+static void usb_submit(struct usb_xfer *uxfer, unsigned char endpoint, void *buf, int length) {
+    struct transport_xfer *xfer = &uxfer->xfer;
+    xfer->endpoint              = endpoint;
+    xfer->buf                   = buf;
+    xfer->length                = length;
+    xfer->actual_length         = 0;
+    xfer->ok                    = false;
+    xfer->completed             = 0;
+    uxfer->flash_result         = false;
+
+    if (!ops->submit(dev->transport, xfer)) {
+        fprintf(stderr, "%s: usb_submit failed\n", dev->serial);
+        usb_fail();
+    }
+    dev->xfer_head = (dev->xfer_head + 1) % USB_MAX_QUEUE_DEPTH;
+    dev->xfer_count++;
+}
+
+// Queue a command packet. The data is copied, so the caller may reuse its buffer.
+static void usb_send_cmd(const void *buf, unsigned length) {
+    struct usb_xfer *xfer = usb_get_xfer();
+    memcpy(xfer->buf, buf, length);
+    usb_submit(xfer, CMD_EPOUT_ADDR, xfer->buf, length);
+}
+
+// Queue a reply read. The buffer must remain valid until usb_flush() returns.
+static void usb_recv(void *buf, unsigned length) {
+    usb_submit(usb_get_xfer(), CMD_EPIN_ADDR, buf, length);
+}
+
+void usb_flush(void) {
+    while (dev->xfer_count > 0) {
+        usb_retire_oldest();
     }
+}
 
-    handle = libusb_open_device_with_vid_pid(ctx, 0xc0de, 0xbabe);
-    if (handle == NULL) {
-        fprintf(stderr, "error opening device\n");
+void usb_set_queue_depth(unsigned depth) {
+    usb_flush();
+    if (depth < 1) {
+        depth = 1;
+    }
+    if (depth > USB_MAX_QUEUE_DEPTH) {
+        depth = USB_MAX_QUEUE_DEPTH;
+    }
+    dev->queue_depth = depth;
+}
+
+// transport is "usb" or the name of another backend, optionally followed by
+// ':' and backend parameters.
+void usb_init(const char *transport) {
+    static const struct transport_ops *const backends[] = {&transport_usb, &transport_sim};
+
+    const char *params = strchr(transport, ':');
+    size_t      length = params != NULL ? (size_t)(params - transport) : strlen(transport);
+
+    ops = NULL;
+    for (unsigned i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strlen(backends[i]->name) == length && strncmp(backends[i]->name, transport, length) == 0) {
+            ops = backends[i];
+        }
+    }
+    if (ops == NULL) {
+        fprintf(stderr, "unknown transport '%s'\n", transport);
+        exit(EXIT_FAILURE);
+    }
+    if (!ops->init(params != NULL ? params + 1 : "")) {
         exit(EXIT_FAILURE);
     }
+    main_thread = pthread_self();
+}
+
+void usb_deinit(void) {
+    ops->deinit();
+}
+
+unsigned usb_list(char (*serials)[USB_SERIAL_SIZE], unsigned max) {
+    return ops->list(serials, max);
+}
 
-    if (libusb_claim_interface(handle, 2) != 0) {
-        fprintf(stderr, "error claiming usb interface!\n");
+struct programmer *usb_open(const char *serial) {
+    char              found_serial[USB_SERIAL_SIZE];
+    struct transport *transport = ops->open(serial, found_serial);
+    if (transport == NULL) {
+        if (serial != NULL) {
+            fprintf(stderr, "error opening device %s\n", serial);
+        } else {
+            fprintf(stderr, "error opening device\n");
+        }
+        return NULL;
+    }
+
+    struct programmer *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
         exit(EXIT_FAILURE);
     }
+    p->transport   = transport;
+    p->queue_depth = 16;
+    strcpy(p->serial, found_serial);
+    return p;
+}
+
+void usb_close(struct programmer *p) {
+    if (p->failed) {
+        // Transfers of a failed programmer may still be in flight
+        for (unsigned i = 0; i < p->xfer_count; i++) {
+            ops->cancel(p->transport, &p->xfers[(p->xfer_head + USB_MAX_QUEUE_DEPTH - p->xfer_count + i) % USB_MAX_QUEUE_DEPTH].xfer);
+        }
+        p->xfer_count = 0;
+    } else {
+        struct programmer *prev = dev;
+        dev                     = p;
+        usb_flush();
+        dev = prev;
+    }
+    if (dev == p) {
+        dev = NULL;
+    }
+
+    for (unsigned i = 0; i < USB_MAX_QUEUE_DEPTH; i++) {
+        if (p->xfers[i].xfer.priv != NULL) {
+            ops->xfer_free(&p->xfers[i].xfer);
+        }
+    }
+
+    ops->close(p->transport);
+    free(p);
+}
+
+void usb_select(struct programmer *p) {
+    dev = p;
+}
+
+const char *usb_serial(const struct programmer *p) {
+    return p->serial;
+}
+
+bool usb_failed(const struct programmer *p) {
+    return p->failed;
+}
+
+struct usb_stats usb_get_stats(const struct programmer *p) {
+    return p->stats;
 }
 
 void spi_set_mode(enum spi_mode mode) {
@@ -36,26 +260,25 @@ void spi_set_mode(enum spi_mode mode) {
         case SPI_MODE_FPGA: cmd = CMD_SPI_MODE_FPGA; break;
         case SPI_MODE_FLASH: cmd = CMD_SPI_MODE_FLASH; break;
     }
-    int transferred = 0;
-    libusb_bulk_transfer(handle, CMD_EPOUT_ADDR, &cmd, 1, &transferred, 0);
-    if (transferred != 1) {
-        fprintf(stderr, "spi_select - transferred != 1 (%d)\n", transferred);
-        exit(EXIT_FAILURE);
-    }
+    usb_send_cmd(&cmd, 1);
+}
+
+void spi_set_timing(const struct spi_timing *timing) {
+    uint8_t cmd[] = {
+        CMD_SPI_SET_TIMING,
+        (uint8_t)timing->prescaler,
+        (uint8_t)(timing->cs_setup_ns >> 0), (uint8_t)(timing->cs_setup_ns >> 8),
+        (uint8_t)(timing->cs_hold_ns >> 0), (uint8_t)(timing->cs_hold_ns >> 8)};
+    usb_send_cmd(cmd, sizeof(cmd));
 }
 
 void spi_select(bool on) {
-    uint8_t cmd         = on ? CMD_SPI_CHIP_SELECT : CMD_SPI_CHIP_DESELECT;
-    int     transferred = 0;
-    libusb_bulk_transfer(handle, CMD_EPOUT_ADDR, &cmd, 1, &transferred, 0);
-    if (transferred != 1) {
-        fprintf(stderr, "spi_select - transferred != 1 (%d)\n", transferred);
-        exit(EXIT_FAILURE);
-    }
+    uint8_t cmd = on ? CMD_SPI_CHIP_SELECT : CMD_SPI_CHIP_DESELECT;
+    usb_send_cmd(&cmd, 1);
 }
 
 void spi_transfer(const void *tx_buf, void *rx_buf, size_t length) {
-    uint8_t  cmd[64];
+    uint8_t  cmd[USB_PACKET_SIZE];
     unsigned cmdlen = 0;
 
     unsigned       remaining = length;
@@ -78,11 +301,11 @@ void spi_transfer(const void *tx_buf, void *rx_buf, size_t length) {
         }
 
         if (tx_buf8) {
-            if (xfer_size > 62)
-                xfer_size = 62;
+            if (xfer_size > USB_PACKET_SIZE - 2)
+                xfer_size = USB_PACKET_SIZE - 2;
         } else {
-            if (xfer_size > 64)
-                xfer_size = 64;
+            if (xfer_size > USB_PACKET_SIZE)
+                xfer_size = USB_PACKET_SIZE;
         }
         cmd[cmdlen++] = xfer_size;
 
@@ -92,39 +315,165 @@ void spi_transfer(const void *tx_buf, void *rx_buf, size_t length) {
             cmdlen += xfer_size;
         }
 
-        int transferred = 0;
-        libusb_bulk_transfer(handle, CMD_EPOUT_ADDR, cmd, cmdlen, &transferred, 0);
-        if (transferred != (int)cmdlen) {
-            fprintf(stderr, "spi_transfer - tx transferred != %d (%d)\n", cmdlen, transferred);
-            exit(EXIT_FAILURE);
-        }
+        usb_send_cmd(cmd, cmdlen);
 
         if (rx_buf8) {
-            libusb_bulk_transfer(handle, CMD_EPIN_ADDR, rx_buf8, xfer_size, &transferred, 0);
-            if (transferred != (int)xfer_size) {
-                fprintf(stderr, "spi_transfer - rx transferred != %d (%d)\n", xfer_size, transferred);
-                exit(EXIT_FAILURE);
-            }
+            usb_recv(rx_buf8, xfer_size);
             rx_buf8 += xfer_size;
         }
 
         remaining -= xfer_size;
     }
+
+    // Received data must be valid on return, transmit-only transfers may stay in flight.
+    if (rx_buf) {
+        usb_flush();
+    }
 }
 
-bool get_cdone(void) {
-    int     transferred = 0;
-    uint8_t cmd         = CMD_GET_CDONE;
-    libusb_bulk_transfer(handle, CMD_EPOUT_ADDR, &cmd, 1, &transferred, 0);
+void spi_stream(bool select, const void *prefix, unsigned prefix_length, const void *tx_buf, void *rx_buf, size_t length) {
+    uint8_t  cmd[USB_PACKET_SIZE];
+    unsigned cmdlen = 0;
+
+    if (prefix_length > USB_PACKET_SIZE - 7 || length > UINT32_MAX) {
+        fprintf(stderr, "spi_stream - invalid length\n");
+        usb_fail();
+    }
+
+    cmd[cmdlen++] = CMD_SPI_STREAM;
+    cmd[cmdlen++] = (tx_buf ? STREAM_TX : 0) | (rx_buf ? STREAM_RX : 0) | (select ? STREAM_SELECT : 0);
+    cmd[cmdlen++] = (uint8_t)(length >> 0);
+    cmd[cmdlen++] = (uint8_t)(length >> 8);
+    cmd[cmdlen++] = (uint8_t)(length >> 16);
+    cmd[cmdlen++] = (uint8_t)(length >> 24);
+    cmd[cmdlen++] = prefix_length;
+    if (prefix_length > 0) {
+        memcpy(&cmd[cmdlen], prefix, prefix_length);
+        cmdlen += prefix_length;
+    }
+    usb_send_cmd(cmd, cmdlen);
+
+    // The device only accepts the next OUT packet once the reply to the
+    // previous one has been read. With a single transfer in flight, a large
+    // OUT transfer could then never complete, so fall back to packet size.
+    unsigned chunk = (tx_buf && rx_buf && dev->queue_depth < 2) ? USB_PACKET_SIZE : USB_STREAM_CHUNK;
+
+    const uint8_t *tx_buf8 = (const uint8_t *)tx_buf;
+    uint8_t *      rx_buf8 = (uint8_t *)rx_buf;
+    size_t         offset  = 0;
+    while (offset < length) {
+        unsigned xfer_size = length - offset < chunk ? length - offset : chunk;
+        if (tx_buf8) {
+            usb_submit(usb_get_xfer(), CMD_EPOUT_ADDR, (void *)(tx_buf8 + offset), xfer_size);
+        }
+        if (rx_buf8) {
+            usb_recv(rx_buf8 + offset, xfer_size);
+        }
+        offset += xfer_size;
+    }
+
+    // Transmit data is sent straight from the caller's buffer
+    if (tx_buf || rx_buf) {
+        usb_flush();
+    }
+}
+
+static void flash_cmd(uint8_t cmd, unsigned address, unsigned length) {
+    uint8_t buf[] = {
+        cmd,
+        (uint8_t)(address >> 0), (uint8_t)(address >> 8), (uint8_t)(address >> 16), (uint8_t)(address >> 24),
+        (uint8_t)(length >> 0), (uint8_t)(length >> 8), (uint8_t)(length >> 16), (uint8_t)(length >> 24)};
+    usb_send_cmd(buf, sizeof(buf));
+}
+
+// Queue reading the result of a CMD_FLASH_* command, it is checked when retired.
+static void flash_queue_result(void) {
+    struct usb_xfer *xfer = usb_get_xfer();
+    usb_submit(xfer, CMD_EPIN_ADDR, xfer->buf, FLASH_RESULT_SIZE);
+    xfer->flash_result = true;
+}
+
+void spi_flash_erase(unsigned address, unsigned length) {
+    flash_cmd(CMD_FLASH_ERASE, address, length);
+    flash_queue_result();
+}
+
+void spi_flash_program(unsigned address, const void *data, unsigned length) {
+    flash_cmd(CMD_FLASH_PROGRAM, address, length);
+
+    // Data is copied per packet, so the caller may reuse its buffer right away.
+    const uint8_t *data8 = (const uint8_t *)data;
+    for (unsigned offset = 0; offset < length; offset += USB_PACKET_SIZE) {
+        usb_send_cmd(data8 + offset, length - offset < USB_PACKET_SIZE ? length - offset : USB_PACKET_SIZE);
+    }
+    flash_queue_result();
+}
+
+uint32_t spi_flash_crc(unsigned address, unsigned length) {
+    uint8_t result[FLASH_RESULT_SIZE];
+    flash_cmd(CMD_FLASH_CRC, address, length);
+    usb_recv(result, sizeof(result));
+    usb_flush();
+    return flash_check_result(result);
+}
+
+// CRC of count consecutive blocks, the requests are pipelined.
+void spi_flash_crc_blocks(unsigned address, unsigned block_size, unsigned count, uint32_t *crcs) {
+    uint8_t results[USB_MAX_QUEUE_DEPTH][FLASH_RESULT_SIZE];
 
+    while (count > 0) {
+        unsigned batch = count < USB_MAX_QUEUE_DEPTH ? count : USB_MAX_QUEUE_DEPTH;
+        for (unsigned i = 0; i < batch; i++) {
+            flash_cmd(CMD_FLASH_CRC, address + i * block_size, block_size);
+            usb_recv(results[i], FLASH_RESULT_SIZE);
+        }
+        usb_flush();
+
+        for (unsigned i = 0; i < batch; i++) {
+            *(crcs++) = flash_check_result(results[i]);
+        }
+        address += batch * block_size;
+        count -= batch;
+    }
+}
+
+bool get_cdone(void) {
+    uint8_t cmd    = CMD_GET_CDONE;
     uint8_t result = 0;
-    libusb_bulk_transfer(handle, CMD_EPIN_ADDR, &result, 1, &transferred, 0);
+    usb_send_cmd(&cmd, 1);
+    usb_recv(&result, 1);
+    usb_flush();
 
     return result != 0;
 }
 
+void get_firmware_stats(struct firmware_stats *stats, bool clear) {
+    uint8_t cmd[2] = {CMD_GET_STATS, clear};
+    uint8_t result[11 * 4];
+    usb_send_cmd(cmd, sizeof(cmd));
+    usb_recv(result, sizeof(result));
+    usb_flush();
+
+    uint32_t values[11];
+    for (unsigned i = 0; i < 11; i++) {
+        const uint8_t *p = &result[i * 4];
+        values[i]        = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+    stats->uptime_ms             = values[0];
+    stats->spi_flash_bytes       = values[1];
+    stats->spi_fpga_bytes        = values[2];
+    stats->dma_busy_us           = values[3];
+    stats->usb_packets_out       = values[4];
+    stats->usb_packets_in        = values[5];
+    stats->cdc_bytes_forwarded   = values[6];
+    stats->cdc_bytes_dropped     = values[7];
+    stats->task_latency_max_us   = values[8];
+    stats->timer_lateness_max_us = values[9];
+    stats->fpga_underruns        = values[10];
+}
+
 void start_mass_erase(void) {
-    int     transferred = 0;
-    uint8_t cmd         = CMD_MASS_ERASE;
-    libusb_bulk_transfer(handle, CMD_EPOUT_ADDR, &cmd, 1, &transferred, 0);
+    uint8_t cmd = CMD_MASS_ERASE;
+    usb_send_cmd(&cmd, 1);
+    usb_flush();
 }
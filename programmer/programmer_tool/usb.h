@@ -1,14 +1,17 @@
 #pragma once
 
 #include "lib.h"
+#include "transport.h"
 
 enum {
     CMD_SPI_MODE_NONE      = 0x20,
     CMD_SPI_MODE_FPGA_BOOT = 0x21,
     CMD_SPI_MODE_FPGA      = 0x22,
     CMD_SPI_MODE_FLASH     = 0x23,
+    CMD_SPI_SET_TIMING     = 0x24,
 
     CMD_GET_CDONE = 0x28,
+    CMD_GET_STATS = 0x29,
 
     CMD_SPI_SHIFT_TX    = 0x30,
     CMD_SPI_SHIFT_RX    = 0x31,
@@ -17,11 +20,39 @@ enum {
     CMD_SPI_CHIP_SELECT   = 0x33,
     CMD_SPI_CHIP_DESELECT = 0x34,
 
+    CMD_SPI_STREAM = 0x35,
+
     CMD_MASS_STORAGE_MODE = 0x40,
-    CMD_MASS_ERASE        = 0xFF,
+
+    CMD_FLASH_ERASE   = 0x50,
+    CMD_FLASH_PROGRAM = 0x51,
+    CMD_FLASH_CRC     = 0x52,
+
+    CMD_MASS_ERASE = 0xFF,
 };
 
-void usb_init(void);
+struct usb_stats {
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+};
+
+// An opened programmer. The functions below operate on the programmer
+// selected for the calling thread, so each thread can drive its own device.
+struct programmer;
+
+void               usb_init(const char *transport);
+void               usb_deinit(void);
+unsigned           usb_list(char (*serials)[USB_SERIAL_SIZE], unsigned max);
+struct programmer *usb_open(const char *serial); // NULL opens the first programmer found
+void               usb_close(struct programmer *programmer);
+void               usb_select(struct programmer *programmer);
+const char *       usb_serial(const struct programmer *programmer);
+bool               usb_failed(const struct programmer *programmer);
+struct usb_stats   usb_get_stats(const struct programmer *programmer);
+void               usb_fail(void);
+
+void usb_flush(void);
+void usb_set_queue_depth(unsigned depth);
 
 enum spi_mode {
     SPI_MODE_NONE,
@@ -30,10 +61,44 @@ enum spi_mode {
     SPI_MODE_FLASH,
 };
 
+// SPI clock and chip select timing of flash mode: SCK is the fastest clock
+// divided by 2^prescaler (0..7), the delays are in ns (at most 65535).
+struct spi_timing {
+    unsigned prescaler;
+    unsigned cs_setup_ns; // from chip select to the first clock edge
+    unsigned cs_hold_ns;  // from the last clock edge to chip deselect
+};
+
 void spi_set_mode(enum spi_mode mode);
+void spi_set_timing(const struct spi_timing *timing);
 void spi_select(bool on);
 void spi_transfer(const void *tx_buf, void *rx_buf, size_t length);
+void spi_stream(bool select, const void *prefix, unsigned prefix_length, const void *tx_buf, void *rx_buf, size_t length);
+
+// Flash operations executed by the programmer. Erase and program are queued,
+// their result is checked when the reply comes in (at the latest on usb_flush).
+void     spi_flash_erase(unsigned address, unsigned length);
+void     spi_flash_program(unsigned address, const void *data, unsigned length);
+uint32_t spi_flash_crc(unsigned address, unsigned length);
+void     spi_flash_crc_blocks(unsigned address, unsigned block_size, unsigned count, uint32_t *crcs);
 
 bool get_cdone(void);
 
+// Counters kept by the programmer firmware since it started or was last cleared
+struct firmware_stats {
+    uint32_t uptime_ms;
+    uint32_t spi_flash_bytes;       // shifted in flash mode
+    uint32_t spi_fpga_bytes;        // sent to the FPGA for configuration
+    uint32_t dma_busy_us;           // SPI DMA transfers running
+    uint32_t usb_packets_out;       // command packets received by the programmer
+    uint32_t usb_packets_in;        // reply packets sent by the programmer
+    uint32_t cdc_bytes_forwarded;   // UART bridge data sent to the host
+    uint32_t cdc_bytes_dropped;     // UART bridge data lost, the host didn't read it in time
+    uint32_t task_latency_max_us;   // longest wait of a posted firmware task
+    uint32_t timer_lateness_max_us; // longest delay of a firmware timer
+    uint32_t fpga_underruns;        // FPGA configurations failed, data not sent in time
+};
+
+void get_firmware_stats(struct firmware_stats *stats, bool clear);
+
 void start_mass_erase(void);
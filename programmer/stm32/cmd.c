@@ -0,0 +1,358 @@
+#include "lib.h"
+#include "usb.h"
+#include "spi.h"
+#include "buf_reader.h"
+#include "flash.h"
+#include "spi_flash.h"
+#include "stats.h"
+
+// Command decoder of the programmer interface, called from the USB command
+// task in usb.c. Hardware is only reached through spi.h, spi_flash.h, the
+// CDONE input and usb_send_buffer(), so programmer_tool's simulator runs this
+// same file on the host.
+
+enum {
+    CMD_SPI_MODE_NONE      = 0x20,
+    CMD_SPI_MODE_FPGA_BOOT = 0x21,
+    CMD_SPI_MODE_FPGA      = 0x22,
+    CMD_SPI_MODE_FLASH     = 0x23,
+    CMD_SPI_SET_TIMING     = 0x24,
+
+    CMD_GET_CDONE = 0x28,
+    CMD_GET_STATS = 0x29,
+
+    CMD_SPI_SHIFT_TX    = 0x30,
+    CMD_SPI_SHIFT_RX    = 0x31,
+    CMD_SPI_SHIFT_TX_RX = 0x32,
+
+    CMD_SPI_CHIP_SELECT   = 0x33,
+    CMD_SPI_CHIP_DESELECT = 0x34,
+
+    CMD_SPI_STREAM = 0x35,
+
+    CMD_MASS_STORAGE_MODE = 0x40,
+
+    CMD_FLASH_ERASE   = 0x50,
+    CMD_FLASH_PROGRAM = 0x51,
+    CMD_FLASH_CRC     = 0x52,
+
+    CMD_MASS_ERASE = 0xFF,
+};
+
+// CMD_SPI_STREAM flags
+enum {
+    STREAM_TX     = (1 << 0), // Data follows in subsequent OUT packets
+    STREAM_RX     = (1 << 1), // Shifted in data is returned in IN packets
+    STREAM_SELECT = (1 << 2), // Wrap chip select around the whole transfer
+};
+
+static uint8_t spi_result[64];
+
+static uint32_t stream_remaining = 0;
+static uint8_t  stream_flags     = 0;
+
+// Commands that wait for FPGA configuration data: a mode change until it has
+// been shifted out, CMD_SPI_SHIFT_TX until it has been queued. The packet is
+// kept meanwhile, so the host's next packets are NAKed.
+static bool          mode_pending     = false;
+static enum spi_mode pending_mode     = SPI_MODE_NONE;
+static bool          shift_tx_pending = false;
+
+// A running transfer to the FPGA is resumed from its DMA interrupt, anything
+// else is polled
+static enum cmd_state transfer_wait(void) {
+    return spi_fpga_busy() ? CMD_WAITING : CMD_BUSY;
+}
+
+static void set_mode(enum spi_mode mode) {
+    mode_pending = true;
+    pending_mode = mode;
+}
+
+// Stream data goes straight between the USB buffers and the SPI DMA: TX data
+// is shifted out of the OUT packet's buffer, RX data is received into one of
+// two buffers and sent from there. While one of them waits for the IN
+// endpoint, the next transfer fills the other.
+static uint8_t        stream_bufs[2][64];
+static unsigned       stream_buf        = 0; // buffer of the next transfer
+static unsigned       stream_dma_length = 0; // transfer running, 0 when none
+static const uint8_t *send_buf          = NULL; // reply waiting for the IN endpoint
+static unsigned       send_length       = 0;
+
+static void stream_advance(unsigned length) {
+    stream_remaining -= length;
+    if (stream_remaining == 0 && (stream_flags & STREAM_SELECT)) {
+        spi_select(false);
+    }
+}
+
+// CMD_SPI_STREAM <flags> <length:u32> <prefix length:u8> <prefix...>
+//
+// The prefix (e.g. a flash command and address) is shifted out after chip
+// select and is not part of the returned data.
+static void stream_start(struct buf_reader *br) {
+    uint8_t  flags, prefix_length;
+    uint32_t length;
+    if (!buf_reader_try_get_u8(br, &flags) ||
+        !buf_reader_try_get_u32(br, &length) ||
+        !buf_reader_try_get_u8(br, &prefix_length) ||
+        buf_reader_get_remaining(br) < prefix_length) {
+        return;
+    }
+
+    if (flags & STREAM_SELECT) {
+        spi_select(true);
+    }
+    spi_transfer(buf_reader_get_current(br), NULL, prefix_length);
+
+    stream_flags     = flags;
+    stream_remaining = length;
+    if (length == 0 && (flags & STREAM_SELECT)) {
+        spi_select(false);
+    }
+}
+
+// Returns true when no reply is waiting anymore.
+static bool send_flush(void) {
+    if (send_buf != NULL && usb_send_ready()) {
+        usb_send_buffer((void *)send_buf, send_length);
+        send_buf = NULL;
+    }
+    return send_buf == NULL;
+}
+
+static void stream_dma_start(const void *tx_buf, unsigned length) {
+    spi_transfer_start(tx_buf, (stream_flags & STREAM_RX) ? stream_bufs[stream_buf] : NULL, length);
+    stream_dma_length = length;
+}
+
+// Returns true while the running transfer isn't finished, or its data can't
+// be queued for sending because the previous reply still waits.
+static bool stream_dma_poll(void) {
+    send_flush();
+    if (stream_dma_length == 0) {
+        return false;
+    }
+    if (spi_transfer_busy()) {
+        return true;
+    }
+
+    if (stream_flags & STREAM_RX) {
+        if (send_buf != NULL) {
+            return true;
+        }
+        send_buf    = stream_bufs[stream_buf];
+        send_length = stream_dma_length;
+        stream_buf ^= 1;
+        send_flush();
+    }
+    stream_advance(stream_dma_length);
+    stream_dma_length = 0;
+    return false;
+}
+
+// Stream data packet (STREAM_TX): the whole packet is payload. It is shifted
+// out of the packet's buffer, which is kept until usb_handle_cmd_continue()
+// returns CMD_IDLE.
+static void stream_data(struct buf_reader *br) {
+    unsigned length = buf_reader_get_remaining(br);
+    if (length > stream_remaining) {
+        length = stream_remaining;
+    }
+    stream_dma_start(buf_reader_get_current(br), length);
+}
+
+// Program data that didn't fit in the page buffer yet. Points into the USB
+// receive buffer, which isn't reused until usb_handle_cmd_continue() returns
+// CMD_IDLE.
+static const uint8_t *flash_data_pending        = NULL;
+static unsigned       flash_data_pending_length = 0;
+
+static void flash_data(const uint8_t *data, unsigned length) {
+    unsigned accepted         = spi_flash_write(data, length);
+    flash_data_pending        = data + accepted;
+    flash_data_pending_length = length - accepted;
+}
+
+// CMD_FLASH_ERASE/PROGRAM/CRC <address:u32> <length:u32>
+//
+// Program data follows in subsequent OUT packets. When the operation has
+// finished the result is returned: <status:u8> <value:u32>, where value is
+// the failing address on error or the CRC for CMD_FLASH_CRC.
+static void flash_start(uint8_t cmd, struct buf_reader *br) {
+    uint32_t address, length;
+    if (!buf_reader_try_get_u32(br, &address) ||
+        !buf_reader_try_get_u32(br, &length)) {
+        return;
+    }
+
+    switch (cmd) {
+        case CMD_FLASH_ERASE: spi_flash_erase(address, length); break;
+        case CMD_FLASH_PROGRAM: spi_flash_program(address, length); break;
+        case CMD_FLASH_CRC: spi_flash_crc(address, length); break;
+    }
+    flash_data_pending_length = 0;
+}
+
+static void flash_send_result(void) {
+    uint32_t value;
+    spi_result[0] = spi_flash_get_result(&value);
+    memcpy(&spi_result[1], &value, sizeof(value));
+
+    // The operation may finish while a reply is still in the IN endpoint
+    send_buf    = spi_result;
+    send_length = 1 + sizeof(value);
+    send_flush();
+}
+
+enum cmd_state usb_handle_cmd_continue(void) {
+    if (mode_pending) {
+        if (spi_fpga_busy()) {
+            return CMD_WAITING;
+        }
+        mode_pending = false;
+        spi_set_mode(pending_mode);
+    }
+    if (shift_tx_pending) {
+        if (spi_transfer_busy()) {
+            return transfer_wait();
+        }
+        shift_tx_pending = false;
+    }
+    if (stream_dma_poll()) {
+        return transfer_wait();
+    }
+
+    switch (spi_flash_poll()) {
+        case SPI_FLASH_IDLE: break;
+        case SPI_FLASH_BUSY: return CMD_BUSY;
+        case SPI_FLASH_WAIT_DATA:
+            if (flash_data_pending_length > 0) {
+                flash_data(flash_data_pending, flash_data_pending_length);
+                return CMD_BUSY;
+            }
+            return CMD_IDLE;
+        case SPI_FLASH_DONE: flash_send_result(); return CMD_BUSY;
+    }
+
+    // Receive-only streams produce data without further OUT packets
+    if (stream_remaining > 0 && !(stream_flags & STREAM_TX)) {
+        unsigned length = stream_remaining;
+        if (length > sizeof(stream_bufs[0])) {
+            length = sizeof(stream_bufs[0]);
+        }
+        stream_dma_start(NULL, length);
+        return CMD_BUSY;
+    }
+
+    // The next stream data packet may be shifted while the last reply waits,
+    // anything else has to wait until the reply has been sent
+    if (stream_remaining > 0 || send_flush()) {
+        return CMD_IDLE;
+    }
+    return CMD_BUSY;
+}
+
+TIMER(self_destruct_timer) {
+    flash_mass_erase();
+}
+
+void usb_handle_cmd_packet(struct buf_reader *br) {
+    if (stream_remaining > 0 && (stream_flags & STREAM_TX)) {
+        stream_data(br);
+        return;
+    }
+    if (spi_flash_wants_data()) {
+        flash_data(buf_reader_get_current(br), buf_reader_get_remaining(br));
+        return;
+    }
+
+    uint8_t cmd = buf_reader_get_u8(br);
+    switch (cmd) {
+        case CMD_SPI_MODE_NONE: set_mode(SPI_MODE_NONE); break;
+        case CMD_SPI_MODE_FPGA_BOOT: set_mode(SPI_MODE_FPGA_BOOT); break;
+        case CMD_SPI_MODE_FPGA: set_mode(SPI_MODE_FPGA); break;
+        case CMD_SPI_MODE_FLASH: set_mode(SPI_MODE_FLASH); break;
+
+        // CMD_SPI_SET_TIMING <prescaler:u8> <cs setup ns:u16> <cs hold ns:u16>
+        case CMD_SPI_SET_TIMING: {
+            uint8_t  prescaler;
+            uint16_t cs_setup_ns, cs_hold_ns;
+            if (buf_reader_try_get_u8(br, &prescaler) &&
+                buf_reader_try_get_u16(br, &cs_setup_ns) &&
+                buf_reader_try_get_u16(br, &cs_hold_ns)) {
+                spi_set_timing(prescaler, cs_setup_ns, cs_hold_ns);
+            }
+            break;
+        }
+
+        case CMD_GET_CDONE:
+            spi_result[0] = io_in(IO_FPGA_CDONE);
+            usb_send_buffer(spi_result, 1);
+            break;
+
+        // CMD_GET_STATS [<clear:u8>], see stats.h for the reply
+        case CMD_GET_STATS: {
+            uint8_t clear = 0;
+            buf_reader_try_get_u8(br, &clear);
+            stats_get(spi_result, clear != 0);
+            usb_send_buffer(spi_result, STATS_REPLY_SIZE);
+            break;
+        }
+
+        case CMD_SPI_CHIP_SELECT: spi_select(true); break;
+        case CMD_SPI_CHIP_DESELECT: spi_select(false); break;
+
+        case CMD_SPI_SHIFT_TX: {
+            uint8_t length;
+            if (!buf_reader_try_get_u8(br, &length)) {
+                return;
+            }
+            if (buf_reader_get_remaining(br) < length) {
+                return;
+            }
+            spi_transfer_start(buf_reader_get_current(br), NULL, length);
+            shift_tx_pending = true;
+            break;
+        }
+
+        case CMD_SPI_SHIFT_RX: {
+            uint8_t length;
+            if (!buf_reader_try_get_u8(br, &length)) {
+                return;
+            }
+            if (length > sizeof(spi_result)) {
+                return;
+            }
+
+            spi_transfer(NULL, spi_result, length);
+            usb_send_buffer(spi_result, length);
+            break;
+        }
+
+        case CMD_SPI_SHIFT_TX_RX: {
+            uint8_t length;
+            if (!buf_reader_try_get_u8(br, &length)) {
+                return;
+            }
+            if (buf_reader_get_remaining(br) < length || length > sizeof(spi_result)) {
+                return;
+            }
+            spi_transfer(buf_reader_get_current(br), spi_result, length);
+            usb_send_buffer(spi_result, length);
+            break;
+        }
+
+        case CMD_SPI_STREAM: stream_start(br); break;
+
+        case CMD_FLASH_ERASE:
+        case CMD_FLASH_PROGRAM:
+        case CMD_FLASH_CRC: flash_start(cmd, br); break;
+
+        case CMD_MASS_ERASE: {
+            usb_send_buffer("T-1", 3);
+            timer_start(&self_destruct_timer, MS_TO_TICKS(1000));
+            break;
+        }
+    }
+}
@@ -0,0 +1,198 @@
+#include "fpga_config.h"
+#include "fpga_wave.h"
+#include "stats.h"
+#include "lib.h"
+
+// TIM3 update events request DMA channel 3, which copies a circular waveform
+// buffer to GPIOA->ODR. The half transfer and transfer complete interrupts
+// refill the half that was just sent from the FIFO, so queueing data is all
+// the CPU does and the next USB packet is received while the previous one is
+// shifted out. Halves without data get idle samples, which don't clock the
+// FPGA. Channels 4/5 belong to the CDC UART, channel 3 is free while SPI1 is
+// off. The DMA reads byte samples and writes them as half-words, zero
+// extended: pins 8-15 of port A aren't GPIO outputs, so this halves the buffer.
+//
+// Nothing waits here: a writer that finds the FIFO full, or the data not yet
+// shifted out, is posted again from the interrupt after the next refill.
+//
+// A refill that's late, after the DMA got to the half, sends stale samples or
+// skips part of the new ones. Unless all of them are idle the configuration is
+// lost: the underrun is counted in stats, and the FPGA is held in reset while
+// the rest of the data is dropped, so CDONE stays low.
+
+#define HALF_BYTES 16 // 43 us at FPGA_CONFIG_SCK_HZ
+#define HALF_SAMPLES (HALF_BYTES * FPGA_WAVE_SAMPLES_PER_BYTE)
+
+_Static_assert((IO_SPI_SCK & 15) < 8 && (IO_SPI_MISO & 15) < 8 && (IO_FPGA_RESET & 15) < 8 && (IO_FPGA_SSEL & 15) < 8,
+               "the DMA only drives pins 0-7 of port A");
+
+static struct fpga_wave      wave;
+static uint8_t               dma_buf[2 * HALF_SAMPLES];
+static unsigned              half_bytes[2]; // data bytes in each half
+static uint8_t               fifo[FPGA_CONFIG_FIFO_SIZE];
+static volatile unsigned     fifo_head;   // written by fpga_config_write()
+static volatile unsigned     fifo_tail;   // written by the DMA interrupt
+static volatile unsigned     idle_halves; // halves refilled without data in a row
+static struct task *volatile waiter;      // posted after the next refill
+static volatile bool         failed;      // underrun, data is dropped
+static bool                  active;
+
+// Have the current task posted after the next refill. Set before looking at
+// the FIFO, so a refill in between posts it as well.
+static void wait_for_refill(void) {
+    waiter = task_get_current();
+    __membar();
+}
+
+// Refill a half the DMA has sent. Returns false when the DMA got to it again
+// before the refill was done, and there was data in it or is now.
+static bool fill_half(unsigned half) {
+    uint8_t *samples = &dma_buf[half * HALF_SAMPLES];
+    unsigned tail    = fifo_tail;
+    unsigned count   = fifo_head - tail;
+    if (count == 0 && idle_halves >= 2) {
+        return true; // both halves are idle already
+    }
+    if (count > HALF_BYTES) {
+        count = HALF_BYTES;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        fpga_wave_expand(&wave, samples + i * FPGA_WAVE_SAMPLES_PER_BYTE, &fifo[(tail + i) % FPGA_CONFIG_FIFO_SIZE], 1);
+    }
+    fpga_wave_fill_idle(&wave, samples + count * FPGA_WAVE_SAMPLES_PER_BYTE, (HALF_BYTES - count) * FPGA_WAVE_SAMPLES_PER_BYTE);
+
+    fifo_tail   = tail + count;
+    idle_halves = count > 0 ? 0 : idle_halves + 1;
+
+    // The DMA has to be in the other half still
+    unsigned position = 2 * HALF_SAMPLES - DMA1_Channel3->CNDTR;
+    bool     late     = position / HALF_SAMPLES == half;
+    bool     data     = count > 0 || half_bytes[half] > 0;
+    half_bytes[half]  = count;
+    return !(late && data);
+}
+
+// Hold the FPGA in reset for the rest of the configuration, drop the data
+static void underrun(void) {
+    DMA1_Channel3->CCR = 0;
+    TIM3->CR1          = 0;
+    io_out(IO_FPGA_RESET, 1);
+
+    fifo_tail = fifo_head;
+    failed    = true;
+    stats.fpga_underruns++;
+}
+
+void dma1_channel2_3_irq_handler(void) {
+    uint32_t isr = DMA1->ISR;
+
+    // Both events at once: one of the halves went out twice
+    bool ok = (isr & (DMA_ISR_HTIF3 | DMA_ISR_TCIF3)) != (DMA_ISR_HTIF3 | DMA_ISR_TCIF3) || (half_bytes[0] == 0 && half_bytes[1] == 0);
+    if (isr & DMA_ISR_HTIF3) {
+        DMA1->IFCR = DMA_IFCR_CHTIF3;
+        ok         = fill_half(0) && ok;
+    }
+    if (isr & DMA_ISR_TCIF3) {
+        DMA1->IFCR = DMA_IFCR_CTCIF3;
+        ok         = fill_half(1) && ok;
+    }
+    if (!ok && !failed) {
+        underrun();
+    }
+
+    struct task *task = waiter;
+    if (task != NULL) {
+        waiter = NULL;
+        task_post(task);
+    }
+}
+
+void fpga_config_start(void) {
+    if (active) {
+        return;
+    }
+
+    uint8_t sck  = 1 << (IO_SPI_SCK & 15);
+    uint8_t data = 1 << (IO_SPI_MISO & 15);
+    fpga_wave_init(&wave, (uint8_t)GPIOA->ODR, sck, data);
+    fpga_wave_fill_idle(&wave, dma_buf, 2 * HALF_SAMPLES);
+    half_bytes[0] = 0;
+    half_bytes[1] = 0;
+    fifo_head     = 0;
+    fifo_tail     = 0;
+    idle_halves   = 2;
+    waiter        = NULL;
+    failed        = false;
+
+    DMA1_Channel3->CCR   = 0;
+    DMA1->IFCR           = DMA_IFCR_CGIF3;
+    DMA1_Channel3->CNDTR = 2 * HALF_SAMPLES;
+    DMA1_Channel3->CPAR  = (uintptr_t)&GPIOA->ODR;
+    DMA1_Channel3->CMAR  = (uintptr_t)dma_buf;
+    DMA1_Channel3->CCR   = DMA_CCR_PL_1 | DMA_CCR_PSIZE_0 | DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_DIR | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_EN;
+
+    // Refills must not wait for USB interrupts
+    NVIC_SetPriority(DMA1_Channel2_3_IRQn, 1);
+    NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
+
+    clock_enable(CLK_TIM3);
+    TIM3->CR1  = 0;
+    TIM3->PSC  = 0;
+    TIM3->ARR  = clock_get_frequency(CLK_TIM3) / (2 * FPGA_CONFIG_SCK_HZ) - 1;
+    TIM3->CNT  = 0;
+    TIM3->EGR  = TIM_EGR_UG;
+    TIM3->DIER = TIM_DIER_UDE;
+    TIM3->CR1 |= TIM_CR1_CEN;
+
+    active = true;
+}
+
+size_t fpga_config_write(const void *data, size_t length) {
+    const uint8_t *data8 = (const uint8_t *)data;
+    if (failed) {
+        return length;
+    }
+
+    unsigned head  = fifo_head;
+    unsigned space = FPGA_CONFIG_FIFO_SIZE - (head - fifo_tail);
+    if (space < length) {
+        wait_for_refill();
+        space = FPGA_CONFIG_FIFO_SIZE - (head - fifo_tail);
+    }
+    if (space > length) {
+        space = length;
+    }
+    for (unsigned i = 0; i < space; i++) {
+        fifo[(head + i) % FPGA_CONFIG_FIFO_SIZE] = *data8++;
+    }
+    __membar();
+    fifo_head = head + space;
+    return space;
+}
+
+bool fpga_config_busy(void) {
+    if (!active || failed || (fifo_head == fifo_tail && idle_halves >= 2)) {
+        return false;
+    }
+
+    // Both halves idle with an empty FIFO means everything was sent
+    wait_for_refill();
+    return fifo_head != fifo_tail || idle_halves < 2;
+}
+
+void fpga_config_stop(void) {
+    if (!active) {
+        return;
+    }
+
+    TIM3->CR1  = 0;
+    TIM3->DIER = 0;
+    clock_disable(CLK_TIM3);
+
+    DMA1_Channel3->CCR = 0;
+    NVIC_DisableIRQ(DMA1_Channel2_3_IRQn);
+    DMA1->IFCR = DMA_IFCR_CGIF3;
+
+    active = false;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "common.h"
+
+// FPGA configuration clock. Each bit takes two DMA transfers to GPIO, paced
+// by a timer; a transfer that isn't served before the next timer event is
+// lost, so keep some margin for the CPU's own bus accesses.
+#define FPGA_CONFIG_SCK_HZ (3000000)
+
+// Bytes queued ahead of the DMA, a few USB packets
+#define FPGA_CONFIG_FIFO_SIZE (256)
+
+// Start shifting out to the FPGA in slave configuration mode, with SCK and
+// MISO configured as outputs.
+void fpga_config_start(void);
+
+// Queue as much data as fits in the FIFO, returns the number of bytes queued.
+// When that's less than length, the calling task is posted again from the DMA
+// interrupt once there's space. After an underrun all data is taken and
+// dropped, see stats.fpga_underruns.
+size_t fpga_config_write(const void *data, size_t length);
+
+// True while queued data is still being shifted out. The calling task is
+// posted again from the DMA interrupt, until this returns false.
+bool fpga_config_busy(void);
+
+// Stop, queued data that isn't shifted out yet is dropped. Wait for
+// fpga_config_busy() to return false first.
+void fpga_config_stop(void);
@@ -0,0 +1,28 @@
+#include "fpga_wave.h"
+#include <string.h>
+
+void fpga_wave_init(struct fpga_wave *wave, uint8_t odr, uint8_t sck, uint8_t data) {
+    odr &= ~(sck | data);
+    for (unsigned nibble = 0; nibble < 16; nibble++) {
+        uint8_t *samples = wave->nibbles[nibble];
+        for (unsigned i = 0; i < 4; i++) {
+            uint8_t bit = (nibble & (8 >> i)) ? data : 0;
+            *samples++  = odr | bit;
+            *samples++  = odr | bit | sck;
+        }
+    }
+    wave->idle = odr | sck;
+}
+
+void fpga_wave_expand(const struct fpga_wave *wave, uint8_t *samples, const uint8_t *bytes, unsigned length) {
+    while (length--) {
+        uint8_t byte = *bytes++;
+        memcpy(samples, wave->nibbles[byte >> 4], sizeof(wave->nibbles[0]));
+        memcpy(samples + FPGA_WAVE_SAMPLES_PER_BYTE / 2, wave->nibbles[byte & 15], sizeof(wave->nibbles[0]));
+        samples += FPGA_WAVE_SAMPLES_PER_BYTE;
+    }
+}
+
+void fpga_wave_fill_idle(const struct fpga_wave *wave, uint8_t *samples, unsigned count) {
+    memset(samples, wave->idle, count);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+// Pin waveform for iCE40 slave SPI configuration, copied to the GPIO output
+// data register by DMA. Every bit takes two samples: SCK low with the data bit
+// on MISO, then SCK high. The FPGA samples on the rising edge, bytes are sent
+// MSB first. SCK idles high, so idle samples don't clock the FPGA.
+// A sample is the low byte of the port's output data register, so all pins
+// driven by the waveform must be pins 0-7.
+// No hardware access here, programmer_tool's simulator decodes the samples.
+
+#define FPGA_WAVE_SAMPLES_PER_BYTE 16
+
+struct fpga_wave {
+    uint8_t nibbles[16][FPGA_WAVE_SAMPLES_PER_BYTE / 2];
+    uint8_t idle;
+};
+
+// odr: value of the other pins of the port, sck/data: pin masks
+void fpga_wave_init(struct fpga_wave *wave, uint8_t odr, uint8_t sck, uint8_t data);
+void fpga_wave_expand(const struct fpga_wave *wave, uint8_t *samples, const uint8_t *bytes, unsigned length);
+void fpga_wave_fill_idle(const struct fpga_wave *wave, uint8_t *samples, unsigned count);
@@ -0,0 +1,296 @@
+#include "lib.h"
+#include "usb.h"
+#include "buf_writer.h"
+#include "iopins.h"
+#include "hal_host.h"
+#include <time.h>
+#include <unistd.h>
+
+// Micro-benchmarks of the firmware core built for the host: scheduler, timers,
+// buffer reader/writer and the command decoder. Each also checks its results,
+// so a faster version that breaks something doesn't go unnoticed.
+
+// Commands from cmd.c
+enum {
+    CMD_GET_CDONE       = 0x28,
+    CMD_SPI_SHIFT_TX_RX = 0x32,
+    CMD_SPI_STREAM      = 0x35,
+};
+
+// CMD_SPI_STREAM flags
+enum {
+    STREAM_TX = (1 << 0),
+    STREAM_RX = (1 << 1),
+};
+
+static unsigned failures;
+
+static double time_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, unsigned ops, double seconds) {
+    printf("%-24s %10u ops  %8.1f ns/op\n", name, ops, seconds * 1e9 / ops);
+}
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("%s: FAILED\n", what);
+        failures++;
+    }
+}
+
+// Scheduler: post one task of each priority, run them
+
+static char     task_order[4];
+static unsigned task_order_length;
+
+static void task_ran(char c) {
+    if (task_order_length < sizeof(task_order) - 1) {
+        task_order[task_order_length++] = c;
+    }
+}
+
+TASK_WITH_PRIORITY(bench_task_high, TASK_PRIORITY_HIGH) {
+    task_ran('H');
+}
+
+TASK(bench_task_normal) {
+    task_ran('N');
+}
+
+TASK_WITH_PRIORITY(bench_task_low, TASK_PRIORITY_LOW) {
+    task_ran('L');
+}
+
+static void bench_tasks(unsigned count) {
+    unsigned runs = 0;
+    double   t0   = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        task_order_length = 0;
+        task_post(&bench_task_low);
+        task_post(&bench_task_normal);
+        task_post(&bench_task_high);
+        task_post(&bench_task_high); // already posted, runs once
+        runs += task_run_posted();
+    }
+    report("task post+run", runs, time_now() - t0);
+
+    check(runs == count * 3, "task post+run: run count");
+    check(strcmp(task_order, "HNL") == 0, "task post+run: priority order");
+}
+
+// Timers: interval timers of different periods, time advanced tick by tick
+
+static struct timer bench_timers[OS_TIMER_COUNT];
+static unsigned     timer_expiries[OS_TIMER_COUNT];
+static unsigned     timer_late;
+
+static void bench_timer_handler(void) {
+    struct timer *timer = timer_get_current();
+    unsigned     *count = timer_get_current_argument();
+    (*count)++;
+    if (os_get_time() != timer->expiration_time - timer->interval) {
+        timer_late++;
+    }
+}
+
+static void bench_timer_dispatch(unsigned ticks) {
+    for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+        timer_expiries[i] = 0;
+        timer_init(&bench_timers[i], bench_timer_handler, &timer_expiries[i], 0);
+        timer_restart(&bench_timers[i], i + 1, i + 1);
+    }
+    timer_late = 0;
+    timer_get_lateness_max(true);
+    task_run_posted();
+
+    unsigned expected = 0;
+    for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+        expected += ticks / (i + 1);
+    }
+
+    double t0 = time_now();
+    for (unsigned t = 0; t < ticks; t++) {
+        hal_host_advance_time(1);
+        task_run_posted();
+    }
+    double t1 = time_now();
+
+    unsigned total = 0;
+    for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+        total += timer_expiries[i];
+        timer_stop(&bench_timers[i]);
+    }
+    report("timer expiry", total, t1 - t0);
+
+    check(total == expected, "timer expiry: expiry count");
+    check(timer_late == 0 && timer_get_lateness_max(true) == 0, "timer expiry: handlers late");
+}
+
+static void bench_timer_restart(unsigned count) {
+    for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+        timer_init(&bench_timers[i], bench_timer_handler, &timer_expiries[i], 0);
+        timer_start(&bench_timers[i], 1000 + i);
+    }
+
+    uint32_t x  = 1;
+    double   t0 = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        x = x * 1103515245 + 12345;
+        timer_start(&bench_timers[(x >> 16) % OS_TIMER_COUNT], 100 + (x >> 20));
+    }
+    double t1 = time_now();
+    report("timer restart", count, t1 - t0);
+
+    bool running = true;
+    for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+        running = running && timer_is_running(&bench_timers[i]);
+        timer_stop(&bench_timers[i]);
+        running = running && !timer_is_running(&bench_timers[i]);
+    }
+    check(running, "timer restart: running state");
+    task_run_posted();
+}
+
+// Buffer reader and writer: a packet of mixed fields
+
+#define FIELDS_PER_PACKET 15 // 5 times u8, u16, u32: 35 bytes
+
+static void bench_buffers(unsigned count) {
+    uint8_t buf[CMD_EPOUT_SIZE];
+
+    uint32_t written = 0;
+    double   t0      = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        struct buf_writer bw;
+        buf_writer_init(&bw, buf, sizeof(buf));
+        for (unsigned j = 0; j < FIELDS_PER_PACKET / 3; j++) {
+            buf_writer_add_u8(&bw, (uint8_t)(i + j));
+            buf_writer_add_u16(&bw, (uint16_t)(i * j));
+            buf_writer_add_u32(&bw, i ^ j);
+            written += (uint8_t)(i + j) + (uint16_t)(i * j) + (i ^ j);
+        }
+        __membar();
+    }
+    report("buf_writer field", count * FIELDS_PER_PACKET, time_now() - t0);
+
+    uint32_t read = 0;
+    t0            = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        struct buf_reader br;
+        buf_reader_init(&br, buf, sizeof(buf));
+        for (unsigned j = 0; j < FIELDS_PER_PACKET / 3; j++) {
+            read += buf_reader_get_u8(&br);
+            read += buf_reader_get_u16(&br);
+            read += buf_reader_get_u32(&br);
+        }
+        __membar();
+    }
+    report("buf_reader field", count * FIELDS_PER_PACKET, time_now() - t0);
+
+    // The reader saw the last packet written each time
+    uint32_t last = 0;
+    for (unsigned j = 0; j < FIELDS_PER_PACKET / 3; j++) {
+        last += (uint8_t)(count - 1 + j) + (uint16_t)((count - 1) * j) + ((count - 1) ^ j);
+    }
+    check(read == last * count, "buf_reader field: values");
+    check(written != 0, "buf_writer field: values");
+}
+
+// Command decoder, as usb.c's command task drives it
+
+static const uint8_t *command(const void *packet, unsigned size, unsigned *reply_length) {
+    struct buf_reader br;
+    buf_reader_init(&br, packet, size);
+    usb_handle_cmd_packet(&br);
+
+    const uint8_t *reply = hal_host_take_reply(reply_length);
+    while (usb_handle_cmd_continue()) {
+        const uint8_t *r = hal_host_take_reply(reply_length);
+        if (r != NULL) {
+            reply = r;
+        }
+    }
+    const uint8_t *r = hal_host_take_reply(reply_length);
+    return r != NULL ? r : reply;
+}
+
+static void bench_commands(unsigned count) {
+    uint8_t  packet[CMD_EPOUT_SIZE];
+    unsigned length;
+
+    io_get_gpio_regs(IO_FPGA_CDONE)->IDR |= 1 << (IO_FPGA_CDONE & 15);
+    packet[0]            = CMD_GET_CDONE;
+    const uint8_t *reply = command(packet, 1, &length);
+    check(reply != NULL && length == 1 && reply[0] == 1, "command: CDONE");
+
+    // CMD_SPI_SHIFT_TX_RX <length> <data>, looped back
+    packet[0] = CMD_SPI_SHIFT_TX_RX;
+    packet[1] = sizeof(packet) - 2;
+    for (unsigned i = 2; i < sizeof(packet); i++) {
+        packet[i] = (uint8_t)(i * 7);
+    }
+
+    bool   ok = true;
+    double t0 = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        reply = command(packet, sizeof(packet), &length);
+        ok    = ok && reply != NULL && length == packet[1];
+    }
+    report("command shift tx/rx", count, time_now() - t0);
+    check(ok && memcmp(reply, packet + 2, packet[1]) == 0, "command shift tx/rx: reply");
+
+    // CMD_SPI_STREAM <flags> <length:u32> <prefix length:u8>, then data packets
+    unsigned          stream_length = count * sizeof(packet);
+    struct buf_writer bw;
+    buf_writer_init(&bw, packet, sizeof(packet));
+    buf_writer_add_u8(&bw, CMD_SPI_STREAM);
+    buf_writer_add_u8(&bw, STREAM_TX | STREAM_RX);
+    buf_writer_add_u32(&bw, stream_length);
+    buf_writer_add_u8(&bw, 0);
+    command(packet, buf_writer_get_offset(&bw), &length);
+
+    for (unsigned i = 0; i < sizeof(packet); i++) {
+        packet[i] = (uint8_t)(i * 13);
+    }
+    ok = true;
+    t0 = time_now();
+    for (unsigned i = 0; i < count; i++) {
+        reply = command(packet, sizeof(packet), &length);
+        ok    = ok && reply != NULL && length == sizeof(packet) && memcmp(reply, packet, length) == 0;
+    }
+    report("command stream packet", count, time_now() - t0);
+    check(ok, "command stream packet: reply");
+}
+
+int main(int argc, char *const argv[]) {
+    int      opt;
+    unsigned count = 1000000;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-n <iterations>]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (count == 0 || !hal_host_init()) {
+        exit(EXIT_FAILURE);
+    }
+
+    bench_tasks(count);
+    bench_timer_dispatch(count);
+    bench_timer_restart(count);
+    bench_buffers(count);
+    bench_commands(count);
+
+    if (failures > 0) {
+        printf("%u checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,240 @@
+// Hardware shim for building the firmware core on the host (see Makefile).
+//
+// The peripheral and core register blocks are backed by memory at their real
+// addresses, so code that accesses registers directly (io.h, CRC, NVIC) runs
+// unchanged. Drivers that wait on hardware flags (spi.c, usb.c, clock.c,
+// lltimer.c) are not built; their interfaces are implemented here instead:
+// SPI transfers complete at once with MISO looped back to MOSI, or go to a
+// device model the caller attaches, USB replies are kept for the caller, and
+// the low level timer runs in simulated ticks. SPI data received into
+// CRC->DR is fed through a model of the CRC unit. The DMA and timer that
+// fpga_config.c sets up don't run, the tests move the DMA counter (CNDTR) and
+// call its interrupt handler.
+
+#include "lib.h"
+#include "usb.h"
+#include "spi.h"
+#include "flash.h"
+#include "hal_host.h"
+#include <sys/mman.h>
+#include <time.h>
+
+static const struct {
+    uintptr_t base;
+    size_t    size;
+} register_blocks[] = {
+    {PERIPH_BASE, 0x24000},    // APB and AHB peripherals, up to the CRC unit
+    {AHB2PERIPH_BASE, 0x1800}, // GPIO ports
+    {SCS_BASE, 0x1000},        // SysTick, NVIC, SCB
+};
+
+static uint64_t ticks;
+static bool     cycles_simulated;
+static uint32_t cycles;
+static uint64_t callback_value;
+static bool     callback_set;
+
+static enum spi_mode                     spi_mode = SPI_MODE_NONE;
+static bool                              spi_selected;
+static const struct hal_host_spi_device *spi_device;
+
+static uint8_t  usb_reply[CMD_EPIN_SIZE];
+static unsigned usb_reply_length;
+static bool     usb_reply_pending;
+
+bool hal_host_init(void) {
+    for (unsigned i = 0; i < NUM_ARRAY_ELEMENTS(register_blocks); i++) {
+        void *base = (void *)register_blocks[i].base;
+        void *p    = mmap(base, register_blocks[i].size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (p != base) {
+            fprintf(stderr, "hal_host: can't map registers at %p\n", base);
+            if (p != MAP_FAILED) {
+                munmap(p, register_blocks[i].size);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t host_cycle_counter(void) {
+    if (cycles_simulated) {
+        return cycles;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    return (uint32_t)(ns * (SYSCLK_FREQ / 1000000) / 1000);
+}
+
+void hal_host_simulate_cycles(bool on) {
+    cycles_simulated = on;
+}
+
+void hal_host_advance_cycles(uint32_t delta) {
+    cycles += delta;
+}
+
+// Low level timer
+
+void lltimer_init(void) {
+}
+
+uint64_t lltimer_get_counter_value(void) {
+    return ticks;
+}
+
+void lltimer_cancel_counter_callback(void) {
+    callback_set = false;
+}
+
+void lltimer_callback_on_counter_value(uint64_t value) {
+    callback_value = value;
+    callback_set   = true;
+    hal_host_advance_time(0);
+}
+
+void hal_host_advance_time(uint32_t delta) {
+    ticks += delta;
+    if (callback_set && ticks >= callback_value) {
+        callback_set = false;
+        lltimer_callback();
+    }
+}
+
+// Clocks are always running
+
+void clock_init(void) {
+}
+
+void clock_enable(enum clock clk) {
+    (void)clk;
+}
+
+void clock_disable(enum clock clk) {
+    (void)clk;
+}
+
+uint32_t clock_get_frequency(enum clock clk) {
+    (void)clk;
+    return SYSCLK_FREQ;
+}
+
+// SPI with MISO connected to MOSI, unless a device is attached
+
+void hal_host_attach_spi(const struct hal_host_spi_device *device) {
+    spi_select(false);
+    spi_device = device;
+}
+
+static uint64_t time_ns(void) {
+    return ticks * (1000000000 / TICKS_PER_SECOND);
+}
+
+static uint8_t spi_transfer_byte(uint8_t data) {
+    if (spi_device == NULL) {
+        return data;
+    }
+    return spi_device->transfer(spi_device->context, data, time_ns());
+}
+
+void spi_set_mode(enum spi_mode mode) {
+    spi_select(false);
+    spi_mode = mode;
+}
+
+void spi_select(bool on) {
+    if (spi_device != NULL && on != spi_selected) {
+        spi_device->select(spi_device->context, on, time_ns());
+    }
+    spi_selected = on;
+}
+
+void spi_set_timing(unsigned prescaler, unsigned cs_setup_ns, unsigned cs_hold_ns) {
+    (void)prescaler;
+    (void)cs_setup_ns;
+    (void)cs_hold_ns;
+}
+
+void spi_transfer(const void *tx_buf, void *rx_buf, size_t length) {
+    const uint8_t *tx = tx_buf;
+    uint8_t *      rx = rx_buf;
+    if (spi_device == NULL && rx != NULL && tx != NULL) {
+        memmove(rx, tx, length);
+        return;
+    }
+    for (size_t i = 0; i < length; i++) {
+        uint8_t data = spi_transfer_byte(tx != NULL ? tx[i] : 0xFF);
+        if (rx != NULL) {
+            rx[i] = data;
+        }
+    }
+}
+
+void spi_transfer_start(const void *tx_buf, void *rx_buf, size_t length) {
+    spi_transfer(tx_buf, rx_buf, length);
+}
+
+// CRC unit as crc32_hw_begin() sets it up: bytes written to DR, reversed
+// input and output. The reset takes effect with the first byte.
+static void crc_unit_write(uint8_t data) {
+    if (CRC->CR & CRC_CR_RESET) {
+        CRC->CR &= ~CRC_CR_RESET;
+        CRC->DR = CRC->INIT;
+    }
+    uint32_t crc = CRC->DR ^ data;
+    for (unsigned i = 0; i < 8; i++) {
+        crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    CRC->DR = crc;
+}
+
+void spi_receive_start(volatile void *rx_buf, size_t length, bool increment) {
+    volatile uint8_t *p = rx_buf;
+    for (size_t i = 0; i < length; i++) {
+        uint8_t data = spi_transfer_byte(0xFF);
+        if (rx_buf == &CRC->DR) {
+            crc_unit_write(data);
+        } else {
+            *p = data;
+        }
+        if (increment) {
+            p++;
+        }
+    }
+}
+
+bool spi_transfer_busy(void) {
+    return false;
+}
+
+bool spi_fpga_busy(void) {
+    return false;
+}
+
+// USB IN endpoint, the caller collects the reply
+
+void usb_send_buffer(void *buf, unsigned size) {
+    assert(size <= sizeof(usb_reply));
+    memcpy(usb_reply, buf, size);
+    usb_reply_length  = size;
+    usb_reply_pending = true;
+}
+
+bool usb_send_ready(void) {
+    return !usb_reply_pending;
+}
+
+const uint8_t *hal_host_take_reply(unsigned *length) {
+    if (!usb_reply_pending) {
+        return NULL;
+    }
+    usb_reply_pending = false;
+    *length           = usb_reply_length;
+    return usb_reply;
+}
+
+bool flash_mass_erase(void) {
+    fprintf(stderr, "hal_host: mass erase\n");
+    return false;
+}
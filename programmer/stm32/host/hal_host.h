@@ -0,0 +1,30 @@
+#pragma once
+
+#include "common.h"
+
+// Map the register blocks, call before anything touches them
+bool hal_host_init(void);
+
+// SPI device model, called for each byte. Times are the OS time in ns.
+struct hal_host_spi_device {
+    void (*select)(void *context, bool on, uint64_t now);
+    uint8_t (*transfer)(void *context, uint8_t data, uint64_t now);
+    void *context;
+};
+
+// Connect a device to the SPI bus, NULL for the loopback
+void hal_host_attach_spi(const struct hal_host_spi_device *device);
+
+// Advance the OS time, raising the lltimer interrupt when it's due
+void hal_host_advance_time(uint32_t delta);
+
+// Run the cycle counter on simulated cycles instead of the host's clock, so
+// run times and latencies are exact
+void hal_host_simulate_cycles(bool on);
+
+// Advance the simulated cycle counter
+void hal_host_advance_cycles(uint32_t delta);
+
+// Reply sent on the USB IN endpoint since the last call, NULL when none.
+// Taking it frees the endpoint again.
+const uint8_t *hal_host_take_reply(unsigned *length);
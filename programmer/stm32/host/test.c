@@ -0,0 +1,77 @@
+#include "lib.h"
+#include "hal_host.h"
+#include "test.h"
+#include <stdarg.h>
+#include <unistd.h>
+
+// Tests of the firmware core built for the host. Randomized tests take their
+// numbers from test_random(), so a failure can be repeated with the seed
+// printed at the start.
+
+#define MAX_FAILURES_PRINTED (20)
+
+static unsigned failures;
+static uint64_t random_state;
+
+void check(bool ok, const char *what, ...) {
+    if (ok) {
+        return;
+    }
+    if (failures < MAX_FAILURES_PRINTED) {
+        va_list args;
+        va_start(args, what);
+        vprintf(what, args);
+        va_end(args);
+        printf(": FAILED\n");
+    }
+    failures++;
+}
+
+// xorshift64*
+uint32_t test_random(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (uint32_t)((random_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+uint32_t test_random_below(uint32_t range) {
+    return (uint32_t)(((uint64_t)test_random() * range) >> 32);
+}
+
+static void run(const char *name, void (*test)(void)) {
+    unsigned failures_before = failures;
+    test();
+    printf("%-24s %s\n", name, failures == failures_before ? "ok" : "FAILED");
+}
+
+int main(int argc, char *const argv[]) {
+    int      opt;
+    uint32_t seed = 1;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-s <seed>]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (!hal_host_init()) {
+        exit(EXIT_FAILURE);
+    }
+    printf("seed %lu\n", (unsigned long)seed);
+    random_state = seed | ((uint64_t)seed << 32) | 1;
+
+    run("flash commands", test_flash);
+    run("fpga waveform", test_fpga_wave);
+    run("spsc ring", test_ring);
+    run("scheduler", test_tasks);
+    run("timers", test_timer);
+
+    if (failures > 0) {
+        printf("%u checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "common.h"
+
+// Tests of the firmware core built for the host (see Makefile). Each module's
+// test is a function called from test.c's main(), it reports what's wrong
+// with check().
+
+// Count a failed check and print it, up to a limit per run
+void check(bool ok, const char *what, ...) __attribute__((format(printf, 2, 3)));
+
+// Pseudo random numbers, the same sequence for the same -s seed
+uint32_t test_random(void);
+
+// Pseudo random number in [0, range)
+uint32_t test_random_below(uint32_t range);
+
+// Module tests
+void test_flash(void);
+void test_fpga_wave(void);
+void test_ring(void);
+void test_tasks(void);
+void test_timer(void);
@@ -0,0 +1,347 @@
+#include "lib.h"
+#include "usb.h"
+#include "buf_writer.h"
+#include "crc32.h"
+#include "spi_flash.h"
+#include "hal_host.h"
+#include "test.h"
+#include "w25q16jv.h"
+
+// CMD_FLASH_ERASE/PROGRAM/CRC, fed to the command decoder the way usb.c's
+// command task does, against programmer_tool's W25Q16JV model with its
+// typical busy times. The OS time advances a tick each time the command task
+// would run again.
+
+// Commands from cmd.c
+enum {
+    CMD_SPI_MODE_FLASH = 0x23,
+    CMD_FLASH_ERASE    = 0x50,
+    CMD_FLASH_PROGRAM  = 0x51,
+    CMD_FLASH_CRC      = 0x52,
+};
+
+// Flash commands logged by the device wrapper
+enum {
+    SECTOR_ERASE_4KB = 0x20,
+    BLOCK_ERASE_32KB = 0x52,
+    BLOCK_ERASE_64KB = 0xD8,
+};
+
+// Longest a command may keep the command task busy: longer than any timeout
+#define COMMAND_TICKS_MAX MS_TO_TICKS(5000)
+
+static struct w25q16jv flash;
+
+// Erase commands the flash received, in order
+#define LOG_SIZE (64)
+
+static struct {
+    uint8_t  cmd;
+    uint32_t address;
+} erase_log[LOG_SIZE];
+static unsigned erase_log_length;
+
+static uint8_t  select_cmd;
+static uint32_t select_address;
+static unsigned select_count;
+
+static void device_select(void *context, bool on, uint64_t now) {
+    if (!on && select_count == 4 && erase_log_length < LOG_SIZE &&
+        (select_cmd == SECTOR_ERASE_4KB || select_cmd == BLOCK_ERASE_32KB || select_cmd == BLOCK_ERASE_64KB)) {
+        erase_log[erase_log_length].cmd       = select_cmd;
+        erase_log[erase_log_length].address   = select_address;
+        erase_log_length++;
+    }
+    select_count = 0;
+    w25q16jv_select(context, on, now);
+}
+
+static uint8_t device_transfer(void *context, uint8_t data, uint64_t now) {
+    if (select_count == 0) {
+        select_cmd     = data;
+        select_address = 0;
+    } else if (select_count <= 3) {
+        select_address = (select_address << 8) | data;
+    }
+    select_count++;
+    return w25q16jv_transfer(context, data, now);
+}
+
+static const struct hal_host_spi_device flash_device = {
+    .select   = device_select,
+    .transfer = device_transfer,
+    .context  = &flash,
+};
+
+// Result of the last flash command
+static struct {
+    bool     replied;
+    uint8_t  status;
+    uint32_t value;
+    unsigned ticks; // from the command packet until the reply
+} result;
+
+static void take_reply(void) {
+    unsigned       length;
+    const uint8_t *reply = hal_host_take_reply(&length);
+    if (reply == NULL) {
+        return;
+    }
+    check(!result.replied && length == 5, "flash: reply length %u", length);
+    result.replied = true;
+    result.status  = reply[0];
+    memcpy(&result.value, &reply[1], sizeof(result.value));
+}
+
+// Hand a packet to the decoder and run the command task until it waits for
+// the next one
+static void packet(const void *data, unsigned length) {
+    struct buf_reader br;
+    buf_reader_init(&br, data, length);
+    usb_handle_cmd_packet(&br);
+
+    unsigned ticks = 0;
+    while (usb_handle_cmd_continue()) {
+        take_reply();
+        if (!result.replied) {
+            hal_host_advance_time(1);
+            result.ticks++;
+        }
+        if (++ticks > COMMAND_TICKS_MAX) {
+            check(false, "flash: command task doesn't finish");
+            break;
+        }
+    }
+    take_reply();
+}
+
+static void flash_command(uint8_t cmd, uint32_t address, uint32_t length) {
+    uint8_t           buf[CMD_EPOUT_SIZE];
+    struct buf_writer bw;
+    buf_writer_init(&bw, buf, sizeof(buf));
+    buf_writer_add_u8(&bw, cmd);
+    buf_writer_add_u32(&bw, address);
+    buf_writer_add_u32(&bw, length);
+
+    memset(&result, 0, sizeof(result));
+    erase_log_length = 0;
+    packet(buf, buf_writer_get_offset(&bw));
+}
+
+static void erase(uint32_t address, uint32_t length) {
+    flash_command(CMD_FLASH_ERASE, address, length);
+}
+
+static void program(uint32_t address, const uint8_t *data, uint32_t length) {
+    flash_command(CMD_FLASH_PROGRAM, address, length);
+    for (uint32_t offset = 0; offset < length; offset += CMD_EPOUT_SIZE) {
+        packet(data + offset, length - offset < CMD_EPOUT_SIZE ? length - offset : CMD_EPOUT_SIZE);
+    }
+}
+
+static void crc(uint32_t address, uint32_t length) {
+    flash_command(CMD_FLASH_CRC, address, length);
+}
+
+static void check_result(const char *what, enum spi_flash_status status, uint32_t value) {
+    check(result.replied && result.status == status && result.value == value, "%s: status %u value 0x%x, expected %u 0x%x", what,
+          result.status, (unsigned)result.value, (unsigned)status, (unsigned)value);
+}
+
+static bool mem_is(uint32_t address, uint32_t length, uint8_t value) {
+    for (uint32_t i = 0; i < length; i++) {
+        if (flash.mem[address + i] != value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void fill_random(uint8_t *data, unsigned length) {
+    for (unsigned i = 0; i < length; i++) {
+        data[i] = test_random();
+    }
+}
+
+// Erase: largest aligned erase that fits, what's erased and what isn't
+
+static const struct erase_case {
+    uint32_t address, length;
+    unsigned count;
+    struct {
+        uint8_t  cmd;
+        uint32_t address;
+    } erases[8];
+} erase_cases[] = {
+    {0x10000, 0x10000, 1, {{BLOCK_ERASE_64KB, 0x10000}}},
+    {0x08000, 0x18000, 2, {{BLOCK_ERASE_32KB, 0x08000}, {BLOCK_ERASE_64KB, 0x10000}}},
+    {0x10000, 0x08000, 1, {{BLOCK_ERASE_32KB, 0x10000}}},
+    {0x01000, 0x01000, 1, {{SECTOR_ERASE_4KB, 0x01000}}},
+    {0x03000, 0x0E000, 7, {{SECTOR_ERASE_4KB, 0x03000}, {SECTOR_ERASE_4KB, 0x04000}, {SECTOR_ERASE_4KB, 0x05000}, {SECTOR_ERASE_4KB, 0x06000}, {SECTOR_ERASE_4KB, 0x07000}, {BLOCK_ERASE_32KB, 0x08000}, {SECTOR_ERASE_4KB, 0x10000}}},
+    {0x20000, 0x01800, 2, {{SECTOR_ERASE_4KB, 0x20000}, {SECTOR_ERASE_4KB, 0x21000}}}, // partial sector at the end
+    {0x20800, 0x00100, 1, {{SECTOR_ERASE_4KB, 0x20000}}},                             // within a sector
+    {0x1F0000, 0x10000, 1, {{BLOCK_ERASE_64KB, 0x1F0000}}},                           // last block
+    {0x30000, 0, 0, {{0, 0}}},
+};
+
+static void test_erase(void) {
+    for (unsigned i = 0; i < NUM_ARRAY_ELEMENTS(erase_cases); i++) {
+        const struct erase_case *c = &erase_cases[i];
+        memset(flash.mem, 0, sizeof(flash.mem));
+        flash.erases = 0;
+
+        erase(c->address, c->length);
+        check_result("erase", SPI_FLASH_OK, 0);
+
+        bool ok = erase_log_length == c->count && flash.erases == c->count;
+        for (unsigned j = 0; ok && j < c->count; j++) {
+            ok = erase_log[j].cmd == c->erases[j].cmd && erase_log[j].address == c->erases[j].address;
+        }
+        check(ok, "erase 0x%x+0x%x: erase commands", (unsigned)c->address, (unsigned)c->length);
+
+        // Everything from the first to the last sector erased, not more
+        uint32_t begin = c->address & ~(SPI_FLASH_SECTOR_SIZE - 1);
+        uint32_t end   = c->length == 0 ? begin : ((c->address + c->length + SPI_FLASH_SECTOR_SIZE - 1) & ~(SPI_FLASH_SECTOR_SIZE - 1));
+        check(mem_is(begin, end - begin, 0xFF) && mem_is(0, begin, 0x00) && mem_is(end, W25Q16JV_SIZE - end, 0x00),
+              "erase 0x%x+0x%x: flash contents", (unsigned)c->address, (unsigned)c->length);
+    }
+    memset(flash.mem, 0xFF, sizeof(flash.mem));
+}
+
+// Erases wait for the flash: 45 ms for a sector, 150 ms for a 64 KB block
+static void test_erase_busy(void) {
+    erase(0x40000, SPI_FLASH_SECTOR_SIZE);
+    check_result("erase busy time", SPI_FLASH_OK, 0);
+    check(result.ticks >= MS_TO_TICKS(45) && result.ticks <= MS_TO_TICKS(45) + 2, "erase busy time: %u ticks", result.ticks);
+
+    erase(0x40000, 0x10000);
+    check_result("block erase busy time", SPI_FLASH_OK, 0);
+    check(result.ticks >= MS_TO_TICKS(150) && result.ticks <= MS_TO_TICKS(150) + 2, "block erase busy time: %u ticks", result.ticks);
+}
+
+// Program: unaligned start and end, blank pages skipped
+
+static void test_program(void) {
+    static uint8_t data[5 * W25Q16JV_PAGE_SIZE];
+    const uint32_t address = 0x50080;
+    const uint32_t length  = sizeof(data) - 0x80 - 0x40;
+
+    // Chunks: 0x50080-0x500FF, three whole pages, 0x50400-0x504BF. The
+    // second whole page is blank.
+    fill_random(data, sizeof(data));
+    memset(data + 0x180, 0xFF, W25Q16JV_PAGE_SIZE);
+
+    erase(0x50000, SPI_FLASH_SECTOR_SIZE);
+    flash.programs = 0;
+    program(address, data, length);
+    check_result("program", SPI_FLASH_OK, 0);
+    check(flash.programs == 4, "program: %u page programs, expected 4", flash.programs);
+    check(memcmp(&flash.mem[address], data, length) == 0, "program: flash contents");
+    check(mem_is(0x50000, address - 0x50000, 0xFF) && mem_is(address + length, 0x51000 - address - length, 0xFF), "program: outside range");
+}
+
+// Verify: a page that doesn't read back as written fails the job, the rest
+// of the data is still taken
+static void test_program_verify(void) {
+    static uint8_t data[4 * W25Q16JV_PAGE_SIZE];
+    fill_random(data, sizeof(data));
+
+    // Can't turn 0 bits back into 1 without an erase
+    erase(0x60000, SPI_FLASH_SECTOR_SIZE);
+    memset(&flash.mem[0x60200], 0x00, W25Q16JV_PAGE_SIZE);
+    flash.programs = 0;
+    program(0x60000, data, sizeof(data));
+    check_result("program verify", SPI_FLASH_ERR_VERIFY, 0x60200);
+    check(flash.programs == 3, "program verify: %u page programs, expected 3", flash.programs);
+
+    // A blank page isn't programmed, but still checked to be erased
+    erase(0x61000, SPI_FLASH_SECTOR_SIZE);
+    memset(data, 0xFF, sizeof(data));
+    flash.mem[0x61000 + 0x1F0] = 0x7F;
+    flash.programs             = 0;
+    program(0x61000, data, sizeof(data));
+    check_result("program verify blank", SPI_FLASH_ERR_VERIFY, 0x61100);
+    check(flash.programs == 0, "program verify blank: %u page programs", flash.programs);
+
+    // The decoder takes commands again afterwards
+    crc(0x61000, 1);
+    check_result("crc after failed program", SPI_FLASH_OK, crc32_update(0, &flash.mem[0x61000], 1));
+}
+
+// Timeouts: a flash that stays busy fails the job with the address of the
+// operation once its timeout has passed
+static void test_timeout(void) {
+    static uint8_t data[2 * W25Q16JV_PAGE_SIZE];
+    fill_random(data, sizeof(data));
+    erase(0x70000, SPI_FLASH_SECTOR_SIZE);
+
+    flash.busy_until = UINT64_MAX;
+
+    erase(0x71000, SPI_FLASH_SECTOR_SIZE);
+    check_result("sector erase timeout", SPI_FLASH_ERR_TIMEOUT, 0x71000);
+    check(result.ticks >= MS_TO_TICKS(1000) && result.ticks <= MS_TO_TICKS(1000) + 2, "sector erase timeout: %u ticks", result.ticks);
+
+    erase(0x80000, 0x10000);
+    check_result("block erase timeout", SPI_FLASH_ERR_TIMEOUT, 0x80000);
+    check(result.ticks >= MS_TO_TICKS(3000) && result.ticks <= MS_TO_TICKS(3000) + 2, "block erase timeout: %u ticks", result.ticks);
+
+    // Only the first erase is tried
+    erase(0x90000, 0x20000);
+    check_result("erase timeout, more blocks", SPI_FLASH_ERR_TIMEOUT, 0x90000);
+    check(erase_log_length == 1, "erase timeout, more blocks: %u erase commands", erase_log_length);
+
+    program(0x70000, data, sizeof(data));
+    check_result("page program timeout", SPI_FLASH_ERR_TIMEOUT, 0x70000);
+    check(result.ticks >= MS_TO_TICKS(10) && result.ticks <= MS_TO_TICKS(10) + 2, "page program timeout: %u ticks", result.ticks);
+
+    flash.busy_until = 0;
+    program(0x70000, data, sizeof(data));
+    check_result("program after timeout", SPI_FLASH_OK, 0);
+}
+
+// CRC: against lib/crc32.c, over ranges of one and several DMA chunks
+
+static void test_crc(void) {
+    static const struct {
+        uint32_t address, length;
+    } ranges[] = {
+        {0xA0000, 1},
+        {0xA0001, 3},
+        {0xA0FFF, 2},
+        {0xA0000, 32768},
+        {0xA0123, 32769},
+        {0xA0000, 70000},
+        {0x1F0000, 0x10000}, // up to the end of the flash
+    };
+
+    fill_random(&flash.mem[0xA0000], 0x20000);
+    fill_random(&flash.mem[0x1F0000], 0x10000);
+
+    for (unsigned i = 0; i < NUM_ARRAY_ELEMENTS(ranges); i++) {
+        crc(ranges[i].address, ranges[i].length);
+        check_result("crc", SPI_FLASH_OK, crc32_update(0, &flash.mem[ranges[i].address], ranges[i].length));
+    }
+
+    // Erased flash
+    static uint8_t blank[SPI_FLASH_SECTOR_SIZE];
+    memset(blank, 0xFF, sizeof(blank));
+    erase(0xC0000, SPI_FLASH_SECTOR_SIZE);
+    crc(0xC0000, sizeof(blank));
+    check_result("crc erased", SPI_FLASH_OK, crc32_update(0, blank, sizeof(blank)));
+}
+
+void test_flash(void) {
+    w25q16jv_init(&flash, true);
+    hal_host_attach_spi(&flash_device);
+    uint8_t mode = CMD_SPI_MODE_FLASH;
+    packet(&mode, 1);
+
+    test_erase();
+    test_erase_busy();
+    test_program();
+    test_program_verify();
+    test_timeout();
+    test_crc();
+
+    hal_host_attach_spi(NULL);
+}
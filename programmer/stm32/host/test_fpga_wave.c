@@ -0,0 +1,230 @@
+#include "lib.h"
+#include "fpga_wave.h"
+#include "fpga_config.h"
+#include "stats.h"
+#include "test.h"
+
+// FPGA configuration waveform: the samples fpga_wave.c generates, decoded the
+// way the FPGA sees them, and fpga_config.c's refills with the DMA position
+// (CNDTR) and interrupt flags set by the test, for the underrun checks.
+
+// Interrupt handler in fpga_config.c, in the vector table on the target
+void dma1_channel2_3_irq_handler(void);
+
+#define SCK (1 << 5)
+#define DATA (1 << 6)
+#define MAX_BYTES (64)
+
+// Data bits the FPGA samples: the data pin at each rising edge of SCK, MSB
+// first. Returns the number of bits, data must have room for all of them.
+static unsigned decode(const uint8_t *samples, unsigned count, bool sck_before, uint8_t *data) {
+    unsigned bits = 0;
+    for (unsigned i = 0; i < count; i++) {
+        bool sck = samples[i] & SCK;
+        if (sck && !sck_before) {
+            if (bits % 8 == 0) {
+                data[bits / 8] = 0;
+            }
+            // The data bit is set up with SCK low and still there on the edge
+            bool bit = samples[i] & DATA;
+            if (i == 0 || bit != ((samples[i - 1] & DATA) != 0)) {
+                return (unsigned)-1;
+            }
+            data[bits / 8] |= bit << (7 - bits % 8);
+            bits++;
+        }
+        sck_before = sck;
+    }
+    return bits;
+}
+
+// Known and random bytes, one after the other, from and back to idle
+static void test_expand(void) {
+    struct fpga_wave wave;
+    fpga_wave_init(&wave, 0, SCK, DATA);
+
+    uint8_t bytes[MAX_BYTES] = {0x00, 0xFF, 0x80, 0x01, 0x7E, 0xAA, 0x99, 0x7E};
+    for (unsigned i = 8; i < MAX_BYTES; i++) {
+        bytes[i] = test_random();
+    }
+    static uint8_t samples[(MAX_BYTES + 2) * FPGA_WAVE_SAMPLES_PER_BYTE];
+    for (unsigned length = 1; length <= MAX_BYTES; length++) {
+        uint8_t *p = samples;
+        fpga_wave_fill_idle(&wave, p, FPGA_WAVE_SAMPLES_PER_BYTE);
+        p += FPGA_WAVE_SAMPLES_PER_BYTE;
+        fpga_wave_expand(&wave, p, bytes, length);
+        p += length * FPGA_WAVE_SAMPLES_PER_BYTE;
+        fpga_wave_fill_idle(&wave, p, FPGA_WAVE_SAMPLES_PER_BYTE);
+        p += FPGA_WAVE_SAMPLES_PER_BYTE;
+
+        uint8_t  decoded[MAX_BYTES];
+        unsigned bits = decode(samples, p - samples, true, decoded);
+        check(bits == length * 8 && memcmp(decoded, bytes, length) == 0, "fpga wave: %u bytes decode to %u bits", length, bits);
+    }
+
+    // Single bits, so a wrong bit order or a shifted bit shows
+    for (unsigned bit = 0; bit < 8; bit++) {
+        uint8_t byte = 0x80 >> bit, decoded = 0;
+        fpga_wave_expand(&wave, samples, &byte, 1);
+        unsigned bits = decode(samples, FPGA_WAVE_SAMPLES_PER_BYTE, true, &decoded);
+        check(bits == 8 && decoded == byte, "fpga wave: byte 0x%02x decodes to 0x%02x", byte, decoded);
+        check((samples[2 * bit] & DATA) && (samples[2 * bit + 1] & DATA) && !(samples[2 * bit] & SCK),
+              "fpga wave: bit %u of 0x%02x not in samples %u-%u", 7 - bit, byte, 2 * bit, 2 * bit + 1);
+    }
+}
+
+// Idle samples hold SCK high, after a byte as well, so they never clock
+static void test_idle(void) {
+    struct fpga_wave wave;
+    fpga_wave_init(&wave, 0, SCK, DATA);
+
+    uint8_t samples[4 * FPGA_WAVE_SAMPLES_PER_BYTE];
+    memset(samples, 0xA5, sizeof(samples));
+    fpga_wave_fill_idle(&wave, samples + 1, sizeof(samples) - 2);
+
+    bool ok = samples[0] == 0xA5 && samples[sizeof(samples) - 1] == 0xA5;
+    for (unsigned i = 1; i < sizeof(samples) - 1; i++) {
+        ok = ok && (samples[i] & SCK);
+    }
+    check(ok, "fpga wave: idle samples with SCK low or out of range");
+
+    uint8_t byte = 0x5A, decoded[2];
+    fpga_wave_expand(&wave, samples, &byte, 1);
+    fpga_wave_fill_idle(&wave, samples + FPGA_WAVE_SAMPLES_PER_BYTE, FPGA_WAVE_SAMPLES_PER_BYTE);
+    check(decode(samples, 2 * FPGA_WAVE_SAMPLES_PER_BYTE, true, decoded) == 8, "fpga wave: idle samples clock the FPGA");
+}
+
+// The other pins keep the output data register's value
+static void test_other_pins(void) {
+    for (unsigned i = 0; i < 256; i++) {
+        uint8_t          odr = i, byte = test_random();
+        struct fpga_wave wave;
+        fpga_wave_init(&wave, odr, SCK, DATA);
+
+        uint8_t samples[2 * FPGA_WAVE_SAMPLES_PER_BYTE];
+        fpga_wave_expand(&wave, samples, &byte, 1);
+        fpga_wave_fill_idle(&wave, samples + FPGA_WAVE_SAMPLES_PER_BYTE, FPGA_WAVE_SAMPLES_PER_BYTE);
+
+        bool ok = true;
+        for (unsigned s = 0; s < sizeof(samples); s++) {
+            ok = ok && (samples[s] & ~(SCK | DATA)) == (odr & ~(SCK | DATA));
+        }
+        check(ok, "fpga wave: other pins not kept with ODR 0x%02x", odr);
+    }
+}
+
+// DMA model: CNDTR counts down from the buffer size to 1 as the DMA moves
+// through the buffer, the half transfer interrupt comes at the middle, the
+// transfer complete interrupt at the end
+static unsigned dma_size;
+
+static void dma_interrupt(uint32_t isr, unsigned position) {
+    DMA1_Channel3->CNDTR = dma_size - position % dma_size;
+    DMA1->ISR            = isr;
+    dma1_channel2_3_irq_handler();
+    DMA1->ISR = 0;
+}
+
+static void config_start(void) {
+    fpga_config_stop();
+    fpga_config_start();
+    dma_size    = DMA1_Channel3->CNDTR;
+    GPIOA->BSRR = 0;
+}
+
+// The FPGA reset pin is active low, an underrun sets it low
+static bool fpga_held_in_reset(void) {
+    return GPIOA->BSRR == 1U << ((IO_FPGA_RESET & 15) + 16);
+}
+
+// Refills in time: the FIFO drains a half at a time, no underrun
+static void test_config_in_time(void) {
+    static const uint8_t data[FPGA_CONFIG_FIFO_SIZE + 100];
+    const unsigned       total = 4 * FPGA_CONFIG_FIFO_SIZE;
+
+    uint32_t underruns = stats.fpga_underruns;
+    config_start();
+    check(!fpga_config_busy(), "fpga config: busy before any data");
+
+    unsigned written = fpga_config_write(data, sizeof(data));
+    check(written == FPGA_CONFIG_FIFO_SIZE, "fpga config: FIFO not filled up");
+    check(fpga_config_write(data, 1) == 0, "fpga config: full FIFO takes data");
+
+    // The interrupts come right after the DMA crossed into the other half,
+    // each refill makes room for the next few bytes
+    unsigned refills = 0;
+    for (; refills < 1000 && fpga_config_busy(); refills++) {
+        bool half = refills % 2 == 0;
+        dma_interrupt(half ? DMA_ISR_HTIF3 : DMA_ISR_TCIF3, half ? dma_size / 2 + 1 : 1);
+        unsigned length = total - written < sizeof(data) ? total - written : sizeof(data);
+        written += fpga_config_write(data, length);
+    }
+
+    // Then the two idle halves
+    unsigned half_bytes = dma_size / 2 / FPGA_WAVE_SAMPLES_PER_BYTE;
+    unsigned expected   = total / half_bytes + 2;
+    check(written == total && refills == expected, "fpga config: %u refills for %u bytes, expected %u", refills, written, expected);
+    check(stats.fpga_underruns == underruns && !fpga_held_in_reset(), "fpga config: underrun with refills in time");
+    fpga_config_stop();
+}
+
+// A refill after the DMA got back to the half, with and without data
+static void test_config_late(void) {
+    static const uint8_t data[64];
+
+    // Idle halves may be late, they're the same samples again
+    uint32_t underruns = stats.fpga_underruns;
+    config_start();
+    dma_interrupt(DMA_ISR_HTIF3, 1);
+    dma_interrupt(DMA_ISR_TCIF3, dma_size / 2 + 1);
+    check(stats.fpga_underruns == underruns && !fpga_held_in_reset(), "fpga config: underrun on a late idle refill");
+
+    // New data in the late half: part of it is skipped
+    fpga_config_write(data, sizeof(data));
+    dma_interrupt(DMA_ISR_HTIF3, 1);
+    check(stats.fpga_underruns == underruns + 1 && fpga_held_in_reset(), "fpga config: no underrun on a late refill with data");
+    check(DMA1_Channel3->CCR == 0 && TIM3->CR1 == 0, "fpga config: DMA still running after an underrun");
+
+    // The rest is dropped
+    check(fpga_config_write(data, sizeof(data)) == sizeof(data) && !fpga_config_busy(), "fpga config: data taken after an underrun");
+    dma_interrupt(DMA_ISR_TCIF3, 1);
+    check(stats.fpga_underruns == underruns + 1, "fpga config: underrun counted twice");
+
+    // No new data, but the half had data the last time: it goes out again
+    underruns = stats.fpga_underruns;
+    config_start();
+    fpga_config_write(data, 1);
+    dma_interrupt(DMA_ISR_HTIF3, dma_size / 2 + 1);
+    dma_interrupt(DMA_ISR_TCIF3, 1);
+    check(stats.fpga_underruns == underruns, "fpga config: underrun on refills in time");
+    dma_interrupt(DMA_ISR_HTIF3, 1);
+    check(stats.fpga_underruns == underruns + 1, "fpga config: no underrun on a late refill after data");
+    fpga_config_stop();
+}
+
+// Both interrupts at once: the DMA went through a half without a refill
+static void test_config_both_interrupts(void) {
+    static const uint8_t data[64];
+
+    uint32_t underruns = stats.fpga_underruns;
+    config_start();
+    dma_interrupt(DMA_ISR_HTIF3 | DMA_ISR_TCIF3, 1);
+    check(stats.fpga_underruns == underruns, "fpga config: underrun with both interrupts while idle");
+
+    // The first half with data went out again, and neither refill is late
+    // nor has new data: only the two flags show it
+    fpga_config_write(data, 16);
+    dma_interrupt(DMA_ISR_HTIF3, dma_size / 2 + 1);
+    dma_interrupt(DMA_ISR_HTIF3 | DMA_ISR_TCIF3, dma_size / 2 + 1);
+    check(stats.fpga_underruns == underruns + 1 && fpga_held_in_reset(), "fpga config: no underrun with both interrupts at once");
+    fpga_config_stop();
+}
+
+void test_fpga_wave(void) {
+    test_expand();
+    test_idle();
+    test_other_pins();
+    test_config_in_time();
+    test_config_late();
+    test_config_both_interrupts();
+}
@@ -0,0 +1,189 @@
+#include "lib.h"
+#include "spsc_ring.h"
+#include "test.h"
+#include <pthread.h>
+#include <sched.h>
+
+// SPSC ring: region sizes against a model of head and tail, a producer and a
+// consumer thread passing a sequence through it, and the overrun path of a
+// producer that can't wait (usbd_cdc_if.c's circular UART DMA).
+
+#define MAX_SIZE (256)
+
+static uint32_t slots[MAX_SIZE];
+
+// Region sizes: producer and consumer take random parts of what's offered,
+// the counters wrap around during the run
+static void test_regions(unsigned steps) {
+    for (uint32_t size = 1; size <= MAX_SIZE; size *= 4) {
+        struct spsc_ring ring;
+        spsc_ring_init(&ring, size);
+        ring.head = ring.tail = 0xFFFFFFFF - 3 * size; // counters wrap after a few rounds
+
+        uint32_t head = ring.head, tail = ring.tail;
+        bool     ok   = true;
+        for (unsigned step = 0; step < steps && ok; step++) {
+            uint32_t index, count;
+            if (test_random() & 1) {
+                count           = spsc_ring_write_region(&ring, &index);
+                uint32_t free   = size - (head - tail);
+                uint32_t contig = size - (head & (size - 1));
+                ok              = index == (head & (size - 1)) && count == (free < contig ? free : contig);
+                uint32_t n      = test_random_below(count + 1);
+                for (uint32_t i = 0; i < n; i++) {
+                    slots[index + i] = head + i;
+                }
+                spsc_ring_commit_write(&ring, n);
+                head += n;
+            } else {
+                count           = spsc_ring_read_region(&ring, &index);
+                uint32_t used   = head - tail;
+                uint32_t contig = size - (tail & (size - 1));
+                ok              = index == (tail & (size - 1)) && count == (used < contig ? used : contig);
+                uint32_t n      = test_random_below(count + 1);
+                for (uint32_t i = 0; i < n; i++) {
+                    ok = ok && slots[index + i] == tail + i;
+                }
+                spsc_ring_commit_read(&ring, n);
+                tail += n;
+            }
+            ok = ok && spsc_ring_used(&ring) == head - tail && spsc_ring_free(&ring) == size - (head - tail);
+            ok = ok && spsc_ring_discard_overrun(&ring) == 0;
+        }
+        check(ok, "ring regions, size %u", (unsigned)size);
+    }
+}
+
+// Producer and consumer threads, each handling random parts of its region
+
+#define STRESS_SIZE (64)
+
+static struct spsc_ring stress_ring;
+static uint32_t         stress_count;
+
+static uint32_t next_random(uint32_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+static void *stress_producer(void *arg) {
+    uint32_t x = (uint32_t)(uintptr_t)arg;
+    for (uint32_t value = 0; value < stress_count;) {
+        uint32_t index;
+        uint32_t count = spsc_ring_write_region(&stress_ring, &index);
+        if (count == 0) {
+            sched_yield();
+            continue;
+        }
+        uint32_t n = 1 + next_random(&x) % count;
+        if (n > stress_count - value) {
+            n = stress_count - value;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            slots[index + i] = value++;
+        }
+        spsc_ring_commit_write(&stress_ring, n);
+    }
+    return NULL;
+}
+
+static void test_threads(uint32_t count) {
+    spsc_ring_init(&stress_ring, STRESS_SIZE);
+    stress_count = count;
+
+    pthread_t producer;
+    if (pthread_create(&producer, NULL, stress_producer, (void *)(uintptr_t)(test_random() | 1)) != 0) {
+        check(false, "ring threads: pthread_create");
+        return;
+    }
+
+    uint32_t x        = test_random() | 1;
+    uint32_t expected = 0;
+    uint32_t errors   = 0;
+    while (expected < count) {
+        uint32_t index;
+        uint32_t available = spsc_ring_read_region(&stress_ring, &index);
+        if (available > STRESS_SIZE) {
+            errors++;
+            break;
+        }
+        if (available == 0) {
+            sched_yield();
+            continue;
+        }
+        uint32_t n = 1 + next_random(&x) % available;
+        for (uint32_t i = 0; i < n; i++) {
+            if (slots[index + i] != expected++) {
+                errors++;
+            }
+        }
+        spsc_ring_commit_read(&stress_ring, n);
+    }
+    pthread_join(producer, NULL);
+
+    check(errors == 0 && spsc_ring_used(&stress_ring) == 0, "ring threads: %u values out of sequence", (unsigned)errors);
+}
+
+// Overrun: the producer writes like a circular DMA, without looking at the
+// tail, and commits the position it has reached. When the consumer falls
+// behind, used exceeds the size until the consumer discards the overwritten
+// slots and reads the newest ones.
+static void test_overrun(unsigned steps) {
+    const uint32_t   size = 16;
+    struct spsc_ring ring;
+    spsc_ring_init(&ring, size);
+
+    uint32_t written = 0; // slots written by the "DMA"
+    uint32_t head = 0, tail = 0;
+    unsigned overruns = 0;
+    bool     ok       = true;
+    for (unsigned step = 0; step < steps && ok; step++) {
+        // The DMA may not go around the ring once more between commits
+        uint32_t n = test_random_below(size);
+        for (uint32_t i = 0; i < n; i++) {
+            slots[written % size] = written;
+            written++;
+        }
+        uint32_t added = spsc_ring_commit_write_to(&ring, written % size);
+        ok             = added == n && spsc_ring_used(&ring) == written - tail;
+        head           = written;
+
+        // The consumer sometimes falls behind
+        if (test_random_below(4) != 0) {
+            continue;
+        }
+        uint32_t lost = spsc_ring_discard_overrun(&ring);
+        if (head - tail > size) {
+            overruns++;
+            ok = ok && lost == head - tail - size;
+            tail += lost;
+        } else {
+            ok = ok && lost == 0;
+        }
+        ok = ok && spsc_ring_used(&ring) == head - tail && spsc_ring_used(&ring) <= size;
+
+        // What's left is in sequence, the newest data after an overrun
+        uint32_t index, count;
+        while (ok && (count = spsc_ring_read_region(&ring, &index)) > 0) {
+            uint32_t m = 1 + test_random_below(count);
+            for (uint32_t i = 0; i < m; i++) {
+                ok = ok && slots[index + i] == tail + i;
+            }
+            spsc_ring_commit_read(&ring, m);
+            tail += m;
+            if (test_random_below(2) == 0) {
+                break;
+            }
+        }
+    }
+    check(ok, "ring overrun: used, discarded slots or data");
+    check(overruns > steps / 20, "ring overrun: only %u overruns", overruns);
+}
+
+void test_ring(void) {
+    test_regions(200000);
+    test_threads(2000000);
+    test_overrun(200000);
+}
@@ -0,0 +1,195 @@
+#include "lib.h"
+#include "hal_host.h"
+#include "test.h"
+
+// Scheduler: tasks of all priorities posted in bursts by a simulated
+// interrupt, which may fire while a handler runs, checked against a model of
+// the per priority FIFOs. The cycle counter is simulated, so run times and
+// latencies can be checked exactly.
+
+#define TASKS_PER_PRIORITY (4)
+#define TASK_COUNT (TASK_PRIORITY_COUNT * TASKS_PER_PRIORITY)
+
+static struct task tasks[TASK_COUNT]; // priority is index / TASKS_PER_PRIORITY
+
+// Model: posted tasks per priority in order, and what the scheduler's
+// statistics should say
+static struct {
+    unsigned ids[TASK_COUNT];
+    unsigned length;
+} model[TASK_PRIORITY_COUNT];
+
+static bool     model_posted[TASK_COUNT];
+static uint32_t model_post_cycles[TASK_COUNT];
+static uint32_t model_runs[TASK_COUNT];
+static uint64_t model_time[TASK_COUNT];
+static uint32_t model_max_time[TASK_COUNT];
+static uint32_t model_latency_max;
+static unsigned model_errors;
+
+static uint32_t cycles; // simulated cycle counter
+static bool     interrupts_enabled;
+static unsigned interrupt_count;
+
+static void advance_cycles(uint32_t delta) {
+    hal_host_advance_cycles(delta);
+    cycles += delta;
+}
+
+static void post(unsigned id) {
+    if (!model_posted[id]) {
+        unsigned priority = id / TASKS_PER_PRIORITY;
+        model[priority].ids[model[priority].length++] = id;
+        model_posted[id]                              = true;
+        model_post_cycles[id]                         = cycles;
+    }
+    task_post(&tasks[id]);
+}
+
+// Task the scheduler should run next: first of the highest priority
+static unsigned model_take(void) {
+    for (unsigned priority = 0; priority < TASK_PRIORITY_COUNT; priority++) {
+        if (model[priority].length > 0) {
+            unsigned id = model[priority].ids[0];
+            memmove(&model[priority].ids[0], &model[priority].ids[1], --model[priority].length * sizeof(unsigned));
+            model_posted[id] = false;
+            return id;
+        }
+    }
+    return TASK_COUNT;
+}
+
+// Interrupt handler posting a burst of tasks, the running one included
+static void interrupt(void) {
+    interrupt_count++;
+    unsigned count = 1 + test_random_below(TASK_COUNT / 2);
+    for (unsigned i = 0; i < count; i++) {
+        post(test_random_below(TASK_COUNT));
+    }
+}
+
+static void test_task_handler(void) {
+    unsigned id = (uintptr_t)task_get_current_argument();
+    if (model_take() != id || tasks[id].posted) {
+        model_errors++;
+    }
+
+    uint32_t latency = cycles - model_post_cycles[id];
+    if (latency > model_latency_max) {
+        model_latency_max = latency;
+    }
+
+    // Run time, with an interrupt in the middle of it now and then
+    uint32_t time = 1 + test_random_below(1000);
+    advance_cycles(time / 2);
+    if (interrupts_enabled && test_random_below(4) == 0) {
+        interrupt();
+    }
+    advance_cycles(time - time / 2);
+
+    model_runs[id]++;
+    model_time[id] += time;
+    if (time > model_max_time[id]) {
+        model_max_time[id] = time;
+    }
+}
+
+static void tasks_init(void) {
+    for (unsigned id = 0; id < TASK_COUNT; id++) {
+        task_init(&tasks[id], test_task_handler, (void *)(uintptr_t)id, id / TASKS_PER_PRIORITY);
+        model_runs[id]     = 0;
+        model_time[id]     = 0;
+        model_max_time[id] = 0;
+    }
+    model_latency_max = 0;
+    model_errors      = 0;
+    task_get_latency_max(true);
+}
+
+// Bitmap decode: every combination of posted priorities, posted in every order
+static void test_priority_masks(void) {
+    tasks_init();
+    interrupts_enabled = false;
+
+    static const uint8_t orders[][TASK_PRIORITY_COUNT] = {{0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0}};
+    for (unsigned mask = 1; mask < (1 << TASK_PRIORITY_COUNT); mask++) {
+        for (unsigned order = 0; order < NUM_ARRAY_ELEMENTS(orders); order++) {
+            unsigned expected = 0;
+            for (unsigned i = 0; i < TASK_PRIORITY_COUNT; i++) {
+                unsigned priority = orders[order][i];
+                if (mask & (1 << priority)) {
+                    post(priority * TASKS_PER_PRIORITY + order % TASKS_PER_PRIORITY);
+                    expected++;
+                }
+            }
+            unsigned errors = model_errors;
+            check(task_run_posted() == expected && model_errors == errors, "tasks: priority mask %u, order %u", mask, order);
+        }
+    }
+}
+
+// A handler that posts itself runs again, after the tasks of its priority
+// posted before
+static char     repost_order[8];
+static unsigned repost_length;
+
+static void repost_handler(void) {
+    char c = *(char *)task_get_current_argument();
+    if (repost_length < sizeof(repost_order) - 1) {
+        repost_order[repost_length++] = c;
+    }
+    if (c == 'A' && repost_length == 1) {
+        task_post(task_get_current());
+        task_post(task_get_current()); // already posted again, runs once
+    }
+}
+
+static void test_repost(void) {
+    static char        names[] = "AB";
+    static struct task a, b;
+    task_init(&a, repost_handler, &names[0], TASK_PRIORITY_NORMAL);
+    task_init(&b, repost_handler, &names[1], TASK_PRIORITY_NORMAL);
+
+    repost_length = 0;
+    task_post(&a);
+    task_post(&b);
+    check(task_run_posted() == 3 && strcmp(repost_order, "ABA") == 0, "tasks: re-post while running, order %s", repost_order);
+    check(a.runs == 2 && b.runs == 1 && !a.posted, "tasks: re-post while running, run counts");
+}
+
+// Bursts from the interrupt between and during handlers
+static void test_bursts(unsigned rounds) {
+    tasks_init();
+    interrupts_enabled = true;
+    interrupt_count    = 0;
+
+    unsigned runs = 0;
+    for (unsigned round = 0; round < rounds; round++) {
+        interrupt();
+        runs += task_run_posted();
+        advance_cycles(test_random_below(100));
+    }
+
+    unsigned model_total = 0;
+    bool     ok          = true;
+    for (unsigned id = 0; id < TASK_COUNT; id++) {
+        model_total += model_runs[id];
+        ok = ok && tasks[id].runs == model_runs[id] && tasks[id].time == model_time[id] && tasks[id].max_time == model_max_time[id];
+    }
+    check(model_errors == 0, "tasks: %u tasks run out of priority order", model_errors);
+    check(runs == model_total && model_take() == TASK_COUNT, "tasks: run count");
+    check(ok, "tasks: run time accounting");
+    check(task_get_latency_max(true) == model_latency_max, "tasks: latency");
+    check(interrupt_count > rounds * 2, "tasks: only %u interrupts", interrupt_count);
+}
+
+void test_tasks(void) {
+    task_run_posted();
+    hal_host_simulate_cycles(true);
+
+    test_priority_masks();
+    test_repost();
+    test_bursts(100000);
+
+    hal_host_simulate_cycles(false);
+}
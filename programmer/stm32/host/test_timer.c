@@ -0,0 +1,211 @@
+#include "lib.h"
+#include "hal_host.h"
+#include "test.h"
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Timers: random starts, restarts and stops against a model of when each
+// timer expires, with hal_host's lltimer standing in for the hardware one.
+
+static struct timer timers[OS_TIMER_COUNT];
+
+// Model of each timer
+static struct {
+    bool      running;
+    os_time_t expiration_time;
+    uint32_t  interval;
+    unsigned  expiries;
+} model[OS_TIMER_COUNT];
+
+static unsigned  expiries[OS_TIMER_COUNT];
+static os_time_t last_expiration; // handlers run in order of expiration time
+static unsigned  handler_errors;
+
+static void test_timer_handler(void) {
+    struct timer *timer = timer_get_current();
+    unsigned      id    = timer - timers;
+    os_time_t     due   = timer->interval > 0 ? timer->expiration_time - timer->interval : timer->expiration_time;
+    if (id >= OS_TIMER_COUNT || timer_get_current_argument() != &expiries[id] || due > os_get_time() || due < last_expiration) {
+        handler_errors++;
+    }
+    last_expiration = due;
+    expiries[id]++;
+}
+
+// Expire the model's timers up to now
+static void model_advance(os_time_t now) {
+    for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+        while (model[i].running && model[i].expiration_time <= now) {
+            model[i].expiries++;
+            if (model[i].interval > 0) {
+                model[i].expiration_time += model[i].interval;
+            } else {
+                model[i].running = false;
+            }
+        }
+    }
+}
+
+static void advance_time(uint32_t delta) {
+    hal_host_advance_time(delta);
+    task_run_posted();
+    model_advance(os_get_time());
+}
+
+// Position of the timer in the heap, 0 for the first to expire
+static unsigned heap_position(unsigned id) {
+    return timers[id].heap_position - 1;
+}
+
+// The running timers take up heap positions 1..n, one each
+static bool heap_is_consistent(void) {
+    unsigned used = 0, count = 0;
+    for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+        if (timer_is_running(&timers[i])) {
+            used |= 1U << heap_position(i);
+            count++;
+        }
+    }
+    return used == (1U << count) - 1;
+}
+
+static bool timers_match_model(void) {
+    bool ok = heap_is_consistent();
+    for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+        ok = ok && timer_is_running(&timers[i]) == model[i].running && expiries[i] == model[i].expiries;
+        ok = ok && (!model[i].running || timers[i].expiration_time == model[i].expiration_time);
+    }
+    return ok;
+}
+
+static void timers_init(void) {
+    for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+        timer_init(&timers[i], test_timer_handler, &expiries[i], 0);
+        memset(&model[i], 0, sizeof(model[i]));
+        expiries[i] = 0;
+    }
+    last_expiration = 0;
+    handler_errors  = 0;
+}
+
+static void timers_stop(void) {
+    for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+        timer_stop(&timers[i]);
+    }
+    task_run_posted();
+}
+
+// Random operations, a few ticks apart
+static void test_random_operations(unsigned steps) {
+    timers_init();
+
+    unsigned not_first = 0; // stops and restarts of a timer not at the top of the heap
+    bool     ok        = true;
+    for (unsigned step = 0; step < steps && ok; step++) {
+        unsigned op    = test_random_below(5);
+        unsigned id    = test_random_below(OS_TIMER_COUNT);
+        uint32_t delay = test_random_below(50);
+        if (op <= 2 && timer_is_running(&timers[id]) && heap_position(id) != 0) {
+            not_first++;
+        }
+
+        switch (op) {
+            case 0:
+                timer_start(&timers[id], delay);
+                model[id].running         = true;
+                model[id].expiration_time = os_get_time() + delay;
+                break;
+            case 1: {
+                uint32_t interval = test_random_below(4) == 0 ? 0 : 1 + test_random_below(30);
+                timer_restart(&timers[id], delay, interval);
+                model[id].running         = true;
+                model[id].expiration_time = os_get_time() + delay;
+                model[id].interval        = interval;
+                break;
+            }
+            case 2:
+                timer_stop(&timers[id]);
+                model[id].running = false;
+                break;
+            default:
+                // A delay of 0 runs the timers started for now
+                advance_time(test_random_below(8));
+                break;
+        }
+        ok = timers_match_model();
+    }
+    timers_stop();
+
+    check(ok && handler_errors == 0, "timers: random operations");
+    check(not_first > steps / 10, "timers: only %u operations on timers not first in the heap", not_first);
+}
+
+// Stop and restart of timers in the middle of the heap
+static void test_middle(void) {
+    timers_init();
+    for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+        timer_start(&timers[i], 10 * (i + 1));
+        model[i].running         = true;
+        model[i].expiration_time = os_get_time() + 10 * (i + 1);
+    }
+
+    unsigned middle = OS_TIMER_COUNT / 2;
+    bool     ok     = heap_position(middle) != 0;
+    timer_stop(&timers[middle]);
+    model[middle].running = false;
+    ok                    = ok && timers_match_model();
+
+    // Later than all others, then earlier than all others
+    unsigned other = middle + 1;
+    ok             = ok && heap_position(other) != 0;
+    timer_start(&timers[other], 1000);
+    model[other].expiration_time = os_get_time() + 1000;
+    ok                           = ok && timers_match_model();
+    timer_start(&timers[middle], 5);
+    model[middle].running         = true;
+    model[middle].expiration_time = os_get_time() + 5;
+    ok                            = ok && heap_position(middle) == 0 && timers_match_model();
+
+    for (unsigned t = 0; t < 1000 && ok; t++) {
+        advance_time(1);
+        ok = timers_match_model();
+    }
+    timers_stop();
+    check(ok && handler_errors == 0, "timers: stop and restart in the middle of the heap");
+}
+
+// Starting one timer more than OS_TIMER_COUNT asserts, tried in a child
+// process
+static void test_count_limit(void) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        static struct timer extra;
+        timers_init();
+        for (unsigned i = 0; i < OS_TIMER_COUNT; i++) {
+            timer_start(&timers[i], 100);
+        }
+        timer_start(&timers[0], 200); // running already, no new heap entry
+        if (!heap_is_consistent()) {
+            _exit(1);
+        }
+        fclose(stderr); // the assert's message is expected, a core dump isn't
+        setrlimit(RLIMIT_CORE, &(struct rlimit){0, 0});
+        timer_init(&extra, test_timer_handler, NULL, 0);
+        timer_start(&extra, 100);
+        _exit(0);
+    }
+
+    int status;
+    check(pid > 0 && waitpid(pid, &status, 0) == pid && WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT,
+          "timers: no assert when starting more than OS_TIMER_COUNT");
+}
+
+void test_timer(void) {
+    task_run_posted();
+    test_random_operations(200000);
+    test_middle();
+    test_count_limit();
+}
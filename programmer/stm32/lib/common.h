@@ -32,6 +32,16 @@ static inline void __membar(void) {
                              : "memory");
 }
 
+#ifdef HOST_BUILD
+// The host build is single threaded, simulated interrupts are only raised
+// between tasks, so there is nothing to mask.
+#    define ATOMIC_SECTION_ENTER \
+        {                        \
+            __membar();
+#    define ATOMIC_SECTION_LEAVE \
+        __membar();              \
+        }
+#else
 /**
  * @brief      Enter atomic section. Should be closed with ATOMIC_SECTION_LEAVE.
  *             Interrupts are disabled during the atomic section. Interrupt
@@ -58,6 +68,7 @@ static inline void __membar(void) {
     __asm volatile("msr primask, %0" ::"r"(__atomic)); \
     __DSB();                                           \
     }
+#endif
 
 /**
  * @brief      Get number of elements in array
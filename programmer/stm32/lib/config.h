@@ -2,3 +2,6 @@
 
 #define STACK_SIZE (1024)
 #define RTT_BUFFER_SIZE (512)
+#define TRACE_ENABLED (1)
+#define TRACE_BUFFER_SIZE (256)
+#define OS_TIMER_COUNT (8)
@@ -0,0 +1,32 @@
+#include "crc32.h"
+#include "clock.h"
+
+// Nibble-wise table, small enough to not matter in flash.
+static const uint32_t crc32_table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length) {
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+    while (length--) {
+        crc ^= *(p++);
+        crc = (crc >> 4) ^ crc32_table[crc & 0xF];
+        crc = (crc >> 4) ^ crc32_table[crc & 0xF];
+    }
+    return ~crc;
+}
+
+void crc32_hw_begin(void) {
+    clock_enable(CLK_CRC);
+
+    // Reflected in- and output (bit reversal per byte) gives the same result as crc32_update()
+    CRC->INIT = 0xFFFFFFFF;
+    CRC->CR   = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT | CRC_CR_RESET;
+}
+
+uint32_t crc32_hw_end(void) {
+    return ~CRC->DR;
+}
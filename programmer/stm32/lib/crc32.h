@@ -0,0 +1,43 @@
+/**
+ * @file
+ */
+
+/**
+ * @defgroup   crc32 CRC-32
+ * @brief      CRC-32 as used by zlib/Ethernet (reflected, polynomial 0x04C11DB7).
+ * @ingroup    lib
+ * @{
+ */
+
+#pragma once
+
+#include "common.h"
+
+/**
+ * @brief      Update a CRC-32 with a block of data. Start with a crc of 0, the
+ *             returned value can be passed in again to continue the
+ *             calculation (same semantics as zlib's crc32()).
+ *
+ * @param      crc     CRC of the preceding data, 0 for the first block
+ * @param      data    Pointer to data
+ * @param      length  Length of data in bytes
+ *
+ * @return     CRC-32 of all data so far
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length);
+
+/**
+ * @brief      Reset the CRC unit to start a new CRC-32 calculation. Data is
+ *             fed by writing bytes to CRC->DR, which lets DMA transfers
+ *             calculate the CRC without CPU involvement.
+ */
+void crc32_hw_begin(void);
+
+/**
+ * @brief      Get result of hardware CRC-32 calculation.
+ *
+ * @return     CRC-32 of all bytes written to CRC->DR since crc32_hw_begin()
+ */
+uint32_t crc32_hw_end(void);
+
+/** @} */
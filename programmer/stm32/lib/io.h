@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "clock.h"
 
 #define IO_BANK(x) ((x) << 4)
 #define IO_INVERT (1 << 8)
@@ -33,7 +34,7 @@ enum iopull {
 };
 
 static inline GPIO_TypeDef *io_get_gpio_regs(uint32_t io) {
-    return (GPIO_TypeDef *)(GPIOA_BASE + (((io >> 4) & 0xF) * 0x400));
+    return (GPIO_TypeDef *)(uintptr_t)(GPIOA_BASE + (((io >> 4) & 0xF) * 0x400));
 }
 
 static inline void io_set_mode(uint32_t io, enum iomode mode) {
@@ -115,14 +116,14 @@ static inline void io_set_alternate_function(uint32_t io, int function) {
         (gpio->AFR[afr_idx] & ~(0xF << shift)) |
         ((function & 0xF) << shift);
 }
-static inline clock_t io_clock_for_io(uint32_t io) {
+static inline enum clock io_clock_for_io(uint32_t io) {
     switch ((io >> 4) & 0xF) {
         case IOBANK_A: return CLK_GPIOA;
         case IOBANK_B: return CLK_GPIOB;
         case IOBANK_C: return CLK_GPIOC;
         case IOBANK_D: return CLK_GPIOD;
         case IOBANK_F: return CLK_GPIOF;
-        default: return (clock_t)0;
+        default: return (enum clock)0;
     }
 }
 
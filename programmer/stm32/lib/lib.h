@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "rtt.h"
+#include "trace.h"
 #include "clock.h"
 #include "io.h"
 #include "os.h"
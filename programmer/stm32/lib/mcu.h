@@ -5,6 +5,22 @@
 #define SYSCLK_FREQ (48000000)
 #define NUM_MCU_INTERRUPTS (32)
 
+#ifdef HOST_BUILD
+// Built for the host (see host/Makefile): delays return at once, the cycle
+// counter runs off the host's clock.
+uint32_t host_cycle_counter(void);
+
+static inline void udelay(uint32_t dt) {
+    (void)dt;
+}
+
+static inline void cycle_counter_init(void) {
+}
+
+static inline uint32_t cycle_counter_get(void) {
+    return host_cycle_counter() & SysTick_LOAD_RELOAD_Msk;
+}
+#else
 static inline void udelay(uint32_t dt) {
     uint32_t count = (dt * (SYSCLK_FREQ / 1000000)) / 4;
     if (count) {
@@ -12,3 +28,27 @@ static inline void udelay(uint32_t dt) {
                              : "+r"(count));
     }
 }
+
+// SysTick as a free running CPU cycle counter for run time accounting. It has
+// 24 bits, so it wraps every 350 ms.
+static inline void cycle_counter_init(void) {
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL  = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+static inline uint32_t cycle_counter_get(void) {
+    return SysTick_LOAD_RELOAD_Msk - SysTick->VAL;
+}
+#endif
+
+static inline uint32_t cycle_counter_elapsed(uint32_t start) {
+    return (cycle_counter_get() - start) & SysTick_LOAD_RELOAD_Msk;
+}
+
+// Wait for a number of CPU cycles, for delays shorter than udelay() resolves
+static inline void cycle_counter_delay(uint32_t cycles) {
+    uint32_t start = cycle_counter_get();
+    while (cycle_counter_elapsed(start) < cycles) {
+    }
+}
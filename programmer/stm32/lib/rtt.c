@@ -286,7 +286,7 @@ struct segger_rtt_cb {
     char                          id[16];           // Initialized to "SEGGER RTT"
     int                           max_up_buffers;   // Initialized to SEGGER_RTT_NUM_UP_BUFFERS (type. 2)
     int                           max_down_buffers; // Initialized to SEGGER_RTT_NUM_DOWN_BUFFERS (type. 2)
-    struct segger_rtt_buffer_up   up;               // Up buffer, transferring information up from target via debug probe to host
+    struct segger_rtt_buffer_up   up[2];            // Up buffers, transferring information up from target via debug probe to host (terminal, trace)
     struct segger_rtt_buffer_down down;             // Down buffer, transferring information down from host via debug probe to target
 };
 
@@ -299,15 +299,27 @@ static struct segger_rtt_cb segger_rtt; // Initialized by bootcode to zero
 static char rtt_up_buffer[RTT_BUFFER_SIZE];
 static char rtt_down_buffer[4];
 
+#    if TRACE_ENABLED
+static alignas(4) char rtt_trace_buffer[TRACE_BUFFER_SIZE];
+_Static_assert(TRACE_BUFFER_SIZE % sizeof(struct trace_record) == 0, "trace records must not wrap around");
+#    endif
+
 static void rtt_init(void) {
     if (segger_rtt.id[0] == 0) {
         // memset(&segger_rtt, 0, sizeof(segger_rtt));
-        segger_rtt.max_up_buffers   = 1;
-        segger_rtt.max_down_buffers = 1;
-        segger_rtt.up.buffer        = rtt_up_buffer;
-        segger_rtt.up.buffer_size   = sizeof(rtt_up_buffer);
-        segger_rtt.down.buffer      = rtt_down_buffer;
-        segger_rtt.down.buffer_size = sizeof(rtt_down_buffer);
+        segger_rtt.max_up_buffers    = 2;
+        segger_rtt.max_down_buffers  = 1;
+        segger_rtt.up[0].name        = "Terminal";
+        segger_rtt.up[0].buffer      = rtt_up_buffer;
+        segger_rtt.up[0].buffer_size = sizeof(rtt_up_buffer);
+#    if TRACE_ENABLED
+        segger_rtt.up[1].name        = "Trace";
+        segger_rtt.up[1].buffer      = rtt_trace_buffer;
+        segger_rtt.up[1].buffer_size = sizeof(rtt_trace_buffer);
+#    endif
+        segger_rtt.down.name         = "Terminal";
+        segger_rtt.down.buffer       = rtt_down_buffer;
+        segger_rtt.down.buffer_size  = sizeof(rtt_down_buffer);
 
         segger_rtt.id[0] = 'S';
         segger_rtt.id[1] = 'E';
@@ -326,12 +338,12 @@ static void rtt_write_bytes(const void *buf, size_t size) {
     const uint8_t *p = buf;
 
     // Determine free space in ring buffer
-    unsigned read_offset  = segger_rtt.up.read_offset;
-    unsigned write_offset = segger_rtt.up.write_offset;
+    unsigned read_offset  = segger_rtt.up[0].read_offset;
+    unsigned write_offset = segger_rtt.up[0].write_offset;
     {
         unsigned buf_remaining;
         if (read_offset <= write_offset) {
-            buf_remaining = segger_rtt.up.buffer_size - 1u - write_offset + read_offset;
+            buf_remaining = segger_rtt.up[0].buffer_size - 1u - write_offset + read_offset;
         } else {
             buf_remaining = read_offset - write_offset - 1u;
         }
@@ -341,19 +353,60 @@ static void rtt_write_bytes(const void *buf, size_t size) {
         }
     }
 
-    unsigned remaining = segger_rtt.up.buffer_size - write_offset;
+    unsigned remaining = segger_rtt.up[0].buffer_size - write_offset;
     if (size <= remaining) {
         // All data fits before wrap around
-        memcpy(segger_rtt.up.buffer + write_offset, p, size);
-        segger_rtt.up.write_offset = write_offset + size;
+        memcpy(segger_rtt.up[0].buffer + write_offset, p, size);
+        segger_rtt.up[0].write_offset = write_offset + size;
     } else {
         // We reach the end of the buffer, so need to wrap around
-        memcpy(segger_rtt.up.buffer + write_offset, p, remaining);
+        memcpy(segger_rtt.up[0].buffer + write_offset, p, remaining);
         unsigned bytes_to_copy = size - remaining;
-        memcpy(segger_rtt.up.buffer, p + remaining, bytes_to_copy);
-        segger_rtt.up.write_offset = bytes_to_copy;
+        memcpy(segger_rtt.up[0].buffer, p + remaining, bytes_to_copy);
+        segger_rtt.up[0].write_offset = bytes_to_copy;
+    }
+}
+
+#    if TRACE_ENABLED
+// The buffer size is a multiple of the record size, so records never wrap
+static void trace_put(struct segger_rtt_buffer_up *up, const struct trace_record *record) {
+    memcpy(up->buffer + up->write_offset, record, sizeof(*record));
+    up->write_offset = (up->write_offset + sizeof(*record)) % up->buffer_size;
+}
+
+void trace_write(const char *fmt, uint32_t arg0, uint32_t arg1) {
+    static const char dropped_fmt[] __attribute__((section(".trace_fmt"))) = "%u events dropped";
+    static unsigned   dropped;
+
+    rtt_init();
+
+    struct segger_rtt_buffer_up *up = &segger_rtt.up[1];
+    ATOMIC_SECTION_ENTER {
+        unsigned used   = (up->write_offset - up->read_offset + up->buffer_size) % up->buffer_size;
+        unsigned needed = (dropped > 0 ? 2 : 1) * sizeof(struct trace_record);
+
+        if (used + needed >= up->buffer_size) {
+            dropped++;
+        } else {
+            struct trace_record record = {
+                .cycles = cycle_counter_get(),
+                .ticks  = (uint16_t)os_get_time(),
+            };
+            if (dropped > 0) {
+                record.fmt    = (uint16_t)(uintptr_t)dropped_fmt;
+                record.arg[0] = dropped;
+                trace_put(up, &record);
+                dropped = 0;
+            }
+            record.fmt    = (uint16_t)(uintptr_t)fmt;
+            record.arg[0] = arg0;
+            record.arg[1] = arg1;
+            trace_put(up, &record);
+        }
     }
+    ATOMIC_SECTION_LEAVE
 }
+#    endif
 
 size_t rtt_read(void *buf, size_t length) {
     rtt_init();
@@ -0,0 +1,161 @@
+/**
+ * @file
+ */
+
+/**
+ * @defgroup   spscring SPSC ring
+ * @brief      Lock-free single-producer/single-consumer ring of slots.
+ * @details    The ring only keeps the positions; the slots (bytes, packet
+ *             buffers, ...) are an array owned by the user, indexed by the
+ *             values returned here. One side, e.g. an interrupt handler or a
+ *             DMA, only writes, the other only reads, so neither has to mask
+ *             interrupts. The write and read regions are contiguous, to hand
+ *             them to a DMA or USB transfer directly and commit when it is
+ *             done.
+ * @ingroup    lib
+ * @{
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+/**
+ * @brief      Ring control structure
+ */
+struct spsc_ring {
+    uint32_t size; ///< Number of slots, a power of two
+    uint32_t head; ///< Slots written, only changed by the producer
+    uint32_t tail; ///< Slots read, only changed by the consumer
+};
+
+/**
+ * @brief      Initialize ring. Neither side may use it meanwhile.
+ *
+ * @param      ring  Pointer to struct spsc_ring structure
+ * @param      size  Number of slots, a power of two
+ */
+static inline void spsc_ring_init(struct spsc_ring *ring, uint32_t size) {
+    assert(size != 0 && (size & (size - 1)) == 0);
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+/**
+ * @brief      Get number of slots holding data. A producer that can't check
+ *             for free space (e.g. a circular DMA) may have overrun the
+ *             consumer, then this is larger than the ring; see
+ *             spsc_ring_discard_overrun().
+ *
+ * @param      ring  Pointer to struct spsc_ring structure
+ *
+ * @return     Number of used slots
+ */
+static inline uint32_t spsc_ring_used(const struct spsc_ring *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief      Get number of free slots
+ *
+ * @param      ring  Pointer to struct spsc_ring structure
+ *
+ * @return     Number of free slots
+ */
+static inline uint32_t spsc_ring_free(const struct spsc_ring *ring) {
+    return ring->size - spsc_ring_used(ring);
+}
+
+/**
+ * @brief      Producer: get free slots to write to, up to the end of the array.
+ *
+ * @param      ring   Pointer to struct spsc_ring structure
+ * @param      index  Returns the index of the first free slot
+ *
+ * @return     Number of contiguous free slots, 0 if the ring is full
+ */
+static inline uint32_t spsc_ring_write_region(const struct spsc_ring *ring, uint32_t *index) {
+    uint32_t head   = ring->head;
+    uint32_t free   = ring->size - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+    uint32_t offset = head & (ring->size - 1);
+    *index          = offset;
+    return free < ring->size - offset ? free : ring->size - offset;
+}
+
+/**
+ * @brief      Producer: hand slots written to the consumer.
+ *
+ * @param      ring   Pointer to struct spsc_ring structure
+ * @param      count  Number of slots, at most what spsc_ring_write_region()
+ *                    returned, unless the producer can't avoid an overrun.
+ */
+static inline void spsc_ring_commit_write(struct spsc_ring *ring, uint32_t count) {
+    __atomic_store_n(&ring->head, ring->head + count, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief      Producer: move the write position to a slot the hardware has
+ *             written up to, e.g. taken from a circular DMA's counter.
+ *
+ * @param      ring   Pointer to struct spsc_ring structure
+ * @param      index  Index of the next slot the hardware will write
+ *
+ * @return     Number of slots added. Must be called before the hardware
+ *             has gone around the ring once more.
+ */
+static inline uint32_t spsc_ring_commit_write_to(struct spsc_ring *ring, uint32_t index) {
+    uint32_t count = (index - ring->head) & (ring->size - 1);
+    spsc_ring_commit_write(ring, count);
+    return count;
+}
+
+/**
+ * @brief      Consumer: get slots to read from, up to the end of the array.
+ *
+ * @param      ring   Pointer to struct spsc_ring structure
+ * @param      index  Returns the index of the first used slot
+ *
+ * @return     Number of contiguous used slots, 0 if the ring is empty
+ */
+static inline uint32_t spsc_ring_read_region(const struct spsc_ring *ring, uint32_t *index) {
+    uint32_t tail   = ring->tail;
+    uint32_t used   = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    uint32_t offset = tail & (ring->size - 1);
+    *index          = offset;
+    return used < ring->size - offset ? used : ring->size - offset;
+}
+
+/**
+ * @brief      Consumer: give slots read back to the producer.
+ *
+ * @param      ring   Pointer to struct spsc_ring structure
+ * @param      count  Number of slots, at most what spsc_ring_read_region()
+ *                    returned
+ */
+static inline void spsc_ring_commit_read(struct spsc_ring *ring, uint32_t count) {
+    __atomic_store_n(&ring->tail, ring->tail + count, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief      Consumer: after the producer has overrun the consumer, skip
+ *             the slots that were overwritten. Only for producers that
+ *             can't wait for free space. Don't call while slots from
+ *             spsc_ring_read_region() are still in use.
+ *
+ * @param      ring  Pointer to struct spsc_ring structure
+ *
+ * @return     Number of slots lost
+ */
+static inline uint32_t spsc_ring_discard_overrun(struct spsc_ring *ring) {
+    uint32_t used = spsc_ring_used(ring);
+    if (used <= ring->size) {
+        return 0;
+    }
+    spsc_ring_commit_read(ring, used - ring->size);
+    return used - ring->size;
+}
+
+/** @} */
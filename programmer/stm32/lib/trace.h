@@ -0,0 +1,67 @@
+/**
+ * @file
+ */
+
+/**
+ * @defgroup   trace Trace
+ * @brief      Binary event tracing over RTT.
+ * @details    Each event is a fixed-size record written to RTT up-buffer 1
+ *             ("Trace"), without formatting anything on the target. The
+ *             format strings are kept in the .trace_fmt section of the ELF
+ *             file, which isn't loaded into the flash; a record only holds
+ *             the string's offset in it. trace-decode.py looks the strings up
+ *             in the ELF file and formats the records on the host.
+ *
+ *             Only integer arguments (at most two) are supported, e.g. %u,
+ *             %d, %x or %c, no strings. An event costs a few stores with
+ *             interrupts disabled, so it can be used in interrupt handlers
+ *             and timing-sensitive code. Events are dropped while the buffer
+ *             is full, the host is told how many when there is room again.
+ * @ingroup    lib
+ * @{
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+
+/**
+ * @brief      Trace record, as found in the RTT buffer
+ */
+struct trace_record {
+    uint32_t cycles; ///< CPU cycle counter (24 bits, see cycle_counter_get())
+    uint16_t ticks;  ///< Lower 16 bits of the OS time
+    uint16_t fmt;    ///< Offset of the format string in the .trace_fmt section
+    uint32_t arg[2]; ///< Arguments
+};
+
+#if TRACE_ENABLED
+/**
+ * @brief      Trace an event
+ *
+ * @param      ...  Format string literal, followed by up to two integer
+ *                  arguments
+ */
+#    define TRACE(...) TRACE_(__VA_ARGS__, 0, 0, 0)
+#    define TRACE_(fmt, arg0, arg1, ...)                                                 \
+        do {                                                                             \
+            static const char trace_fmt_[] __attribute__((section(".trace_fmt"))) = fmt; \
+            trace_write(trace_fmt_, (uint32_t)(arg0), (uint32_t)(arg1));                 \
+        } while (0)
+#else
+#    define TRACE(...) \
+        do {           \
+        } while (0)
+#endif
+
+/**
+ * @brief      Write trace record. Use TRACE() instead.
+ *
+ * @param      fmt   Format string in the .trace_fmt section
+ * @param      arg0  First argument
+ * @param      arg1  Second argument
+ */
+void trace_write(const char *fmt, uint32_t arg0, uint32_t arg1);
+
+/** @} */
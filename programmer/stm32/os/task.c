@@ -1,43 +1,101 @@
 #include "task.h"
 #include "lib.h"
 
-LIST_NODE(posted_tasks);
+// One FIFO of posted tasks per priority, and a bitmap of the non-empty ones
+static struct list_node posted_tasks[TASK_PRIORITY_COUNT] = {
+    {.prev = &posted_tasks[0], .next = &posted_tasks[0]},
+    {.prev = &posted_tasks[1], .next = &posted_tasks[1]},
+    {.prev = &posted_tasks[2], .next = &posted_tasks[2]},
+};
+static unsigned posted_priorities;
+
+// Highest priority (lowest bit) set in the bitmap, Cortex-M0 has no CLZ/CTZ
+static const uint8_t first_priority[1 << TASK_PRIORITY_COUNT] = {0, 0, 1, 0, 2, 0, 1, 0};
+_Static_assert(TASK_PRIORITY_COUNT == 3, "update posted_tasks and first_priority");
+
 static struct task *current_task;
+static struct task *run_tasks;   // tasks that have run, for task_print_stats()
+static uint32_t     latency_max; // cycles from task_post() until the handler ran
 
-void task_init(struct task *task, void (*handler)(void), void *arg) {
-    task->handler = handler;
-    task->arg     = arg;
-    task->posted  = false;
+void task_init(struct task *task, void (*handler)(void), void *arg, enum task_priority priority) {
+    task->handler  = handler;
+    task->arg      = arg;
+    task->posted   = false;
+    task->priority = priority;
+    task->label    = NULL;
+    task->runs     = 0;
+    task->max_time = 0;
+    task->time     = 0;
     list_node_init(&task->list_node);
 }
 
 void task_post(struct task *task) {
     ATOMIC_SECTION_ENTER {
         if (!task->posted) {
-            task->posted = true;
+            task->posted    = true;
+            task->post_time = cycle_counter_get();
             list_node_remove(&task->list_node);
-            list_node_insert(&task->list_node, posted_tasks.prev);
+            list_node_insert(&task->list_node, posted_tasks[task->priority].prev);
+            posted_priorities |= 1U << task->priority;
         }
     }
     ATOMIC_SECTION_LEAVE
 }
 
 static void suspend_cpu(void) {
+#ifndef HOST_BUILD
     // Suspend and wait for interrupt
     __WFI();
+#endif
+}
+
+static void run_task(struct task *task) {
+    uint32_t start   = cycle_counter_get();
+    uint32_t latency = (start - task->post_time) & SysTick_LOAD_RELOAD_Msk;
+    if (latency > latency_max) {
+        latency_max = latency;
+    }
+
+    current_task = task;
+    task->handler();
+    current_task = NULL;
+
+    // A handler running longer than the cycle counter wraps is counted short
+    uint32_t time = cycle_counter_elapsed(start);
+    if (task->runs == 0) {
+        task->next_run = run_tasks;
+        run_tasks      = task;
+    }
+    task->runs++;
+    task->time += time;
+    if (time > task->max_time) {
+        task->max_time = time;
+    }
+}
+
+// Get first task of the highest posted priority. Called in critical section.
+static struct task *take_posted_task(void) {
+    if (posted_priorities == 0) {
+        return NULL;
+    }
+
+    unsigned          priority = first_priority[posted_priorities];
+    struct list_node *list     = &posted_tasks[priority];
+    struct task *     task     = GET_CONTAINER_OF(list->next, struct task, list_node);
+
+    list_node_remove(&task->list_node);
+    task->posted = false;
+    if (list_node_is_empty(list)) {
+        posted_priorities &= ~(1U << priority);
+    }
+    return task;
 }
 
 void task_run(void) {
     while (1) {
-        // Get next task from posted task list
-        struct task *task = NULL;
+        struct task *task;
         ATOMIC_SECTION_ENTER {
-            if (!list_node_is_empty(&posted_tasks)) {
-                task = GET_CONTAINER_OF(posted_tasks.next, struct task, list_node);
-                list_node_remove(&task->list_node);
-                task->posted = false;
-            }
-
+            task = take_posted_task();
             if (task == NULL) {
                 // No active task, suspend
                 suspend_cpu();
@@ -47,13 +105,45 @@ void task_run(void) {
 
         // Run task
         if (task != NULL) {
-            current_task = task;
-            task->handler();
-            current_task = NULL;
+            run_task(task);
         }
     }
 }
 
+unsigned task_run_posted(void) {
+    unsigned count = 0;
+    while (1) {
+        struct task *task;
+        ATOMIC_SECTION_ENTER {
+            task = take_posted_task();
+        }
+        ATOMIC_SECTION_LEAVE
+
+        if (task == NULL) {
+            return count;
+        }
+        run_task(task);
+        count++;
+    }
+}
+
+uint32_t task_get_latency_max(bool clear) {
+    uint32_t result = latency_max;
+    if (clear) {
+        latency_max = 0;
+    }
+    return result;
+}
+
+void task_print_stats(void) {
+    uint32_t cycles_per_us = clock_get_frequency(CLK_DMA) / 1000000; // AHB clock, same as SysTick
+
+    for (struct task *task = run_tasks; task != NULL; task = task->next_run) {
+        printf("task %-24s prio %u runs %8lu total %10lu us max %8lu us\n", task->label != NULL ? task->label : "?", task->priority, (unsigned long)task->runs,
+               (unsigned long)(task->time / cycles_per_us), (unsigned long)(task->max_time / cycles_per_us));
+    }
+}
+
 struct task *task_get_current(void) {
     return current_task;
 }
@@ -13,6 +13,17 @@
 #include "common.h"
 #include "list_node.h"
 
+/**
+ * @brief      Task priority. Posted tasks of a higher priority always run
+ *             first, tasks of the same priority in the order they were posted.
+ */
+enum task_priority {
+    TASK_PRIORITY_HIGH,   ///< Short handlers that keep data flowing (timers, UART bridge)
+    TASK_PRIORITY_NORMAL, ///< Default
+    TASK_PRIORITY_LOW,    ///< Background work
+    TASK_PRIORITY_COUNT,
+};
+
 /**
  * @brief      Task control structure (don't manipulate directly)
  */
@@ -21,6 +32,13 @@ struct task {
     void *           arg;       ///< User defined argument that can be retrieved by handler function
     struct list_node list_node; ///< List node to keep track of tasks
     volatile bool    posted;    ///< True when task is posted
+    uint8_t          priority;  ///< enum task_priority
+    const char *     label;     ///< Name shown by task_print_stats()
+    struct task *    next_run;  ///< List of tasks that have run, for task_print_stats()
+    uint32_t         runs;      ///< Number of times the handler was called
+    uint32_t         max_time;  ///< Longest handler run in CPU cycles
+    uint64_t         time;      ///< Total handler run time in CPU cycles
+    uint32_t         post_time; ///< Cycle counter when the task was posted
 };
 
 /**
@@ -29,8 +47,9 @@ struct task {
  * @param      task      Task object
  * @param      handler   Task handler
  * @param      arg       Argument that can be retrieved by handler
+ * @param      priority  Task priority
  */
-void task_init(struct task *task, void (*handler)(void), void *arg);
+void task_init(struct task *task, void (*handler)(void), void *arg, enum task_priority priority);
 
 /**
  * @brief      Post task for execution
@@ -53,6 +72,21 @@ struct task *task_get_current(void);
  */
 void *task_get_current_argument(void);
 
+/**
+ * @brief      Get the longest time from task_post() until a handler ran.
+ *
+ * @param      clear  Start over after reading.
+ *
+ * @return     Latency in CPU cycles
+ */
+uint32_t task_get_latency_max(bool clear);
+
+/**
+ * @brief      Print run count and run time of all tasks that have run to the
+ *             debug output.
+ */
+void task_print_stats(void);
+
 /**
  * @brief      Task loop. Not to be called from user code.
  * @details    This function never returns. It will loop over the list of posted
@@ -62,6 +96,14 @@ void *task_get_current_argument(void);
  */
 void task_run(void);
 
+/**
+ * @brief      Run posted tasks, including the ones they post, until none is
+ *             left. Doesn't suspend, for the host build's benchmarks.
+ *
+ * @return     Number of handlers run
+ */
+unsigned task_run_posted(void);
+
 /**
  * @brief      Forward declare static task.
  *
@@ -79,23 +121,31 @@ void task_run(void);
     extern struct task name
 
 /**
- * @brief      Define task handler. This macro will implicitly also define and initialize a static struct task object.
+ * @brief      Define task handler with a priority. This macro will implicitly also define and initialize a static struct task object.
  *
  * @param      name  Name of task.
+ * @param      prio  Task priority, see enum task_priority.
  */
-#define TASK(name)                                                                                                                                             \
-    static void        task_handler_##name(void);                                                                                                              \
-    static struct task name = {.handler = task_handler_##name, .arg = NULL, .list_node = {.prev = &name.list_node, .next = &name.list_node}, .posted = false}; \
+#define TASK_WITH_PRIORITY(name, prio)                                                                                                                                                           \
+    static void        task_handler_##name(void);                                                                                                                                                \
+    static struct task name = {.handler = task_handler_##name, .arg = NULL, .list_node = {.prev = &name.list_node, .next = &name.list_node}, .posted = false, .priority = prio, .label = #name}; \
     static void        task_handler_##name(void)
 
+/**
+ * @brief      Define task handler. This macro will implicitly also define and initialize a static struct task object.
+ *
+ * @param      name  Name of task.
+ */
+#define TASK(name) TASK_WITH_PRIORITY(name, TASK_PRIORITY_NORMAL)
+
 /**
  * @brief      Define task handler. This macro will implicitly also define and initialize a non-static struct task object.
  *
  * @param      name  Name of task.
  */
-#define TASK_NONSTATIC(name)                                                                                                                            \
-    static void task_handler_##name(void);                                                                                                              \
-    struct task name = {.handler = task_handler_##name, .arg = NULL, .list_node = {.prev = &name.list_node, .next = &name.list_node}, .posted = false}; \
+#define TASK_NONSTATIC(name)                                                                                                                                                                              \
+    static void task_handler_##name(void);                                                                                                                                                                \
+    struct task name = {.handler = task_handler_##name, .arg = NULL, .list_node = {.prev = &name.list_node, .next = &name.list_node}, .posted = false, .priority = TASK_PRIORITY_NORMAL, .label = #name}; \
     static void task_handler_##name(void)
 
 /** @} */
@@ -1,38 +1,95 @@
 #include "timer.h"
 #include "lib.h"
 
-LIST_NODE(timer_list);
+// Running timers are kept in a binary min-heap ordered by expiration time, so
+// heap[0] expires first. Inserting, removing and moving a timer are O(log n);
+// a re-armed interval timer is moved in place, and since its new expiration
+// time is usually later than most others, it rarely has far to go.
+static struct timer *heap[OS_TIMER_COUNT];
+static unsigned      heap_count;
 static struct timer *current_timer;
+static uint32_t      lateness_max; // system ticks a handler ran after its expiration time
 
 TASK_DECL(ostimer);
 
-// Assumed to be called in critical section
-static void ostimer_insert(struct timer *timer) {
-    assert(timer != NULL);
-    assert(list_node_is_empty(&timer->list_node));
+static void heap_set(unsigned position, struct timer *timer) {
+    heap[position]       = timer;
+    timer->heap_position = position + 1;
+}
 
-    // Add timer to list of active time events (sorted by expiration time)
-    struct list_node *node = &timer_list;
-    while (node->next != &timer_list) {
-        struct list_node *next_node = node->next;
+static void heap_sift_up(unsigned position, struct timer *timer) {
+    while (position > 0) {
+        unsigned parent = (position - 1) / 2;
+        if (heap[parent]->expiration_time <= timer->expiration_time) {
+            break;
+        }
+        heap_set(position, heap[parent]);
+        position = parent;
+    }
+    heap_set(position, timer);
+}
 
-        struct timer *node_timer = GET_CONTAINER_OF(node->next, struct timer, list_node);
-        if (node_timer->expiration_time > timer->expiration_time) {
+static void heap_sift_down(unsigned position, struct timer *timer) {
+    while (true) {
+        unsigned child = 2 * position + 1;
+        if (child >= heap_count) {
             break;
         }
-        node = next_node;
+        if (child + 1 < heap_count && heap[child + 1]->expiration_time < heap[child]->expiration_time) {
+            child++;
+        }
+        if (timer->expiration_time <= heap[child]->expiration_time) {
+            break;
+        }
+        heap_set(position, heap[child]);
+        position = child;
     }
-    list_node_insert(&timer->list_node, node);
+    heap_set(position, timer);
+}
 
-    task_post(&ostimer);
+// Put timer at position, moving it up or down as needed
+static void heap_place(unsigned position, struct timer *timer) {
+    if (position > 0 && timer->expiration_time < heap[(position - 1) / 2]->expiration_time) {
+        heap_sift_up(position, timer);
+    } else {
+        heap_sift_down(position, timer);
+    }
 }
 
 // Assumed to be called in critical section
 static void ostimer_remove(struct timer *timer) {
-    // Remove timer from list of active time events
-    list_node_remove(&timer->list_node);
+    if (timer->heap_position == 0) {
+        return;
+    }
+    unsigned position    = timer->heap_position - 1;
+    timer->heap_position = 0;
 
-    task_post(&ostimer);
+    struct timer *last = heap[--heap_count];
+    if (last != timer) {
+        heap_place(position, last);
+    }
+
+    // The lltimer callback is only set for the first timer
+    if (position == 0) {
+        task_post(&ostimer);
+    }
+}
+
+// Assumed to be called in critical section
+static void ostimer_set_expiration_time(struct timer *timer, os_time_t expiration_time) {
+    unsigned position;
+    if (timer->heap_position == 0) {
+        assert(heap_count < OS_TIMER_COUNT);
+        position = heap_count++;
+    } else {
+        position = timer->heap_position - 1;
+    }
+    timer->expiration_time = expiration_time;
+    heap_place(position, timer);
+
+    if (position == 0 || timer->heap_position == 1) {
+        task_post(&ostimer);
+    }
 }
 
 void timer_init(struct timer *timer, void (*handler)(void), void *arg, uint32_t interval) {
@@ -40,7 +97,7 @@ void timer_init(struct timer *timer, void (*handler)(void), void *arg, uint32_t
     timer->arg             = arg;
     timer->interval        = interval;
     timer->expiration_time = 0;
-    list_node_init(&timer->list_node);
+    timer->heap_position   = 0;
 }
 
 void timer_start(struct timer *timer, uint32_t delay) {
@@ -49,18 +106,15 @@ void timer_start(struct timer *timer, uint32_t delay) {
 
 void timer_start_with_expiration_time(struct timer *timer, os_time_t expiration_time) {
     ATOMIC_SECTION_ENTER {
-        ostimer_remove(timer);
-        timer->expiration_time = expiration_time;
-        ostimer_insert(timer);
+        ostimer_set_expiration_time(timer, expiration_time);
     }
     ATOMIC_SECTION_LEAVE
 }
 
 void timer_restart(struct timer *timer, uint32_t delay, uint32_t interval) {
     ATOMIC_SECTION_ENTER {
-        timer_stop(timer);
         timer->interval = interval;
-        timer_start(timer, delay);
+        ostimer_set_expiration_time(timer, os_get_time() + delay);
     }
     ATOMIC_SECTION_LEAVE
 }
@@ -77,25 +131,29 @@ void *timer_argument(struct timer *timer) {
 }
 
 bool timer_is_running(struct timer *timer) {
-    bool result;
-    ATOMIC_SECTION_ENTER {
-        result = !list_node_is_empty(&timer->list_node);
-    }
-    ATOMIC_SECTION_LEAVE
-    return result;
+    return timer->heap_position != 0;
 }
 
-TASK(ostimer) {
+TASK_WITH_PRIORITY(ostimer, TASK_PRIORITY_HIGH) {
     struct timer *timer;
 
     do {
         timer = NULL;
 
         ATOMIC_SECTION_ENTER {
-            if (!list_node_is_empty(&timer_list)) {
-                timer = GET_CONTAINER_OF(timer_list.next, struct timer, list_node);
-                if (os_get_time() >= timer->expiration_time) {
-                    ostimer_remove(timer);
+            if (heap_count > 0) {
+                os_time_t now = os_get_time();
+                timer         = heap[0];
+                if (now >= timer->expiration_time) {
+                    if (now - timer->expiration_time > lateness_max) {
+                        lateness_max = now - timer->expiration_time;
+                    }
+                    if (timer->interval > 0) {
+                        // Interval timer, re-arm before the handler, which may still stop or restart it
+                        ostimer_set_expiration_time(timer, timer->expiration_time + timer->interval);
+                    } else {
+                        ostimer_remove(timer);
+                    }
                 } else {
                     // Too early for this timer, set lltimer to give callback when it's time for this one.
                     lltimer_callback_on_counter_value(timer->expiration_time);
@@ -112,18 +170,6 @@ TASK(ostimer) {
             current_timer = timer;
             timer->handler();
             current_timer = NULL;
-
-            ATOMIC_SECTION_ENTER {
-                if (!timer_is_running(timer)) {
-                    if (timer->interval > 0) {
-                        // Interval timer, restart timer
-                        timer->expiration_time = timer->expiration_time + timer->interval;
-
-                        ostimer_insert(timer);
-                    }
-                }
-            }
-            ATOMIC_SECTION_LEAVE
         }
     } while (timer != NULL);
 }
@@ -132,6 +178,14 @@ void lltimer_callback(void) {
     task_post(&ostimer);
 }
 
+uint32_t timer_get_lateness_max(bool clear) {
+    uint32_t result = lateness_max;
+    if (clear) {
+        lateness_max = 0;
+    }
+    return result;
+}
+
 struct timer *timer_get_current(void) {
     return current_timer;
 }
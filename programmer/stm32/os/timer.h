@@ -12,7 +12,6 @@
 #pragma once
 
 #include "common.h"
-#include "list_node.h"
 
 /**
  * @brief      OS Timer control structure
@@ -20,9 +19,9 @@
 struct timer {
     void (*handler)(void);            ///< Callback function called at timer expiry
     void *           arg;             ///< User defined argument that can be retrieved by handler function
-    struct list_node list_node;       ///< List node to keep track of timers
     uint32_t         interval;        ///< Timer interval in system ticks
     os_time_t        expiration_time; ///< Absolute expiration time in system ticks
+    uint8_t          heap_position;   ///< Position in the timer heap plus one, 0 when stopped
 };
 
 /**
@@ -105,6 +104,15 @@ struct timer *timer_get_current(void);
  */
 void *timer_get_current_argument(void);
 
+/**
+ * @brief      Get the longest delay of a timer handler after its expiration time.
+ *
+ * @param      clear  Start over after reading.
+ *
+ * @return     Delay in system ticks
+ */
+uint32_t timer_get_lateness_max(bool clear);
+
 /**
  * @brief      Forward declare static ostimer
  *
@@ -126,9 +134,9 @@ void *timer_get_current_argument(void);
  *
  * @param      name  Name of timer
  */
-#define TIMER(name)                                                                                                                                                                  \
-    static void         timer_handler_##name(void);                                                                                                                                  \
-    static struct timer name = {.handler = timer_handler_##name, .arg = NULL, .list_node = {.prev = &name.list_node, .next = &name.list_node}, .interval = 0, .expiration_time = 0}; \
+#define TIMER(name)                                                                                                 \
+    static void         timer_handler_##name(void);                                                                 \
+    static struct timer name = {.handler = timer_handler_##name, .arg = NULL, .interval = 0, .expiration_time = 0}; \
     static void         timer_handler_##name(void)
 
 /**
@@ -136,9 +144,9 @@ void *timer_get_current_argument(void);
  *
  * @param      name  Name of timer
  */
-#define TIMER_NONSTATIC(name)                                                                                                                                                 \
-    static void  timer_handler_##name(void);                                                                                                                                  \
-    struct timer name = {.handler = timer_handler_##name, .arg = NULL, .list_node = {.prev = &name.list_node, .next = &name.list_node}, .interval = 0, .expiration_time = 0}; \
+#define TIMER_NONSTATIC(name)                                                                                \
+    static void  timer_handler_##name(void);                                                                 \
+    struct timer name = {.handler = timer_handler_##name, .arg = NULL, .interval = 0, .expiration_time = 0}; \
     static void  timer_handler_##name(void)
 
 /**
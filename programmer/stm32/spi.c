@@ -1,4 +1,6 @@
 #include "spi.h"
+#include "fpga_config.h"
+#include "stats.h"
 #include "lib.h"
 
 #define USE_DMA 1
@@ -6,7 +8,40 @@
 static bool          spi_active   = false;
 static enum spi_mode current_mode = SPI_MODE_NONE;
 
-static void spi_tx_bit_bang(const void *tx_buf, size_t length);
+// Flash mode timing, see spi_set_timing(). The defaults are safe for any
+// board, the host tool looks for faster settings.
+#define NS_TO_CYCLES(ns) (((ns) * (SYSCLK_FREQ / 1000000) + 999) / 1000)
+static uint16_t spi_prescaler   = 0;
+static uint32_t cs_setup_cycles = NS_TO_CYCLES(2000);
+static uint32_t cs_hold_cycles  = NS_TO_CYCLES(2000);
+
+// The write enable before a program or erase command is deselected right
+// before selecting again
+#define CS_DESELECT_CYCLES NS_TO_CYCLES(SPI_CS_DESELECT_NS)
+
+// FPGA configuration data that didn't fit in the FIFO yet, queued by
+// spi_transfer_busy()
+static const uint8_t *fpga_pending        = NULL;
+static size_t         fpga_pending_length = 0;
+
+static void fpga_queue(const void *tx_buf, size_t length) {
+    size_t queued = fpga_config_write(tx_buf, length);
+    stats.spi_fpga_bytes += queued;
+    fpga_pending        = (const uint8_t *)tx_buf + queued;
+    fpga_pending_length = length - queued;
+}
+
+// Returns true while some of the pending data is left
+static bool fpga_queue_pending(void) {
+    if (fpga_pending_length > 0) {
+        fpga_queue(fpga_pending, fpga_pending_length);
+    }
+    return fpga_pending_length > 0;
+}
+
+bool spi_fpga_busy(void) {
+    return fpga_pending_length > 0 || fpga_config_busy();
+}
 
 static void spi_init(void) {
     if (spi_active) {
@@ -21,8 +56,8 @@ static void spi_init(void) {
 
     clock_enable(CLK_SPI1);
     unsigned freq = clock_get_frequency(CLK_SPI1);
-    uint16_t br   = 0;
-    printf("Selected SPI clock frequency: %u\n", freq / (2 << br));
+    uint16_t br   = spi_prescaler;
+    TRACE("spi_init: SPI clock %u Hz", freq / (2 << br));
 
     SPI1->CR1 = (br << 3) | SPI_CR1_SSM | SPI_CR1_SSI | SPI_CR1_MSTR;
     SPI1->CR2 = SPI_CR2_FRXTH | (7 << SPI_CR2_DS_Pos);
@@ -34,15 +69,19 @@ static void spi_init(void) {
     spi_active = true;
 }
 
+static void spi_wait_idle(void) {
+    while ((SPI1->SR & SPI_SR_FTLVL_Msk) != 0) {
+    }
+    while ((SPI1->SR & SPI_SR_BSY) != 0) {
+    }
+}
+
 static void spi_deinit(void) {
     if (!spi_active) {
         return;
     }
 
-    while ((SPI1->SR & SPI_SR_FTLVL_Msk) != 0) {
-    }
-    while ((SPI1->SR & SPI_SR_BSY) != 0) {
-    }
+    spi_wait_idle();
     SPI1->CR1 &= ~SPI_CR1_SPE;
     while ((SPI1->SR & SPI_SR_FRLVL) != 0) {
         *((volatile uint8_t *)&SPI1->DR);
@@ -54,10 +93,12 @@ static void spi_deinit(void) {
     io_set_mode(IO_SPI_MISO, IOMODE_IN);
 
     spi_active = false;
-    printf("spi_deinit\n");
+    TRACE("spi_deinit");
 }
 
 void spi_set_mode(enum spi_mode mode) {
+    fpga_config_stop();
+    fpga_pending_length = 0;
     current_mode = mode;
 
     switch (mode) {
@@ -65,7 +106,7 @@ void spi_set_mode(enum spi_mode mode) {
         case SPI_MODE_NONE:
             spi_deinit();
 
-            printf("SPI_MODE_NONE\n");
+            TRACE("SPI_MODE_NONE");
 
             io_set_mode(IO_SPI_SCK, IOMODE_IN);
             io_set_mode(IO_SPI_MISO, IOMODE_IN);
@@ -76,7 +117,7 @@ void spi_set_mode(enum spi_mode mode) {
         case SPI_MODE_FPGA_BOOT:
             spi_deinit();
 
-            printf("SPI_MODE_FPGA_BOOT\n");
+            TRACE("SPI_MODE_FPGA_BOOT");
 
             io_out(IO_FPGA_RESET, 1);
             io_set_mode(IO_SPI_SCK, IOMODE_IN);
@@ -90,10 +131,10 @@ void spi_set_mode(enum spi_mode mode) {
         case SPI_MODE_FPGA:
             spi_deinit();
 
-            printf("SPI_MODE_FPGA\n");
+            TRACE("SPI_MODE_FPGA");
 
             io_out(IO_FPGA_RESET, 1);
-            io_out(IO_SPI_SCK, 0);
+            io_out(IO_SPI_SCK, 1); // idles high, the FPGA samples on rising edges
             io_out(IO_SPI_MISO, 0);
             io_out(IO_SPI_MOSI, 0);
 
@@ -106,6 +147,7 @@ void spi_set_mode(enum spi_mode mode) {
             udelay(2);
             io_out(IO_FPGA_RESET, 0);
             udelay(2);
+            fpga_config_start();
             break;
 
         case SPI_MODE_FLASH:
@@ -122,7 +164,7 @@ void spi_set_mode(enum spi_mode mode) {
             }
 
             udelay(2);
-            printf("SPI_MODE_FLASH\n");
+            TRACE("SPI_MODE_FLASH");
 
             break;
     }
@@ -131,56 +173,103 @@ void spi_set_mode(enum spi_mode mode) {
 void spi_select(bool on) {
     if (current_mode == SPI_MODE_FLASH) {
         // printf("FPGA_SSEL: %d\n", on);
+        if (!on) {
+            cycle_counter_delay(cs_hold_cycles);
+        }
         io_out(IO_FPGA_SSEL, on);
-        udelay(2);
+        cycle_counter_delay(on ? cs_setup_cycles : CS_DESELECT_CYCLES);
+    }
+}
+
+void spi_set_timing(unsigned prescaler, unsigned cs_setup_ns, unsigned cs_hold_ns) {
+    spi_prescaler   = prescaler & 7;
+    cs_setup_cycles = NS_TO_CYCLES(cs_setup_ns);
+    cs_hold_cycles  = NS_TO_CYCLES(cs_hold_ns);
+    TRACE("spi_set_timing: prescaler %u", spi_prescaler);
+    TRACE("spi_set_timing: cs setup %u ns, hold %u ns", cs_setup_ns, cs_hold_ns);
+
+    if (spi_active) {
+        // The baud rate may only change while the SPI is disabled
+        spi_wait_idle();
+        SPI1->CR1 &= ~SPI_CR1_SPE;
+        SPI1->CR1 = (SPI1->CR1 & ~SPI_CR1_BR) | (spi_prescaler << SPI_CR1_BR_Pos);
+        SPI1->CR1 |= SPI_CR1_SPE;
     }
 }
 
 #if USE_DMA
-void spi_transfer(const void *tx_buf, void *rx_buf, size_t length) {
+static uint8_t  dma_rx_dummy;
+static uint8_t  dma_tx_dummy = 0xff;
+static bool     dma_active   = false;
+static uint32_t dma_start_time; // cycle counter
+
+static void dma_start(const volatile void *tx_buf, bool tx_increment, volatile void *rx_buf, bool rx_increment, size_t length) {
+    DMA1->IFCR = DMA_IFCR_CGIF2 | DMA_IFCR_CGIF3;
+
+    // DMA channel 2: SPI1_RX
+    DMA1_Channel2->CNDTR = length;                                     // Number of data register
+    DMA1_Channel2->CPAR  = (uintptr_t)&SPI1->DR;                       // Peripheral address register
+    DMA1_Channel2->CMAR  = (uintptr_t)rx_buf;                          // Memory address register
+    DMA1_Channel2->CCR   = (rx_increment ? DMA_CCR_MINC : 0) | DMA_CCR_EN; // Configuration register
+
+    // DMA channel 3: SPI1_TX
+    DMA1_Channel3->CNDTR = length;                                                   // Number of data register
+    DMA1_Channel3->CPAR  = (uintptr_t)&SPI1->DR;                                     // Peripheral address register
+    DMA1_Channel3->CMAR  = (uintptr_t)tx_buf;                                        // Memory address register
+    DMA1_Channel3->CCR   = (tx_increment ? DMA_CCR_MINC : 0) | DMA_CCR_DIR | DMA_CCR_EN; // Configuration register
+
+    dma_active     = true;
+    dma_start_time = cycle_counter_get();
+    stats.spi_flash_bytes += length;
+}
+
+void spi_transfer_start(const void *tx_buf, void *rx_buf, size_t length) {
     if (length == 0) {
         return;
     }
     if (!spi_active) {
-        if (tx_buf) {
-            spi_tx_bit_bang(tx_buf, length);
+        if (tx_buf && current_mode == SPI_MODE_FPGA) {
+            fpga_queue(tx_buf, length);
         }
         return;
     }
 
-    uint8_t rx_dummy;
-    uint8_t tx_dummy = 0xff;
-
-    DMA1->IFCR = DMA_IFCR_CGIF2 | DMA_IFCR_CGIF3;
+    dma_start(
+        tx_buf ? tx_buf : &dma_tx_dummy, tx_buf != NULL,
+        rx_buf ? rx_buf : &dma_rx_dummy, rx_buf != NULL,
+        length);
+}
 
-    // DMA channel 2: SPI1_RX
-    DMA1_Channel2->CNDTR = length;                       // Number of data register
-    DMA1_Channel2->CPAR  = (uintptr_t)&SPI1->DR;         // Peripheral address register
-    if (rx_buf) {                                        //
-        DMA1_Channel2->CMAR = (uintptr_t)rx_buf;         // Memory address register
-        DMA1_Channel2->CCR  = DMA_CCR_MINC | DMA_CCR_EN; // Configuration register
-    } else {                                             //
-        DMA1_Channel2->CMAR = (uintptr_t)&rx_dummy;      // Memory address register
-        DMA1_Channel2->CCR  = DMA_CCR_EN;                // Configuration register
+void spi_transfer(const void *tx_buf, void *rx_buf, size_t length) {
+    spi_transfer_start(tx_buf, rx_buf, length);
+    while (spi_transfer_busy()) {
     }
+}
 
-    // DMA channel 3: SPI1_TX
-    DMA1_Channel3->CNDTR = length;                                     // Number of data register
-    DMA1_Channel3->CPAR  = (uintptr_t)&SPI1->DR;                       // Peripheral address register
-    if (tx_buf) {                                                      //
-        DMA1_Channel3->CMAR = (uintptr_t)tx_buf;                       // Memory address register
-        DMA1_Channel3->CCR  = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN; // Configuration register
-    } else {                                                           //
-        DMA1_Channel3->CMAR = (uintptr_t)&tx_dummy;                    // Memory address register
-        DMA1_Channel3->CCR  = DMA_CCR_DIR | DMA_CCR_EN;                // Configuration register
+void spi_receive_start(volatile void *rx_buf, size_t length, bool increment) {
+    if (length == 0 || !spi_active) {
+        return;
     }
+    dma_start(&dma_tx_dummy, false, rx_buf, increment, length);
+}
 
-    while ((DMA1->ISR & (DMA_ISR_TCIF2 | DMA_ISR_TCIF3)) != (DMA_ISR_TCIF2 | DMA_ISR_TCIF3)) {
+bool spi_transfer_busy(void) {
+    if (fpga_queue_pending()) {
+        return true;
+    }
+    if (!dma_active) {
+        return false;
+    }
+    if ((DMA1->ISR & (DMA_ISR_TCIF2 | DMA_ISR_TCIF3)) != (DMA_ISR_TCIF2 | DMA_ISR_TCIF3)) {
+        return true;
     }
 
     DMA1_Channel2->CCR &= ~DMA_CCR_EN;
     DMA1_Channel3->CCR &= ~DMA_CCR_EN;
     DMA1->IFCR = DMA_IFCR_CGIF2 | DMA_IFCR_CGIF3;
+    dma_active = false;
+    stats.dma_busy_cycles += cycle_counter_elapsed(dma_start_time);
+    return false;
 }
 #else
 void spi_transfer(const void *tx_buf, void *rx_buf, size_t length) {
@@ -190,6 +279,7 @@ void spi_transfer(const void *tx_buf, void *rx_buf, size_t length) {
 
     if (spi_active) {
         // printf("spi_transfer: %u\n", length);
+        stats.spi_flash_bytes += length;
 
         uint8_t *      rx_buf8 = (uint8_t *)rx_buf;
         const uint8_t *tx_buf8 = (const uint8_t *)tx_buf;
@@ -239,29 +329,45 @@ void spi_transfer(const void *tx_buf, void *rx_buf, size_t length) {
             }
         }
 
-    } else {
-        if (tx_buf) {
-            spi_tx_bit_bang(tx_buf, length);
+    } else if (tx_buf && current_mode == SPI_MODE_FPGA) {
+        fpga_queue(tx_buf, length);
+        while (fpga_queue_pending()) {
         }
     }
 }
-#endif
 
-#pragma GCC optimize("O3")
+void spi_transfer_start(const void *tx_buf, void *rx_buf, size_t length) {
+    if (!spi_active) {
+        if (tx_buf && current_mode == SPI_MODE_FPGA) {
+            fpga_queue(tx_buf, length);
+        }
+        return;
+    }
+    spi_transfer(tx_buf, rx_buf, length);
+}
 
-void spi_tx_bit_bang(const void *tx_buf, size_t length) {
-    // printf("spi_tx_bit_bang: %u\n", length);
-    if (length == 0) {
+void spi_receive_start(volatile void *rx_buf, size_t length, bool increment) {
+    if (!spi_active) {
         return;
     }
-    const uint8_t *tx_buf8 = (const uint8_t *)tx_buf;
 
+    stats.spi_flash_bytes += length;
+    volatile uint8_t *rx_buf8 = (volatile uint8_t *)rx_buf;
     while (length--) {
-        uint8_t data = *(tx_buf8++);
-        for (unsigned i = 0; i < 8; i++) {
-            io_out(IO_SPI_SCK, 0);
-            io_out(IO_SPI_MISO, (data & (1 << (7 - i))) != 0);
-            io_out(IO_SPI_SCK, 1);
+        while ((SPI1->SR & SPI_SR_TXE) == 0) {
+        }
+        *((volatile uint8_t *)&SPI1->DR) = 0xFF;
+
+        while ((SPI1->SR & SPI_SR_RXNE) == 0) {
+        }
+        *rx_buf8 = *((volatile uint8_t *)&SPI1->DR);
+        if (increment) {
+            rx_buf8++;
         }
     }
 }
+
+bool spi_transfer_busy(void) {
+    return fpga_queue_pending();
+}
+#endif
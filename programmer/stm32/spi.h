@@ -10,6 +10,37 @@ enum spi_mode {
     SPI_MODE_FLASH,
 };
 
+// Data of FPGA configuration that isn't shifted out yet is dropped, wait for
+// spi_fpga_busy() to return false first.
 void spi_set_mode(enum spi_mode mode);
 void spi_select(bool on);
+
+// Flash mode timing: SCK is the APB clock / (2 << prescaler) (0..7), the chip
+// select setup time is waited after selecting, the hold time before
+// deselecting. Takes effect at once when flash mode is active. Whatever the
+// timing, chip select stays high for at least SPI_CS_DESELECT_NS after
+// deselecting, the W25Q16JV's minimum before an erase or program command.
+#define SPI_CS_DESELECT_NS 50 // tSHSL, 10 ns would do for reads
+
+void spi_set_timing(unsigned prescaler, unsigned cs_setup_ns, unsigned cs_hold_ns);
+
 void spi_transfer(const void *tx_buf, void *rx_buf, size_t length);
+
+// Start a transfer (max 65535 bytes) without waiting for completion, the
+// buffers must stay valid until spi_transfer_busy() returns false. In FPGA
+// mode the data is queued for configuration, busy until all of it fit in the
+// queue; the calling task is posted from the DMA interrupt when there's room
+// again, see spi_fpga_busy().
+void spi_transfer_start(const void *tx_buf, void *rx_buf, size_t length);
+
+// Start receiving length bytes (max 65535) without waiting for completion.
+// With increment false all data is written to the same address, e.g. a
+// peripheral data register. Poll spi_transfer_busy() until it returns false.
+// No other transfer may be started meanwhile.
+void spi_receive_start(volatile void *rx_buf, size_t length, bool increment);
+bool spi_transfer_busy(void);
+
+// True while FPGA configuration data is queued or still being shifted out.
+// Meanwhile the calling task is posted again from the DMA interrupt, instead
+// of polling it can wait for that.
+bool spi_fpga_busy(void);
@@ -0,0 +1,278 @@
+#include "spi_flash.h"
+#include "spi.h"
+#include "lib.h"
+#include "crc32.h"
+
+enum {
+    WRITE_ENABLE           = 0x06,
+    FAST_READ              = 0x0B, // one dummy byte before data
+    READ_STATUS_REGISTER_1 = 0x05,
+    PAGE_PROGRAM           = 0x02,
+    SECTOR_ERASE_4KB       = 0x20,
+    BLOCK_ERASE_32KB       = 0x52,
+    BLOCK_ERASE_64KB       = 0xD8,
+};
+
+#define ERASE_WRITE_IN_PROGRESS (0x01)
+
+// Worst case timings for W25Q16JV are 3 ms page program, 400 ms sector erase,
+// 1.6 s 32 KB block erase and 2 s 64 KB block erase.
+#define PAGE_PROGRAM_TIMEOUT MS_TO_TICKS(10)
+#define SECTOR_ERASE_TIMEOUT MS_TO_TICKS(1000)
+#define BLOCK_ERASE_TIMEOUT MS_TO_TICKS(3000)
+
+// Ordered from largest to smallest
+static const struct {
+    uint32_t size;
+    uint8_t  cmd;
+    uint16_t timeout;
+} erase_types[] = {
+    {65536, BLOCK_ERASE_64KB, BLOCK_ERASE_TIMEOUT},
+    {32768, BLOCK_ERASE_32KB, BLOCK_ERASE_TIMEOUT},
+    {SPI_FLASH_SECTOR_SIZE, SECTOR_ERASE_4KB, SECTOR_ERASE_TIMEOUT},
+};
+
+// Maximum amount of data per DMA transfer for CRC jobs
+#define CRC_CHUNK_SIZE (32768)
+
+enum job_op {
+    OP_NONE,
+    OP_ERASE,
+    OP_PROGRAM,
+    OP_CRC,
+};
+
+static struct {
+    enum job_op           op;
+    enum spi_flash_status status;
+    uint32_t              value;      // Failing address or CRC
+    bool                  busy;       // Waiting for flash operation to complete
+    os_time_t             deadline;   // Timeout for flash operation
+    uint32_t              address;    // Current address
+    uint32_t              end;        // End address of job
+    uint32_t              erase_size; // Erase: size of current erase operation
+    unsigned              page_fill;  // Program: bytes in page buffer
+    uint8_t               page[SPI_FLASH_PAGE_SIZE];
+} job;
+
+static void flash_command(uint8_t cmd, uint32_t address, const void *data, unsigned length) {
+    uint8_t buf[] = {cmd, address >> 16, address >> 8, address >> 0};
+    spi_select(1);
+    spi_transfer(buf, NULL, sizeof(buf));
+    spi_transfer(data, NULL, length);
+    spi_select(0);
+}
+
+static void flash_write_enable(void) {
+    uint8_t cmd = WRITE_ENABLE;
+    spi_select(1);
+    spi_transfer(&cmd, NULL, 1);
+    spi_select(0);
+}
+
+static bool flash_is_busy(void) {
+    uint8_t buf[] = {READ_STATUS_REGISTER_1, 0};
+    spi_select(1);
+    spi_transfer(buf, buf, sizeof(buf));
+    spi_select(0);
+    return (buf[1] & ERASE_WRITE_IN_PROGRESS) != 0;
+}
+
+static void flash_read(uint32_t address, void *data, unsigned length) {
+    uint8_t buf[] = {FAST_READ, address >> 16, address >> 8, address >> 0, 0xFF};
+    spi_select(1);
+    spi_transfer(buf, NULL, sizeof(buf));
+    spi_transfer(NULL, data, length);
+    spi_select(0);
+}
+
+static void job_start_wait(os_time_t timeout) {
+    job.busy     = true;
+    job.deadline = os_get_time() + timeout;
+}
+
+static void job_fail(enum spi_flash_status status, uint32_t address) {
+    if (job.status == SPI_FLASH_OK) {
+        job.status = status;
+        job.value  = address;
+    }
+}
+
+// Size of the current program chunk: up to the end of the page or job.
+static unsigned program_chunk_size(void) {
+    uint32_t page_end = (job.address | (SPI_FLASH_PAGE_SIZE - 1)) + 1;
+    return (page_end < job.end ? page_end : job.end) - job.address;
+}
+
+static bool page_is_blank(unsigned length) {
+    for (unsigned i = 0; i < length; i++) {
+        if (job.page[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void program_verify(void) {
+    unsigned length = program_chunk_size();
+    uint8_t  buf[32];
+
+    for (unsigned offset = 0; offset < length; offset += sizeof(buf)) {
+        unsigned size = length - offset < sizeof(buf) ? length - offset : sizeof(buf);
+        flash_read(job.address + offset, buf, size);
+        if (memcmp(buf, job.page + offset, size) != 0) {
+            job_fail(SPI_FLASH_ERR_VERIFY, job.address);
+            return;
+        }
+    }
+}
+
+static void program_next(void) {
+    job.address += program_chunk_size();
+    job.page_fill = 0;
+}
+
+void spi_flash_erase(uint32_t address, uint32_t length) {
+    job.op      = OP_ERASE;
+    job.status  = SPI_FLASH_OK;
+    job.value   = 0;
+    job.busy    = false;
+    job.address = address & ~(SPI_FLASH_SECTOR_SIZE - 1);
+    job.end     = address + length;
+}
+
+void spi_flash_program(uint32_t address, uint32_t length) {
+    job.op        = OP_PROGRAM;
+    job.status    = SPI_FLASH_OK;
+    job.value     = 0;
+    job.busy      = false;
+    job.address   = address;
+    job.end       = address + length;
+    job.page_fill = 0;
+}
+
+// The CRC job is a single read command. The received data is written to the
+// CRC unit by DMA, in chunks, while chip select stays active.
+void spi_flash_crc(uint32_t address, uint32_t length) {
+    job.op      = OP_CRC;
+    job.status  = SPI_FLASH_OK;
+    job.value   = 0;
+    job.busy    = false;
+    job.address = address;
+    job.end     = address + length;
+
+    uint8_t buf[] = {FAST_READ, address >> 16, address >> 8, address >> 0, 0xFF};
+    spi_select(1);
+    spi_transfer(buf, NULL, sizeof(buf));
+    crc32_hw_begin();
+}
+
+bool spi_flash_wants_data(void) {
+    return job.op == OP_PROGRAM && job.address < job.end;
+}
+
+unsigned spi_flash_write(const void *data, unsigned length) {
+    if (!spi_flash_wants_data() || job.busy) {
+        return 0;
+    }
+
+    unsigned chunk_size = program_chunk_size();
+    if (length > chunk_size - job.page_fill) {
+        length = chunk_size - job.page_fill;
+    }
+    memcpy(job.page + job.page_fill, data, length);
+    job.page_fill += length;
+
+    if (job.page_fill == chunk_size) {
+        if (job.status != SPI_FLASH_OK) {
+            // Drain the remaining data of a failed job
+            program_next();
+        } else if (page_is_blank(chunk_size)) {
+            // Nothing to program, but check the page really is erased
+            program_verify();
+            program_next();
+        } else {
+            flash_write_enable();
+            flash_command(PAGE_PROGRAM, job.address, job.page, chunk_size);
+            job_start_wait(PAGE_PROGRAM_TIMEOUT);
+        }
+    }
+    return length;
+}
+
+enum spi_flash_poll_result spi_flash_poll(void) {
+    if (job.op == OP_NONE) {
+        return SPI_FLASH_IDLE;
+    }
+
+    if (job.busy) {
+        if (flash_is_busy()) {
+            if (os_get_time() < job.deadline) {
+                return SPI_FLASH_BUSY;
+            }
+            job_fail(SPI_FLASH_ERR_TIMEOUT, job.address);
+        }
+        job.busy = false;
+
+        if (job.op == OP_PROGRAM) {
+            if (job.status == SPI_FLASH_OK) {
+                program_verify();
+            }
+            program_next();
+        } else if (job.op == OP_ERASE) {
+            job.address += job.erase_size;
+        }
+    }
+
+    if (job.address < job.end) {
+        switch (job.op) {
+            case OP_ERASE:
+                if (job.status != SPI_FLASH_OK) {
+                    break;
+                }
+                // Largest aligned erase that fits in the remaining range, a
+                // partial sector at the end of the range is erased as well.
+                unsigned type = 0;
+                while (type < NUM_ARRAY_ELEMENTS(erase_types) - 1 &&
+                       ((job.address % erase_types[type].size) != 0 || job.end - job.address < erase_types[type].size)) {
+                    type++;
+                }
+                job.erase_size = erase_types[type].size;
+                flash_write_enable();
+                flash_command(erase_types[type].cmd, job.address, NULL, 0);
+                job_start_wait(erase_types[type].timeout);
+                return SPI_FLASH_BUSY;
+
+            case OP_PROGRAM:
+                return SPI_FLASH_WAIT_DATA;
+
+            case OP_CRC: {
+                if (spi_transfer_busy()) {
+                    return SPI_FLASH_BUSY;
+                }
+                unsigned length = job.end - job.address < CRC_CHUNK_SIZE ? job.end - job.address : CRC_CHUNK_SIZE;
+                spi_receive_start(&CRC->DR, length, false);
+                job.address += length;
+                return SPI_FLASH_BUSY;
+            }
+
+            default: break;
+        }
+    }
+
+    if (job.op == OP_CRC) {
+        if (spi_transfer_busy()) {
+            return SPI_FLASH_BUSY;
+        }
+        spi_select(0);
+        job.value = crc32_hw_end();
+    }
+
+    job.op = OP_NONE;
+    return SPI_FLASH_DONE;
+}
+
+enum spi_flash_status spi_flash_get_result(uint32_t *value) {
+    *value = job.value;
+    return job.status;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "common.h"
+
+// Flash operations executed on the device, so the host doesn't need a USB
+// round trip for every status register poll. Each operation is a job that is
+// advanced by calling spi_flash_poll() from the command task; long waits for
+// the flash (erase, page program) don't block the rest of the system.
+//
+// Read-modify-write stays on the host: there isn't enough RAM here to hold a
+// sector.
+
+#define SPI_FLASH_PAGE_SIZE (256)
+#define SPI_FLASH_SECTOR_SIZE (4096)
+
+enum spi_flash_status {
+    SPI_FLASH_OK          = 0,
+    SPI_FLASH_ERR_VERIFY  = 1, // Read back data differs, value is address of failing page
+    SPI_FLASH_ERR_TIMEOUT = 2, // Flash stayed busy, value is address of operation
+};
+
+enum spi_flash_poll_result {
+    SPI_FLASH_IDLE,      // No job
+    SPI_FLASH_BUSY,      // Job is running, poll again
+    SPI_FLASH_WAIT_DATA, // Program job needs more data (spi_flash_write)
+    SPI_FLASH_DONE,      // Job finished, result available from spi_flash_get_result()
+};
+
+// Erase all sectors covering [address, address + length), using 64 KB and
+// 32 KB block erases where the range allows.
+void spi_flash_erase(uint32_t address, uint32_t length);
+
+// Program length bytes at address, data is supplied with spi_flash_write().
+// Pages are verified after programming. Pages that are all 0xFF are not
+// programmed, only verified.
+void spi_flash_program(uint32_t address, uint32_t length);
+
+// Supply program data, returns the number of bytes accepted. Fewer bytes than
+// offered are accepted when a page boundary is reached, the rest can be
+// written when spi_flash_poll() returns SPI_FLASH_WAIT_DATA again.
+unsigned spi_flash_write(const void *data, unsigned length);
+
+// Calculate CRC-32 over [address, address + length).
+void spi_flash_crc(uint32_t address, uint32_t length);
+
+// Advance the current job.
+enum spi_flash_poll_result spi_flash_poll(void);
+
+// True while a program job still expects data.
+bool spi_flash_wants_data(void);
+
+enum spi_flash_status spi_flash_get_result(uint32_t *value);
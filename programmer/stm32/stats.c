@@ -0,0 +1,29 @@
+#include "stats.h"
+#include "lib.h"
+
+struct stats stats;
+
+#define CYCLES_PER_US (SYSCLK_FREQ / 1000000)
+
+static uint8_t *put_u32(uint8_t *buf, uint32_t value) {
+    memcpy(buf, &value, sizeof(value));
+    return buf + sizeof(value);
+}
+
+void stats_get(uint8_t *buf, bool clear) {
+    buf = put_u32(buf, os_get_time() * 1000 / TICKS_PER_SECOND);
+    buf = put_u32(buf, stats.spi_flash_bytes);
+    buf = put_u32(buf, stats.spi_fpga_bytes);
+    buf = put_u32(buf, stats.dma_busy_cycles / CYCLES_PER_US);
+    buf = put_u32(buf, stats.usb_packets_out);
+    buf = put_u32(buf, stats.usb_packets_in);
+    buf = put_u32(buf, stats.cdc_bytes_forwarded);
+    buf = put_u32(buf, stats.cdc_bytes_dropped);
+    buf = put_u32(buf, task_get_latency_max(clear) / CYCLES_PER_US);
+    buf = put_u32(buf, timer_get_lateness_max(clear) * (1000000 / TICKS_PER_SECOND));
+    put_u32(buf, stats.fpga_underruns);
+
+    if (clear) {
+        memset(&stats, 0, sizeof(stats));
+    }
+}
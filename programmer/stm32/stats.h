@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+
+// Counters returned by CMD_GET_STATS, so a host can see where the time goes
+// during a job without a debugger. Updated from the code they count.
+struct stats {
+    uint32_t spi_flash_bytes;     // shifted in flash mode
+    uint32_t spi_fpga_bytes;      // sent to the FPGA in configuration mode
+    uint64_t dma_busy_cycles;     // SPI DMA transfers running
+    uint32_t usb_packets_out;     // command endpoint packets received
+    uint32_t usb_packets_in;      // command endpoint packets sent
+    uint32_t cdc_bytes_forwarded; // UART RX data sent to USB
+    uint32_t cdc_bytes_dropped;   // UART RX data overwritten before it was sent
+    uint32_t fpga_underruns;      // FPGA configurations failed by a late DMA refill
+};
+
+extern struct stats stats;
+
+// CMD_GET_STATS reply, u32 values in this order:
+// <uptime ms> <SPI flash bytes> <SPI FPGA bytes> <DMA busy us>
+// <USB packets out> <USB packets in> <CDC bytes forwarded> <CDC bytes dropped>
+// <max task latency us> <max timer lateness us> <FPGA underruns>
+#define STATS_REPLY_SIZE (11 * 4)
+
+// Fill buf with the reply and optionally start over.
+void stats_get(uint8_t *buf, bool clear);
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+
+# Decodes the binary trace records the firmware writes to RTT up-buffer 1
+# ("Trace", see lib/trace.h). The format strings are read from the .trace_fmt
+# section of the firmware's ELF file.
+#
+# Capture the channel e.g. with OpenOCD:
+#   rtt setup 0x20000000 0x1800 "SEGGER RTT"; rtt start; rtt server start 9091 1
+#   nc localhost 9091 | ./trace-decode.py obj/stm32.elf
+# or with J-Link: JLinkRTTLogger -Device STM32F070F6 -RTTChannel 1 trace.bin
+
+import sys
+import re
+import struct
+from optparse import OptionParser
+
+RECORD = struct.Struct('<IHHII')  # cycles, ticks, fmt, arg0, arg1
+TICKS_PER_SECOND = 10000
+CYCLES_MASK = 0xFFFFFF
+
+
+def read_format_section(file):
+    data = open(file, 'rb').read()
+    if data[:4] != b'\x7fELF':
+        raise ValueError('%s: not an ELF file' % file)
+    if data[4] == 1:
+        shoff, = struct.unpack_from('<I', data, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from('<3H', data, 0x2E)
+        section = struct.Struct('<10I')
+    else:
+        shoff, = struct.unpack_from('<Q', data, 0x28)
+        shentsize, shnum, shstrndx = struct.unpack_from('<3H', data, 0x3A)
+        section = struct.Struct('<2I4Q2I2Q')
+
+    headers = [section.unpack_from(data, shoff + i * shentsize) for i in range(shnum)]
+    names_offset = headers[shstrndx][4]
+    for header in headers:
+        name = data[names_offset + header[0]:].split(b'\0', 1)[0]
+        if name == b'.trace_fmt':
+            return data[header[4]:header[4] + header[5]]
+    raise ValueError('%s: no .trace_fmt section' % file)
+
+
+def signed32(value):
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+# Converts a C format string, e.g. "%lu" or "%02x", to a Python one
+def convert(fmt, args):
+    args = list(args)
+    values = []
+
+    def conversion(match):
+        flags, width, spec = match.group(1), match.group(2), match.group(3)
+        if spec == '%':
+            return '%%'
+        value = args.pop(0) if args else 0
+        if spec in 'di':
+            values.append(signed32(value))
+            spec = 'd'
+        elif spec == 'u':
+            values.append(value)
+            spec = 'd'
+        elif spec == 'c':
+            values.append(chr(value & 0xFF))
+        else:
+            values.append(value)
+        return '%' + flags + width + spec
+
+    return re.sub(r'%([-0]?)(\d*)(?:hh|h|ll|l|z)?([diuxXoc%])', conversion, fmt) % tuple(values)
+
+
+def decode(formats, stream, cpu_frequency, out):
+    ticks = None
+    cycles = 0
+    while True:
+        record = stream.read(RECORD.size)
+        if len(record) < RECORD.size:
+            break
+        record_cycles, record_ticks, fmt, arg0, arg1 = RECORD.unpack(record)
+
+        if ticks is None:
+            ticks = record_ticks
+            delta = 0.0
+        else:
+            delta_ticks = (record_ticks - ticks) & 0xFFFF
+            ticks += delta_ticks
+            # The cycle counter wraps too fast to be useful for long gaps
+            delta = delta_ticks / TICKS_PER_SECOND
+            if delta < CYCLES_MASK / cpu_frequency * 0.9:
+                delta = ((record_cycles - cycles) & CYCLES_MASK) / cpu_frequency
+        cycles = record_cycles
+
+        if fmt < len(formats):
+            text = formats[fmt:].split(b'\0', 1)[0].decode('utf-8', 'replace')
+            text = convert(text, (arg0, arg1))
+        else:
+            text = '<unknown format 0x%04x: 0x%08x 0x%08x>' % (fmt, arg0, arg1)
+
+        out.write('[%10.4f] +%10.1f us  %s\n' % (ticks / TICKS_PER_SECOND, delta * 1e6, text))
+        out.flush()
+
+
+if __name__ == "__main__":
+    usage = """
+%prog [-c cpu_frequency] firmware.elf [trace.bin]
+
+Reads the records from trace.bin or stdin."""
+    parser = OptionParser(usage=usage)
+    parser.add_option("-c", "--cpu-frequency", type="int", dest="cpu_frequency", default=48000000,
+                      help="CPU clock of the cycle counter in Hz (default 48000000)")
+    (options, args) = parser.parse_args()
+
+    if len(args) not in (1, 2):
+        parser.print_help()
+        sys.exit(1)
+
+    try:
+        formats = read_format_section(args[0])
+    except (OSError, ValueError) as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
+
+    stream = open(args[1], 'rb') if len(args) == 2 else sys.stdin.buffer
+    try:
+        decode(formats, stream, options.cpu_frequency, sys.stdout)
+    except KeyboardInterrupt:
+        pass
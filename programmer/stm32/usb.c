@@ -5,6 +5,8 @@
 #include "stm32f0xx_hal_pcd.h"
 #include "usbd_cdc.h"
 #include "usbd_cdc_if.h"
+#include "stats.h"
+#include "spsc_ring.h"
 
 USBD_HandleTypeDef usbd_device;
 
@@ -121,37 +123,65 @@ static const USBD_DescriptorsTypeDef programmer_desc = {
     .GetInterfaceStrDescriptor     = programmer_interface_str_descriptor,
 };
 
-static alignas(2) uint8_t cmd_rx_buf[64];
-static volatile unsigned cmd_rx_buf_size  = 0;
-static volatile bool     cmd_rx_buf_ready = false;
+// OUT packets are received into two buffers in turn, so the next packet can
+// arrive while the command decoder still works from the previous one's buffer
+// (e.g. SPI DMA straight out of it). With both buffers taken the endpoint
+// isn't armed and the host's packets are NAKed.
+static alignas(2) uint8_t cmd_rx_bufs[2][CMD_EPOUT_SIZE];
+static volatile unsigned cmd_rx_sizes[2];
+static struct spsc_ring  cmd_rx_ring;            // the USB interrupt writes, the decoder reads
+static volatile bool     cmd_rx_armed   = false;
+static bool              cmd_rx_holding = false; // decoder has the packet at the ring's tail
+static volatile bool     cmd_tx_busy    = false;
+
+// Only called while the endpoint isn't armed, so the interrupt doesn't race.
+static void cmd_rx_arm(USBD_HandleTypeDef *pdev) {
+    uint32_t index;
+    if (spsc_ring_write_region(&cmd_rx_ring, &index) > 0) {
+        cmd_rx_armed = true;
+        USBD_LL_PrepareReceive(pdev, CMD_EPOUT_ADDR, cmd_rx_bufs[index], CMD_EPOUT_SIZE);
+    }
+}
 
 uint8_t programmer_init(struct _USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
-    printf("programmer_init\n");
+    TRACE("programmer_init");
     USBD_LL_OpenEP(pdev, CMD_EPIN_ADDR, USBD_EP_TYPE_BULK, CMD_EPIN_SIZE);
     USBD_LL_OpenEP(pdev, CMD_EPOUT_ADDR, USBD_EP_TYPE_BULK, CMD_EPOUT_SIZE);
-    USBD_LL_PrepareReceive(pdev, CMD_EPOUT_ADDR, cmd_rx_buf, sizeof(cmd_rx_buf));
+
+    spsc_ring_init(&cmd_rx_ring, 2);
+    cmd_rx_holding = false;
+    cmd_rx_arm(pdev);
 
     return USBD_OK;
 }
 
 uint8_t programmer_deinit(struct _USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
-    printf("programmer_deinit\n");
+    TRACE("programmer_deinit");
     return USBD_OK;
 }
 
 uint8_t programmer_data_in(struct _USBD_HandleTypeDef *pdev, uint8_t epnum) {
     // printf("programmer_data_in\n");
+    if (epnum == (CMD_EPIN_ADDR & 0xF)) {
+        cmd_tx_busy = false;
+        task_post(&handle_cmd_packet_task);
+    }
     return USBD_OK;
 }
 
 uint8_t programmer_data_out(struct _USBD_HandleTypeDef *pdev, uint8_t epnum) {
     unsigned size = USBD_LL_GetRxDataSize(pdev, epnum);
 
-    printf("programmer_data_out: 0x%02x  %u\n", epnum, size);
+    // printf("programmer_data_out: 0x%02x  %u\n", epnum, size);
 
     if (epnum == (CMD_EPOUT_ADDR & 0xF)) {
-        cmd_rx_buf_size  = size;
-        cmd_rx_buf_ready = true;
+        uint32_t index;
+        spsc_ring_write_region(&cmd_rx_ring, &index);
+        cmd_rx_sizes[index] = size;
+        spsc_ring_commit_write(&cmd_rx_ring, 1);
+        stats.usb_packets_out++;
+        cmd_rx_armed = false;
+        cmd_rx_arm(pdev);
         task_post(&handle_cmd_packet_task);
     }
     return USBD_OK;
@@ -191,20 +221,45 @@ void usb_init() {
 }
 
 TASK(handle_cmd_packet_task) {
-    if (!cmd_rx_buf_ready) {
-        return;
+    // A command may keep running after its packet, e.g. a DMA transfer from
+    // the packet's buffer, or keep producing data without further packets.
+    enum cmd_state state = usb_handle_cmd_continue();
+    bool           busy  = state != CMD_IDLE;
+    if (!busy && cmd_rx_holding) {
+        cmd_rx_holding = false;
+        spsc_ring_commit_read(&cmd_rx_ring, 1);
+        if (!cmd_rx_armed) {
+            cmd_rx_arm(&usbd_device);
+        }
     }
 
-    if (cmd_rx_buf_size) {
-        struct buf_reader br;
-        buf_reader_init(&br, cmd_rx_buf, cmd_rx_buf_size);
-        usb_handle_cmd_packet(&br);
+    // The host may have several commands queued. Don't take the next one
+    // before the reply to the previous one has left the IN endpoint buffer.
+    uint32_t index;
+    if (!busy && !cmd_tx_busy && spsc_ring_read_region(&cmd_rx_ring, &index) > 0) {
+        if (cmd_rx_sizes[index]) {
+            struct buf_reader br;
+            buf_reader_init(&br, cmd_rx_bufs[index], cmd_rx_sizes[index]);
+            usb_handle_cmd_packet(&br);
+        }
+        cmd_rx_holding = true;
+        state          = CMD_BUSY;
     }
 
-    cmd_rx_buf_ready = false;
-    USBD_LL_PrepareReceive(&usbd_device, CMD_EPOUT_ADDR, cmd_rx_buf, sizeof(cmd_rx_buf));
+    // Waiting for the IN endpoint is resumed from programmer_data_in(), the
+    // packet is kept meanwhile and further ones are NAKed once both buffers
+    // are full. A waiting command is resumed from its interrupt.
+    if (state == CMD_BUSY && !cmd_tx_busy) {
+        task_post(&handle_cmd_packet_task);
+    }
 }
 
 void usb_send_buffer(void *buf, unsigned size) {
+    cmd_tx_busy = true;
+    stats.usb_packets_in++;
     USBD_LL_Transmit(&usbd_device, CMD_EPIN_ADDR, buf, size);
 }
+
+bool usb_send_ready(void) {
+    return !cmd_tx_busy;
+}
@@ -10,8 +10,17 @@
 
 void usb_init();
 void usb_send_buffer(void *buf, unsigned size);
+bool usb_send_ready(void); // IN endpoint buffer is free
 
-extern void usb_handle_cmd_packet(struct buf_reader *br);
+// What the command decoder is doing after usb_handle_cmd_continue()
+enum cmd_state {
+    CMD_IDLE,    // ready for the next packet
+    CMD_BUSY,    // call usb_handle_cmd_continue() again
+    CMD_WAITING, // same, once an interrupt has posted the calling task
+};
+
+extern void           usb_handle_cmd_packet(struct buf_reader *br);
+extern enum cmd_state usb_handle_cmd_continue(void);
 
 uint8_t programmer_init(struct _USBD_HandleTypeDef *pdev, uint8_t cfgidx);
 uint8_t programmer_deinit(struct _USBD_HandleTypeDef *pdev, uint8_t cfgidx);
@@ -1,4 +1,6 @@
 #include "usbd_cdc_if.h"
+#include "stats.h"
+#include "spsc_ring.h"
 #include "lib.h"
 
 static void cdc_if_init(void);
@@ -24,24 +26,42 @@ struct cdc_line_coding line_coding = {
 
 extern USBD_HandleTypeDef usbd_device;
 
-TIMER(uart_check) {
-    struct cdc_handle *hcdc      = (struct cdc_handle *)usbd_device.pClassData;
-    unsigned           cndtr     = DMA1_Channel5->CNDTR;
-    unsigned           write_idx = sizeof(hcdc->uart_rx_buffer) - cndtr;
-    static uint16_t    read_idx  = 0;
+// UART RX: DMA channel 5 writes to uart_rx_buffer in a circle, the ring's
+// producer side is moved up to the DMA position by the USART idle line and
+// the DMA half/full transfer interrupts. The uart_rx task sends everything
+// received as one transfer and only frees it when the transfer is done, so
+// bursts arriving meanwhile are coalesced into the next one.
+static struct spsc_ring uart_rx_ring;
+static uint32_t         uart_rx_sending; // bytes of the transfer in flight
 
-    if (read_idx == write_idx) {
+TASK_DECL(uart_rx);
+
+static void uart_rx_update(void) {
+    struct cdc_handle *hcdc = (struct cdc_handle *)usbd_device.pClassData;
+    spsc_ring_commit_write_to(&uart_rx_ring, sizeof(hcdc->uart_rx_buffer) - DMA1_Channel5->CNDTR);
+    task_post(&uart_rx);
+}
+
+TASK_WITH_PRIORITY(uart_rx, TASK_PRIORITY_HIGH) {
+    struct cdc_handle *hcdc = (struct cdc_handle *)usbd_device.pClassData;
+    if (hcdc == NULL || uart_rx_sending > 0) {
         return;
     }
 
-    if (read_idx > write_idx) {
-        if (cdc_transmit_packet(&usbd_device, hcdc->uart_rx_buffer + read_idx, sizeof(hcdc->uart_rx_buffer) - read_idx)) {
-            read_idx = 0;
-        }
-    } else {
-        if (cdc_transmit_packet(&usbd_device, hcdc->uart_rx_buffer + read_idx, write_idx - read_idx)) {
-            read_idx = write_idx;
-        }
+    stats.cdc_bytes_dropped += spsc_ring_discard_overrun(&uart_rx_ring);
+
+    uint32_t index;
+    uint32_t length = spsc_ring_read_region(&uart_rx_ring, &index);
+    if (length > 0 && cdc_transmit_packet(&usbd_device, hcdc->uart_rx_buffer + index, length)) {
+        uart_rx_sending = length;
+        stats.cdc_bytes_forwarded += length;
+    }
+}
+
+void usart2_irq_handler(void) {
+    if (USART2->ISR & USART_ISR_IDLE) {
+        USART2->ICR = USART_ICR_IDLECF;
+        uart_rx_update();
     }
 }
 
@@ -50,10 +70,10 @@ static void uart_init2(void) {
     DMA1_Channel4->CCR = 0;
     DMA1_Channel5->CCR = 0;
     USART2->CR1        = 0;
-    uint32_t cr1       = USART_CR1_OVER8 | USART_CR1_TE | USART_CR1_RE | USART_CR1_UE;
+    uint32_t cr1       = USART_CR1_OVER8 | USART_CR1_IDLEIE | USART_CR1_TE | USART_CR1_RE | USART_CR1_UE;
 
     if (line_coding.bitrate != 0) {
-        if (USART2->CR1 & USART_CR1_OVER8) { // oversampling by 8
+        if (cr1 & USART_CR1_OVER8) { // oversampling by 8
             uint16_t USARTDIV = SYSCLK_FREQ * 2 / line_coding.bitrate;
             USART2->BRR       = (USARTDIV & 0xFFF0) | ((USARTDIV & 0xF) >> 1);
         } else { // oversampling by 16
@@ -86,7 +106,7 @@ static void uart_init2(void) {
 
     // restart UART and RX DMA
     USART2->CR1        = cr1;
-    DMA1_Channel5->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_EN; // DMA channel 5 configuration register
+    DMA1_Channel5->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_EN; // DMA channel 5 configuration register
 }
 
 static void uart_init(void) {
@@ -96,6 +116,8 @@ static void uart_init(void) {
     clock_enable(CLK_DMA);
 
     // DMA channel 5: USART2_RX
+    spsc_ring_init(&uart_rx_ring, sizeof(hcdc->uart_rx_buffer));
+    uart_rx_sending      = 0;
     DMA1_Channel5->CNDTR = sizeof(hcdc->uart_rx_buffer);    // DMA channel 5 number of data register
     DMA1_Channel5->CPAR  = (uintptr_t)&USART2->RDR;         // DMA channel 5 peripheral address register
     DMA1_Channel5->CMAR  = (uintptr_t)hcdc->uart_rx_buffer; // DMA channel 5 memory address register
@@ -107,21 +129,22 @@ static void uart_init(void) {
 
     NVIC_SetPriority(DMA1_Channel4_5_IRQn, 2);
     NVIC_EnableIRQ(DMA1_Channel4_5_IRQn);
-
-    timer_restart(&uart_check, MS_TO_TICKS(100), MS_TO_TICKS(1));
+    NVIC_SetPriority(USART2_IRQn, 2);
+    NVIC_EnableIRQ(USART2_IRQn);
 }
 
 static void uart_deinit(void) {
-    timer_stop(&uart_check);
+    NVIC_DisableIRQ(USART2_IRQn);
+    DMA1_Channel5->CCR &= ~(DMA_CCR_HTIE | DMA_CCR_TCIE);
 }
 
 static void cdc_if_init(void) {
-    printf("cdc_if_init\n");
+    TRACE("cdc_if_init");
     uart_init();
 }
 
 static void cdc_if_deinit(void) {
-    printf("cdc_if_deinit\n");
+    TRACE("cdc_if_deinit");
     uart_deinit();
 }
 
@@ -140,7 +163,8 @@ static void cdc_if_control(uint8_t cmd, uint8_t *pbuf, uint16_t length) {
             line_coding.paritytype = pbuf[5];
             line_coding.datatype   = pbuf[6];
             uart_init2();
-            printf("CDC_SET_LINE_CODING  bitrate: %lu\n", line_coding.bitrate);
+            TRACE("CDC_SET_LINE_CODING bitrate: %u format: 0x%06x", line_coding.bitrate,
+                  line_coding.format | (line_coding.paritytype << 8) | (line_coding.datatype << 16));
             break;
 
         case CDC_GET_LINE_CODING:
@@ -159,14 +183,21 @@ static void cdc_if_control(uint8_t cmd, uint8_t *pbuf, uint16_t length) {
     }
 }
 
-TASK(uart_tx_done) {
+TASK_WITH_PRIORITY(uart_tx_done, TASK_PRIORITY_HIGH) {
     cdc_receive_packet(&usbd_device);
 }
 
 void dma1_channel4_5_irq_handler(void) {
     // printf("dma1_channel4_5_irq_handler\n");
-    DMA1->IFCR = DMA_IFCR_CGIF4;
-    task_post(&uart_tx_done);
+    uint32_t isr = DMA1->ISR;
+    if (isr & DMA_ISR_TCIF4) {
+        DMA1->IFCR = DMA_IFCR_CGIF4;
+        task_post(&uart_tx_done);
+    }
+    if (isr & (DMA_ISR_HTIF5 | DMA_ISR_TCIF5)) {
+        DMA1->IFCR = DMA_IFCR_CHTIF5 | DMA_IFCR_CTCIF5;
+        uart_rx_update();
+    }
 }
 
 static void cdc_if_receive(uint8_t *buf, uint32_t length) {
@@ -188,4 +219,7 @@ static void cdc_if_receive(uint8_t *buf, uint32_t length) {
 }
 
 static void cdc_if_transmit_done(void) {
+    spsc_ring_commit_read(&uart_rx_ring, uart_rx_sending);
+    uart_rx_sending = 0;
+    task_post(&uart_rx);
 }